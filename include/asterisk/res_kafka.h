@@ -26,6 +26,21 @@
 
 struct ast_kafka_pipe;
 struct ast_kafka_consumer_message;
+struct ast_kafka_consumer_batch;
+
+/*!
+ * \brief Message of the batch, see ast_kafka_send_batch().
+ */
+struct ast_kafka_msg {
+	/*! Kafka message key, can be NULL */
+	const char *key;
+	/*! Message payload, copied by ast_kafka_send_batch() */
+	const void *payload;
+	/*! Payload size */
+	size_t payload_size;
+	/*! Reason for message (added to message header) or NULL */
+	const char *reason;
+};
 
 /*!
  * \brief Publish event to the specified pipe.
@@ -80,11 +95,125 @@ int ast_kafka_send_json_message(struct ast_kafka_pipe *pipe, const char *key,
  * 
  * \return
  */
-int ast_kafka_send_raw_message(struct ast_kafka_pipe *pipe, const char *key, 
+int ast_kafka_send_raw_message(struct ast_kafka_pipe *pipe, const char *key,
 				const void *payload, size_t payload_size,
 				const char *reason);
+
 /*!
- * 
+ * \brief Send raw message to the specified pipe without payload copy.
+ *
+ * \details
+ * Send raw message to the specified pipe. Payload ownership moved to the pipe,
+ * even on failure: payload released by free_fn when all topics messages
+ * processed. For pipe with single topic and payload allocated by ast_malloc()
+ * (free_fn is ast_free_ptr) payload released by librdkafka directly.
+ *
+ * \note Payload must not be modified or released by caller after this call.
+ *
+ * \param pipe
+ * \param key - Kafka message key, can be NULL
+ * \param payoad
+ * \param payload_size
+ * \param free_fn - function to release payload
+ * \param reason - reason for message (added to message header) or NULL
+ *
+ * \return
+ */
+int ast_kafka_send_raw_message_nocopy(struct ast_kafka_pipe *pipe, const char *key,
+				void *payload, size_t payload_size,
+				void (*free_fn)(void *payload),
+				const char *reason);
+
+/*!
+ * \brief Kafka message key hash.
+ *
+ * \details
+ * Positive murmur2 hash of the key, same as Java client and librdkafka
+ * murmur2 partitioners use. Can be computed once and cached by caller.
+ *
+ * \param key
+ * \param key_size
+ *
+ * \return key hash
+ */
+uint32_t ast_kafka_key_hash(const char *key, size_t key_size);
+
+/*!
+ * \brief Send raw message to the specified pipe with precomputed key hash.
+ *
+ * \details
+ * Same as ast_kafka_send_raw_message(), topics of producers with murmur2
+ * or murmur2_random partitioner select partition by key_hash without
+ * hashing the key again. Other topics partition message by its key.
+ *
+ * \param pipe
+ * \param key - Kafka message key, not NUL terminated if key_size set
+ * \param key_size - key size, strlen() of the key if zero
+ * \param key_hash - ast_kafka_key_hash() of the key and key_size
+ * \param payoad
+ * \param payload_size
+ * \param reason - reason for message (added to message header) or NULL
+ *
+ * \return
+ */
+int ast_kafka_send_raw_message_hash(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, uint32_t key_hash,
+				const void *payload, size_t payload_size,
+				const char *reason);
+
+/*!
+ * \brief Send raw message to the specified partition.
+ *
+ * \details
+ * Same as ast_kafka_send_raw_message(), message sent to the partition
+ * on the topics of producers without partition option.
+ *
+ * \param pipe
+ * \param key - Kafka message key, can be NULL, not NUL terminated if key_size set
+ * \param key_size - key size, strlen() of the key if zero
+ * \param partition - partition, less than zero selected by topic partitioner
+ * \param payoad
+ * \param payload_size
+ * \param reason - reason for message (added to message header) or NULL
+ *
+ * \return
+ */
+int ast_kafka_send_raw_message_partition(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, int32_t partition,
+				const void *payload, size_t payload_size,
+				const char *reason);
+
+/*!
+ * \brief Send batch of raw messages to the specified pipe.
+ *
+ * \details
+ * Send messages to all pipe's producer topics. Message headers are built once
+ * per run of messages with the same reason, messages for topics without headers
+ * are enqueued by one rd_kafka_produce_batch() call. Messages rejected by full
+ * producer queue are retried according to the producer's on_queue_full policy.
+ *
+ * \param pipe
+ * \param msgs - messages, payloads copied
+ * \param count - number of messages
+ * \param status - array of count elements or NULL, set to 0 for message
+ *                 enqueued to all topics, -1 otherwise
+ *
+ * \return number of failed messages, 0 if all messages enqueued
+ */
+int ast_kafka_send_batch(struct ast_kafka_pipe *pipe, const struct ast_kafka_msg *msgs, size_t count, int *status);
+/*!
+ * \brief Get pipe by id.
+ *
+ * \details
+ * Get referenced pipe by id. Pipes are never destroyed while res_kafka loaded,
+ * so caller can keep the reference for module lifetime (for example, get it
+ * on load and release on unload). Topics attached to the pipe on reload become
+ * visible via the same handle.
+ *
+ * \note
+ *
+ * \param pipe_id
+ * \param force - create pipe if not exist
+ *
+ * \return Referenced pipe or NULL
  */
 struct ast_kafka_pipe *ast_kafka_get_pipe(const char *pipe_id, int force);
 
@@ -104,6 +233,70 @@ struct ast_kafka_pipe *ast_kafka_get_pipe(const char *pipe_id, int force);
  */
 struct stasis_topic *ast_kafka_get_stasis_topic(struct ast_kafka_pipe *pipe);
 
+/*!
+ * \brief Get number of the pipe's dispatch lanes.
+ * 
+ * \details
+ * Number of lane stasis topics, set by the dispatch_lanes general option.
+ * 
+ * \param pipe
+ * 
+ * \return Number of lanes, 0 if messages forwarded to the pipe's topic only
+ */
+unsigned int ast_kafka_get_stasis_lane_count(struct ast_kafka_pipe *pipe);
+
+/*!
+ * \brief Get dispatch lane stasis topic from the pipe.
+ * 
+ * \details
+ * Consumed messages are published to the lane selected by hash of the message
+ * key (or partition for messages without key), so messages of the same key
+ * arrive to one lane in order. Lanes are forwarded to the pipe's topic too,
+ * subscribe each lane instead of the pipe's topic to serve unrelated keys in parallel.
+ * 
+ * \note
+ * 
+ * \param pipe
+ * \param lane - lane index, less than ast_kafka_get_stasis_lane_count()
+ * 
+ * \return Stasis message topic or NULL if lane not exist
+ */
+struct stasis_topic *ast_kafka_get_stasis_lane_topic(struct ast_kafka_pipe *pipe, unsigned int lane);
+
+/*!
+ * \brief Seek pipe's consumer topic partition.
+ * 
+ * \details
+ * Continue consuming of the partition from the specified offset. Only
+ * low-level consumers started the partition (partition or partitions
+ * option) can be seeked. Messages already
+ * fetched before seek may still be forwarded to the stasis topic.
+ * 
+ * \note
+ * 
+ * \param pipe
+ * \param topic - Kafka topic name
+ * \param partition
+ * \param offset - offset of the next message to consume
+ * 
+ * \return 0 if at least one consumer seeked, -1 otherwise
+ */
+int ast_kafka_pipe_seek(struct ast_kafka_pipe *pipe, const char *topic, int32_t partition, int64_t offset);
+
+/*!
+ * \brief Rewind pipe's consumer topics.
+ * 
+ * \details
+ * Seek all partitions started by the pipe's low-level consumers to the
+ * beginning. Used by subscribers which build state from the whole topic
+ * but subscribed after consuming was started.
+ * 
+ * \param pipe
+ * 
+ * \return 0 if at least one partition seeked, -1 otherwise
+ */
+int ast_kafka_pipe_rewind(struct ast_kafka_pipe *pipe);
+
 /*!
  * \brief Get Kafka consumer stasis message type.
  * 
@@ -116,4 +309,269 @@ struct stasis_topic *ast_kafka_get_stasis_topic(struct ast_kafka_pipe *pipe);
  */
 struct stasis_message_type *ast_kafka_consumer_message_type(void);
 
+/*!
+ * \brief Get Kafka consumer batch stasis message type.
+ * 
+ * \details
+ * Get Kafka consumer batch stasis message type.
+ * Consumers with batch_size option greater than 1 forward received messages
+ * by batches, each stasis message data is ast_kafka_consumer_batch.
+ * 
+ * \note
+ * 
+ * \return Stasis message type
+ */
+struct stasis_message_type *ast_kafka_consumer_batch_type(void);
+
+/*!
+ * \brief Get received message payload.
+ * 
+ * \details
+ * Get received message payload. Payload is not copied and valid while
+ * stasis message referenced.
+ * 
+ * \note
+ * 
+ * \param message
+ * \param size - payload size, can be NULL
+ * 
+ * \return Payload pointer, can be NULL
+ */
+const void *ast_kafka_consumer_message_payload(const struct ast_kafka_consumer_message *message, size_t *size);
+
+/*!
+ * \brief Get received message key.
+ * 
+ * \details
+ * Get received message key. Key is not copied and valid while
+ * stasis message referenced.
+ * 
+ * \note
+ * 
+ * \param message
+ * \param size - key size, can be NULL
+ * 
+ * \return Key pointer, NULL if message has no key
+ */
+const void *ast_kafka_consumer_message_key(const struct ast_kafka_consumer_message *message, size_t *size);
+
+/*!
+ * \brief Get received message header value.
+ * 
+ * \details
+ * Get last value of the received message header with specified name.
+ * 
+ * \note
+ * 
+ * \param message
+ * \param name - header name
+ * \param value - header value, not copied
+ * \param size - value size
+ * 
+ * \return 0 on success, -1 if header not exist
+ */
+int ast_kafka_consumer_message_header(const struct ast_kafka_consumer_message *message, const char *name, const void **value, size_t *size);
+
+/*!
+ * \brief Get received message payload as JSON.
+ * 
+ * \details
+ * Decode received message payload by its content-type header: MessagePack,
+ * CBOR or JSON text (if header not present). Payload is decoded on the first
+ * call only, the result is shared by all subscribers of the message.
+ * 
+ * \note
+ * 
+ * \param message
+ * 
+ * \return Referenced JSON, caller must ast_json_unref() it. NULL if payload can't be decoded
+ */
+struct ast_json *ast_kafka_consumer_message_json(const struct ast_kafka_consumer_message *message);
+
+/*!
+ * \brief Get Kafka topic name of the received message.
+ * 
+ * \param message
+ * 
+ * \return Topic name
+ */
+const char *ast_kafka_consumer_message_topic(const struct ast_kafka_consumer_message *message);
+
+/*!
+ * \brief Get Kafka partition of the received message.
+ * 
+ * \param message
+ * 
+ * \return Partition
+ */
+int32_t ast_kafka_consumer_message_partition(const struct ast_kafka_consumer_message *message);
+
+/*!
+ * \brief Get Kafka offset of the received message.
+ * 
+ * \param message
+ * 
+ * \return Offset
+ */
+int64_t ast_kafka_consumer_message_offset(const struct ast_kafka_consumer_message *message);
+
+/*!
+ * \brief Get number of messages in the received batch.
+ * 
+ * \param batch
+ * 
+ * \return Number of messages
+ */
+size_t ast_kafka_consumer_batch_count(const struct ast_kafka_consumer_batch *batch);
+
+/*!
+ * \brief Get message from the received batch.
+ * 
+ * \details
+ * Get message from the received batch. All messages in the batch are
+ * received from the same topic.
+ * 
+ * \note
+ * 
+ * \param batch
+ * \param index - message index, less than ast_kafka_consumer_batch_count()
+ * 
+ * \return Message or NULL if index out of range
+ */
+const struct ast_kafka_consumer_message *ast_kafka_consumer_batch_message(const struct ast_kafka_consumer_batch *batch, size_t index);
+
+/*!
+ * \brief Publish pipeline stages timed by ast_kafka_bench().
+ */
+enum ast_kafka_stage {
+	/*! ast_json_pack() of the benchmark message */
+	AST_KAFKA_STAGE_PACK = 0,
+	/*! JSON dump or binary encode with envelope */
+	AST_KAFKA_STAGE_SERIALIZE,
+	/*! Message headers template lookup */
+	AST_KAFKA_STAGE_HEADERS,
+	/*! Enqueue by rd_kafka_producev() */
+	AST_KAFKA_STAGE_PRODUCEV,
+	/*! Delivery report callback */
+	AST_KAFKA_STAGE_DELIVERY,
+	/*! Number of stages */
+	AST_KAFKA_STAGE_COUNT,
+};
+
+/*!
+ * \brief Benchmark parameters, see ast_kafka_bench().
+ */
+struct ast_kafka_bench_options {
+	/*! Messages to send, positive */
+	unsigned int messages;
+	/*! Payload size, raised to the benchmark prefix size */
+	unsigned int size;
+	/*! Total rate, msg/s, 0 for unlimited */
+	unsigned int rate;
+	/*! Sender threads, from 1 to 64 */
+	unsigned int threads;
+	/*! Pack messages and publish by ast_kafka_publish() */
+	unsigned int json;
+};
+
+/*!
+ * \brief Benchmark results, see ast_kafka_bench().
+ */
+struct ast_kafka_bench_report {
+	/*! Producer topics of the pipe */
+	int topics;
+	/*! Messages sent by all threads */
+	int sent;
+	/*! Messages rejected on send */
+	int failed;
+	/*! Delivery reports expected, accepted messages by topics */
+	int expected;
+	/*! Delivery reports without error */
+	int delivered;
+	/*! Delivery reports with error */
+	int delivery_errors;
+	/*! Time to send all messages, us */
+	int64_t send_us;
+	/*! Time to send and receive delivery reports, us */
+	int64_t total_us;
+	/*! Enqueue to delivery report latency percentiles, us */
+	uint64_t latency_p50_us;
+	uint64_t latency_p99_us;
+	uint64_t latency_p999_us;
+	uint64_t latency_max_us;
+	/*! Full producer queue events while running */
+	int queue_full;
+	/*! Retried on full queue messages */
+	int retried;
+	/*! Dropped on full queue messages */
+	int dropped;
+	/*! Publish stages timings */
+	struct {
+		/*! Timed calls */
+		uint64_t count;
+		/*! Average call time, ns */
+		uint64_t avg_ns;
+	} stages[AST_KAFKA_STAGE_COUNT];
+};
+
+/*!
+ * \brief Run producer benchmark on the pipe.
+ *
+ * \details
+ * Send messages to the pipe by the sender threads with total rate and wait
+ * delivery reports of the every pipe's producer topic (up to 30 seconds).
+ * Only one benchmark run at time. Each stage timing and the summary are
+ * reported by test suite events (KAFKA_BENCH_STAGE and KAFKA_BENCH), USDT
+ * probes stage__start, stage__stop and bench__delivered fire when res_kafka
+ * is built with <sys/sdt.h>.
+ *
+ * \note
+ * Blocks the caller until the benchmark complete.
+ *
+ * \param pipe
+ * \param options - benchmark parameters
+ * \param report - filled with results on success
+ *
+ * \return 0 on success, -1 if invalid options, pipe have no producers or other benchmark running
+ */
+int ast_kafka_bench(struct ast_kafka_pipe *pipe, const struct ast_kafka_bench_options *options, struct ast_kafka_bench_report *report);
+
+/*!
+ * \brief Get name of the publish pipeline stage.
+ *
+ * \param stage
+ *
+ * \return Stage name
+ */
+const char *ast_kafka_stage_name(enum ast_kafka_stage stage);
+
+/*!
+ * \brief Create pipe produced to the librdkafka mock cluster.
+ *
+ * \details
+ * Pipe's producer is connected to the in-process mock cluster started by
+ * librdkafka (test.mock.num.brokers), no Kafka brokers needed. The pipe is
+ * not configured in kafka.conf, so it's retired by reload.
+ *
+ * \note
+ * Use it for benchmarks and tests only.
+ *
+ * \param pipe_id - pipe id, not configured in kafka.conf
+ * \param brokers - number of mock brokers, positive
+ *
+ * \return Referenced pipe or NULL
+ */
+struct ast_kafka_pipe *ast_kafka_mock_pipe_create(const char *pipe_id, unsigned int brokers);
+
+/*!
+ * \brief Stop mock pipe's producer.
+ *
+ * \details
+ * Retire producer created by ast_kafka_mock_pipe_create() and release the
+ * pipe reference, outstanding messages are flushed by the producer release.
+ *
+ * \param pipe - pipe created by ast_kafka_mock_pipe_create()
+ */
+void ast_kafka_mock_pipe_destroy(struct ast_kafka_pipe *pipe);
+
 #endif /* _ASTERISK_RES_KAFKA_H */
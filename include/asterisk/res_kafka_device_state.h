@@ -0,0 +1,49 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2020, Vedga
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Cluster-wide device states received via Kafka
+ */
+
+#ifndef _ASTERISK_RES_KAFKA_DEVICE_STATE_H
+#define _ASTERISK_RES_KAFKA_DEVICE_STATE_H
+
+#include <asterisk/devicestate.h>
+#include <asterisk/utils.h>
+
+/*! Device state provider technology, "Kafka/<device key>" */
+#define AST_KAFKA_DEVICE_STATE_TECH "Kafka"
+
+/*!
+ * \brief Get cluster-wide device state.
+ * 
+ * \details
+ * Get the last device state received from the "device_state" pipe, resolved
+ * by the rules of DEVICESTATE.RUS.txt: offline state (UNKNOWN, INVALID or
+ * UNAVAILABLE) replace the known one only if it is published by the same
+ * server (EID).
+ * 
+ * \note
+ * 
+ * \param device - device key or device name with technology ("PJSIP/1234" and "1234" are the same)
+ * \param eid - EID of the server published the state, can be NULL
+ * \param state - device state, can be NULL
+ * 
+ * \return 0 if device state is known, -1 otherwise
+ */
+int ast_kafka_device_state_get(const char *device, struct ast_eid *eid, enum ast_device_state *state);
+
+#endif /* _ASTERISK_RES_KAFKA_DEVICE_STATE_H */
@@ -36,6 +36,88 @@
 	<configInfo name="res_kafka" language="en_US">
 		<synopsis>Kafka Resource using rdkafka client library</synopsis>
 		<configFile name="kafka.conf">
+			<configObject name="general">
+				<synopsis>Module-wide options</synopsis>
+				<configOption name="type">
+					<synopsis>Must be of type 'general'</synopsis>
+				</configOption>
+				<configOption name="poller_threads" default="1">
+					<synopsis>Number of threads, serving producers and consumers events</synopsis>
+					<description><para>
+						Each producer and consumer is served by one poller thread,
+						selected by the service <literal>poller</literal> option or by hash
+						of the service id. Changes take effect when module is loaded.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="poller_cpus">
+					<synopsis>Comma-separated list of CPUs to pin poller threads to</synopsis>
+					<description><para>
+						Poller thread N is pinned to the N-th CPU in the list (wrapped around).
+						Empty value (default) mean threads are not pinned.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="publish_threads" default="0">
+					<synopsis>Number of threads, serving asynchronous publish</synopsis>
+					<description><para>
+						When non-zero, <literal>ast_kafka_publish()</literal> and
+						<literal>ast_kafka_send_json_message()</literal> only enqueue the
+						referenced JSON, packing, serialization and produce are done by
+						the publish threads in batches. Messages of the same key (or of the
+						same pipe for messages without key) are served by one thread in order.
+						Zero (default) mean messages are produced on the caller's thread.
+						Changes take effect when module is loaded.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="publish_queue_max" default="10000">
+					<synopsis>Maximum number of messages waiting in each publish thread queue</synopsis>
+					<description><para>
+						Messages published to the full queue are rejected and counted as dropped.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="publish_high_water" default="500">
+					<synopsis>Publish thread queue size to raise taskprocessor alert</synopsis>
+					<description><para>
+						Alert is cleared when queue size drop below 90% of this level.
+						Zero disable alerts.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="dispatch_lanes" default="0">
+					<synopsis>Number of stasis topics (lanes) of each pipe, consumed messages dispatched by key</synopsis>
+					<description><para>
+						When non-zero, each consumed message is also published to one of the
+						pipe's lane topics by hash of the message key (or partition for
+						messages without key), so messages of the same key are kept in order
+						and unrelated keys are served in parallel by the lanes subscribers
+						(<literal>ast_kafka_get_stasis_lane_topic()</literal>). Lanes are
+						forwarded to the pipe's stasis topic. Changes take effect when module is loaded.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="flush_timeout" default="10000">
+					<synopsis>Maximum time to deliver outstanding messages on unload or topic removal, ms</synopsis>
+					<description><para>
+						On module unload all producers are flushed concurrently with one
+						deadline, so unload take at most flush_timeout. Messages still
+						outstanding after the deadline are dropped or spooled (flush_spool).
+						</para>
+					</description>
+				</configOption>
+				<configOption name="flush_spool" default="yes">
+					<synopsis>Purge messages outstanding after flush_timeout to the producer's spool</synopsis>
+					<description><para>
+						Purged messages are appended to the spool of producers with
+						<literal>spool=yes</literal> and replayed after restart. In-flight
+						messages can be delivered twice.
+						</para>
+					</description>
+				</configOption>
+			</configObject>
+
 			<configObject name="cluster">
 				<synopsis>Kafka cluster description</synopsis>
 				<description><para>
@@ -94,6 +176,15 @@
 				<configOption name="sasl_password">
 					<synopsis>SASL authentication password</synopsis>
 				</configOption>
+				<configOption name="^rdkafka\..+$" regex="true">
+					<synopsis>librdkafka property passthrough</synopsis>
+					<description><para>
+						<literal>rdkafka.&lt;name&gt;=&lt;value&gt;</literal> set librdkafka
+						configuration property <literal>&lt;name&gt;</literal> as is.
+						Applied to all producers and consumers of the cluster, overridden by them.
+						</para>
+					</description>
+				</configOption>
 			</configObject>
  
 			<configObject name="producer">
@@ -126,6 +217,9 @@
 				<configOption name="partition" default="-1">
 					<synopsis>Producer's partition, less than zero if unassigned (default)</synopsis>
 				</configOption>
+				<configOption name="poller" default="-1">
+					<synopsis>Poller thread index, less than zero mean selected by hash of producer id (default)</synopsis>
+				</configOption>
 				<configOption name="request_required_acks" default="-1">
 					<synopsis>request.required.acks (default -1)</synopsis>
 				</configOption>
@@ -156,9 +250,146 @@
 						<para>Default value: 100</para>
 					</description>
 				</configOption>
+				<configOption name="compression_type">
+					<synopsis>Compression codec of message sets</synopsis>
+					<description><para>
+						One of <literal>none</literal>, <literal>gzip</literal>, <literal>snappy</literal>,
+						<literal>lz4</literal> or <literal>zstd</literal>. Empty value (default) keep
+						librdkafka default.
+						</para>
+						<para>Kafka property: compression.type</para>
+					</description>
+				</configOption>
+				<configOption name="linger_ms" default="-1">
+					<synopsis>Delay in milliseconds to accumulate messages before sending batches</synopsis>
+					<description><para>
+						Higher value trade latency for throughput. Negative value (default) keep librdkafka default.
+						</para>
+						<para>Kafka property: linger.ms</para>
+					</description>
+				</configOption>
+				<configOption name="partitioner">
+					<synopsis>Partitioner of the messages with key</synopsis>
+					<description><para>
+						One of <literal>random</literal>, <literal>consistent</literal>, <literal>consistent_random</literal>,
+						<literal>murmur2</literal>, <literal>murmur2_random</literal>, <literal>fnv1a</literal> or
+						<literal>fnv1a_random</literal> (same names as librdkafka). Empty value (default) keep
+						librdkafka partitioner and topic's rdkafka.partitioner property.
+						</para>
+						<para>With <literal>random</literal> and <literal>*_random</literal> partitioners null key
+						messages stay on one partition for sticky_linger_ms. With <literal>murmur2</literal> partitioners
+						key hash precomputed by ast_kafka_key_hash() is used by ast_kafka_send_raw_message_hash().</para>
+						<para>Kafka property: partitioner</para>
+					</description>
+				</configOption>
+				<configOption name="sticky_linger_ms" default="10">
+					<synopsis>Time in milliseconds null key messages sent to the same partition</synopsis>
+					<description><para>
+						Only with <literal>random</literal> and <literal>*_random</literal> partitioner option,
+						larger batches are better compressed. Zero spread each message to random partition.
+						</para>
+						<para>Kafka property: sticky.partitioning.linger.ms</para>
+					</description>
+				</configOption>
+				<configOption name="batch_num_messages" default="-1">
+					<synopsis>Maximum number of messages batched in one message set</synopsis>
+					<description><para>
+						Negative value (default) keep librdkafka default.
+						</para>
+						<para>Kafka property: batch.num.messages</para>
+					</description>
+				</configOption>
+				<configOption name="batch_size" default="-1">
+					<synopsis>Maximum size in bytes of all messages batched in one message set</synopsis>
+					<description><para>
+						Negative value (default) keep librdkafka default.
+						</para>
+						<para>Kafka property: batch.size</para>
+					</description>
+				</configOption>
+				<configOption name="queue_buffering_max_messages" default="-1">
+					<synopsis>Maximum number of messages in the producer queue</synopsis>
+					<description><para>
+						Negative value (default) keep librdkafka default.
+						</para>
+						<para>Kafka property: queue.buffering.max.messages</para>
+					</description>
+				</configOption>
+				<configOption name="queue_buffering_max_kbytes" default="-1">
+					<synopsis>Maximum total size in kbytes of messages in the producer queue</synopsis>
+					<description><para>
+						Negative value (default) keep librdkafka default.
+						</para>
+						<para>Kafka property: queue.buffering.max.kbytes</para>
+					</description>
+				</configOption>
+				<configOption name="on_queue_full" default="drop">
+					<synopsis>Action when librdkafka producer queue is full</synopsis>
+					<description>
+						<enumlist>
+							<enum name="drop"><para>Drop the message (default).</para></enum>
+							<enum name="block"><para>Serve producer events and retry for up to queue_full_timeout ms, then drop.</para></enum>
+							<enum name="spill"><para>Append message to the producer's spool, drop if spool disabled or full.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="queue_full_timeout" default="100">
+					<synopsis>Maximum time to block publisher on full queue, ms. Default 100ms, limited to 5000ms.</synopsis>
+				</configOption>
+				<configOption name="spool" default="no">
+					<synopsis>Keep undelivered messages in the on-disk spool</synopsis>
+					<description><para>
+						Messages failed by delivery timeout or transport errors (and messages
+						rejected by full queue when on_queue_full=spill) are appended to the
+						memory-mapped spool file and replayed in order when the broker is
+						available again. While the spool is not empty new messages are
+						appended to the spool too, so the delivery order is kept.
+						</para>
+						<para>Spool file is astspooldir/kafka/&lt;producer id&gt;.spool or spool_file.</para>
+					</description>
+				</configOption>
+				<configOption name="spool_file">
+					<synopsis>Spool file path, default astspooldir/kafka/&lt;producer id&gt;.spool</synopsis>
+				</configOption>
+				<configOption name="spool_size" default="64">
+					<synopsis>Spool file size, MB. Default 64MB.</synopsis>
+					<description><para>
+						Spool never grows above this size, messages are dropped when spool is full.
+						Size of the existing spool file is kept until the spool recreated.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="spool_sync" default="periodic">
+					<synopsis>Spool file sync policy</synopsis>
+					<description>
+						<enumlist>
+							<enum name="none"><para>Leave writeback to the operating system.</para></enum>
+							<enum name="periodic"><para>Sync spool once per second (default).</para></enum>
+							<enum name="always"><para>Sync each appended message.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="statistics_interval" default="0">
+					<synopsis>librdkafka statistics interval, ms. Zero (default) disable statistics.</synopsis>
+					<description><para>
+						Broker round trip times, partition queues and consumer lag reported by
+						librdkafka are shown by <literal>kafka show stats</literal>, the
+						<literal>KafkaStats</literal> AMI action and the kafka/metrics HTTP endpoint.
+						</para>
+					</description>
+				</configOption>
 				<configOption name="debug">
 					<synopsis>Comma-separated list of debug contexts to enable</synopsis>
 				</configOption>
+				<configOption name="^rdkafka\..+$" regex="true">
+					<synopsis>librdkafka property passthrough</synopsis>
+					<description><para>
+						<literal>rdkafka.&lt;name&gt;=&lt;value&gt;</literal> set librdkafka
+						producer configuration property <literal>&lt;name&gt;</literal> as is.
+						Applied after the typed options and overrides them.
+						</para>
+					</description>
+				</configOption>
 			</configObject>
 
 			<configObject name="consumer">
@@ -178,6 +409,52 @@
 				<configOption name="partition" default="-1">
 					<synopsis>Consumer's partition, less than zero if unassigned (default)</synopsis>
 				</configOption>
+				<configOption name="partitions" default="">
+					<synopsis>Low-level consumer partitions: comma separated list or 'all'</synopsis>
+					<description><para>
+						Each partition of the consumer topics is started with its own queue,
+						forwarded to the consumer queue. With 'all' the partitions are taken
+						from the topic metadata. By default the partition option is used.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="start_offset" default="beginning">
+					<synopsis>Low-level consumer start offset: beginning, end, stored or timestamp</synopsis>
+					<description><para>
+						With 'stored' consumer continues from the offset stored by the topic
+						offset store (rdkafka.offset.store.method topic property). With 'timestamp'
+						each partition starts from the first message not older than start_time.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="start_time" default="0">
+					<synopsis>Start time for start_offset=timestamp: UNIX time, seconds, or seconds before now if not positive</synopsis>
+				</configOption>
+				<configOption name="poller" default="-1">
+					<synopsis>Poller thread index, less than zero mean selected by hash of consumer id (default)</synopsis>
+				</configOption>
+				<configOption name="batch_size" default="1">
+					<synopsis>Maximum number of messages, forwarded to the pipe by one stasis message</synopsis>
+					<description><para>
+						When greater than 1, received messages are published to the pipe's
+						stasis topic as batches (see <literal>ast_kafka_consumer_batch_type</literal>),
+						one stasis message per up to batch_size Kafka messages.
+						Message wrappers of the batch are kept in buffers recycled by the
+						consumer's bounded free-list, so allocations per message are amortized
+						by the batch. With batch_size 1 each message is still one allocation.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="batch_timeout" default="0">
+					<synopsis>Maximum time to wait for the batch to fill, ms</synopsis>
+					<description><para>
+						Zero (default) mean batch contain only already received messages.
+						Otherwise a partial batch is kept between poller wakeups and
+						forwarded when full or when batch_timeout expired, the poller
+						thread is not blocked.
+						</para>
+					</description>
+				</configOption>
 				<configOption name="enable_auto_commit" default="yes">
 					<synopsis>Enable auto commit (default yes)</synopsis>
 					<description>
@@ -190,6 +467,26 @@
 				<configOption name="auto_commit_interval" default="5000">
 					<synopsis>Interval when consumer commited offset, ms. Default 5000ms.</synopsis>
 				</configOption>
+				<configOption name="commit_mode" default="auto">
+					<synopsis>How consumed offsets are committed</synopsis>
+					<description>
+						<enumlist>
+							<enum name="auto"><para>librdkafka commits received offsets (enable_auto_commit).</para></enum>
+							<enum name="processed"><para>
+								Offset is commited when all messages of the partition up to this offset
+								are processed, i.e. all stasis messages with them are released by subscribers
+								(at-least-once delivery). Commits are asynchronous, by commit_batch messages
+								or each commit_interval. Require group_id, enable_auto_commit ignored.
+							</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="commit_batch" default="1000">
+					<synopsis>Processed messages to commit offsets with commit_mode=processed</synopsis>
+				</configOption>
+				<configOption name="commit_interval" default="1000">
+					<synopsis>Maximum interval to commit processed offsets with commit_mode=processed, ms</synopsis>
+				</configOption>
 				<configOption name="isolation_level" default="read_committed">
 					<synopsis>isolation.level (default 'read_committed')</synopsis>
 					<description>
@@ -199,9 +496,21 @@
 						</enumlist>
 					</description>
 				</configOption>
+				<configOption name="statistics_interval" default="0">
+					<synopsis>librdkafka statistics interval, ms. Zero (default) disable statistics.</synopsis>
+				</configOption>
 				<configOption name="debug">
 					<synopsis>Comma-separated list of debug contexts to enable</synopsis>
 				</configOption>
+				<configOption name="^rdkafka\..+$" regex="true">
+					<synopsis>librdkafka property passthrough</synopsis>
+					<description><para>
+						<literal>rdkafka.&lt;name&gt;=&lt;value&gt;</literal> set librdkafka
+						consumer configuration property <literal>&lt;name&gt;</literal> as is.
+						Applied after the typed options and overrides them.
+						</para>
+					</description>
+				</configOption>
 			</configObject>
 
 			<configObject name="topic">
@@ -221,6 +530,45 @@
 				<configOption name="consumer">
 					<synopsis>Consumer resource id</synopsis>
 				</configOption>
+				<configOption name="headers" default="yes">
+					<synopsis>Add "reason" and "eid" headers to the produced messages</synopsis>
+					<description><para>
+						Disable for topics whose consumers read only the message body.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="format" default="json">
+					<synopsis>Wire format of the published JSON messages</synopsis>
+					<description><para>
+						Messages sent by <literal>ast_kafka_publish()</literal> and
+						<literal>ast_kafka_send_json_message()</literal> are encoded as
+						JSON text (<literal>json</literal>), MessagePack (<literal>msgpack</literal>)
+						or CBOR (<literal>cbor</literal>). Binary formats are marked by the
+						<literal>content-type</literal> header when topic headers are enabled.
+						Raw messages are sent as is.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="drop_own_eid" default="no">
+					<synopsis>Consumer drop messages published by this server</synopsis>
+					<description><para>
+						Messages with <literal>eid</literal> header equal to the server's
+						Entity ID are released in the consumer poll, before any stasis
+						message or JSON decode.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="reason_in">
+					<synopsis>Comma separated list of reasons accepted by consumer</synopsis>
+					<description><para>
+						When set, consumer accepts only messages with <literal>reason</literal>
+						header from the list, other messages are dropped in the consumer poll.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="key_prefix">
+					<synopsis>Consumer accepts only messages with key starting by this prefix</synopsis>
+				</configOption>
 				<configOption name="message_timeout_ms" default="300000">
 					<synopsis>message.timeout.ms</synopsis>
 					<description><para>
@@ -238,9 +586,32 @@
 						<para>Default value: 300000</para>
 					</description>
 				</configOption>
+				<configOption name="^rdkafka\..+$" regex="true">
+					<synopsis>librdkafka property passthrough</synopsis>
+					<description><para>
+						<literal>rdkafka.&lt;name&gt;=&lt;value&gt;</literal> set librdkafka
+						topic configuration property <literal>&lt;name&gt;</literal> as is.
+						</para>
+					</description>
+				</configOption>
 			</configObject>
 		</configFile>
 	</configInfo>
+	<manager name="KafkaStats" language="en_US">
+		<synopsis>
+			Show Kafka performance counters.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Pipe">
+				<para>Pipe id. Counters of all pipes are shown if not specified.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Emit <literal>KafkaStats</literal> event for each pipe, topic, service,
+			broker and partition, followed by <literal>KafkaStatsComplete</literal>.</para>
+		</description>
+	</manager>
  ***/
 
 
@@ -252,7 +623,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 
 #include "asterisk/module.h"
 #include "asterisk/sorcery.h"
-//#include "asterisk/taskprocessor.h"
+#include "asterisk/taskprocessor.h"
 #include "asterisk/astobj2.h"
 #include "asterisk/linkedlists.h"
 #include "asterisk/dlinkedlists.h"
@@ -260,6 +631,14 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 #include "asterisk/stringfields.h"
 #include "asterisk/utils.h"
 #include "asterisk/lock.h"
+#include "asterisk/alertpipe.h"
+#include "asterisk/poll-compat.h"
+#include "asterisk/manager.h"
+#include "asterisk/http.h"
+#include "asterisk/json.h"
+#include "asterisk/threadstorage.h"
+#include "asterisk/test.h"
+#include "asterisk/vector.h"
 /* define ast_config_AST_SYSTEM_NAME */
 #include "asterisk/paths.h"
 
@@ -267,29 +646,241 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 #include "librdkafka/rdkafka.h"
 
 #include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <sched.h>
+#include <math.h>
+#include <stdint.h>
+
+#ifdef HAVE_SYS_SDT_H
+/* Static tracepoints, enabled when configure found <sys/sdt.h> (systemtap-sdt-dev) */
+#include <sys/sdt.h>
+#define KAFKA_TRACE(name, arg) DTRACE_PROBE1(res_kafka, name, arg)
+#else
+#define KAFKA_TRACE(name, arg)
+#endif
 
 #define KAFKA_CONFIG_FILENAME "kafka.conf"
 
+#define KAFKA_GENERAL "general"
 #define KAFKA_CLUSTER "cluster"
 #define KAFKA_TOPIC "topic"
 #define KAFKA_PRODUCER "producer"
 #define KAFKA_CONSUMER "consumer"
 #define KAFKA_ERRSTR_MAX_SIZE 80
+
+/*! Prefix of the librdkafka properties passthrough options */
+#define KAFKA_RDKAFKA_PREFIX "rdkafka."
 #define TMP_BUF_SIZE 32
 
-#define KAFKA_MONITOR_NO_EVENTS_SLEEP_US 500
+/*! Maximum events served on one service per monitor wakeup */
+#define KAFKA_MONITOR_POLL_BUDGET 1000
+
+/*! Monitor wakeup period when no events signalled, ms */
+#define KAFKA_MONITOR_IDLE_TIMEOUT_MS 1000
+
+/*! Monitor pause after poll() failure, us */
+#define KAFKA_MONITOR_ERROR_PAUSE_US 100000
+
+/*! Upper limit for the poller_threads option */
+#define KAFKA_MONITOR_MAX_THREADS 64
+
+/*! Default outstanding messages flush timeout, ms */
+#define KAFKA_FLUSH_TIMEOUT_MS 10000
+
+/*! Maximum time to serve delivery reports of the purged messages, ms */
+#define KAFKA_FLUSH_PURGE_TIMEOUT_MS 1000
 
 #define KAFKA_SUBSYSTEM "kafka"
 
 //#define KAFKA_TASKPROCESSOR_MONITOR_ID "kafka/monitor"
 
+/*! Publish threads taskprocessors name prefix */
+#define KAFKA_TASKPROCESSOR_PUBLISH_ID "kafka/publish"
+
+/*! Maximum messages serialized and produced by one publish task */
+#define KAFKA_PUBLISH_BATCH_MAX 64
+
+/*! Initial size of the thread serialization buffer */
+#define KAFKA_ENVELOPE_BUF_INIT 1024
+
+/*! Maximum nesting of encoded and decoded messages */
+#define KAFKA_FORMAT_MAX_DEPTH 64
+
 /*! Buckets for pipe hash. Keep it prime! */
 #define KAFKA_PIPE_BUCKETS 127
 
+/*! Buckets for headers templates hash. Keep it prime! */
+#define KAFKA_HEADERS_BUCKETS 31
+
+/*! Buckets for shared producer connections hash. Keep it prime! */
+#define KAFKA_CONNECTION_BUCKETS 31
+
+/*! Maximum number of cached headers templates */
+#define KAFKA_HEADERS_CACHE_MAX 128
+
+/*! Upper limit of the publisher block time on full producer queue, ms */
+#define KAFKA_QUEUE_FULL_MAX_TIMEOUT_MS 5000
+
+/*! Producer events serve interval while publisher blocked on full queue, ms */
+#define KAFKA_QUEUE_FULL_POLL_MS 1
+
+/*! Log each N-th dropped message on full producer queue */
+#define KAFKA_QUEUE_FULL_LOG_INTERVAL 1000
+
+/*! Spool file signature 'KSPL' */
+#define KAFKA_SPOOL_MAGIC 0x4b53504c
+
+/*! Spool record signature 'KREC' */
+#define KAFKA_SPOOL_RECORD_MAGIC 0x4b524543
+
+/*! Spool file format version */
+#define KAFKA_SPOOL_VERSION 2
+
+/*! Offset of the first spool record, header occupy the first page */
+#define KAFKA_SPOOL_DATA_OFFSET 4096
+
+/*! Spool records alignment */
+#define KAFKA_SPOOL_ALIGN 8
+
+/*! Maximum records replayed per producer poll */
+#define KAFKA_SPOOL_REPLAY_BUDGET 500
+
+/*! Replay paused while producer queue hold more messages */
+#define KAFKA_SPOOL_REPLAY_OUTQ_MAX 1000
+
+/*! Replay pause after failed delivery, ms */
+#define KAFKA_SPOOL_RETRY_MS 1000
+
+/*! Periodic spool sync interval, ms */
+#define KAFKA_SPOOL_SYNC_INTERVAL_MS 1000
+
+/*! Benchmark payload signature */
+#define KAFKA_BENCH_MAGIC "KBENCH01"
+
+/*! Benchmark JSON message marker, KAFKA_BENCH_MAGIC ":" and hex run id */
+#define KAFKA_BENCH_MARKER_SIZE 20
+
+/*! Latency histogram: sub-buckets per power of two */
+#define KAFKA_HISTOGRAM_SUB_BUCKETS 16
+
+/*! Latency histogram size, covers up to 2^32 us with ~6% precision */
+#define KAFKA_HISTOGRAM_BUCKETS ((32 - 3) * KAFKA_HISTOGRAM_SUB_BUCKETS)
+
+/*! Maximum benchmark sender threads */
+#define KAFKA_BENCH_MAX_THREADS 64
+
+/*! Time to wait for delivery reports after all messages sent, ms */
+#define KAFKA_BENCH_DRAIN_TIMEOUT_MS 30000
+
+/*! Maximum recycled batch buffers of each consumer */
+#define KAFKA_BATCH_BUFFERS_MAX 16
+
+/*! Minimum consumer batch buffer capacity, messages */
+#define KAFKA_BATCH_BUFFER_MIN 16
+
+/*! Cluster, producer and topic id prefix of the mock pipe */
+#define KAFKA_MOCK_PREFIX "mock."
+
+/*! Loopback probe payload signature */
+#define KAFKA_PROBE_MAGIC "KPROBE01"
+
+/*! Default loopback probe interval, ms */
+#define KAFKA_PROBE_INTERVAL_MS 1000
+
+/*! Loopback probe rolling histogram window, ms */
+#define KAFKA_PROBE_WINDOW_MS 60000
+
+/*! Buckets for loopback probes hash. Keep it prime! */
+#define KAFKA_PROBE_BUCKETS 7
+
 /*! Buckets for topic hash. Keep it prime! */
 #define KAFKA_TOPIC_BUCKETS 127
 
+/*! Performance counters stripes, power of two, stripe selected by CPU */
+#define KAFKA_STATS_STRIPES 16
+
+/*! Cache line size, keep counters stripes apart */
+#define KAFKA_STATS_CACHE_LINE 64
+
+/*! Maximum length of the broker or topic name in librdkafka statistics */
+#define KAFKA_STATS_NAME_MAX 256
+
+/*! Performance counters */
+enum kafka_counter {
+	/*! Messages enqueued to librdkafka */
+	KAFKA_COUNTER_PRODUCED_MESSAGES = 0,
+	/*! Payload bytes enqueued to librdkafka */
+	KAFKA_COUNTER_PRODUCED_BYTES,
+	/*! Messages received by consumer */
+	KAFKA_COUNTER_CONSUMED_MESSAGES,
+	/*! Payload bytes received by consumer */
+	KAFKA_COUNTER_CONSUMED_BYTES,
+	/*! Produce attempts rejected by full queue */
+	KAFKA_COUNTER_QUEUE_FULL,
+	/*! Messages dropped because queue is full */
+	KAFKA_COUNTER_DROPPED,
+	/*! Messages delivered to the broker */
+	KAFKA_COUNTER_DELIVERED,
+	/*! Messages failed by delivery report */
+	KAFKA_COUNTER_DELIVERY_FAILED,
+	/*! Service polls by monitor thread */
+	KAFKA_COUNTER_POLL_ITERATIONS,
+	/*! Service polls without events */
+	KAFKA_COUNTER_POLL_IDLE,
+	/*! Events served by service polls */
+	KAFKA_COUNTER_POLL_EVENTS,
+	/*! Messages dropped by consumer topic filter */
+	KAFKA_COUNTER_FILTERED,
+	/*! Number of counters */
+	KAFKA_COUNTER_MAX,
+};
+
+/*! Counter names, shown by CLI, AMI and metrics endpoint */
+static const char *kafka_counter_names[KAFKA_COUNTER_MAX] = {
+	[KAFKA_COUNTER_PRODUCED_MESSAGES] = "produced_messages",
+	[KAFKA_COUNTER_PRODUCED_BYTES] = "produced_bytes",
+	[KAFKA_COUNTER_CONSUMED_MESSAGES] = "consumed_messages",
+	[KAFKA_COUNTER_CONSUMED_BYTES] = "consumed_bytes",
+	[KAFKA_COUNTER_QUEUE_FULL] = "queue_full",
+	[KAFKA_COUNTER_DROPPED] = "dropped",
+	[KAFKA_COUNTER_DELIVERED] = "delivered",
+	[KAFKA_COUNTER_DELIVERY_FAILED] = "delivery_failed",
+	[KAFKA_COUNTER_POLL_ITERATIONS] = "poll_iterations",
+	[KAFKA_COUNTER_POLL_IDLE] = "poll_idle",
+	[KAFKA_COUNTER_POLL_EVENTS] = "poll_events",
+	[KAFKA_COUNTER_FILTERED] = "filtered",
+};
+
+/*! Module-wide parameters */
+struct sorcery_kafka_general {
+	SORCERY_OBJECT(defails);
+	AST_DECLARE_STRING_FIELDS(
+		/*! Comma separated CPUs to pin poller threads */
+		AST_STRING_FIELD(poller_cpus);
+	);
+	/*! Number of poller threads */
+	unsigned int poller_threads;
+	/*! Number of asynchronous publish threads, 0 if disabled */
+	unsigned int publish_threads;
+	/*! Maximum messages in the publish thread queue */
+	unsigned int publish_queue_max;
+	/*! Publish thread queue size to raise alert */
+	unsigned int publish_high_water;
+	/*! Number of consumer dispatch lanes of each pipe, 0 if disabled */
+	unsigned int dispatch_lanes;
+	/*! Outstanding messages flush timeout, ms */
+	unsigned int flush_timeout_ms;
+	/*! Spool messages outstanding after flush timeout */
+	unsigned int flush_spool;
+};
+
 /*! Kafka cluster common parameters */
 struct sorcery_kafka_cluster {
 	SORCERY_OBJECT(defails);
@@ -305,6 +896,8 @@ struct sorcery_kafka_cluster {
 		/*! SASL authentication password */
 		AST_STRING_FIELD(sasl_password);
 	);
+	/*! rdkafka.<name> properties passthrough */
+	struct ast_variable *rdkafka_properties;
 };
 
 /*! Kafka producer common parameters */
@@ -321,11 +914,31 @@ struct sorcery_kafka_producer {
 		AST_STRING_FIELD(transactional_id);
 		/*! Comma separated contexts for debug */
 		AST_STRING_FIELD(debug);
+		/*! Action on full producer queue ('drop', 'block', 'spill') */
+		AST_STRING_FIELD(on_queue_full);
+		/*! Spool file path, empty for default */
+		AST_STRING_FIELD(spool_file);
+		/*! Spool sync policy ('none', 'periodic', 'always') */
+		AST_STRING_FIELD(spool_sync);
+		/*! compression.type, empty for librdkafka default */
+		AST_STRING_FIELD(compression_type);
+		/*! Partitioner of keyed messages, empty for librdkafka partitioner */
+		AST_STRING_FIELD(partitioner);
 	);
 	/*! Default service timeout, ms */
 	unsigned int timeout_ms;
+	/*! Maximum time to block publisher on full queue, ms */
+	unsigned int queue_full_timeout_ms;
+	/*! Enable on-disk spool */
+	unsigned int spool;
+	/*! Spool file size, MB */
+	unsigned int spool_size;
 	/*! Producer's partition, less than zero mean is unassigned */
 	int partition;
+	/*! Poller thread index, less than zero mean selected by hash */
+	int poller;
+	/*! statistics.interval.ms, zero if disabled */
+	unsigned int statistics_interval_ms;
 	/*! request.required.acks */
 	int request_required_acks;
 	/*! max.in.flight.requests.per.connection */
@@ -336,6 +949,20 @@ struct sorcery_kafka_producer {
 	unsigned int enable_idempotence;
 	/*! The backoff time in milliseconds before retrying a protocol request. */
 	unsigned int retry_backoff_ms;
+	/*! linger.ms, less than zero for librdkafka default */
+	int linger_ms;
+	/*! Null key messages sticky partition time, ms */
+	unsigned int sticky_linger_ms;
+	/*! batch.num.messages, less than zero for librdkafka default */
+	int batch_num_messages;
+	/*! batch.size, less than zero for librdkafka default */
+	int batch_size;
+	/*! queue.buffering.max.messages, less than zero for librdkafka default */
+	int queue_buffering_max_messages;
+	/*! queue.buffering.max.kbytes, less than zero for librdkafka default */
+	int queue_buffering_max_kbytes;
+	/*! rdkafka.<name> properties passthrough */
+	struct ast_variable *rdkafka_properties;
 };
 
 /*! Kafka consumer common parameters */
@@ -350,15 +977,37 @@ struct sorcery_kafka_consumer {
 		AST_STRING_FIELD(isolation_level);
 		/*! Comma separated contexts for debug */
 		AST_STRING_FIELD(debug);
+		/*! Low-level consumer partitions list or "all" */
+		AST_STRING_FIELD(partitions);
+		/*! Low-level consumer start offset */
+		AST_STRING_FIELD(start_offset);
+		/*! Offsets commit mode */
+		AST_STRING_FIELD(commit_mode);
 	);
 	/*! Default service timeout, ms */
 	unsigned int timeout_ms;
 	/*! Consumer's partition, less than zero mean is unassigned */
 	int partition;
+	/*! Start time of start_offset=timestamp, UNIX time or seconds before now if not positive */
+	int start_time;
+	/*! Poller thread index, less than zero mean selected by hash */
+	int poller;
+	/*! statistics.interval.ms, zero if disabled */
+	unsigned int statistics_interval_ms;
+	/*! Maximum messages in one stasis message */
+	unsigned int batch_size;
+	/*! Maximum time to fill the batch, ms */
+	unsigned int batch_timeout_ms;
 	/*! enable.auto.commit */
 	unsigned int enable_auto_commit;
 	/*! Automatic update offset interval, ms */
 	unsigned int auto_commit_interval_ms;
+	/*! Processed messages to commit with commit_mode=processed */
+	unsigned int commit_batch;
+	/*! Maximum processed offsets commit interval with commit_mode=processed, ms */
+	unsigned int commit_interval_ms;
+	/*! rdkafka.<name> properties passthrough */
+	struct ast_variable *rdkafka_properties;
 };
 
 /*! Kafka topic common parameters */
@@ -373,9 +1022,308 @@ struct sorcery_kafka_topic {
 		AST_STRING_FIELD(producer_id);
 		/*! Consumer resource id */
 		AST_STRING_FIELD(consumer_id);
+		/*! Wire format of JSON messages */
+		AST_STRING_FIELD(format);
+		/*! Consumer accepted reasons list */
+		AST_STRING_FIELD(reason_in);
+		/*! Consumer accepted key prefix */
+		AST_STRING_FIELD(key_prefix);
 	);
 	/*! message.timeout.ms */
 	unsigned int message_timeout_ms;
+	/*! Add message headers on produce */
+	unsigned int headers;
+	/*! Consumer drop messages with own EID */
+	unsigned int drop_own_eid;
+	/*! rdkafka.<name> properties passthrough */
+	struct ast_variable *rdkafka_properties;
+};
+
+/*! Wire format of JSON messages */
+enum kafka_format {
+	KAFKA_FORMAT_JSON = 0,
+	KAFKA_FORMAT_MSGPACK,
+	KAFKA_FORMAT_CBOR,
+	KAFKA_FORMAT_COUNT
+};
+
+/*! Format names, used by the topic format option */
+static const char *kafka_format_names[KAFKA_FORMAT_COUNT] = {
+	[KAFKA_FORMAT_JSON] = "json",
+	[KAFKA_FORMAT_MSGPACK] = "msgpack",
+	[KAFKA_FORMAT_CBOR] = "cbor",
+};
+
+/*! Value of the content-type header */
+static const char *kafka_format_content_types[KAFKA_FORMAT_COUNT] = {
+	[KAFKA_FORMAT_JSON] = "application/json",
+	[KAFKA_FORMAT_MSGPACK] = "application/msgpack",
+	[KAFKA_FORMAT_CBOR] = "application/cbor",
+};
+
+/*! Partitioners by the producer partitioner option */
+static const struct {
+	/*! librdkafka partitioner name */
+	const char *name;
+	/*! librdkafka partitioner */
+	int32_t (*partitioner)(const rd_kafka_topic_t *rkt, const void *key, size_t keylen, int32_t partition_cnt, void *rkt_opaque, void *msg_opaque);
+	/*! Null key messages spread to random partitions */
+	int random;
+	/*! Partition is ast_kafka_key_hash() modulo partitions count */
+	int key_hash;
+} kafka_partitioners[] = {
+	{ "random", rd_kafka_msg_partitioner_random, 1, 0 },
+	{ "consistent", rd_kafka_msg_partitioner_consistent, 0, 0 },
+	{ "consistent_random", rd_kafka_msg_partitioner_consistent_random, 1, 0 },
+	{ "murmur2", rd_kafka_msg_partitioner_murmur2, 0, 1 },
+	{ "murmur2_random", rd_kafka_msg_partitioner_murmur2_random, 1, 1 },
+	{ "fnv1a", rd_kafka_msg_partitioner_fnv1a, 0, 0 },
+	{ "fnv1a_random", rd_kafka_msg_partitioner_fnv1a_random, 1, 0 },
+};
+
+/*! Growable binary serialization buffer */
+struct kafka_buf {
+	/*! Buffer, allocated by ast_malloc */
+	unsigned char *data;
+	/*! Allocated size */
+	size_t size;
+	/*! Used size */
+	size_t used;
+	/*! Non-zero if out of memory or value can't be encoded */
+	int failed;
+};
+
+/*! Binary message reader */
+struct kafka_decoder {
+	const unsigned char *data;
+	size_t size;
+	/*! Read position */
+	size_t pos;
+	enum kafka_format format;
+};
+
+/*! Kind of the encoded item head */
+enum kafka_item_kind {
+	KAFKA_ITEM_SCALAR,
+	KAFKA_ITEM_STRING,
+	KAFKA_ITEM_ARRAY,
+	KAFKA_ITEM_MAP,
+};
+
+/*! Poller thread, serving events on the subset of services */
+struct kafka_monitor {
+	/*! Thread handle, AST_PTHREADT_NULL if not started */
+	pthread_t thread;
+	/*! Wakeup thread when services list changed or module unloaded */
+	int alert_pipe[2];
+	/*! Index in the monitors array */
+	unsigned int index;
+	/*! CPU to pin this thread, less than zero if not pinned */
+	int cpu;
+};
+
+/*! Producer's action on full librdkafka queue */
+enum kafka_queue_full_policy {
+	/*! Drop message */
+	KAFKA_QUEUE_FULL_DROP = 0,
+	/*! Serve producer events and retry until timeout */
+	KAFKA_QUEUE_FULL_BLOCK,
+	/*! Append message to the spool */
+	KAFKA_QUEUE_FULL_SPILL,
+};
+
+/*! Spool file sync policy */
+enum kafka_spool_sync {
+	/*! Writeback by operating system */
+	KAFKA_SPOOL_SYNC_NONE = 0,
+	/*! Sync by producer poller once per interval */
+	KAFKA_SPOOL_SYNC_PERIODIC,
+	/*! Sync each appended record */
+	KAFKA_SPOOL_SYNC_ALWAYS,
+};
+
+/*! Spool file header, stored at the file start */
+struct kafka_spool_header {
+	/*! KAFKA_SPOOL_MAGIC */
+	uint32_t magic;
+	/*! KAFKA_SPOOL_VERSION */
+	uint32_t version;
+	/*! Spool file size */
+	uint64_t size;
+	/*! Offset of the first record to replay */
+	uint64_t head;
+	/*! Offset after the last record */
+	uint64_t tail;
+	/*! Offset after the last record before the file end when tail wrapped below head, 0 otherwise */
+	uint64_t wrap;
+};
+
+/*! Spool record frame, followed by topic name, key, serialized headers and payload */
+struct kafka_spool_record {
+	/*! KAFKA_SPOOL_RECORD_MAGIC */
+	uint32_t magic;
+	/*! Whole frame size, aligned to KAFKA_SPOOL_ALIGN */
+	uint32_t size;
+	/*! Topic name length */
+	uint32_t topic_size;
+	/*! Key length, 0 if no key */
+	uint32_t key_size;
+	/*! Serialized headers length, 0 if no headers */
+	uint32_t headers_size;
+	/*! Payload length */
+	uint32_t payload_size;
+	/*! Record data */
+	unsigned char data[0];
+};
+
+/*! Producer's memory-mapped append-only spool */
+struct kafka_spool {
+	/*! Protect spool content and state */
+	ast_mutex_t lock;
+	/*! Spool file descriptor */
+	int fd;
+	/*! Mapped spool file */
+	unsigned char *map;
+	/*! Mapped size */
+	size_t size;
+	/*! Sync policy */
+	enum kafka_spool_sync sync;
+	/*! Records appended after last sync */
+	int dirty;
+	/*! Last sync time */
+	struct timeval synced;
+	/*! Replay paused until */
+	struct timeval hold;
+	/*! Number of records to replay, read without lock */
+	volatile int pending;
+	/*! Number of appended records */
+	volatile int spooled_count;
+	/*! Number of replayed records */
+	volatile int replayed_count;
+	/*! Number of records dropped because spool is full */
+	volatile int overflow_count;
+	/*! Spool file path */
+	char path[0];
+};
+
+/*! Log-linear latency histogram, us */
+struct kafka_histogram {
+	/*! Values counted by bucket */
+	volatile int counts[KAFKA_HISTOGRAM_BUCKETS];
+};
+
+/*! Counters updated by one CPU */
+struct kafka_stats_stripe {
+	/*! Counter values */
+	uint64_t counters[KAFKA_COUNTER_MAX];
+	/*! Keep neighbour stripes on different cache lines */
+	char padding[KAFKA_STATS_CACHE_LINE];
+};
+
+/*! Performance counters of the pipe, topic or service */
+struct kafka_stats {
+	/*! Counters, summarized on read */
+	struct kafka_stats_stripe stripes[KAFKA_STATS_STRIPES];
+	/*! Enqueue to delivery report latency, us */
+	struct kafka_histogram delivery_latency;
+	/*! Consumer lag by last librdkafka statistics, less than zero if unknown */
+	volatile int64_t consumer_lag;
+};
+
+/*! Broker state by librdkafka statistics */
+struct kafka_broker_stats {
+	/*! Broker name */
+	char name[KAFKA_STATS_NAME_MAX];
+	/*! Broker connection is up */
+	int up;
+	/*! Average round trip time, us */
+	int64_t rtt_avg_us;
+	/*! 99th percentile round trip time, us */
+	int64_t rtt_p99_us;
+	/*! Average internal producer queue latency, us */
+	int64_t int_latency_avg_us;
+	/*! Requests waiting to be sent */
+	int64_t outbuf_cnt;
+	/*! Requests waiting for response */
+	int64_t waitresp_cnt;
+	/*! Total requests sent */
+	int64_t tx;
+	/*! Total responses received */
+	int64_t rx;
+};
+
+/*! Partition state by librdkafka statistics */
+struct kafka_partition_stats {
+	/*! Topic name */
+	char topic[KAFKA_STATS_NAME_MAX];
+	/*! Partition id */
+	int32_t partition;
+	/*! Messages waiting in the partition queue */
+	int64_t msgq_cnt;
+	/*! Total messages sent */
+	int64_t txmsgs;
+	/*! Total messages received */
+	int64_t rxmsgs;
+	/*! Consumer lag, less than zero if unknown */
+	int64_t consumer_lag;
+};
+
+/*! Immutable parsed librdkafka statistics, replaced on each statistics callback */
+struct kafka_rdkafka_stats {
+	/*! Messages in producer queues */
+	int64_t msg_cnt;
+	/*! Operations waiting in the reply queue */
+	int64_t replyq;
+	/*! Number of brokers */
+	size_t broker_count;
+	/*! Brokers state */
+	struct kafka_broker_stats *brokers;
+	/*! Number of partitions */
+	size_t partition_count;
+	/*! Partitions state */
+	struct kafka_partition_stats *partitions;
+};
+
+/*! Metrics endpoint family, samples grouped under one TYPE line */
+struct kafka_metrics_family {
+	/*! Prometheus metric type */
+	const char *type;
+	/*! Family samples */
+	struct ast_str *samples;
+	/*! Metric name */
+	char name[0];
+};
+
+/*! Statistics output formatter, shared by CLI, AMI and metrics endpoint */
+struct kafka_stats_writer {
+	/*! Start record of the scope ("pipe", "topic", "producer", "consumer", "broker", "partition") */
+	void (*begin)(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition);
+	/*! Output one named value */
+	void (*value)(struct kafka_stats_writer *writer, const char *name, int64_t value);
+	/*! Finish record */
+	void (*end)(struct kafka_stats_writer *writer);
+	/*! CLI file descriptor */
+	int fd;
+	/*! AMI session */
+	struct mansession *session;
+	/*! AMI ActionID */
+	const char *action_id;
+	/*! Metrics endpoint output */
+	struct ast_str *out;
+	/*! Current record scope */
+	const char *scope;
+	/*! Current record pipe id */
+	const char *pipe_id;
+	/*! Current record id */
+	const char *id;
+	/*! Current record partition, less than zero if not partition record */
+	int32_t partition;
+	/*! Number of records */
+	int count;
+	/*! Services and librdkafka handles already reported, each reported once */
+	AST_VECTOR(, const void *) reported;
+	/*! Metrics endpoint families in the first sample order */
+	AST_VECTOR(, struct kafka_metrics_family *) families;
 };
 
 /*! Internal representation of Kafka's producer or consumer service */
@@ -384,22 +1332,54 @@ struct kafka_service {
 	AST_RWDLLIST_ENTRY(kafka_service) link;
 	/*! librdkafka producer's or consumer's handle */
 	rd_kafka_t *rd_kafka;
+	/*! librdkafka main queue, NULL if forwarded to the consumer queue */
+	rd_kafka_queue_t *main_queue;
+	/*! Signalled by librdkafka when any service queue become non-empty */
+	int alert_pipe[2];
+	/*! Serve pending service events, return number of processed events */
+	int (*poll)(struct kafka_service *service, int budget);
+	/*! Poller thread serving this service */
+	struct kafka_monitor *monitor;
+	/*! Poll also when not signalled after this time, zero if not requested (accessed by the poller thread only) */
+	struct timeval wakeup;
 	/*! Default service timeout, ms */
 	unsigned int timeout_ms;
 	/*! Service partition */
 	int32_t partition;
 	/*! Linked topics (must be accessed with lock producers or customers variable) */
 	unsigned int topic_count;
+	/*! Service retired by reload, topics are released (must be accessed with lock producers or customers variable) */
+	int retired;
 	/*! Kafka topics, handled via this service */
 	struct ao2_container *topics;
+	/*! Sorcery producer or consumer object the service built from */
+	void *sorcery_service;
+	/*! Sorcery cluster object the service built from */
+	struct sorcery_kafka_cluster *sorcery_cluster;
+	/*! Performance counters */
+	struct kafka_stats *stats;
+	/*! Last librdkafka statistics (struct kafka_rdkafka_stats) */
+	struct ao2_global_obj rdkafka_stats;
 	/*! Producer or consumer specific */
 	union {
 		/*! Producer specific */
 		struct {
-			/*! Forced key value or NULL */
-			char *forced_key;
-			/*! Force key is null */
-			int force_null_key;
+			/*! Shared librdkafka handle, rd_kafka is borrowed from it */
+			struct kafka_connection *connection;
+			/*! Link to next producer sharing the connection (protected by connection lock) */
+			AST_LIST_ENTRY(kafka_service) connection_link;
+			/*! Action on full queue */
+			enum kafka_queue_full_policy queue_full_policy;
+			/*! Maximum time to block publisher on full queue, ms */
+			unsigned int queue_full_timeout_ms;
+			/*! Number of produce attempts rejected by full queue */
+			volatile int queue_full_count;
+			/*! Number of messages enqueued after wait on full queue */
+			volatile int retried_count;
+			/*! Number of messages dropped because queue is full */
+			volatile int dropped_count;
+			/*! Undelivered messages spool or NULL */
+			struct kafka_spool *spool;
 		} producer;
 		/*! Consumer specific */
 		struct {
@@ -407,22 +1387,186 @@ struct kafka_service {
 			rd_kafka_queue_t *queue;
 			/*! If non-NULL we are init high-level consumer */
 			rd_kafka_topic_partition_list_t *topic_partition_list;
+			/*! Batch receive buffer, NULL if batching disabled */
+			rd_kafka_message_t **batch;
+			/*! Batch receive buffer capacity */
+			size_t batch_size;
+			/*! Recycled buffers of the forwarded batches, NULL if batching disabled */
+			struct kafka_batch_pool *batch_pool;
+			/*! Messages collected in the batch receive buffer, forwarded when full or on wakeup */
+			size_t batch_count;
+			/*! Maximum time to fill the batch, ms */
+			int batch_timeout_ms;
+			/*! Low-level consumer partitions, NULL if the service partition used */
+			int32_t *partitions;
+			/*! Number of low-level consumer partitions */
+			size_t partition_count;
+			/*! Low-level consumer read all topic partitions */
+			int all_partitions;
+			/*! Low-level consumer start offset, RD_KAFKA_OFFSET_* */
+			int64_t start_offset;
+			/*! Start by message time instead of start_offset */
+			int start_by_time;
+			/*! Start time, UNIX time or seconds before now if not positive */
+			int start_time;
+			/*! Processed offsets tracker, NULL if librdkafka commit offsets */
+			struct kafka_commit_tracker *tracker;
 		} consumer;
 	} specific;
 };
 
-/*! Internal representation of Kafka's topic */
-struct kafka_topic {
-	AST_DECLARE_STRING_FIELDS(
-		/*! Topic id same as kafka broker's topic name */
-		AST_STRING_FIELD(id);
-	);
-	/*! Link to next topic on the list in ast_kafka_pipe */
-	AST_LIST_ENTRY(kafka_topic) link;
-	/*! Link to the topic service (producer or consumer) */
-	struct kafka_service *service;
-	/*! librdkafka topic's handle, can be NULL on high-level consumer */
+/*! Consumed offset of the partition, dispatched to subscribers */
+struct kafka_commit_offset {
+	/*! Message offset */
+	int64_t offset;
+	/*! Message released by subscribers */
+	int done;
+};
+
+/*! Processed offsets of the consumer's topic partition */
+struct kafka_commit_partition {
+	/*! Link to next partition */
+	AST_LIST_ENTRY(kafka_commit_partition) link;
+	/*! Partition id */
+	int32_t partition;
+	/*! Next offset to commit (low-watermark), RD_KAFKA_OFFSET_INVALID if nothing processed */
+	int64_t watermark;
+	/*! Last committed offset, RD_KAFKA_OFFSET_INVALID if not committed yet */
+	int64_t committed;
+	/*! Tracker generation the partition tracked since, older messages belong to revoked assignment */
+	unsigned int generation;
+	/*! Dispatched offsets in ascending order, entries before head are processed */
+	struct kafka_commit_offset *offsets;
+	/*! First not processed entry */
+	size_t head;
+	/*! Number of entries */
+	size_t count;
+	/*! Allocated entries */
+	size_t allocated;
+	/*! Topic name */
+	char topic[0];
+};
+
+/*! At-least-once offsets commit: consumer offsets committed when processed by subscribers */
+struct kafka_commit_tracker {
+	/*! Consumer's handle, NULL when consumer closed (protected by object lock) */
+	rd_kafka_t *rd_kafka;
+	/*! Processed messages to commit */
+	unsigned int batch;
+	/*! Maximum commit interval, ms */
+	unsigned int interval_ms;
+	/*! Processed and not committed messages */
+	unsigned int pending;
+	/*! Last commit time */
+	struct timeval committed;
+	/*! Incremented when partitions revoked, releases of older generation messages ignored */
+	unsigned int generation;
+	/*! Consumed partitions */
+	AST_LIST_HEAD_NOLOCK(/*commit_partitions_s*/, kafka_commit_partition) partitions;
+};
+
+/*! librdkafka producer handle shared by producers of the cluster with the same configuration */
+struct kafka_connection {
+	/*! librdkafka producer's handle */
+	rd_kafka_t *rd_kafka;
+	/*! librdkafka main queue, delivery reports and statistics */
+	rd_kafka_queue_t *main_queue;
+	/*! Producers using the handle, not referenced (protected by object lock), the first one watch main queue */
+	AST_LIST_HEAD_NOLOCK(/*connection_services_s*/, kafka_service) services;
+	/*! Cluster id and effective librdkafka configuration */
+	char key[0];
+};
+
+/*! Immutable set of pipe's dispatch lanes stasis topics */
+struct kafka_dispatch_lanes {
+	/*! Number of lanes */
+	unsigned int count;
+	/*! Lanes forwards to the pipe's stasis topic */
+	struct stasis_forward **forwards;
+	/*! Lanes stasis topics */
+	struct stasis_topic *topics[0];
+};
+
+/*! Consumer topic filter, evaluated on raw messages */
+struct kafka_topic_filter {
+	/*! Drop messages with own EID header */
+	int drop_own_eid;
+	/*! Accepted key prefix or NULL */
+	char *key_prefix;
+	/*! Accepted key prefix size */
+	size_t key_prefix_size;
+	/*! Buffer of accepted reasons */
+	char *reasons_buf;
+	/*! Number of accepted reasons, zero if any reason accepted */
+	size_t reason_count;
+	/*! Accepted reasons, points to reasons_buf */
+	const char *reasons[0];
+};
+
+/*! Started partition of the low-level consumer topic */
+struct kafka_topic_partition {
+	/*! Partition id */
+	int32_t partition;
+	/*! Partition queue, forwarded to the consumer queue */
+	rd_kafka_queue_t *queue;
+};
+
+/*! Internal representation of Kafka's topic */
+struct kafka_topic {
+	AST_DECLARE_STRING_FIELDS(
+		/*! Topic id same as kafka broker's topic name */
+		AST_STRING_FIELD(id);
+	);
+	/*! Link to next topic on the list in ast_kafka_pipe */
+	AST_LIST_ENTRY(kafka_topic) link;
+	/*! Link to the topic service (producer or consumer) */
+	struct kafka_service *service;
+	/*! librdkafka topic's handle, can be NULL on high-level consumer */
 	rd_kafka_topic_t *rd_kafka_topic;
+	/*! Pipe's stasis topic to forward consumer's messages, NULL on producer */
+	struct stasis_topic *stasis_topic;
+	/*! Pipe's dispatch lanes or NULL, only on consumer */
+	struct kafka_dispatch_lanes *lanes;
+	/*! Sorcery topic object the topic built from */
+	struct sorcery_kafka_topic *sorcery_topic;
+	/*! Add message headers on produce */
+	unsigned int headers;
+	/*! Wire format of JSON messages */
+	enum kafka_format format;
+	/*! Producer's static key or NULL */
+	char *forced_key;
+	/*! Static key size */
+	size_t forced_key_size;
+	/*! Producer send messages with null key */
+	int force_null_key;
+	/*! Producer's partition or RD_KAFKA_PARTITION_UA */
+	int32_t partition;
+	/*! Producer's partitioner of keyed messages, NULL if librdkafka partitioner used */
+	int32_t (*partitioner)(const rd_kafka_topic_t *rkt, const void *key, size_t keylen, int32_t partition_cnt, void *rkt_opaque, void *msg_opaque);
+	/*! Partitioner map ast_kafka_key_hash() to the partition */
+	int partitioner_key_hash;
+	/*! Null key messages sticky partition time, ms, zero if not sticky */
+	unsigned int sticky_linger_ms;
+	/*! Current sticky partition of null key messages, less than zero if not selected */
+	int32_t sticky_partition;
+	/*! Time to select other sticky partition, us */
+	int64_t sticky_until_us;
+	/*! Partitions count seen by the partitioner, zero if unknown */
+	int32_t partitioner_count;
+	/*! Consumer's messages filter or NULL if all messages accepted */
+	struct kafka_topic_filter *filter;
+	/*! Started partitions of the low-level consumer topic */
+	struct kafka_topic_partition *partitions;
+	/*! Number of started partitions */
+	size_t partition_count;
+	/*! Enqueue message with non-empty key, selected on topic creation */
+	rd_kafka_resp_err_t (*producev_keyed)(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+	/*! Enqueue message w/o key, selected on topic creation */
+	rd_kafka_resp_err_t (*producev_unkeyed)(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+	/*! Performance counters */
+	struct kafka_stats *stats;
+	/*! Pipe's performance counters */
+	struct kafka_stats *pipe_stats;
 };
 
 /*! Internal representation of message pipe */
@@ -433,10 +1577,16 @@ struct ast_kafka_pipe {
 	);
 	/*! List of producer's topics for this pipe */
 	AST_LIST_HEAD(/*producer_topics_s*/, kafka_topic) producer_topics;
+	/*! Read-mostly snapshot of producer_topics, used by publish path */
+	struct ao2_global_obj producer_snapshot;
 	/*! List of consumer's topics for this pipe */
 	AST_LIST_HEAD(/*consumer_topics_s*/, kafka_topic) consumer_topics;
 	/*! Stasis topic to forward consumer's messages */
 	struct stasis_topic *stasis_topic;
+	/*! Dispatch lanes of consumer's messages or NULL */
+	struct kafka_dispatch_lanes *lanes;
+	/*! Performance counters */
+	struct kafka_stats *stats;
 };
 
 /*!
@@ -446,27 +1596,327 @@ struct ast_kafka_pipe {
 struct ast_kafka_consumer_message {
 	/*! librdkafka message pointer */
 	rd_kafka_message_t *rkm;
+	/*! Tracker notified when message released or NULL, not referenced by the batch messages */
+	struct kafka_commit_tracker *tracker;
+	/*! Tracker generation the message dispatched in */
+	unsigned int generation;
+	/*! Decoded payload, NULL until requested by ast_kafka_consumer_message_json() */
+	struct ast_json *json;
+};
+
+/*!
+ * \brief The structure that contains batch of cosumer's received messages from one topic
+ * \since 13.34
+ */
+struct ast_kafka_consumer_batch {
+	/*! Tracker notified when messages released or NULL */
+	struct kafka_commit_tracker *tracker;
+	/*! Tracker generation the messages dispatched in */
+	unsigned int generation;
+	/*! Number of messages */
+	size_t count;
+	/*! Received messages, buffer recycled by the batch destructor */
+	struct kafka_batch_buffer *buffer;
+	/*! Consumer's pool the buffer returned to or NULL */
+	struct kafka_batch_pool *pool;
+};
+
+/*! Messages buffer of the consumer batch, recycled by the consumer's pool */
+struct kafka_batch_buffer {
+	/*! Free-list entry */
+	AST_LIST_ENTRY(kafka_batch_buffer) link;
+	/*! Capacity, messages */
+	size_t capacity;
+	/*! Messages */
+	struct ast_kafka_consumer_message messages[0];
+};
+
+/*! Consumer's free-list of batch buffers, referenced by the batches outlive the consumer */
+struct kafka_batch_pool {
+	/*! Recycled buffers, protected by the object lock */
+	AST_LIST_HEAD_NOLOCK(/*kafka_batch_buffers_s*/, kafka_batch_buffer) buffers;
+	/*! Number of recycled buffers */
+	unsigned int count;
+};
+
+
+/*! Immutable array of the pipe's producer topics, replaced when topics list changed */
+struct kafka_topics_snapshot {
+	/*! Number of topics with message headers */
+	unsigned int headers_count;
+	/*! Bit mask of topics formats (1 << kafka_format) */
+	unsigned int formats;
+	/*! Number of topics */
+	size_t count;
+	/*! Referenced topics */
+	struct kafka_topic *topics[0];
+};
+
+/*! Prebuilt message headers for the event reason */
+struct kafka_headers_template {
+	/*! Headers, never modified after build, NULL if not available */
+	rd_kafka_headers_t *headers;
+	/*! Headers with content-type of the binary formats, NULL if not available */
+	rd_kafka_headers_t *format_headers[KAFKA_FORMAT_COUNT];
+	/*! Serialized event envelope up to the payload value by format, NULL if not available */
+	unsigned char *envelope[KAFKA_FORMAT_COUNT];
+	/*! Envelope prefix length */
+	size_t envelope_size[KAFKA_FORMAT_COUNT];
+	/*! Event reason, empty string if not specified */
+	char reason[0];
+};
+
+/*! Benchmark payload prefix, identify benchmark messages in delivery reports */
+struct kafka_bench_payload {
+	/*! KAFKA_BENCH_MAGIC */
+	char magic[8];
+	/*! Benchmark run id */
+	uint32_t id;
+};
+
+/*! Running benchmark state */
+struct kafka_bench {
+	/*! Benchmark run id */
+	uint32_t id;
+	/*! Messages sent by all threads */
+	volatile int sent;
+	/*! Messages rejected by ast_kafka_send_raw_message() */
+	volatile int failed;
+	/*! Delivery reports received */
+	volatile int delivered;
+	/*! Delivery reports with error */
+	volatile int delivery_errors;
+	/*! Enqueue to delivery report latency histogram */
+	struct kafka_histogram latency;
+	/*! Messages published as JSON by ast_kafka_publish() */
+	unsigned int json;
+	/*! JSON message marker */
+	char marker[KAFKA_BENCH_MARKER_SIZE];
+};
+
+/*! Stage timing accumulator */
+struct kafka_stage_timing {
+	/*! Timed calls */
+	uint64_t count;
+	/*! Total time, ns */
+	uint64_t total_ns;
+};
+
+/*! Producer's handle flushed on module unload */
+struct kafka_flush_job {
+	/*! Flush thread */
+	pthread_t thread;
+	/*! Producer, owner of the handle */
+	struct kafka_service *producer;
+	/*! rd_kafka_flush() result */
+	rd_kafka_resp_err_t result;
+};
+
+/*! Benchmark sender thread parameters */
+struct kafka_bench_sender {
+	/*! Sender thread */
+	pthread_t thread;
+	/*! Benchmark */
+	struct kafka_bench *bench;
+	/*! Target pipe */
+	struct ast_kafka_pipe *pipe;
+	/*! Messages to send by this thread */
+	unsigned int messages;
+	/*! Interval between messages, us, zero if unlimited */
+	int64_t interval_us;
+	/*! Payload size */
+	size_t size;
+};
+
+/*! Loopback probe message */
+struct kafka_probe_payload {
+	/*! KAFKA_PROBE_MAGIC */
+	char magic[8];
+	/*! Probe id */
+	uint32_t id;
+	/*! Reserved, zero */
+	uint32_t reserved;
+	/*! Probe message sequence number */
+	uint64_t seq;
+	/*! Send time, monotonic us */
+	int64_t sent_us;
+};
+
+/*! Continuous loopback probe on the pipe with producer and consumer topics */
+struct kafka_probe {
+	/*! Protect probe state */
+	ast_mutex_t lock;
+	/*! Signalled on stop */
+	ast_cond_t cond;
+	/*! Sender thread, AST_PTHREADT_NULL if stopped */
+	pthread_t thread;
+	/*! Sender thread must stop */
+	int stop;
+	/*! Probe id, match received messages */
+	uint32_t id;
+	/*! Send interval, ms */
+	unsigned int interval_ms;
+	/*! Probed pipe */
+	struct ast_kafka_pipe *pipe;
+	/*! Probe start time */
+	struct timeval started;
+	/*! Sent probe messages, next sequence number */
+	uint64_t sent;
+	/*! Received probe messages */
+	uint64_t received;
+	/*! Highest received sequence number + 1, zero if nothing received */
+	uint64_t highest;
+	/*! Sequence numbers skipped and not received later */
+	uint64_t lost;
+	/*! Messages received after message with higher sequence number */
+	uint64_t reordered;
+	/*! Current rolling window start, monotonic us */
+	int64_t window_started_us;
+	/*! Current window index */
+	unsigned int window;
+	/*! Round trip histograms of the current and previous window */
+	struct kafka_histogram windows[2];
+	/*! Round trip histogram since start */
+	struct kafka_histogram total;
+	/*! Pipe id */
+	char pipe_id[0];
+};
+
+/*! Payload shared by several topics messages, released when all messages processed */
+struct kafka_shared_payload {
+	/*! Payload pointer */
+	void *payload;
+	/*! Function to release payload */
+	void (*free_fn)(void *payload);
 };
 
+/*! Partition selected by the caller */
+struct message_partition {
+	/*! Explicit partition or RD_KAFKA_PARTITION_UA to use key_hash */
+	int32_t partition;
+	/*! Precomputed ast_kafka_key_hash() of the message key */
+	uint32_t key_hash;
+};
 
 /*! Additional message options */
 struct message_options {
 	/*! Message key or NULL */
 	const char *key;
+	/*! Message key size, strlen() of the key if zero */
+	size_t key_size;
 	/*! Message headers or NULL */
 	rd_kafka_headers_t *headers;
+	/*! librdkafka message flags (RD_KAFKA_MSG_F_*) */
+	int msgflags;
+	/*! Shared payload referenced by each produced message or NULL */
+	struct kafka_shared_payload *shared;
+	/*! Bit mask of topics formats to produce, 0 for all topics */
+	unsigned int formats;
+	/*! Caller's partition or NULL if selected by the topic */
+	const struct message_partition *partition;
 };
 
+/*! Payload allocated by libc allocator and can be released by librdkafka */
+#ifdef __AST_DEBUG_MALLOC
+#define KAFKA_PAYLOAD_FREED_BY_LIBC(free_fn) ((void (*)(void *))free == (free_fn))
+#else
+#define KAFKA_PAYLOAD_FREED_BY_LIBC(free_fn) (((void (*)(void *))free == (free_fn)) || ((void (*)(void *))ast_free_ptr == (free_fn)))
+#endif
+
 /* Fowrdwd local functions declaration */
 
 static rd_kafka_headers_t *build_message_headers(const char *reason);
+static struct kafka_headers_template *get_message_headers(const struct kafka_topics_snapshot *snapshot, const char *reason);
+static void kafka_headers_template_destructor(void *obj);
+static void flush_message_headers(void);
 static int produce_message(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
+static const char *topic_message_key(const struct kafka_topic *topic, const char *suggested_key, size_t suggested_key_size, size_t *key_size);
+static int32_t topic_message_partition(const struct kafka_topic *topic, const struct message_options *options);
+static int32_t kafka_topic_partitioner(const rd_kafka_topic_t *rkt, const void *keydata, size_t keylen, int32_t partition_cnt, void *rkt_opaque, void *msg_opaque);
+static int32_t kafka_topic_sticky_partition(struct kafka_topic *topic, const rd_kafka_topic_t *rkt, int32_t partition_cnt);
+static int kafka_send_raw_partitioned(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, const struct message_partition *partition, const void *payload, size_t payload_size, const char *reason);
+static int produce_batch(struct kafka_topic *topic, const struct ast_kafka_msg *msgs, size_t count, rd_kafka_message_t *rkms, int *status, struct ast_kafka_pipe *pipe);
+static rd_kafka_resp_err_t producev_message(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, struct kafka_shared_payload *shared, rd_kafka_headers_t *headers);
+static rd_kafka_resp_err_t producev_plain(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+static rd_kafka_resp_err_t producev_headers(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+static rd_kafka_resp_err_t producev_key(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+static rd_kafka_resp_err_t producev_key_headers(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers);
+static int producer_queue_full_wait(struct kafka_service *producer, struct timeval start);
+static struct kafka_spool *kafka_spool_open(const char *path, size_t size, enum kafka_spool_sync sync);
+static void kafka_spool_close(struct kafka_spool *spool);
+static int kafka_spool_recover(struct kafka_spool *spool);
+static void kafka_spool_reset(struct kafka_spool *spool);
+static int kafka_spool_empty(struct kafka_spool *spool);
+static int kafka_spool_append(struct kafka_spool *spool, const char *topic_name, const void *key, size_t key_size, const rd_kafka_headers_t *headers, const void *payload, size_t payload_size);
+static int produce_spool_append(struct kafka_topic *topic, const char *key, size_t key_size, rd_kafka_headers_t *headers, void *payload, size_t payload_size, int msgflags);
+static int kafka_spool_replay(struct kafka_service *producer, int budget);
+static void kafka_spool_sync(struct kafka_spool *spool, int force);
+static size_t kafka_spool_headers_size(const rd_kafka_headers_t *headers);
+static void kafka_spool_headers_write(const rd_kafka_headers_t *headers, unsigned char *buffer);
+static rd_kafka_headers_t *kafka_spool_headers_read(const unsigned char *buffer, size_t size);
+static int kafka_spool_retriable(rd_kafka_resp_err_t err);
+static void kafka_shared_payload_destructor(void *obj);
+static int on_snapshot_topics(struct kafka_topics_snapshot *snapshot, int (*callback)(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe), void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
+static void pipe_update_producer_snapshot(struct ast_kafka_pipe *pipe);
+static void kafka_topics_snapshot_destructor(void *obj);
 
 static char *handle_kafka_loopback(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+static char *handle_kafka_bench(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+static struct kafka_probe *kafka_probe_alloc(struct ast_kafka_pipe *pipe, unsigned int interval_ms);
+static void kafka_probe_destructor(void *obj);
+static void kafka_probe_stop(struct kafka_probe *probe);
+static int kafka_probe_stop_cb(void *obj, void *arg, int flags);
+static int kafka_probe_match_id_cb(void *obj, void *arg, int flags);
+static void *kafka_probe_sender_job(void *opaque);
+static void kafka_probe_received(const rd_kafka_message_t *rkm);
+static void kafka_probe_rotate(struct kafka_probe *probe, int64_t now);
+static void kafka_probe_show(int fd, struct kafka_probe *probe);
+static void kafka_histogram_show(int fd, const char *title, const struct kafka_histogram *histogram);
+static void *kafka_bench_sender_job(void *opaque);
+static void kafka_bench_delivered(const rd_kafka_message_t *message);
+static void kafka_histogram_add(struct kafka_histogram *histogram, uint64_t value);
+static void kafka_histogram_merge(struct kafka_histogram *histogram, const struct kafka_histogram *other);
+static int kafka_histogram_count(const struct kafka_histogram *histogram);
+static uint64_t kafka_histogram_percentile(const struct kafka_histogram *histogram, double percentile);
+static unsigned int kafka_histogram_bucket(uint64_t value);
+static uint64_t kafka_histogram_bucket_value(unsigned int bucket);
+static int64_t kafka_bench_now_us(void);
+static int64_t kafka_bench_now_ns(void);
+static int64_t kafka_stage_start(enum ast_kafka_stage stage);
+static void kafka_stage_stop(enum ast_kafka_stage stage, int64_t started);
+static int kafka_bench_queue_full_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
+static void *kafka_mock_object_alloc(const char *type, const char *id, const char *const *fields);
+static struct kafka_stats *kafka_stats_alloc(void);
+static unsigned int kafka_stats_stripe(void);
+static void kafka_stats_add(struct kafka_stats *stats, enum kafka_counter counter, uint64_t value);
+static void kafka_stats_topic_add(struct kafka_topic *topic, enum kafka_counter counter, uint64_t value);
+static void kafka_stats_sum(const struct kafka_stats *stats, uint64_t *counters);
+static void kafka_stats_delivered(struct kafka_topic *topic, const rd_kafka_message_t *message);
+static int on_service_statistics(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque);
+static int64_t kafka_stats_json_integer(struct ast_json *object, const char *key, int64_t missing);
+static int kafka_stats_consumer_lag_cb(void *obj, void *arg, int flags);
+static void kafka_stats_report(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, const struct kafka_stats *stats);
+static int kafka_stats_report_topic_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
+static int kafka_stats_report_pipe_cb(void *obj, void *arg, int flags);
+static int kafka_stats_report_pipes(struct kafka_stats_writer *writer, struct ast_kafka_pipe *pipe);
+static int kafka_stats_first_report(struct kafka_stats_writer *writer, const void *object);
+static void cli_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition);
+static void cli_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value);
+static void ami_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition);
+static void ami_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value);
+static void ami_stats_end(struct kafka_stats_writer *writer);
+static void metrics_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition);
+static void metrics_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value);
+static const char *metrics_stats_type(const char *name);
+static void metrics_append_label(struct ast_str **out, const char *name, const char *value);
+static void metrics_stats_flush(struct kafka_stats_writer *writer);
+static int manager_kafka_stats(struct mansession *s, const struct message *m);
+static int http_kafka_metrics(struct ast_tcptls_session_instance *ser, const struct ast_http_uri *urih, const char *uri, enum ast_http_method method, struct ast_variable *get_params, struct ast_variable *headers);
 static char *handle_kafka_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 static char *complete_pipe_choice(const char *word);
 static int show_pipes_cb(void *obj, void *arg, int flags);
 static int cli_show_topic_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
+static int kafka_consumer_topic_seek_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe);
 
 
 static void on_producer_created(const void *obj);
@@ -479,6 +1929,14 @@ static void process_all_clusters(void);
 static void process_cluster(const struct sorcery_kafka_cluster *cluster);
 static int process_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer);
 static int process_consumer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_consumer *sorcery_consumer);
+static void reconcile_all_services(void);
+static void reconcile_services(const char *type);
+static int reconcile_service(struct kafka_service *service, const char *type);
+static int sorcery_object_changed(const void *original, const void *modified);
+static void retire_service(struct kafka_service *service, const char *type);
+static void retire_service_topic(struct kafka_service *service, struct kafka_topic *topic, const char *type);
+static int reconcile_collect_cb(struct kafka_service *service, void *opaque);
+static struct kafka_topic *service_topic_by_sorcery_id(struct kafka_service *service, const char *sorcery_id);
 
 static struct kafka_service *new_kafka_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer);
 static void kafka_producer_destructor(void *obj);
@@ -502,6 +1960,16 @@ static int service_add_property_string(rd_kafka_conf_t *config,
 					const char *service_type,
 					const char *service_id,
 					const char *cluster_id);
+static int service_add_properties(rd_kafka_conf_t *config, 
+					const struct ast_variable *properties,
+					const char *service_type,
+					const char *service_id,
+					const char *cluster_id);
+static int topic_add_properties(rd_kafka_topic_conf_t *config, 
+					const struct ast_variable *properties,
+					const char *topic_id);
+static int kafka_properties_append(struct ast_variable **properties, const struct ast_variable *var);
+static int kafka_properties_to_fields(const struct ast_variable *properties, struct ast_variable **fields);
 
 
 static int process_producer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic);
@@ -511,6 +1979,9 @@ static struct kafka_topic *new_kafka_producer_topic(struct kafka_service *produc
 static void kafka_producer_topic_destructor(void *obj);
 static struct kafka_topic *new_kafka_consumer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic);
 static void kafka_consumer_topic_destructor(void *obj);
+static int consumer_topic_start(struct kafka_service *consumer, struct kafka_topic *topic, const struct sorcery_kafka_topic *sorcery_topic);
+static void consumer_topic_stop(struct kafka_topic *topic);
+static int consumer_partitions_parse(struct kafka_service *consumer, const struct sorcery_kafka_consumer *sorcery_consumer);
 
 static int topic_add_property_int(rd_kafka_topic_conf_t  *config, 
 					const char *property, int value, 
@@ -523,8 +1994,59 @@ static int topic_add_property_string(rd_kafka_topic_conf_t  *config,
 					const char *topic_id);
 
 
-static int start_monitor_thread(void);
+static int init_monitors(void);
+static void destroy_monitors(void);
+static struct kafka_monitor *select_service_monitor(const char *service_id, int poller);
+static int start_monitor_thread(struct kafka_monitor *monitor);
+static void notify_monitor_thread(struct kafka_monitor *monitor);
 static void *monitor_thread_job(void *opaque);
+static int monitor_services_snapshot(struct kafka_monitor *monitor, struct kafka_service ***services, size_t *allocated, size_t *count, struct pollfd **fds);
+static int monitor_stop_requested(const struct kafka_monitor *monitor);
+static int service_watch_queue(struct kafka_service *service, rd_kafka_queue_t *queue);
+static struct kafka_connection *kafka_connection_attach(struct kafka_service *producer, const struct sorcery_kafka_cluster *sorcery_cluster, rd_kafka_conf_t *config);
+static void kafka_connection_detach(struct kafka_connection *connection, struct kafka_service *producer);
+static struct kafka_connection *new_kafka_connection(const char *key, rd_kafka_conf_t *config, const char *cluster_id, const char *producer_id);
+static void kafka_connection_destructor(void *obj);
+static struct ast_str *kafka_connection_key(const char *cluster_id, const char *producer_id, rd_kafka_conf_t *config);
+static struct kafka_topic *kafka_connection_topic(struct kafka_connection *connection, const char *topic_name);
+static int kafka_connection_overlap(struct kafka_connection *connection, const struct sorcery_kafka_producer *sorcery_producer);
+static int kafka_connection_replay(struct kafka_connection *connection, int budget);
+static int on_connection_statistics(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque);
+static void service_unwatch_queue(rd_kafka_queue_t *queue);
+static int service_main_queue_poll(struct kafka_service *service, int budget);
+static int producer_poll(struct kafka_service *producer, int budget);
+static int high_level_consumer_poll(struct kafka_service *consumer, int budget);
+static int low_level_consumer_poll(struct kafka_service *consumer, int budget);
+static int consumer_batch_poll(struct kafka_service *consumer, int budget);
+static void consumer_message_process(struct kafka_service *consumer, rd_kafka_message_t *rkm);
+static void consumer_batch_process(struct kafka_service *consumer, rd_kafka_message_t **rkms, size_t count);
+static struct kafka_topic *consumer_message_topic(struct kafka_service *consumer, rd_kafka_message_t **rkms, size_t *count);
+static struct kafka_topic_filter *new_kafka_topic_filter(const struct sorcery_kafka_topic *sorcery_topic);
+static void kafka_topic_filter_destroy(struct kafka_topic_filter *filter);
+static int kafka_topic_filter_accept(const struct kafka_topic_filter *filter, const rd_kafka_message_t *rkm);
+static unsigned int kafka_dispatch_lane(const struct kafka_dispatch_lanes *lanes, const rd_kafka_message_t *rkm);
+static struct stasis_topic *kafka_dispatch_topic(const struct kafka_topic *topic, const rd_kafka_message_t *rkm);
+static void consumer_batch_dispatch(const struct kafka_dispatch_lanes *lanes, struct kafka_commit_tracker *tracker, struct kafka_batch_pool *pool, rd_kafka_message_t **rkms, size_t count);
+static struct kafka_commit_tracker *new_kafka_commit_tracker(const struct sorcery_kafka_consumer *sorcery_consumer);
+static void kafka_commit_tracker_destructor(void *obj);
+static struct kafka_commit_partition *kafka_commit_partition_find(struct kafka_commit_tracker *tracker, const char *topic_name, int32_t partition_id);
+static void kafka_commit_track(struct kafka_commit_tracker *tracker, const rd_kafka_message_t *rkm);
+static void kafka_commit_done(struct kafka_commit_tracker *tracker, const rd_kafka_message_t *rkm, unsigned int generation);
+static unsigned int kafka_commit_generation(struct kafka_commit_tracker *tracker);
+static void kafka_commit_revoke(struct kafka_commit_tracker *tracker, const rd_kafka_topic_partition_list_t *partitions);
+static void kafka_commit_flush(struct kafka_commit_tracker *tracker, int force);
+static void kafka_commit_detach(struct kafka_commit_tracker *tracker);
+static int kafka_commit_offsets(struct kafka_commit_tracker *tracker, int async);
+static void kafka_consumer_message_release(struct kafka_commit_tracker *tracker, rd_kafka_message_t *rkm, unsigned int generation);
+static void on_consumer_offsets_committed(rd_kafka_t *rd_kafka, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *offsets, void *opaque);
+static void on_consumer_rebalance(rd_kafka_t *rd_kafka, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque);
+static struct kafka_dispatch_lanes *new_kafka_dispatch_lanes(const char *name, struct stasis_topic *stasis_topic, unsigned int count);
+static void kafka_dispatch_lanes_destructor(void *obj);
+static void init_dispatch_lanes(void);
+static void kafka_service_flush(struct kafka_service *service, const char *service_type, int producer);
+static int kafka_service_purge(struct kafka_service *service);
+static void kafka_flush_producers(void);
+static void *kafka_flush_job_run(void *opaque);
 static void on_producer_message_processed(rd_kafka_t *rd_kafka, const rd_kafka_message_t *message, void *opaque);
 static void on_consumer_message_processed(rd_kafka_t *rd_kafka, const rd_kafka_message_t *message, void *opaque);
 
@@ -534,10 +2056,35 @@ static int on_all_consumers(int (*callback)(struct kafka_service *service, void
 
 static int on_all_producer_topics(struct ast_kafka_pipe *pipe, int (*callback)(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe), void *opaque_1, void *opaque_2, const void *options);
 static int on_all_consumer_topics(struct ast_kafka_pipe *pipe, int (*callback)(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe), void *opaque_1, void *opaque_2, const void *options);
-static struct kafka_service *rdkafka_topic_to_service(const rd_kafka_topic_t *rd_kafka_topic);
-static struct kafka_topic *rdkafka_topic_to_topic(const rd_kafka_topic_t *rd_kafka_topic);
 
 static int sorcery_object_register(const char *type, void *(*alloc)(const char *name),int (*apply)(const struct ast_sorcery *sorcery, void *obj));
+static struct sorcery_kafka_general *sorcery_kafka_general_get(void);
+static int kafka_publish_json(struct ast_kafka_pipe *pipe, const char *key, const char *reason, struct ast_json *json, int envelope);
+static int kafka_pipe_json_only(struct ast_kafka_pipe *pipe);
+static int kafka_serialize(enum kafka_format format, const char *reason, struct ast_json *json, int envelope, const void **data, size_t *size);
+static int kafka_event_envelope_append(struct ast_str **buf, const char *reason, struct ast_json *payload);
+static void kafka_json_string_append(struct ast_str **buf, const char *value);
+static unsigned char *build_event_envelope(const char *reason, enum kafka_format format, size_t *size);
+static enum kafka_format kafka_format_parse(const char *name, int *valid);
+static void kafka_buf_put(struct kafka_buf *buf, const void *data, size_t size);
+static void kafka_buf_put_be(struct kafka_buf *buf, uint64_t value, size_t bytes);
+static void kafka_buf_cleanup(void *data);
+static void kafka_encode_head(struct kafka_buf *buf, enum kafka_format format, enum kafka_item_kind kind, uint64_t count);
+static void kafka_encode_string(struct kafka_buf *buf, enum kafka_format format, const char *value);
+static void kafka_encode_integer(struct kafka_buf *buf, enum kafka_format format, intmax_t value);
+static void kafka_encode_value(struct kafka_buf *buf, enum kafka_format format, struct ast_json *json, int depth);
+static struct ast_json *kafka_decode_message(const rd_kafka_message_t *rkm);
+static struct ast_json *kafka_decode_value(struct kafka_decoder *decoder, int depth);
+static int kafka_decode_head(struct kafka_decoder *decoder, enum kafka_item_kind *kind, uint64_t *count, struct ast_json **scalar, int depth);
+static int kafka_decode_be(struct kafka_decoder *decoder, size_t bytes, uint64_t *value);
+static struct kafka_headers_template *get_reason_template(const char *reason);
+static int kafka_publish_enqueue(struct ast_kafka_pipe *pipe, const char *key, const char *reason, struct ast_json *json, int envelope);
+static int kafka_publish_drain(void *data);
+static int init_publish_lanes(void);
+static void destroy_publish_lanes(void);
+static int sorcery_kafka_general_apply_handler(const struct ast_sorcery *sorcery, void *obj);
+static void *sorcery_kafka_general_alloc(const char *name);
+static void sorcery_kafka_general_destructor(void *obj);
 static int sorcery_kafka_topic_apply_handler(const struct ast_sorcery *sorcery, void *obj);
 static void *sorcery_kafka_topic_alloc(const char *name);
 static void sorcery_kafka_topic_destructor(void *obj);
@@ -554,16 +2101,33 @@ static void sorcery_kafka_cluster_destructor(void *obj);
 static void *kafka_pipe_alloc(const char *pipe_id);
 static void kafka_pipe_destructor(void *obj);
 
-static int stasis_publish_kafka_consumer_message(struct stasis_topic *topic, rd_kafka_message_t *rkm);
+static int stasis_publish_kafka_consumer_message(struct stasis_topic *topic, struct kafka_commit_tracker *tracker, rd_kafka_message_t *rkm);
 static void kafka_consumer_message_destructor(void *obj);
+static int stasis_publish_kafka_consumer_batch(struct stasis_topic *topic, struct kafka_commit_tracker *tracker, struct kafka_batch_pool *pool, rd_kafka_message_t **rkms, size_t count);
+static struct kafka_batch_pool *new_kafka_batch_pool(void);
+static void kafka_batch_pool_destructor(void *obj);
+static struct kafka_batch_buffer *kafka_batch_buffer_get(struct kafka_batch_pool *pool, size_t count);
+static void kafka_batch_buffer_put(struct kafka_batch_pool *pool, struct kafka_batch_buffer *buffer);
+static void kafka_consumer_batch_destructor(void *obj);
 
 static void rdkafka_logger(const rd_kafka_t *rk, int level, const char *fac, const char *buf);
 static void update_global_producer_eid(void);
 static void clear_global_producer_eid(void);
 
+/*! Prometheus text format metrics */
+static struct ast_http_uri kafka_metrics_uri = {
+	.description = "Kafka performance counters",
+	.uri = "kafka/metrics",
+	.callback = http_kafka_metrics,
+	.has_subtree = 0,
+	.data = NULL,
+	.key = __FILE__,
+};
+
 static struct ast_cli_entry kafka_cli[] = {
 	AST_CLI_DEFINE(handle_kafka_show, "Show module data"),
 	AST_CLI_DEFINE(handle_kafka_loopback, "Loopback test operations"),
+	AST_CLI_DEFINE(handle_kafka_bench, "Producer benchmark"),
 };
 
 static const struct ast_sorcery_observer producer_observers = {
@@ -582,18 +2146,73 @@ STASIS_MESSAGE_TYPE_DEFN(ast_kafka_consumer_message_type,
  */
 );
 
+/*! Declare public batch message type */
+STASIS_MESSAGE_TYPE_DEFN(ast_kafka_consumer_batch_type);
+
 /*! Global producer's EID */
 static char *global_producer_eid;
 
-/*! Protect access to the monitor variable */
+/*! Protect access to the monitor threads state */
 AST_MUTEX_DEFINE_STATIC(monitor_lock);
 
-/*! Module's monitor thread */
-static pthread_t monitor;
+/*! Module's monitor (poller) threads */
+static struct kafka_monitor *monitors;
+
+/*! Number of monitor threads */
+static unsigned int monitor_count;
 
 /*! Module's taskprocessor */
 //static struct ast_taskprocessor *kafka_tps;
 
+/*! Message waiting in the publish lane */
+struct kafka_publish_item {
+	AST_LIST_ENTRY(kafka_publish_item) link;
+	/*! Referenced destination pipe */
+	struct ast_kafka_pipe *pipe;
+	/*! Referenced message or event payload */
+	struct ast_json *json;
+	/*! Non-zero if json is the event payload to be packed by event envelope */
+	int envelope;
+	/*! Message key or NULL */
+	const char *key;
+	/*! Reason or NULL */
+	const char *reason;
+	/*! Key and reason strings */
+	char data[0];
+};
+
+/*! Asynchronous publish lane, served by the own taskprocessor */
+struct kafka_publish_lane {
+	ast_mutex_t lock;
+	/*! Messages waiting to be published */
+	AST_LIST_HEAD_NOLOCK(/*kafka_publish_items_s*/, kafka_publish_item) items;
+	/*! Taskprocessor, one task pushed per message */
+	struct ast_taskprocessor *tps;
+	/*! Number of messages rejected by full queue */
+	volatile int dropped_count;
+};
+
+/*! Asynchronous publish lanes */
+static struct kafka_publish_lane *publish_lanes;
+
+/*! Number of publish lanes, 0 if asynchronous publish disabled */
+static unsigned int publish_lane_count;
+
+/*! Maximum messages in the publish lane */
+static unsigned int publish_queue_max;
+
+/*! Number of dispatch lanes of new pipes, 0 if disabled */
+static unsigned int dispatch_lane_count;
+
+/*! Outstanding messages flush timeout, ms */
+static unsigned int flush_timeout_ms = KAFKA_FLUSH_TIMEOUT_MS;
+
+/*! Spool messages outstanding after flush timeout */
+static int flush_spool = 1;
+
+/*! Common flush deadline on module unload, zero until unload */
+static struct timeval flush_deadline;
+
 /*! List of active producers */
 static AST_RWLIST_HEAD(kafka_producers_head_t, kafka_service) producers;
 
@@ -606,1570 +2225,7829 @@ static struct ast_sorcery *kafka_sorcery;
 /*! Defined pipes container */
 static struct ao2_container *pipes;
 
-int ast_kafka_publish(struct ast_kafka_pipe *pipe, const char *key, 
-			const char *reason, struct ast_json *payload) {
-	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
-	
-        json = ast_json_pack("{s: s, s: s, s: s, s: o}",
-				"reason", reason,
-				"eid", global_producer_eid,
-				"sysname", ast_config_AST_SYSTEM_NAME,
-				"payload", ast_json_ref(payload));
-	
-	return ast_kafka_send_json_message(pipe, key, json, reason);
-}
+/*! Prebuilt message headers by reason */
+static struct ao2_container *headers_cache;
 
-/*! Module API: Send json message to the pipe */
-int ast_kafka_send_json_message(struct ast_kafka_pipe *pipe, const char *key, 
-				struct ast_json *json,
-				const char *reason) {
-	int processed = 0;
-	char *raw = ast_json_dump_string(json);
-	
-	if(raw) {
-		ast_debug(3, "Message to send: '%s'", raw);
-		
-		processed = ast_kafka_send_raw_message(pipe, key, raw, strlen(raw), reason);
+/*! Shared producer handles by cluster and configuration */
+static struct ao2_container *connections;
+
+/*! Running benchmark, checked by delivery report callback */
+AO2_GLOBAL_OBJ_STATIC(current_bench);
+
+/*! Non-zero while benchmark running, avoid holder lock on each delivery report */
+static volatile int bench_running;
+
+/*! Pipeline stages timings of the running benchmark */
+static struct kafka_stage_timing stage_timings[AST_KAFKA_STAGE_COUNT];
+
+/*! Stage names for the benchmark report */
+static const char *kafka_stage_names[AST_KAFKA_STAGE_COUNT] = {
+	[AST_KAFKA_STAGE_PACK] = "json pack",
+	[AST_KAFKA_STAGE_SERIALIZE] = "serialize",
+	[AST_KAFKA_STAGE_HEADERS] = "headers",
+	[AST_KAFKA_STAGE_PRODUCEV] = "producev",
+	[AST_KAFKA_STAGE_DELIVERY] = "delivery callback",
+};
+
+/*! Loopback probes by pipe id */
+static struct ao2_container *probes;
+
+/*! Number of running probes, avoid probes lookup on each consumed message */
+static volatile int probes_running;
+
+/*! Event envelope serialization buffer of the publishing thread */
+AST_THREADSTORAGE(kafka_envelope_buf);
 
-		ast_json_free(raw);
+/*! Batch serialization buffer of the publish thread */
+AST_THREADSTORAGE(kafka_publish_buf);
+
+/*! Binary formats serialization buffer of the publishing thread */
+AST_THREADSTORAGE_CUSTOM(kafka_binary_buf, NULL, kafka_buf_cleanup);
+
+int ast_kafka_publish(struct ast_kafka_pipe *pipe, const char *key, 
+			const char *reason, struct ast_json *payload) {
+	if(publish_lane_count) {
+		/* Envelope packed by the publish thread */
+		return kafka_publish_enqueue(pipe, key, reason, payload, 1);
 	}
-	
-	return processed;
+
+	return kafka_publish_json(pipe, key, reason, payload, 1);
 }
 
-/*! Module API: Send raw message to the pipe */
-int ast_kafka_send_raw_message(struct ast_kafka_pipe *pipe, const char *key, 
-				const void *payload, size_t payload_size,
-				const char *reason) {
-	int processed;
+/*! Serialize message in each format of the pipe topics and produce it on the topics of this format */
+static int kafka_publish_json(struct ast_kafka_pipe *pipe, const char *key, const char *reason, struct ast_json *json, int envelope) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+	RAII_VAR(struct kafka_headers_template *, template, NULL, ao2_cleanup);
 	struct message_options options = {
 		.key = key,
-		.headers = build_message_headers(reason),
+		.headers = NULL,
+		.msgflags = RD_KAFKA_MSG_F_COPY,
+		.shared = NULL,
 	};
-	
-	processed = on_all_producer_topics(pipe, produce_message, (void*)payload, &payload_size, &options);
-	
-	if(options.headers) {
-		rd_kafka_headers_destroy(options.headers);
-	}
-	
-	return processed;
-}
-
-/*! Build Kafka's message headers 
- * 
- * Added two message headers:
- * "reason" - event's reason
- * "eid" - server's EID
- */
-static rd_kafka_headers_t *build_message_headers(const char *reason) {
 	int processed = 0;
-	rd_kafka_headers_t *headers = rd_kafka_headers_new(2);
-	
-	if(NULL == headers) {
-		ast_log(LOG_WARNING, "Unable to allocate message headers for event '%s'\n", reason);
-		
-		return NULL;
+	unsigned int format;
+
+	if((NULL == snapshot) || (0 == snapshot->count) || (NULL == json)) {
+		/* No producers, nothing to do */
+		return 0;
 	}
-	
-	if(reason) {
-		rd_kafka_resp_err_t response = rd_kafka_header_add(headers, "reason", 6, reason, strlen(reason));
-		
-		if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
-			processed++;
-		} else {
-			ast_log(LOG_WARNING, "Add reason header failed: %s\n", 
-				rd_kafka_err2str(response));
+
+	template = get_message_headers(snapshot, reason);
+
+	for(format = 0;format < KAFKA_FORMAT_COUNT;format++) {
+		const void *data;
+		size_t size;
+		int64_t stage;
+		int failed;
+
+		if(0 == (snapshot->formats & (1 << format))) {
+			continue;
 		}
-	}
-	
-	if(global_producer_eid) {
-		rd_kafka_resp_err_t response = rd_kafka_header_add(headers, "eid", 3, global_producer_eid, strlen(global_producer_eid));
-		
-		if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
-			processed++;
-		} else {
-			ast_log(LOG_WARNING, "Add eid header failed: %s\n", 
-				rd_kafka_err2str(response));
+
+		stage = kafka_stage_start(AST_KAFKA_STAGE_SERIALIZE);
+		failed = kafka_serialize(format, reason, json, envelope, &data, &size);
+		kafka_stage_stop(AST_KAFKA_STAGE_SERIALIZE, stage);
+
+		if(failed) {
+			ast_log(LOG_WARNING, "Unable to serialize %s message to pipe '%s'\n", kafka_format_names[format], pipe->id);
+			processed |= -1;
+			continue;
 		}
+
+		/* JSON messages are sent without content-type as before */
+		options.headers = template ? ((KAFKA_FORMAT_JSON == format) ? template->headers : template->format_headers[format]) : NULL;
+		options.formats = 1 << format;
+
+		/* Thread buffer reused, payload copied */
+		processed |= on_snapshot_topics(snapshot, produce_message, (void *)data, &size, &options, pipe);
 	}
-	
-	if(processed) {
-		return headers;
-	}
-	
-	/* No message headers available */
-	rd_kafka_headers_destroy(headers);
-	
-	return NULL;
+
+	return processed;
 }
 
-/*! Send message to the specified topic */
-static int produce_message(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
-	void *payload = opaque_1;
-	size_t payload_size = *(size_t *)opaque_2;
-	const struct message_options *producer_options = options;
-	const char *suggested_key = producer_options ? producer_options->key : NULL;
-	const char *key;
-	size_t key_size;
-	rd_kafka_resp_err_t response;
-		
-	if(topic->service->specific.producer.force_null_key) {
-		/* Force null key */
-		key = NULL;
-	} else {
-		/* Select static or suggested key value */
-		key = topic->service->specific.producer.forced_key ? topic->service->specific.producer.forced_key : suggested_key;
+/*! Non-zero if all pipe topics use JSON format */
+static int kafka_pipe_json_only(struct ast_kafka_pipe *pipe) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+
+	return (NULL == snapshot) || (0 == (snapshot->formats & ~(1 << KAFKA_FORMAT_JSON)));
+}
+
+/*! Serialize message to the thread buffer of the format */
+static int kafka_serialize(enum kafka_format format, const char *reason, struct ast_json *json, int envelope, const void **data, size_t *size) {
+	struct kafka_buf *binary;
+	struct ast_str *buf;
+
+	if(KAFKA_FORMAT_JSON == format) {
+		if(NULL == (buf = ast_str_thread_get(&kafka_envelope_buf, KAFKA_ENVELOPE_BUF_INIT))) {
+			return -1;
+		}
+
+		ast_str_reset(buf);
+
+		if(envelope ? kafka_event_envelope_append(&buf, reason, json) : ast_json_dump_str(json, &buf)) {
+			return -1;
+		}
+
+		ast_debug(3, "Message to send: '%s'", ast_str_buffer(buf));
+
+		*data = ast_str_buffer(buf);
+		*size = ast_str_strlen(buf);
+
+		return 0;
 	}
-	
-	/* Determine used key size */
-	key_size = key ? strlen(key) : 0;
-	
-	if(RD_KAFKA_PARTITION_UA == topic->service->partition) {
-		ast_debug(3, "Kafka pipe %s (%p) try to produce message on topic (%p) via unassigned partition, payload=%p, size=%lu\n", 
-				pipe->id, pipe, topic->rd_kafka_topic, payload, payload_size);
-	} else {
-		ast_debug(3, "Kafka pipe %s (%p) try to produce message on topic (%p) via partition %d, payload=%p, size=%lu\n", 
-				pipe->id, pipe, topic->rd_kafka_topic, topic->service->partition, payload, payload_size);
+
+	if(NULL == (binary = ast_threadstorage_get(&kafka_binary_buf, sizeof(*binary)))) {
+		return -1;
 	}
 
-#if 1
-	if(key_size) {
-		/* Send message with key */
-		if(producer_options->headers) {
-			/* Send message with key and headers */
-			rd_kafka_headers_t *copy = rd_kafka_headers_copy(producer_options->headers);
-			
-			response = rd_kafka_producev(topic->service->rd_kafka,
-							RD_KAFKA_V_RKT(topic->rd_kafka_topic),
-							RD_KAFKA_V_PARTITION(topic->service->partition),
-							RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-							RD_KAFKA_V_VALUE(payload, payload_size),
-							RD_KAFKA_V_KEY(key, key_size),
-							RD_KAFKA_V_HEADERS(copy),
-							RD_KAFKA_V_END);
-			
-			if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
-				rd_kafka_headers_destroy(copy);
-			}
-		} else {
-			/* Send message with key and w/o headers */
-			response = rd_kafka_producev(topic->service->rd_kafka,
-							RD_KAFKA_V_RKT(topic->rd_kafka_topic),
-							RD_KAFKA_V_PARTITION(topic->service->partition),
-							RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-							RD_KAFKA_V_VALUE(payload, payload_size),
-							RD_KAFKA_V_KEY(key, key_size),
-							RD_KAFKA_V_END);
-		}
-	} else {
-		/* Send message w/o key */
-		if(producer_options->headers) {
-			/* Send message w/o key but with headers */
-			rd_kafka_headers_t *copy = rd_kafka_headers_copy(producer_options->headers);
-			
-			response = rd_kafka_producev(topic->service->rd_kafka,
-							RD_KAFKA_V_RKT(topic->rd_kafka_topic),
-							RD_KAFKA_V_PARTITION(topic->service->partition),
-							RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-							RD_KAFKA_V_VALUE(payload, payload_size),
-							RD_KAFKA_V_HEADERS(copy),
-							RD_KAFKA_V_END);
-			
-			if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
-				rd_kafka_headers_destroy(copy);
-			}
-		} else {
-			/* Send message w/o key and headers */
-			response = rd_kafka_producev(topic->service->rd_kafka,
-							RD_KAFKA_V_RKT(topic->rd_kafka_topic),
-							RD_KAFKA_V_PARTITION(topic->service->partition),
-							RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-							RD_KAFKA_V_VALUE(payload, payload_size),
-							RD_KAFKA_V_END);
+	binary->used = 0;
+	binary->failed = 0;
+
+	if(envelope) {
+		RAII_VAR(struct kafka_headers_template *, template, get_reason_template(reason), ao2_cleanup);
+
+		if((NULL == template) || (NULL == template->envelope[format])) {
+			return -1;
 		}
+
+		/* Prebuilt map head with reason, eid, sysname and payload key */
+		kafka_buf_put(binary, template->envelope[format], template->envelope_size[format]);
 	}
-#else
-	/* Can specify key, but w/o headers */
-	response = rd_kafka_produce(topic->rd_kafka_topic, 
-				topic->service->partition, 
-				RD_KAFKA_MSG_F_COPY, 
-				payload, payload_size,			/* payload and payload size*/
-				key_size ? key : NULL, key_size,	/* key and key size */
-				NULL) ? rd_kafka_last_error() : RD_KAFKA_RESP_ERR_NO_ERROR;
-#endif
-	
-	if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
-		return 0;
+
+	kafka_encode_value(binary, format, json, 0);
+
+	if(binary->failed) {
+		return -1;
 	}
 
-	ast_log(LOG_WARNING, "Produce message on pipe '%s' failed: %s\n", 
-		pipe->id, rd_kafka_err2str(response));
+	*data = binary->data;
+	*size = binary->used;
 
-	return -1;
+	return 0;
 }
 
-/*! Module API: Get existing pipe or create new if not present */
-struct ast_kafka_pipe *ast_kafka_get_pipe(const char *pipe_id, int force) {
-	struct ast_kafka_pipe *pipe;
+/*! Append serialized event envelope {reason, eid, sysname, payload} to the buffer */
+static int kafka_event_envelope_append(struct ast_str **buf, const char *reason, struct ast_json *payload) {
+	RAII_VAR(struct kafka_headers_template *, template, get_reason_template(reason), ao2_cleanup);
 
-	ao2_lock(pipes);
+	if((NULL == template) || (NULL == template->envelope[KAFKA_FORMAT_JSON]) || (NULL == payload)) {
+		return -1;
+	}
 
-	if((NULL == (pipe = ao2_find(pipes, pipe_id, OBJ_SEARCH_KEY|OBJ_NOLOCK))) && force) {
-		/* Pipe with requested id not found */
-		if(NULL != (pipe = kafka_pipe_alloc(pipe_id))) {
-			/* Add new pipe to the container */
-			ao2_link_flags(pipes, pipe, OBJ_NOLOCK);
+	/* Prebuilt prefix instead of the wrapper object */
+	ast_str_append_substr(buf, 0, (const char *)template->envelope[KAFKA_FORMAT_JSON], template->envelope_size[KAFKA_FORMAT_JSON]);
 
-			ast_debug(3, "New Kafka pipe %s (%p) added to the container\n", pipe->id, pipe);
-		}
+	if(ast_json_dump_str(payload, buf)) {
+		return -1;
 	}
 
-	ao2_unlock(pipes);
+	ast_str_append_substr(buf, 0, "}", 1);
 
-	return pipe;
+	return 0;
 }
 
-struct stasis_topic *ast_kafka_get_stasis_topic(struct ast_kafka_pipe *pipe) {
-	return pipe->stasis_topic;
-}
+/*! Append value as JSON string */
+static void kafka_json_string_append(struct ast_str **buf, const char *value) {
+	const char *c;
 
-/*! Cli loppback command */
-static char *handle_kafka_loopback(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
-	static const char *option[] = {
-		"pipe",
-		NULL,
-	};
-	static const char *pipe_option[] = {
-		"start",
-		"stop",
-		NULL,
-	};
+	ast_str_append_substr(buf, 0, "\"", 1);
 
-	switch(cmd) {
-	case CLI_INIT:
-		e->command = "kafka loopback";
-		e->usage =
-			"Usage: kafka loopback pipe <pipe_id>\n"
-			"       Execute loopback test on specified pipe\n";
-		return NULL;
-	case CLI_GENERATE:
-		switch(a->pos) {
-		case 2:
-			/* "kafka loopback" */
-			return ast_cli_complete(a->word, option, a->n);
-		case 3:
-			/* "kafka loopback some"*/
-			if(0 == strcasecmp(a->argv[2], option[0])) {
-				/* "kafka loopback pipe"*/
-				return complete_pipe_choice(a->word);
-			}
-			return NULL;
-		case 4:
-			if(0 == strcasecmp(a->argv[2], option[0])) {
-				/* "kafka loopback pipe <pipe_id>"*/
-				return ast_cli_complete(a->word, pipe_option, a->n);
-			}
-			return NULL;
+	for(c = S_OR(value, "");*c;c++) {
+		switch(*c) {
+		case '"':
+			ast_str_append_substr(buf, 0, "\\\"", 2);
+			break;
+		case '\\':
+			ast_str_append_substr(buf, 0, "\\\\", 2);
+			break;
 		default:
-			/* No completion choices */
-			return NULL;
-		}
-	default:
-		break;
-	}
-
-	if(5 == a->argc) {
-		if(0 == strcasecmp(a->argv[2], option[0])) {
-			RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(a->argv[3],0), ao2_cleanup);
-
-			if(NULL == pipe) {
-				ast_cli(a->fd, "Pipe '%s' not found\n", a->argv[3]);
+			if((unsigned char)*c < 0x20) {
+				ast_str_append(buf, 0, "\\u%04x", (unsigned char)*c);
 			} else {
-				int res = ast_kafka_send_raw_message(pipe, NULL, "PING LOOPBACK", 13, "LOOPBACK");
-
-				ast_cli(a->fd, "Execute %s on pipe %s with code %d\n", a->argv[4], a->argv[3], res);
+				ast_str_append_substr(buf, 0, c, 1);
 			}
-
-			return CLI_SUCCESS;
+			break;
 		}
 	}
 
-	return CLI_SHOWUSAGE;
+	ast_str_append_substr(buf, 0, "\"", 1);
 }
 
-
-/*! Cli show command */
-static char *handle_kafka_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
-	static const char *option[] = {
-		"version",
-		"pipes",
-		"pipe",
-		NULL,
-	};
-	static const char *pipe_option[] = {
-		"services",
-		"producers",
-		"consumers",
-		NULL,
-	};
-
-	switch(cmd) {
-	case CLI_INIT:
-		e->command = "kafka show";
-		e->usage =
-			"Usage: kafka show version|pipes|pipe\n"
-			"       Show the version of librdkafka that res_kafka is running against\n";
-		return NULL;
-	case CLI_GENERATE:
-		switch(a->pos) {
-		case 2:
-			/* "kafka show" */
-			return ast_cli_complete(a->word, option, a->n);
-		case 3:
-			/* "kafka show some"*/
-			if(0 == strcasecmp(a->argv[2], option[2])) {
-				/* "kafka show pipe"*/
-				return complete_pipe_choice(a->word);
-			}
-			return NULL;
-		case 4:
-			if(0 == strcasecmp(a->argv[2], option[2])) {
-				/* "kafka show pipe <pipe_id>"*/
-				return ast_cli_complete(a->word, pipe_option, a->n);
-			}
-			return NULL;
-		default:
-			/* No completion choices */
+/*! Build event envelope prefix up to the payload value, allocated by ast_malloc */
+static unsigned char *build_event_envelope(const char *reason, enum kafka_format format, size_t *size) {
+	struct ast_str *buf;
+	char *envelope;
+
+	if(KAFKA_FORMAT_JSON != format) {
+		struct kafka_buf binary = { NULL, 0, 0, 0 };
+
+		kafka_encode_head(&binary, format, KAFKA_ITEM_MAP, 4);
+		kafka_encode_string(&binary, format, "reason");
+		kafka_encode_string(&binary, format, S_OR(reason, ""));
+		kafka_encode_string(&binary, format, "eid");
+		kafka_encode_string(&binary, format, S_OR(global_producer_eid, ""));
+		kafka_encode_string(&binary, format, "sysname");
+		kafka_encode_string(&binary, format, ast_config_AST_SYSTEM_NAME);
+		kafka_encode_string(&binary, format, "payload");
+
+		if(binary.failed) {
+			ast_free(binary.data);
 			return NULL;
 		}
-	default:
-		break;
+
+		*size = binary.used;
+
+		return binary.data;
 	}
 
-	if(3 == a->argc) {
-		if(0 == strcasecmp(a->argv[2], option[0])) {
-			/* "kafka show version" */
-			ast_cli(a->fd, "librdkafka version currently running against: %s\n", rd_kafka_version_str());
-			return CLI_SUCCESS;
-		}
+	if(NULL == (buf = ast_str_create(128))) {
+		return NULL;
+	}
 
-		if(0 == strcasecmp(a->argv[2], option[1])) {
-			/* "kafka show pipes" */
-			ao2_callback(pipes, OBJ_NODATA, show_pipes_cb, a);
-			return CLI_SUCCESS;
-		}
-		return CLI_SHOWUSAGE;
+	/* Same layout as compact dump of the packed envelope object */
+	ast_str_append(&buf, 0, "{\"reason\":");
+	kafka_json_string_append(&buf, reason);
+	ast_str_append(&buf, 0, ",\"eid\":");
+	kafka_json_string_append(&buf, global_producer_eid);
+	ast_str_append(&buf, 0, ",\"sysname\":");
+	kafka_json_string_append(&buf, ast_config_AST_SYSTEM_NAME);
+	ast_str_append(&buf, 0, ",\"payload\":");
+
+	if(NULL != (envelope = ast_strdup(ast_str_buffer(buf)))) {
+		*size = ast_str_strlen(buf);
 	}
 
-	if(5 == a->argc) {
-		if(0 == strcasecmp(a->argv[2], option[2])) {
-			/* "kafka show pipe <pipe_id> services|consumers|producers" */
-			RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(a->argv[3],0), ao2_cleanup);
+	ast_free(buf);
 
-			if(NULL == pipe) {
-				ast_cli(a->fd, "Pipe '%s' not found\n", a->argv[3]);
-			} else {
-				if((0 == strcasecmp(a->argv[4], pipe_option[0])) || (0 == strcasecmp(a->argv[4], pipe_option[1]))) {
-					/* Show services or producers */
-					on_all_producer_topics(pipe, cli_show_topic_cb, a, (char*)pipe_option[1], NULL);
-				}
+	return (unsigned char *)envelope;
+}
 
-				if((0 == strcasecmp(a->argv[4], pipe_option[0])) || (0 == strcasecmp(a->argv[4], pipe_option[2]))) {
-					/* Show services or consumers */
-					on_all_consumer_topics(pipe, cli_show_topic_cb, a, (char*)pipe_option[2], NULL);
-				}
-			}
+/*! Parse format name, JSON if name is empty or unknown */
+static enum kafka_format kafka_format_parse(const char *name, int *valid) {
+	int i;
 
-			return CLI_SUCCESS;
+	*valid = 1;
+
+	if(ast_strlen_zero(name)) {
+		return KAFKA_FORMAT_JSON;
+	}
+
+	for(i = 0;i < KAFKA_FORMAT_COUNT;i++) {
+		if(0 == strcasecmp(name, kafka_format_names[i])) {
+			return i;
 		}
 	}
 
-	return CLI_SHOWUSAGE;
+	*valid = 0;
+
+	return KAFKA_FORMAT_JSON;
 }
 
+/*! Append bytes to the buffer */
+static void kafka_buf_put(struct kafka_buf *buf, const void *data, size_t size) {
+	if(buf->failed) {
+		return;
+	}
 
-/*! Complete pipe names for cli */
-static char *complete_pipe_choice(const char *word) {
-	int wordlen = strlen(word);
-	struct ao2_iterator i;
-	void *obj;
+	if(buf->used + size > buf->size) {
+		size_t new_size = buf->size ? buf->size : KAFKA_ENVELOPE_BUF_INIT;
+		unsigned char *new_data;
 
-	i = ao2_iterator_init(pipes, 0);
-	while(NULL != (obj = ao2_iterator_next(&i))) {
-		struct ast_kafka_pipe *pipe = obj;
+		while(new_size < buf->used + size) {
+			new_size *= 2;
+		}
 
-		if(0 == strncasecmp(word, pipe->id, wordlen)) {
-			ast_cli_completion_add(ast_strdup(pipe->id));
+		if(NULL == (new_data = ast_realloc(buf->data, new_size))) {
+			buf->failed = 1;
+			return;
 		}
 
-		ao2_ref(obj, -1);
+		buf->data = new_data;
+		buf->size = new_size;
 	}
-	ao2_iterator_destroy(&i);
 
-	return NULL;
+	memcpy(buf->data + buf->used, data, size);
+	buf->used += size;
 }
 
-/*! Show registered pipes */
-static int show_pipes_cb(void *obj, void *arg, int flags) {
-	struct ast_kafka_pipe *pipe = obj;
-	struct ast_cli_args *a = arg;
+/*! Append big-endian value of the specified size */
+static void kafka_buf_put_be(struct kafka_buf *buf, uint64_t value, size_t bytes) {
+	unsigned char be[8];
+	size_t i;
 
-	ast_cli(a->fd, "%s\n", pipe->id);
+	for(i = 0;i < bytes;i++) {
+		be[bytes - i - 1] = value & 0xff;
+		value >>= 8;
+	}
 
-	return 0;
+	kafka_buf_put(buf, be, bytes);
 }
 
-static int cli_show_topic_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
-	struct ast_cli_args *a = opaque_1;
-	const char *service_type = opaque_2;
-	RAII_VAR(struct kafka_service *, service, rdkafka_topic_to_service(topic->rd_kafka_topic), ao2_cleanup);
-	const struct rd_kafka_metadata *metadata;
-	rd_kafka_resp_err_t response;
-
-	ast_debug(3, "Kafka request %s (%p) for topic (%p)\n", service_type, service->rd_kafka, topic->rd_kafka_topic);
-
-	if(RD_KAFKA_RESP_ERR_NO_ERROR == (response = rd_kafka_metadata(service->rd_kafka, 1, topic->rd_kafka_topic, &metadata, service->timeout_ms))) {
-		int i;
-//		ast_cli(a->fd, "broker id=%d '%s', total brokers %d, total topics %d\n", metadata->orig_broker_id, metadata->orig_broker_name, metadata->broker_cnt, metadata->topic_cnt);
+/*! Release thread binary buffer */
+static void kafka_buf_cleanup(void *data) {
+	struct kafka_buf *buf = data;
 
-		for(i = 0;i < metadata->topic_cnt;i++) {
-			const rd_kafka_metadata_topic_t *topic_metadata = metadata->topics + i;
+	ast_free(buf->data);
+	ast_free(buf);
+}
 
-			ast_cli(a->fd, "On %s topic '%s' handled by broker %d '%s', total partitions %d, total brokers %d, status %s (%d)\n", 
-				service_type, topic_metadata->topic, metadata->orig_broker_id, metadata->orig_broker_name,
-				topic_metadata->partition_cnt,
-				metadata->broker_cnt, rd_kafka_err2str(topic_metadata->err), topic_metadata->err);
+/*! Append head of string, array or map with count bytes or items */
+static void kafka_encode_head(struct kafka_buf *buf, enum kafka_format format, enum kafka_item_kind kind, uint64_t count) {
+	unsigned char byte;
+
+	if(KAFKA_FORMAT_CBOR == format) {
+		/* Major type and the shortest argument */
+		unsigned char major = (KAFKA_ITEM_STRING == kind) ? 3 : (KAFKA_ITEM_ARRAY == kind) ? 4 : 5;
+
+		if(count < 24) {
+			byte = (major << 5) | count;
+			kafka_buf_put(buf, &byte, 1);
+		} else if(count <= 0xff) {
+			byte = (major << 5) | 24;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 1);
+		} else if(count <= 0xffff) {
+			byte = (major << 5) | 25;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 2);
+		} else if(count <= 0xffffffff) {
+			byte = (major << 5) | 26;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 4);
+		} else {
+			byte = (major << 5) | 27;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 8);
 		}
 
-		rd_kafka_metadata_destroy(metadata);
-	} else {
-		ast_log(LOG_ERROR, "Kafka get metadata got error: %s\n", rd_kafka_err2str(response));
+		return;
 	}
 
-	return 0;
+	if(count > 0xffffffff) {
+		/* Not representable by MessagePack */
+		buf->failed = 1;
+		return;
+	}
+
+	switch(kind) {
+	case KAFKA_ITEM_STRING:
+		if(count < 32) {
+			byte = 0xa0 | count;
+			kafka_buf_put(buf, &byte, 1);
+		} else if(count <= 0xff) {
+			byte = 0xd9;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 1);
+		} else if(count <= 0xffff) {
+			byte = 0xda;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 2);
+		} else {
+			byte = 0xdb;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 4);
+		}
+		break;
+	case KAFKA_ITEM_ARRAY:
+	case KAFKA_ITEM_MAP:
+		if(count < 16) {
+			byte = ((KAFKA_ITEM_ARRAY == kind) ? 0x90 : 0x80) | count;
+			kafka_buf_put(buf, &byte, 1);
+		} else if(count <= 0xffff) {
+			byte = (KAFKA_ITEM_ARRAY == kind) ? 0xdc : 0xde;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 2);
+		} else {
+			byte = (KAFKA_ITEM_ARRAY == kind) ? 0xdd : 0xdf;
+			kafka_buf_put(buf, &byte, 1);
+			kafka_buf_put_be(buf, count, 4);
+		}
+		break;
+	default:
+		buf->failed = 1;
+		break;
+	}
 }
 
+/*! Append UTF-8 string */
+static void kafka_encode_string(struct kafka_buf *buf, enum kafka_format format, const char *value) {
+	size_t size = strlen(value);
 
+	kafka_encode_head(buf, format, KAFKA_ITEM_STRING, size);
+	kafka_buf_put(buf, value, size);
+}
 
-static void on_producer_created(const void *obj) {
-	const struct sorcery_kafka_producer *producer = obj;
+/*! Append integer by the shortest encoding */
+static void kafka_encode_integer(struct kafka_buf *buf, enum kafka_format format, intmax_t value) {
+	unsigned char byte;
 
-	ast_debug(3, "on_producer_created %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
-}
+	if(KAFKA_FORMAT_CBOR == format) {
+		/* Unsigned or negative integer major type */
+		uint64_t argument = (value < 0) ? (uint64_t)(-(value + 1)) : (uint64_t)value;
+		unsigned char major = (value < 0) ? 1 : 0;
+		size_t bytes = (argument < 24) ? 0 : (argument <= 0xff) ? 1 : (argument <= 0xffff) ? 2 : (argument <= 0xffffffff) ? 4 : 8;
 
-static void on_producer_updated(const void *obj) {
-	const struct sorcery_kafka_producer *producer = obj;
+		byte = (major << 5) | ((0 == bytes) ? argument : (1 == bytes) ? 24 : (2 == bytes) ? 25 : (4 == bytes) ? 26 : 27);
+		kafka_buf_put(buf, &byte, 1);
+		kafka_buf_put_be(buf, argument, bytes);
 
-	ast_debug(3, "on_producer_updated %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
-}
+		return;
+	}
 
-static void on_producer_deleted(const void *obj) {
-	const struct sorcery_kafka_producer *producer = obj;
+	if((value >= -32) && (value <= 127)) {
+		/* Positive or negative fixint */
+		byte = (unsigned char)value;
+		kafka_buf_put(buf, &byte, 1);
+	} else if(value > 0) {
+		size_t bytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
 
-	ast_debug(3, "on_producer_deleted %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
-}
+		byte = (1 == bytes) ? 0xcc : (2 == bytes) ? 0xcd : (4 == bytes) ? 0xce : 0xcf;
+		kafka_buf_put(buf, &byte, 1);
+		kafka_buf_put_be(buf, value, bytes);
+	} else {
+		size_t bytes = (value >= INT8_MIN) ? 1 : (value >= INT16_MIN) ? 2 : (value >= INT32_MIN) ? 4 : 8;
 
-static void on_producer_loaded(const char *type) {
-	ast_debug(3, "on_producer_loaded %s\n", type);
+		byte = (1 == bytes) ? 0xd0 : (2 == bytes) ? 0xd1 : (4 == bytes) ? 0xd2 : 0xd3;
+		kafka_buf_put(buf, &byte, 1);
+		kafka_buf_put_be(buf, (uint64_t)value, bytes);
+	}
 }
 
+/*! Append JSON value encoded by the binary format */
+static void kafka_encode_value(struct kafka_buf *buf, enum kafka_format format, struct ast_json *json, int depth) {
+	int cbor = (KAFKA_FORMAT_CBOR == format);
+	struct ast_json_iter *iter;
+	unsigned char byte;
+	uint64_t bits;
+	double real;
+	size_t i;
+
+	if((NULL == json) || (depth > KAFKA_FORMAT_MAX_DEPTH)) {
+		buf->failed = 1;
+		return;
+	}
 
+	switch(ast_json_typeof(json)) {
+	case AST_JSON_OBJECT:
+		kafka_encode_head(buf, format, KAFKA_ITEM_MAP, ast_json_object_size(json));
 
+		for(iter = ast_json_object_iter(json);iter && !buf->failed;iter = ast_json_object_iter_next(json, iter)) {
+			kafka_encode_string(buf, format, ast_json_object_iter_key(iter));
+			kafka_encode_value(buf, format, ast_json_object_iter_value(iter), depth + 1);
+		}
+		break;
+	case AST_JSON_ARRAY:
+		kafka_encode_head(buf, format, KAFKA_ITEM_ARRAY, ast_json_array_size(json));
 
+		for(i = 0;(i < ast_json_array_size(json)) && !buf->failed;i++) {
+			kafka_encode_value(buf, format, ast_json_array_get(json, i), depth + 1);
+		}
+		break;
+	case AST_JSON_STRING:
+		kafka_encode_string(buf, format, ast_json_string_get(json));
+		break;
+	case AST_JSON_INTEGER:
+		kafka_encode_integer(buf, format, ast_json_integer_get(json));
+		break;
+	case AST_JSON_REAL:
+		/* Always double precision */
+		real = ast_json_real_get(json);
+		memcpy(&bits, &real, sizeof(bits));
+		byte = cbor ? 0xfb : 0xcb;
+		kafka_buf_put(buf, &byte, 1);
+		kafka_buf_put_be(buf, bits, 8);
+		break;
+	case AST_JSON_TRUE:
+		byte = cbor ? 0xf5 : 0xc3;
+		kafka_buf_put(buf, &byte, 1);
+		break;
+	case AST_JSON_FALSE:
+		byte = cbor ? 0xf4 : 0xc2;
+		kafka_buf_put(buf, &byte, 1);
+		break;
+	case AST_JSON_NULL:
+	default:
+		byte = cbor ? 0xf6 : 0xc0;
+		kafka_buf_put(buf, &byte, 1);
+		break;
+	}
+}
 
-/*! Process all defined in configuration file clusters */
-static void process_all_clusters(void) {
-	RAII_VAR(struct ao2_container *, clusters, 
-		ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_CLUSTER, AST_RETRIEVE_FLAG_MULTIPLE | AST_RETRIEVE_FLAG_ALL, NULL), ao2_cleanup);
-
-	if(clusters) {
-		struct ao2_iterator i = ao2_iterator_init(clusters, 0);
-		struct sorcery_kafka_cluster *cluster;
+/*! Decode received message payload by its content-type header */
+static struct ast_json *kafka_decode_message(const rd_kafka_message_t *rkm) {
+	struct kafka_decoder decoder = {
+		.data = rkm->payload,
+		.size = rkm->len,
+		.pos = 0,
+		.format = KAFKA_FORMAT_JSON,
+	};
+	rd_kafka_headers_t *headers;
+	const void *value;
+	size_t size;
+	struct ast_json *json;
+	int i;
 
-		while(NULL != (cluster = ao2_iterator_next(&i))) {
-			process_cluster(cluster);
+	if(NULL == rkm->payload) {
+		return NULL;
+	}
 
-			ao2_ref(cluster, -1);
+	if((RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_message_headers(rkm, &headers))
+		&& (RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_header_get_last(headers, "content-type", &value, &size))) {
+		for(i = 0;i < KAFKA_FORMAT_COUNT;i++) {
+			if((strlen(kafka_format_content_types[i]) == size) && (0 == strncasecmp(value, kafka_format_content_types[i], size))) {
+				decoder.format = i;
+				break;
+			}
 		}
+	}
 
-		ao2_iterator_destroy(&i);
+	if(KAFKA_FORMAT_JSON == decoder.format) {
+		return ast_json_load_buf(rkm->payload, rkm->len, NULL);
 	}
-}
 
-/*! Process Kafka cluster */
-static void process_cluster(const struct sorcery_kafka_cluster *cluster) {
-	RAII_VAR(struct ast_variable *, filter, ast_variable_new("cluster", ast_sorcery_object_get_id(cluster), ""), ast_variables_destroy);
-	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+	if((NULL != (json = kafka_decode_value(&decoder, 0))) && (decoder.pos != decoder.size)) {
+		/* Trailing garbage */
+		ast_json_unref(json);
+		json = NULL;
+	}
 
-	ast_debug(3, "Kafka cluster at %s (%p)\n", ast_sorcery_object_get_id(cluster), cluster);
+	return json;
+}
 
-	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_PRODUCER, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
-		ast_log(LOG_WARNING, "Unable to retrieve producers from cluster %s\n", ast_sorcery_object_get_id(cluster));
-	} else {
-		struct ao2_iterator i = ao2_iterator_init(found, 0);
-		struct sorcery_kafka_producer *producer;
+/*! Decode one binary item */
+static struct ast_json *kafka_decode_value(struct kafka_decoder *decoder, int depth) {
+	enum kafka_item_kind kind;
+	uint64_t count;
+	uint64_t i;
+	struct ast_json *json = NULL;
+	char *string;
+
+	if((depth > KAFKA_FORMAT_MAX_DEPTH) || kafka_decode_head(decoder, &kind, &count, &json, depth)) {
+		return NULL;
+	}
+
+	if(KAFKA_ITEM_SCALAR == kind) {
+		return json;
+	}
+
+	/* Each array item or map entry take at least one byte */
+	if(count > decoder->size - decoder->pos) {
+		return NULL;
+	}
+
+	switch(kind) {
+	case KAFKA_ITEM_STRING:
+		if(NULL == (string = ast_malloc(count + 1))) {
+			return NULL;
+		}
+
+		memcpy(string, decoder->data + decoder->pos, count);
+		string[count] = '\0';
+		decoder->pos += count;
+
+		json = ast_json_string_create(string);
+		ast_free(string);
+		break;
+	case KAFKA_ITEM_ARRAY:
+		if(NULL == (json = ast_json_array_create())) {
+			return NULL;
+		}
+
+		for(i = 0;i < count;i++) {
+			struct ast_json *item = kafka_decode_value(decoder, depth + 1);
+
+			if((NULL == item) || ast_json_array_append(json, item)) {
+				ast_json_unref(json);
+				return NULL;
+			}
+		}
+		break;
+	case KAFKA_ITEM_MAP:
+		if(NULL == (json = ast_json_object_create())) {
+			return NULL;
+		}
+
+		for(i = 0;i < count;i++) {
+			struct ast_json *key = kafka_decode_value(decoder, depth + 1);
+			struct ast_json *item;
+
+			if((NULL == key) || (AST_JSON_STRING != ast_json_typeof(key))
+				|| (NULL == (item = kafka_decode_value(decoder, depth + 1)))) {
+				/* Only string keys are representable by JSON */
+				ast_json_unref(key);
+				ast_json_unref(json);
+				return NULL;
+			}
+
+			if(ast_json_object_set(json, ast_json_string_get(key), item)) {
+				ast_json_unref(key);
+				ast_json_unref(json);
+				return NULL;
+			}
+
+			ast_json_unref(key);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return json;
+}
+
+/*! Read item head: scalar value or string, array, map size */
+static int kafka_decode_head(struct kafka_decoder *decoder, enum kafka_item_kind *kind, uint64_t *count, struct ast_json **scalar, int depth) {
+	unsigned char byte;
+	uint64_t value = 0;
+	union {
+		uint32_t u32;
+		float f32;
+		uint64_t u64;
+		double f64;
+	} real;
+
+	if(decoder->pos >= decoder->size) {
+		return -1;
+	}
+
+	byte = decoder->data[decoder->pos++];
+	*kind = KAFKA_ITEM_SCALAR;
+	*count = 0;
+	*scalar = NULL;
+
+	if(KAFKA_FORMAT_CBOR == decoder->format) {
+		unsigned char major = byte >> 5;
+		unsigned char info = byte & 0x1f;
+
+		if(info < 24) {
+			value = info;
+		} else if((info > 27) || kafka_decode_be(decoder, 1 << (info - 24), &value)) {
+			/* Indefinite length items not supported */
+			return -1;
+		}
+
+		switch(major) {
+		case 0:
+			*scalar = (value > INTMAX_MAX) ? ast_json_real_create(value) : ast_json_integer_create(value);
+			break;
+		case 1:
+			*scalar = (value > INTMAX_MAX) ? ast_json_real_create(-1.0 - value) : ast_json_integer_create(-1 - (intmax_t)value);
+			break;
+		case 2:
+		case 3:
+			*kind = KAFKA_ITEM_STRING;
+			*count = value;
+			return 0;
+		case 4:
+			*kind = KAFKA_ITEM_ARRAY;
+			*count = value;
+			return 0;
+		case 5:
+			*kind = KAFKA_ITEM_MAP;
+			*count = value;
+			return 0;
+		case 6:
+			/* Tag ignored, tagged item decoded as is */
+			*scalar = kafka_decode_value(decoder, depth + 1);
+			break;
+		default:
+			if(20 == info) {
+				*scalar = ast_json_false();
+			} else if(21 == info) {
+				*scalar = ast_json_true();
+			} else if((22 == info) || (23 == info)) {
+				*scalar = ast_json_null();
+			} else if(25 == info) {
+				/* Half precision */
+				int exponent = (value >> 10) & 0x1f;
+				double mantissa = value & 0x3ff;
+
+				if(31 == exponent) {
+					return -1;
+				}
+
+				real.f64 = exponent ? ldexp(mantissa + 1024, exponent - 25) : ldexp(mantissa, -24);
+				*scalar = ast_json_real_create((value & 0x8000) ? -real.f64 : real.f64);
+			} else if(26 == info) {
+				real.u32 = value;
+				*scalar = ast_json_real_create(real.f32);
+			} else if(27 == info) {
+				real.u64 = value;
+				*scalar = ast_json_real_create(real.f64);
+			}
+			break;
+		}
+
+		return *scalar ? 0 : -1;
+	}
+
+	if((byte <= 0x7f) || (byte >= 0xe0)) {
+		/* Positive or negative fixint */
+		*scalar = ast_json_integer_create((int8_t)byte);
+	} else if(byte <= 0x8f) {
+		*kind = KAFKA_ITEM_MAP;
+		*count = byte & 0x0f;
+		return 0;
+	} else if(byte <= 0x9f) {
+		*kind = KAFKA_ITEM_ARRAY;
+		*count = byte & 0x0f;
+		return 0;
+	} else if(byte <= 0xbf) {
+		*kind = KAFKA_ITEM_STRING;
+		*count = byte & 0x1f;
+		return 0;
+	} else {
+		switch(byte) {
+		case 0xc0:
+			*scalar = ast_json_null();
+			break;
+		case 0xc2:
+			*scalar = ast_json_false();
+			break;
+		case 0xc3:
+			*scalar = ast_json_true();
+			break;
+		case 0xc4:
+		case 0xc5:
+		case 0xc6:
+			/* Binary decoded as string */
+			*kind = KAFKA_ITEM_STRING;
+			return kafka_decode_be(decoder, 1 << (byte - 0xc4), count);
+		case 0xca:
+			if(kafka_decode_be(decoder, 4, &value)) {
+				return -1;
+			}
+			real.u32 = value;
+			*scalar = ast_json_real_create(real.f32);
+			break;
+		case 0xcb:
+			if(kafka_decode_be(decoder, 8, &value)) {
+				return -1;
+			}
+			real.u64 = value;
+			*scalar = ast_json_real_create(real.f64);
+			break;
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			if(kafka_decode_be(decoder, 1 << (byte - 0xcc), &value)) {
+				return -1;
+			}
+			*scalar = (value > INTMAX_MAX) ? ast_json_real_create(value) : ast_json_integer_create(value);
+			break;
+		case 0xd0:
+			if(kafka_decode_be(decoder, 1, &value)) {
+				return -1;
+			}
+			*scalar = ast_json_integer_create((int8_t)value);
+			break;
+		case 0xd1:
+			if(kafka_decode_be(decoder, 2, &value)) {
+				return -1;
+			}
+			*scalar = ast_json_integer_create((int16_t)value);
+			break;
+		case 0xd2:
+			if(kafka_decode_be(decoder, 4, &value)) {
+				return -1;
+			}
+			*scalar = ast_json_integer_create((int32_t)value);
+			break;
+		case 0xd3:
+			if(kafka_decode_be(decoder, 8, &value)) {
+				return -1;
+			}
+			*scalar = ast_json_integer_create((int64_t)value);
+			break;
+		case 0xd9:
+		case 0xda:
+		case 0xdb:
+			*kind = KAFKA_ITEM_STRING;
+			return kafka_decode_be(decoder, 1 << (byte - 0xd9), count);
+		case 0xdc:
+		case 0xdd:
+			*kind = KAFKA_ITEM_ARRAY;
+			return kafka_decode_be(decoder, 2 << (byte - 0xdc), count);
+		case 0xde:
+		case 0xdf:
+			*kind = KAFKA_ITEM_MAP;
+			return kafka_decode_be(decoder, 2 << (byte - 0xde), count);
+		default:
+			/* Extension types not supported */
+			return -1;
+		}
+	}
+
+	return *scalar ? 0 : -1;
+}
+
+/*! Read big-endian value of the specified size */
+static int kafka_decode_be(struct kafka_decoder *decoder, size_t bytes, uint64_t *value) {
+	size_t i;
+
+	if(bytes > decoder->size - decoder->pos) {
+		return -1;
+	}
+
+	*value = 0;
+
+	for(i = 0;i < bytes;i++) {
+		*value = (*value << 8) | decoder->data[decoder->pos++];
+	}
+
+	return 0;
+}
+
+/*! Module API: Send json message to the pipe */
+int ast_kafka_send_json_message(struct ast_kafka_pipe *pipe, const char *key,
+				struct ast_json *json,
+				const char *reason) {
+	if(publish_lane_count) {
+		/* Serialized by the publish thread */
+		return kafka_publish_enqueue(pipe, key, reason, json, 0);
+	}
+
+	return kafka_publish_json(pipe, key, reason, json, 0);
+}
+
+/*! Enqueue message to the publish lane selected by key or pipe id */
+static int kafka_publish_enqueue(struct ast_kafka_pipe *pipe, const char *key, const char *reason, struct ast_json *json, int envelope) {
+	struct kafka_publish_lane *lane;
+	struct kafka_publish_item *item;
+	size_t key_size = key ? strlen(key) + 1 : 0;
+	size_t reason_size = reason ? strlen(reason) + 1 : 0;
+	int dropped_count;
+
+	if(NULL == json) {
+		return -1;
+	}
+
+	/* Same key (or pipe) messages are served by one lane to keep order */
+	lane = &publish_lanes[ast_str_hash(S_OR(key, pipe->id)) % publish_lane_count];
+
+	if(ast_taskprocessor_size(lane->tps) >= publish_queue_max) {
+		kafka_stats_add(pipe->stats, KAFKA_COUNTER_DROPPED, 1);
+
+		if(0 == ((dropped_count = ast_atomic_fetchadd_int(&lane->dropped_count, +1)) % KAFKA_QUEUE_FULL_LOG_INTERVAL)) {
+			ast_log(LOG_WARNING, "Kafka publish queue '%s' is full, %d message(s) dropped\n", ast_taskprocessor_name(lane->tps), dropped_count + 1);
+		}
+
+		return -1;
+	}
+
+	if(NULL == (item = ast_malloc(sizeof(*item) + key_size + reason_size))) {
+		return -1;
+	}
+
+	item->pipe = ao2_bump(pipe);
+	item->json = ast_json_ref(json);
+	item->envelope = envelope;
+	item->key = key ? strcpy(item->data, key) : NULL;
+	item->reason = reason ? strcpy(item->data + key_size, reason) : NULL;
+
+	ast_mutex_lock(&lane->lock);
+	AST_LIST_INSERT_TAIL(&lane->items, item, link);
+	ast_mutex_unlock(&lane->lock);
+
+	/* Task per message, so taskprocessor size and alerts follow the queue depth */
+	if(ast_taskprocessor_push(lane->tps, kafka_publish_drain, lane)) {
+		/* Only the lane's thread serve the queue, otherwise order is broken */
+		ast_mutex_lock(&lane->lock);
+		item = AST_LIST_REMOVE(&lane->items, item, link);
+		ast_mutex_unlock(&lane->lock);
+
+		if(NULL == item) {
+			/* Already served by the task of the previous message */
+			return 0;
+		}
+
+		kafka_stats_add(pipe->stats, KAFKA_COUNTER_DROPPED, 1);
+
+		if(0 == ((dropped_count = ast_atomic_fetchadd_int(&lane->dropped_count, +1)) % KAFKA_QUEUE_FULL_LOG_INTERVAL)) {
+			ast_log(LOG_WARNING, "Kafka publish queue '%s' unable to accept task, %d message(s) dropped\n", ast_taskprocessor_name(lane->tps), dropped_count + 1);
+		}
+
+		ast_json_unref(item->json);
+		ao2_ref(item->pipe, -1);
+		ast_free(item);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! Publish task: serialize and produce batch of queued messages */
+static int kafka_publish_drain(void *data) {
+	struct kafka_publish_lane *lane = data;
+	struct kafka_publish_item *items[KAFKA_PUBLISH_BATCH_MAX];
+	struct ast_kafka_msg msgs[KAFKA_PUBLISH_BATCH_MAX];
+	size_t offsets[KAFKA_PUBLISH_BATCH_MAX];
+	struct ast_str *buf = ast_str_thread_get(&kafka_publish_buf, KAFKA_ENVELOPE_BUF_INIT);
+	size_t count = 0;
+	size_t serialized = 0;
+	size_t i;
+	size_t j;
+
+	ast_mutex_lock(&lane->lock);
+
+	while((count < KAFKA_PUBLISH_BATCH_MAX) && (NULL != (items[count] = AST_LIST_REMOVE_HEAD(&lane->items, link)))) {
+		count++;
+	}
+
+	ast_mutex_unlock(&lane->lock);
+
+	if(0 == count) {
+		/* Served by previous task */
+		return 0;
+	}
+
+	if(buf) {
+		ast_str_reset(buf);
+	}
+
+	/* Serialize all messages into one buffer, failed messages are skipped */
+	for(i = 0;i < count;i++) {
+		struct kafka_publish_item *item = items[i];
+		size_t offset = buf ? ast_str_strlen(buf) : 0;
+
+		if(!kafka_pipe_json_only(item->pipe)) {
+			/* Serialized by each format of the pipe topics */
+			kafka_publish_json(item->pipe, item->key, item->reason, item->json, item->envelope);
+			ast_json_unref(item->json);
+			ao2_ref(item->pipe, -1);
+			ast_free(item);
+			continue;
+		}
+
+		if((NULL == buf) || (item->envelope ? kafka_event_envelope_append(&buf, item->reason, item->json) : ast_json_dump_str(item->json, &buf))) {
+			if(buf) {
+				ast_str_truncate(buf, offset);
+			}
+
+			ast_log(LOG_WARNING, "Unable to serialize message to pipe '%s'\n", item->pipe->id);
+			kafka_stats_add(item->pipe->stats, KAFKA_COUNTER_DROPPED, 1);
+			ast_json_unref(item->json);
+			ao2_ref(item->pipe, -1);
+			ast_free(item);
+			continue;
+		}
+
+		items[serialized] = item;
+		offsets[serialized] = offset;
+		msgs[serialized].key = item->key;
+		msgs[serialized].payload_size = ast_str_strlen(buf) - offset;
+		msgs[serialized].reason = item->reason;
+		serialized++;
+	}
+
+	/* Buffer not moved anymore */
+	for(i = 0;i < serialized;i++) {
+		msgs[i].payload = ast_str_buffer(buf) + offsets[i];
+	}
+
+	/* Produce runs of the same pipe messages by one batch */
+	for(i = 0;i < serialized;i = j) {
+		for(j = i + 1;(j < serialized) && (items[j]->pipe == items[i]->pipe);j++) {
+		}
+
+		ast_kafka_send_batch(items[i]->pipe, msgs + i, j - i, NULL);
+	}
+
+	for(i = 0;i < serialized;i++) {
+		ast_json_unref(items[i]->json);
+		ao2_ref(items[i]->pipe, -1);
+		ast_free(items[i]);
+	}
+
+	return 0;
+}
+
+/*! Module API: Send raw message to the pipe */
+int ast_kafka_send_raw_message(struct ast_kafka_pipe *pipe, const char *key,
+				const void *payload, size_t payload_size,
+				const char *reason) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+	RAII_VAR(struct kafka_headers_template *, template, get_message_headers(snapshot, reason), ao2_cleanup);
+	struct message_options options = {
+		.key = key,
+		.headers = template ? template->headers : NULL,
+		.msgflags = RD_KAFKA_MSG_F_COPY,
+		.shared = NULL,
+	};
+
+	return on_snapshot_topics(snapshot, produce_message, (void*)payload, &payload_size, &options, pipe);
+}
+
+/*! Module API: Send raw message to the pipe with precomputed key hash */
+int ast_kafka_send_raw_message_hash(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, uint32_t key_hash,
+				const void *payload, size_t payload_size,
+				const char *reason) {
+	const struct message_partition partition = {
+		.partition = RD_KAFKA_PARTITION_UA,
+		.key_hash = key_hash,
+	};
+
+	return kafka_send_raw_partitioned(pipe, key, key_size, &partition, payload, payload_size, reason);
+}
+
+/*! Module API: Send raw message to the partition of the pipe topics */
+int ast_kafka_send_raw_message_partition(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, int32_t partition,
+				const void *payload, size_t payload_size,
+				const char *reason) {
+	const struct message_partition selected = {
+		.partition = partition,
+		.key_hash = 0,
+	};
+
+	/* Partitioned by topic if partition not specified */
+	return kafka_send_raw_partitioned(pipe, key, key_size, (partition < 0) ? NULL : &selected, payload, payload_size, reason);
+}
+
+/*! Send raw message with key size to the partition selected by the caller or by the topic if NULL */
+static int kafka_send_raw_partitioned(struct ast_kafka_pipe *pipe, const char *key, size_t key_size, const struct message_partition *partition, const void *payload, size_t payload_size, const char *reason) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+	RAII_VAR(struct kafka_headers_template *, template, get_message_headers(snapshot, reason), ao2_cleanup);
+	struct message_options options = {
+		.key = key,
+		.key_size = key ? key_size : 0,
+		.headers = template ? template->headers : NULL,
+		.msgflags = RD_KAFKA_MSG_F_COPY,
+		.shared = NULL,
+		.partition = partition,
+	};
+
+	return on_snapshot_topics(snapshot, produce_message, (void*)payload, &payload_size, &options, pipe);
+}
+
+/*! Module API: Send raw message to the pipe, payload ownership moved to the pipe */
+int ast_kafka_send_raw_message_nocopy(struct ast_kafka_pipe *pipe, const char *key,
+				void *payload, size_t payload_size,
+				void (*free_fn)(void *payload),
+				const char *reason) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+	RAII_VAR(struct kafka_headers_template *, template, get_message_headers(snapshot, reason), ao2_cleanup);
+	int processed = 0;
+	struct message_options options = {
+		.key = key,
+		.headers = template ? template->headers : NULL,
+		.msgflags = 0,
+		.shared = NULL,
+	};
+
+	/* Snapshot is immutable, so payload ownership decided safely */
+	if((NULL == snapshot) || (0 == snapshot->count)) {
+		/* No producers, nothing to do */
+		free_fn(payload);
+	} else if((1 == snapshot->count) && KAFKA_PAYLOAD_FREED_BY_LIBC(free_fn)) {
+		/* Single topic, librdkafka release payload when message processed */
+		options.msgflags = RD_KAFKA_MSG_F_FREE;
+
+		if((processed = produce_message(snapshot->topics[0], payload, &payload_size, &options, pipe))) {
+			/* Ownership not moved on failure */
+			free_fn(payload);
+		}
+	} else if(NULL == (options.shared = ao2_alloc_options(sizeof(*options.shared), kafka_shared_payload_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		/* Out of memory, fallback to copy payload */
+		options.msgflags = RD_KAFKA_MSG_F_COPY;
+
+		processed = on_snapshot_topics(snapshot, produce_message, payload, &payload_size, &options, pipe);
+
+		free_fn(payload);
+	} else {
+		/* Each produced message reference shared payload */
+		options.shared->payload = payload;
+		options.shared->free_fn = free_fn;
+
+		processed = on_snapshot_topics(snapshot, produce_message, payload, &payload_size, &options, pipe);
+
+		/* Payload released after the last message processed */
+		ao2_ref(options.shared, -1);
+	}
+
+	return processed;
+}
+
+/*! Module API: Send batch of raw messages to the pipe */
+int ast_kafka_send_batch(struct ast_kafka_pipe *pipe, const struct ast_kafka_msg *msgs, size_t count, int *status) {
+	RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+	struct kafka_headers_template **templates = NULL;
+	rd_kafka_message_t *rkms = NULL;
+	int *failed = status;
+	int failed_count = 0;
+	size_t i;
+	size_t j;
+
+	if((NULL == failed) && (NULL == (failed = ast_calloc(count, sizeof(*failed))))) {
+		return count;
+	}
+
+	memset(failed, 0, count * sizeof(*failed));
+
+	if((NULL == snapshot) || (0 == snapshot->count) || (0 == count)) {
+		/* No producers, nothing to do */
+		if(failed != status) {
+			ast_free(failed);
+		}
+
+		return 0;
+	}
+
+	if(snapshot->headers_count && (NULL != (templates = ast_calloc(count, sizeof(*templates))))) {
+		/* Headers built once per run of messages with the same reason */
+		for(i = 0;i < count;i++) {
+			if(i && (0 == strcmp(S_OR(msgs[i].reason, ""), S_OR(msgs[i - 1].reason, "")))) {
+				templates[i] = ao2_bump(templates[i - 1]);
+			} else {
+				templates[i] = get_message_headers(snapshot, msgs[i].reason);
+			}
+		}
+	}
+
+	for(i = 0;i < snapshot->count;i++) {
+		struct kafka_topic *topic = snapshot->topics[i];
+		struct kafka_spool *spool = topic->service->specific.producer.spool;
+
+		if(!(topic->headers && snapshot->headers_count) && (NULL == spool || kafka_spool_empty(spool))
+			&& ((NULL != rkms) || (NULL != (rkms = ast_malloc(count * sizeof(*rkms)))))) {
+			/* Headers-free topic, enqueue all messages by one call */
+			produce_batch(topic, msgs, count, rkms, failed, pipe);
+			continue;
+		}
+
+		for(j = 0;j < count;j++) {
+			struct message_options options = {
+				.key = msgs[j].key,
+				.headers = (templates && templates[j]) ? templates[j]->headers : NULL,
+				.msgflags = RD_KAFKA_MSG_F_COPY,
+				.shared = NULL,
+			};
+			size_t payload_size = msgs[j].payload_size;
+
+			if(produce_message(topic, (void *)msgs[j].payload, &payload_size, &options, pipe)) {
+				failed[j] = -1;
+			}
+		}
+	}
+
+	for(i = 0;i < count;i++) {
+		failed_count += (0 != failed[i]);
+
+		if(templates) {
+			ao2_cleanup(templates[i]);
+		}
+	}
+
+	ast_free(templates);
+	ast_free(rkms);
+
+	if(failed != status) {
+		ast_free(failed);
+	}
+
+	return failed_count;
+}
+
+/*! Enqueue batch of messages w/o headers to the topic, status of failed messages set to -1 */
+static int produce_batch(struct kafka_topic *topic, const struct ast_kafka_msg *msgs, size_t count, rd_kafka_message_t *rkms, int *status, struct ast_kafka_pipe *pipe) {
+	size_t bytes = 0;
+	int accepted;
+	size_t i;
+
+	memset(rkms, 0, count * sizeof(*rkms));
+
+	for(i = 0;i < count;i++) {
+		size_t key_size;
+		const char *key = topic_message_key(topic, msgs[i].key, 0, &key_size);
+
+		rkms[i].payload = (void *)msgs[i].payload;
+		rkms[i].len = msgs[i].payload_size;
+		rkms[i].key = (void *)key;
+		rkms[i].key_len = key_size;
+		rkms[i]._private = NULL;
+	}
+
+	/* Each message keep the topic until delivery report */
+	ao2_ref(topic, (int)count);
+
+	accepted = rd_kafka_produce_batch(topic->rd_kafka_topic, topic->partition, RD_KAFKA_MSG_F_COPY, rkms, count);
+
+	if(accepted < (int)count) {
+		/* Rejected messages never reported */
+		ao2_ref(topic, accepted - (int)count);
+	}
+
+	ast_debug(3, "Kafka pipe '%s' produce batch on topic '%s' partition %d, accepted %d of %zu\n",
+			pipe->id, topic->id, topic->partition, accepted, count);
+
+	for(i = 0;i < count;i++) {
+		if(RD_KAFKA_RESP_ERR_NO_ERROR == rkms[i].err) {
+			bytes += msgs[i].payload_size;
+		} else if(RD_KAFKA_RESP_ERR__QUEUE_FULL == rkms[i].err) {
+			/* Retry one by one, apply producer's queue full policy */
+			struct message_options options = {
+				.key = msgs[i].key,
+				.headers = NULL,
+				.msgflags = RD_KAFKA_MSG_F_COPY,
+				.shared = NULL,
+			};
+			size_t payload_size = msgs[i].payload_size;
+
+			if(produce_message(topic, (void *)msgs[i].payload, &payload_size, &options, pipe)) {
+				status[i] = -1;
+			}
+		} else {
+			ast_log(LOG_WARNING, "Produce message on pipe '%s' failed: %s\n",
+				pipe->id, rd_kafka_err2str(rkms[i].err));
+
+			status[i] = -1;
+		}
+	}
+
+	if(accepted > 0) {
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_PRODUCED_MESSAGES, accepted);
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_PRODUCED_BYTES, bytes);
+	}
+
+	return (accepted == (int)count) ? 0 : -1;
+}
+
+/*! Apply callback to the all topics in the snapshot */
+static int on_snapshot_topics(struct kafka_topics_snapshot *snapshot, int (*callback)(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe), void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	int status = 0;
+	size_t i;
+
+	for(i = 0;snapshot && (i < snapshot->count);i++) {
+		status |= (*callback)(snapshot->topics[i], opaque_1, opaque_2, options, pipe);
+
+		if(status < 0) {
+			/* Fatal error */
+			break;
+		}
+	}
+
+	return status;
+}
+
+/*! Replace pipe's producer topics snapshot, must be called with producer_topics lock held */
+static void pipe_update_producer_snapshot(struct ast_kafka_pipe *pipe) {
+	struct kafka_topics_snapshot *snapshot;
+	struct kafka_topic *topic;
+	size_t count = 0;
+
+	AST_LIST_TRAVERSE(&pipe->producer_topics, topic, link) {
+		count++;
+	}
+
+	if(NULL == (snapshot = ao2_alloc_options(sizeof(*snapshot) + count * sizeof(snapshot->topics[0]), kafka_topics_snapshot_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		ast_log(LOG_ERROR, "Pipe '%s': unable to update producer topics - Out of memory\n", pipe->id);
+		return;
+	}
+
+	snapshot->count = 0;
+	snapshot->headers_count = 0;
+	snapshot->formats = 0;
+
+	AST_LIST_TRAVERSE(&pipe->producer_topics, topic, link) {
+		snapshot->headers_count += topic->headers ? 1 : 0;
+		snapshot->formats |= 1 << topic->format;
+		snapshot->topics[snapshot->count++] = ao2_bump(topic);
+	}
+
+	/* Publishers holding previous snapshot keep it until send complete */
+	ao2_global_obj_replace_unref(pipe->producer_snapshot, snapshot);
+	ao2_ref(snapshot, -1);
+}
+
+/*! Release snapshot topics */
+static void kafka_topics_snapshot_destructor(void *obj) {
+	struct kafka_topics_snapshot *snapshot = obj;
+	size_t i;
+
+	for(i = 0;i < snapshot->count;i++) {
+		ao2_ref(snapshot->topics[i], -1);
+	}
+}
+
+/*! Release shared payload */
+static void kafka_shared_payload_destructor(void *obj) {
+	struct kafka_shared_payload *shared = obj;
+
+	shared->free_fn(shared->payload);
+}
+
+/*! Build Kafka's message headers 
+ * 
+ * Added two message headers:
+ * "reason" - event's reason
+ * "eid" - server's EID
+ */
+static rd_kafka_headers_t *build_message_headers(const char *reason) {
+	int processed = 0;
+	rd_kafka_headers_t *headers = rd_kafka_headers_new(2);
+	
+	if(NULL == headers) {
+		ast_log(LOG_WARNING, "Unable to allocate message headers for event '%s'\n", reason);
+		
+		return NULL;
+	}
+	
+	if(reason) {
+		rd_kafka_resp_err_t response = rd_kafka_header_add(headers, "reason", 6, reason, strlen(reason));
+		
+		if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
+			processed++;
+		} else {
+			ast_log(LOG_WARNING, "Add reason header failed: %s\n", 
+				rd_kafka_err2str(response));
+		}
+	}
+	
+	if(global_producer_eid) {
+		rd_kafka_resp_err_t response = rd_kafka_header_add(headers, "eid", 3, global_producer_eid, strlen(global_producer_eid));
+		
+		if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
+			processed++;
+		} else {
+			ast_log(LOG_WARNING, "Add eid header failed: %s\n", 
+				rd_kafka_err2str(response));
+		}
+	}
+	
+	if(processed) {
+		return headers;
+	}
+	
+	/* No message headers available */
+	rd_kafka_headers_destroy(headers);
+	
+	return NULL;
+}
+
+/*! Get referenced prebuilt message headers for the reason, NULL if pipe topics not use headers */
+static struct kafka_headers_template *get_message_headers(const struct kafka_topics_snapshot *snapshot, const char *reason) {
+	struct kafka_headers_template *template;
+	int64_t stage;
+
+	if((NULL == snapshot) || (0 == snapshot->headers_count)) {
+		/* Headers-free pipe */
+		return NULL;
+	}
+
+	stage = kafka_stage_start(AST_KAFKA_STAGE_HEADERS);
+	template = get_reason_template(reason);
+	kafka_stage_stop(AST_KAFKA_STAGE_HEADERS, stage);
+
+	return template;
+}
+
+/*! Get referenced prebuilt headers and event envelope for the reason */
+static struct kafka_headers_template *get_reason_template(const char *reason) {
+	const char *key = S_OR(reason, "");
+	struct kafka_headers_template *template;
+	unsigned int format;
+
+	if(NULL == headers_cache) {
+		return NULL;
+	}
+
+	if(NULL != (template = ao2_find(headers_cache, key, OBJ_SEARCH_KEY))) {
+		return template;
+	}
+
+	ao2_lock(headers_cache);
+
+	/* Template may be built by other thread */
+	if(NULL == (template = ao2_find(headers_cache, key, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		if(NULL != (template = ao2_alloc_options(sizeof(*template) + strlen(key) + 1, kafka_headers_template_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+			strcpy(template->reason, key);
+			template->headers = build_message_headers(reason);
+
+			for(format = 0;format < KAFKA_FORMAT_COUNT;format++) {
+				template->format_headers[format] = NULL;
+				template->envelope_size[format] = 0;
+				template->envelope[format] = build_event_envelope(reason, format, &template->envelope_size[format]);
+
+				if((KAFKA_FORMAT_JSON != format) && (NULL != (template->format_headers[format] = template->headers ? rd_kafka_headers_copy(template->headers) : rd_kafka_headers_new(1)))) {
+					rd_kafka_header_add(template->format_headers[format], "content-type", 12, kafka_format_content_types[format], strlen(kafka_format_content_types[format]));
+				}
+			}
+
+			if(ao2_container_count(headers_cache) < KAFKA_HEADERS_CACHE_MAX) {
+				ao2_link_flags(headers_cache, template, OBJ_NOLOCK);
+			} else {
+				ast_debug(3, "Kafka headers cache is full, headers for event '%s' not cached\n", key);
+			}
+		}
+	}
+
+	ao2_unlock(headers_cache);
+
+	return template;
+}
+
+/*! Headers template destructor */
+static void kafka_headers_template_destructor(void *obj) {
+	struct kafka_headers_template *template = obj;
+
+	unsigned int format;
+
+	if(template->headers) {
+		rd_kafka_headers_destroy(template->headers);
+	}
+
+	for(format = 0;format < KAFKA_FORMAT_COUNT;format++) {
+		if(template->format_headers[format]) {
+			rd_kafka_headers_destroy(template->format_headers[format]);
+		}
+
+		ast_free(template->envelope[format]);
+	}
+}
+
+/*! Drop all prebuilt message headers */
+static void flush_message_headers(void) {
+	if(headers_cache) {
+		ao2_callback(headers_cache, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, NULL, NULL);
+	}
+}
+
+/*! Send message to the specified topic */
+static int produce_message(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	void *payload = opaque_1;
+	size_t payload_size = *(size_t *)opaque_2;
+	const struct message_options *producer_options = options;
+	const char *suggested_key = producer_options ? producer_options->key : NULL;
+	int msgflags = producer_options ? producer_options->msgflags : RD_KAFKA_MSG_F_COPY;
+	struct kafka_shared_payload *shared = producer_options ? producer_options->shared : NULL;
+	rd_kafka_headers_t *headers = (producer_options && topic->headers) ? producer_options->headers : NULL;
+	size_t key_size;
+	const char *key = topic_message_key(topic, suggested_key, producer_options ? producer_options->key_size : 0, &key_size);
+	int32_t partition = topic_message_partition(topic, producer_options);
+	rd_kafka_resp_err_t response;
+	struct timeval start = { 0, };
+	int retried = 0;
+
+	if(producer_options && producer_options->formats && (0 == (producer_options->formats & (1 << topic->format)))) {
+		/* Message serialized for topics of other format */
+		return 0;
+	}
+
+	ast_debug(3, "Kafka pipe '%s' produce message on topic '%s' partition %d, size=%zu\n",
+			pipe->id, topic->id, partition, payload_size);
+
+	if(topic->service->specific.producer.spool && !kafka_spool_empty(topic->service->specific.producer.spool)) {
+		/* Keep delivery order, replayed after previously spooled messages */
+		return produce_spool_append(topic, key, key_size, headers, payload, payload_size, msgflags);
+	}
+
+	if(shared) {
+		/* Message reference to the payload until processed */
+		ao2_ref(shared, +1);
+	}
+
+	while(RD_KAFKA_RESP_ERR__QUEUE_FULL == (response = producev_message(topic, partition, key, key_size, payload, payload_size, msgflags, shared, headers))) {
+		ast_atomic_fetchadd_int(&topic->service->specific.producer.queue_full_count, +1);
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_QUEUE_FULL, 1);
+
+		if(!retried) {
+			/* Full queue detected first time for this message */
+			start = ast_tvnow();
+		}
+
+		if(!producer_queue_full_wait(topic->service, start)) {
+			break;
+		}
+
+		retried = 1;
+	}
+	
+	if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
+		if(retried) {
+			ast_atomic_fetchadd_int(&topic->service->specific.producer.retried_count, +1);
+		}
+
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_PRODUCED_MESSAGES, 1);
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_PRODUCED_BYTES, payload_size);
+
+		return 0;
+	}
+
+	if(shared) {
+		/* Message not enqueued and never processed */
+		ao2_ref(shared, -1);
+	}
+
+	if(RD_KAFKA_RESP_ERR__QUEUE_FULL == response) {
+		int dropped_count;
+
+		if((KAFKA_QUEUE_FULL_SPILL == topic->service->specific.producer.queue_full_policy)
+			&& (0 == produce_spool_append(topic, key, key_size, headers, payload, payload_size, msgflags))) {
+			/* Message replayed from the spool when queue drained */
+			return 0;
+		}
+
+		dropped_count = ast_atomic_fetchadd_int(&topic->service->specific.producer.dropped_count, +1);
+		kafka_stats_topic_add(topic, KAFKA_COUNTER_DROPPED, 1);
+
+		/* Don't flood the log while broker unavailable */
+		if(0 == (dropped_count % KAFKA_QUEUE_FULL_LOG_INTERVAL)) {
+			ast_log(LOG_WARNING, "Produce message on pipe '%s' topic '%s' failed: %s, total dropped %d\n",
+				pipe->id, topic->id, rd_kafka_err2str(response), dropped_count + 1);
+		}
+
+		return -1;
+	}
+
+	ast_log(LOG_WARNING, "Produce message on pipe '%s' failed: %s\n", 
+		pipe->id, rd_kafka_err2str(response));
+
+	return -1;
+}
+
+/*! Message key by topic's key policy, NULL if message sent w/o key */
+static const char *topic_message_key(const struct kafka_topic *topic, const char *suggested_key, size_t suggested_key_size, size_t *key_size) {
+	if(topic->forced_key) {
+		/* Static key, size known on topic creation */
+		*key_size = topic->forced_key_size;
+		return topic->forced_key;
+	}
+
+	if(topic->force_null_key || (NULL == suggested_key)) {
+		*key_size = 0;
+		return NULL;
+	}
+
+	*key_size = suggested_key_size ? suggested_key_size : strlen(suggested_key);
+
+	return suggested_key;
+}
+
+/*! Copy message to the producer's spool, payload owned by librdkafka (RD_KAFKA_MSG_F_FREE) released on success */
+static int produce_spool_append(struct kafka_topic *topic, const char *key, size_t key_size, rd_kafka_headers_t *headers, void *payload, size_t payload_size, int msgflags) {
+	if(kafka_spool_append(topic->service->specific.producer.spool, topic->id, key, key_size, headers, payload, payload_size)) {
+		/* Ownership not moved on failure */
+		return -1;
+	}
+
+	if(msgflags & RD_KAFKA_MSG_F_FREE) {
+		/* Caller moved ownership, librdkafka never see this payload */
+		ast_std_free(payload);
+	}
+
+	return 0;
+}
+
+/*! Message partition: producer's, caller's or RD_KAFKA_PARTITION_UA for the topic partitioner */
+static int32_t topic_message_partition(const struct kafka_topic *topic, const struct message_options *options) {
+	const struct message_partition *selected = options ? options->partition : NULL;
+	int32_t count;
+
+	if((RD_KAFKA_PARTITION_UA != topic->partition) || (NULL == selected)) {
+		/* Static producer's partition has priority */
+		return topic->partition;
+	}
+
+	if(RD_KAFKA_PARTITION_UA != selected->partition) {
+		return selected->partition;
+	}
+
+	if(topic->partitioner_key_hash && (0 < (count = __atomic_load_n(&topic->partitioner_count, __ATOMIC_RELAXED)))) {
+		/* Same partition as the partitioner select by the key */
+		return selected->key_hash % count;
+	}
+
+	/* Partitions count unknown yet */
+	return RD_KAFKA_PARTITION_UA;
+}
+
+/*! Producer topic partitioner, called by librdkafka for unassigned partition messages */
+static int32_t kafka_topic_partitioner(const rd_kafka_topic_t *rkt, const void *keydata, size_t keylen, int32_t partition_cnt, void *rkt_opaque, void *msg_opaque) {
+	struct kafka_topic *topic = rkt_opaque;
+
+	/* Partitions count for key hash sends */
+	__atomic_store_n(&topic->partitioner_count, partition_cnt, __ATOMIC_RELAXED);
+
+	if((NULL == keydata) && topic->sticky_linger_ms) {
+		return kafka_topic_sticky_partition(topic, rkt, partition_cnt);
+	}
+
+	return topic->partitioner(rkt, keydata, keylen, partition_cnt, rkt_opaque, msg_opaque);
+}
+
+/*! Partition of null key messages, kept for sticky_linger_ms to fill larger batches */
+static int32_t kafka_topic_sticky_partition(struct kafka_topic *topic, const rd_kafka_topic_t *rkt, int32_t partition_cnt) {
+	int32_t partition = __atomic_load_n(&topic->sticky_partition, __ATOMIC_RELAXED);
+	int64_t now = kafka_bench_now_us();
+
+	if((partition < 0) || (partition >= partition_cnt) || (now >= __atomic_load_n(&topic->sticky_until_us, __ATOMIC_RELAXED))
+		|| !rd_kafka_topic_partition_available(rkt, partition)) {
+		/* Concurrent producers may select twice, last one wins */
+		partition = rd_kafka_msg_partitioner_random(rkt, NULL, 0, partition_cnt, NULL, NULL);
+
+		__atomic_store_n(&topic->sticky_partition, partition, __ATOMIC_RELAXED);
+		__atomic_store_n(&topic->sticky_until_us, now + (int64_t)topic->sticky_linger_ms * 1000, __ATOMIC_RELAXED);
+	}
+
+	return partition;
+}
+
+/*! Module API: Kafka (murmur2) hash of the message key */
+uint32_t ast_kafka_key_hash(const char *key, size_t key_size) {
+	const unsigned char *data = (const unsigned char *)key;
+	const uint32_t m = 0x5bd1e995;
+	uint32_t h = 0x9747b28c ^ (uint32_t)key_size;
+	size_t i;
+
+	for(i = 0;i + 4 <= key_size;i += 4) {
+		uint32_t k = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | ((uint32_t)data[i + 3] << 24);
+
+		k *= m;
+		k ^= k >> 24;
+		k *= m;
+		h *= m;
+		h ^= k;
+	}
+
+	switch(key_size & 3) {
+	case 3:
+		h ^= data[i + 2] << 16;
+		/* Fall through */
+	case 2:
+		h ^= data[i + 1] << 8;
+		/* Fall through */
+	case 1:
+		h ^= data[i];
+		h *= m;
+	}
+
+	h ^= h >> 13;
+	h *= m;
+	h ^= h >> 15;
+
+	/* Positive as the Java client and librdkafka murmur2 partitioner */
+	return h & 0x7fffffff;
+}
+
+/*! Enqueue message to the librdkafka producer, headers copied */
+static rd_kafka_resp_err_t producev_message(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, struct kafka_shared_payload *shared, rd_kafka_headers_t *headers) {
+	int64_t stage = kafka_stage_start(AST_KAFKA_STAGE_PRODUCEV);
+	rd_kafka_resp_err_t response;
+
+	/* Message keep the topic until delivery report */
+	ao2_ref(topic, +1);
+
+	/* Key and headers mode resolved by new_kafka_producer_topic() */
+	response = (key_size ? topic->producev_keyed : topic->producev_unkeyed)(topic, partition, key, key_size, payload, payload_size, msgflags, shared, headers);
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
+		ao2_ref(topic, -1);
+	}
+
+	kafka_stage_stop(AST_KAFKA_STAGE_PRODUCEV, stage);
+
+	return response;
+}
+
+/*! Enqueue message w/o key and headers */
+static rd_kafka_resp_err_t producev_plain(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers) {
+	return rd_kafka_producev(topic->service->rd_kafka,
+					RD_KAFKA_V_RKT(topic->rd_kafka_topic),
+					RD_KAFKA_V_PARTITION(partition),
+					RD_KAFKA_V_MSGFLAGS(msgflags),
+					RD_KAFKA_V_VALUE(payload, payload_size),
+					RD_KAFKA_V_OPAQUE(opaque),
+					RD_KAFKA_V_END);
+}
+
+/*! Enqueue message w/o key but with headers */
+static rd_kafka_resp_err_t producev_headers(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers) {
+	rd_kafka_headers_t *copy;
+	rd_kafka_resp_err_t response;
+
+	if(NULL == headers) {
+		/* Headers not available for this message */
+		return producev_plain(topic, partition, key, key_size, payload, payload_size, msgflags, opaque, headers);
+	}
+
+	/* Headers owned by librdkafka on success */
+	copy = rd_kafka_headers_copy(headers);
+
+	response = rd_kafka_producev(topic->service->rd_kafka,
+					RD_KAFKA_V_RKT(topic->rd_kafka_topic),
+					RD_KAFKA_V_PARTITION(partition),
+					RD_KAFKA_V_MSGFLAGS(msgflags),
+					RD_KAFKA_V_VALUE(payload, payload_size),
+					RD_KAFKA_V_OPAQUE(opaque),
+					RD_KAFKA_V_HEADERS(copy),
+					RD_KAFKA_V_END);
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
+		rd_kafka_headers_destroy(copy);
+	}
+
+	return response;
+}
+
+/*! Enqueue message with key and w/o headers */
+static rd_kafka_resp_err_t producev_key(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers) {
+	return rd_kafka_producev(topic->service->rd_kafka,
+					RD_KAFKA_V_RKT(topic->rd_kafka_topic),
+					RD_KAFKA_V_PARTITION(partition),
+					RD_KAFKA_V_MSGFLAGS(msgflags),
+					RD_KAFKA_V_VALUE(payload, payload_size),
+					RD_KAFKA_V_OPAQUE(opaque),
+					RD_KAFKA_V_KEY(key, key_size),
+					RD_KAFKA_V_END);
+}
+
+/*! Enqueue message with key and headers */
+static rd_kafka_resp_err_t producev_key_headers(struct kafka_topic *topic, int32_t partition, const char *key, size_t key_size, void *payload, size_t payload_size, int msgflags, void *opaque, rd_kafka_headers_t *headers) {
+	rd_kafka_headers_t *copy;
+	rd_kafka_resp_err_t response;
+
+	if(NULL == headers) {
+		/* Headers not available for this message */
+		return producev_key(topic, partition, key, key_size, payload, payload_size, msgflags, opaque, headers);
+	}
+
+	/* Headers owned by librdkafka on success */
+	copy = rd_kafka_headers_copy(headers);
+
+	response = rd_kafka_producev(topic->service->rd_kafka,
+					RD_KAFKA_V_RKT(topic->rd_kafka_topic),
+					RD_KAFKA_V_PARTITION(partition),
+					RD_KAFKA_V_MSGFLAGS(msgflags),
+					RD_KAFKA_V_VALUE(payload, payload_size),
+					RD_KAFKA_V_OPAQUE(opaque),
+					RD_KAFKA_V_KEY(key, key_size),
+					RD_KAFKA_V_HEADERS(copy),
+					RD_KAFKA_V_END);
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
+		rd_kafka_headers_destroy(copy);
+	}
+
+	return response;
+}
+
+/*! Wait for free space in the producer queue, return non-zero if produce can be retried */
+static int producer_queue_full_wait(struct kafka_service *producer, struct timeval start) {
+	if(KAFKA_QUEUE_FULL_BLOCK != producer->specific.producer.queue_full_policy) {
+		/* Drop message immediately */
+		return 0;
+	}
+
+	if(ast_tvdiff_ms(ast_tvnow(), start) >= (int64_t)producer->specific.producer.queue_full_timeout_ms) {
+		/* Publisher never blocked longer than timeout */
+		return 0;
+	}
+
+	/* Served delivery reports release queue space */
+	rd_kafka_poll(producer->rd_kafka, KAFKA_QUEUE_FULL_POLL_MS);
+
+	return 1;
+}
+
+/*! Open or create spool file, recover records left from previous run */
+static struct kafka_spool *kafka_spool_open(const char *path, size_t size, enum kafka_spool_sync sync) {
+	struct kafka_spool *spool;
+	struct stat st;
+	char *dir;
+	char *slash;
+
+	if(size < KAFKA_SPOOL_DATA_OFFSET * 2) {
+		ast_log(LOG_ERROR, "Spool '%s': size %zu too small\n", path, size);
+		return NULL;
+	}
+
+	if(NULL == (spool = ast_calloc(1, sizeof(*spool) + strlen(path) + 1))) {
+		return NULL;
+	}
+
+	strcpy(spool->path, path);
+	ast_mutex_init(&spool->lock);
+	spool->fd = -1;
+	spool->map = MAP_FAILED;
+	spool->sync = sync;
+	spool->synced = ast_tvnow();
+	spool->hold = ast_tv(0, 0);
+
+	/* Create spool directory if not exist */
+	dir = ast_strdupa(path);
+
+	if(NULL != (slash = strrchr(dir, '/'))) {
+		*slash = '\0';
+
+		if(*dir && ast_mkdir(dir, 0755)) {
+			ast_log(LOG_ERROR, "Spool '%s': unable to create directory: %s\n", path, strerror(errno));
+			kafka_spool_close(spool);
+			return NULL;
+		}
+	}
+
+	if((spool->fd = open(path, O_RDWR | O_CREAT, 0640)) < 0) {
+		ast_log(LOG_ERROR, "Spool '%s': unable to open: %s\n", path, strerror(errno));
+		kafka_spool_close(spool);
+		return NULL;
+	}
+
+	if(fstat(spool->fd, &st)) {
+		ast_log(LOG_ERROR, "Spool '%s': unable to stat: %s\n", path, strerror(errno));
+		kafka_spool_close(spool);
+		return NULL;
+	}
+
+	if(st.st_size >= KAFKA_SPOOL_DATA_OFFSET * 2) {
+		/* Existing spool keep its size, records may be present */
+		if((size_t)st.st_size != size) {
+			ast_log(LOG_NOTICE, "Spool '%s': keep existing size %zu instead of %zu\n", path, (size_t)st.st_size, size);
+		}
+
+		size = st.st_size;
+	} else if(ftruncate(spool->fd, size)) {
+		ast_log(LOG_ERROR, "Spool '%s': unable to allocate %zu bytes: %s\n", path, size, strerror(errno));
+		kafka_spool_close(spool);
+		return NULL;
+	}
+
+	if(MAP_FAILED == (spool->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0))) {
+		ast_log(LOG_ERROR, "Spool '%s': unable to map: %s\n", path, strerror(errno));
+		kafka_spool_close(spool);
+		return NULL;
+	}
+
+	spool->size = size;
+
+	if(kafka_spool_recover(spool)) {
+		ast_log(LOG_NOTICE, "Spool '%s': %d messages left from previous run will be replayed\n", path, spool->pending);
+		spool->spooled_count = 0;
+	}
+
+	return spool;
+}
+
+/*! Sync and close spool */
+static void kafka_spool_close(struct kafka_spool *spool) {
+	if(NULL == spool) {
+		return;
+	}
+
+	if(MAP_FAILED != spool->map) {
+		msync(spool->map, spool->size, MS_SYNC);
+		munmap(spool->map, spool->size);
+	}
+
+	if(spool->fd >= 0) {
+		close(spool->fd);
+	}
+
+	ast_mutex_destroy(&spool->lock);
+	ast_free(spool);
+}
+
+/*! Validate spool header and records, return number of records to replay */
+static int kafka_spool_recover(struct kafka_spool *spool) {
+	struct kafka_spool_header *header = (struct kafka_spool_header *)spool->map;
+	uint64_t offset;
+	uint64_t end;
+	int count = 0;
+
+	if((KAFKA_SPOOL_MAGIC != header->magic) || (KAFKA_SPOOL_VERSION != header->version) || (spool->size != header->size)
+		|| (header->head < KAFKA_SPOOL_DATA_OFFSET) || (header->tail < KAFKA_SPOOL_DATA_OFFSET) || (header->tail > spool->size)
+		|| (header->wrap ? ((header->tail >= header->head) || (header->head > header->wrap) || (header->wrap > spool->size))
+			: (header->head > header->tail))) {
+		/* New or damaged spool */
+		if(header->magic) {
+			ast_log(LOG_WARNING, "Spool '%s': invalid header, spool reset\n", spool->path);
+		}
+
+		kafka_spool_reset(spool);
+		return 0;
+	}
+
+	/* Only frames are checked, so recovery not depend on payloads size */
+	offset = header->head;
+	end = header->wrap ? header->wrap : header->tail;
+
+	while(1) {
+		const struct kafka_spool_record *record = (const struct kafka_spool_record *)(spool->map + offset);
+
+		if(offset == end) {
+			if(!header->wrap || (end == header->tail)) {
+				break;
+			}
+
+			/* Continue with records written after wrap */
+			offset = KAFKA_SPOOL_DATA_OFFSET;
+			end = header->tail;
+			continue;
+		}
+
+		if((end - offset < sizeof(*record)) || (KAFKA_SPOOL_RECORD_MAGIC != record->magic)
+			|| (record->size < sizeof(*record)) || (record->size > end - offset)
+			|| (sizeof(*record) + (uint64_t)record->topic_size + record->key_size + record->headers_size + record->payload_size > record->size)) {
+			/* Torn write on crash, drop records after */
+			ast_log(LOG_WARNING, "Spool '%s': damaged record at %lu, records after dropped\n", spool->path, (unsigned long)offset);
+
+			if(header->wrap && (end == header->wrap)) {
+				/* Records after wrap follow the damaged one */
+				header->wrap = 0;
+			}
+
+			header->tail = offset;
+			break;
+		}
+
+		offset += record->size;
+		count++;
+	}
+
+	if(!count) {
+		kafka_spool_reset(spool);
+	}
+
+	spool->spooled_count = count;
+	spool->pending = count;
+
+	return count;
+}
+
+/*! Drop all records, spool must be locked or not shared */
+static void kafka_spool_reset(struct kafka_spool *spool) {
+	struct kafka_spool_header *header = (struct kafka_spool_header *)spool->map;
+
+	header->magic = KAFKA_SPOOL_MAGIC;
+	header->version = KAFKA_SPOOL_VERSION;
+	header->size = spool->size;
+	header->head = KAFKA_SPOOL_DATA_OFFSET;
+	header->tail = KAFKA_SPOOL_DATA_OFFSET;
+	header->wrap = 0;
+
+	__atomic_store_n(&spool->pending, 0, __ATOMIC_RELEASE);
+}
+
+/*! Check spool have no records to replay, without lock on produce path */
+static int kafka_spool_empty(struct kafka_spool *spool) {
+	return 0 == __atomic_load_n(&spool->pending, __ATOMIC_ACQUIRE);
+}
+
+/*! Append message to the spool, return 0 on success */
+static int kafka_spool_append(struct kafka_spool *spool, const char *topic_name, const void *key, size_t key_size, const rd_kafka_headers_t *headers, const void *payload, size_t payload_size) {
+	struct kafka_spool_header *header;
+	struct kafka_spool_record *record;
+	size_t topic_size = strlen(topic_name);
+	size_t headers_size = kafka_spool_headers_size(headers);
+	size_t size = sizeof(*record) + topic_size + key_size + headers_size + payload_size;
+	uint64_t offset;
+	int wrap = 0;
+	unsigned char *data;
+
+	if(NULL == spool) {
+		return -1;
+	}
+
+	size = (size + KAFKA_SPOOL_ALIGN - 1) & ~((size_t)KAFKA_SPOOL_ALIGN - 1);
+
+	header = (struct kafka_spool_header *)spool->map;
+
+	ast_mutex_lock(&spool->lock);
+
+	offset = header->tail;
+
+	if(!header->wrap && (offset + size > spool->size) && (header->head > KAFKA_SPOOL_DATA_OFFSET)) {
+		/* No room before the file end, continue from the data start if replay freed it */
+		offset = KAFKA_SPOOL_DATA_OFFSET;
+		wrap = 1;
+	}
+
+	/* Wrapped tail must stay below head, tail == head mean empty spool */
+	if((size > UINT32_MAX) || ((header->wrap || wrap) ? (offset + size >= header->head) : (offset + size > spool->size))) {
+		int overflow_count;
+
+		ast_mutex_unlock(&spool->lock);
+
+		/* Don't flood the log while spool is full */
+		if(0 == ((overflow_count = ast_atomic_fetchadd_int(&spool->overflow_count, +1)) % KAFKA_QUEUE_FULL_LOG_INTERVAL)) {
+			ast_log(LOG_WARNING, "Spool '%s' is full, total dropped %d messages\n", spool->path, overflow_count + 1);
+		}
+
+		return -1;
+	}
+
+	record = (struct kafka_spool_record *)(spool->map + offset);
+
+	record->magic = KAFKA_SPOOL_RECORD_MAGIC;
+	record->size = size;
+	record->topic_size = topic_size;
+	record->key_size = key_size;
+	record->headers_size = headers_size;
+	record->payload_size = payload_size;
+
+	data = record->data;
+	memcpy(data, topic_name, topic_size);
+	data += topic_size;
+
+	if(key_size) {
+		memcpy(data, key, key_size);
+		data += key_size;
+	}
+
+	if(headers_size) {
+		kafka_spool_headers_write(headers, data);
+		data += headers_size;
+	}
+
+	memcpy(data, payload, payload_size);
+
+	if(KAFKA_SPOOL_SYNC_ALWAYS == spool->sync) {
+		/* Record must reach the disk before the header refer it */
+		uintptr_t start = (uintptr_t)record & ~((uintptr_t)KAFKA_SPOOL_DATA_OFFSET - 1);
+
+		msync((void *)start, (uintptr_t)record + size - start, MS_SYNC);
+	}
+
+	/* Record become visible for recovery */
+	if(wrap) {
+		header->wrap = header->tail;
+	}
+
+	header->tail = offset + size;
+
+	if(KAFKA_SPOOL_SYNC_ALWAYS == spool->sync) {
+		msync(spool->map, KAFKA_SPOOL_DATA_OFFSET, MS_SYNC);
+	} else {
+		spool->dirty = 1;
+	}
+
+	/* Counted under lock, so replay never see pending records missing */
+	ast_atomic_fetchadd_int(&spool->pending, +1);
+
+	ast_mutex_unlock(&spool->lock);
+
+	ast_atomic_fetchadd_int(&spool->spooled_count, +1);
+
+	return 0;
+}
+
+/*! Replay spooled records in order, called by producer poller */
+static int kafka_spool_replay(struct kafka_service *producer, int budget) {
+	struct kafka_spool *spool = producer->specific.producer.spool;
+	struct kafka_spool_header *header = (struct kafka_spool_header *)spool->map;
+	int replayed = 0;
+	int consumed = 0;
+
+	ast_mutex_lock(&spool->lock);
+
+	if(ast_tvcmp(ast_tvnow(), spool->hold) < 0) {
+		/* Broker still unavailable */
+		ast_mutex_unlock(&spool->lock);
+		return 0;
+	}
+
+	while((replayed < budget) && (header->head != header->tail) && (rd_kafka_outq_len(producer->rd_kafka) < KAFKA_SPOOL_REPLAY_OUTQ_MAX)) {
+		const struct kafka_spool_record *record = (const struct kafka_spool_record *)(spool->map + header->head);
+		const unsigned char *data = record->data;
+		const char *key = (const char *)(data + record->topic_size);
+		RAII_VAR(struct kafka_topic *, topic, NULL, ao2_cleanup);
+		rd_kafka_headers_t *headers;
+		char *topic_name;
+		rd_kafka_resp_err_t response;
+
+		topic_name = ast_alloca(record->topic_size + 1);
+		memcpy(topic_name, data, record->topic_size);
+		topic_name[record->topic_size] = '\0';
+
+		if(NULL == (topic = ao2_find(producer->topics, topic_name, OBJ_SEARCH_KEY))) {
+			/* Topic removed from configuration */
+			ast_log(LOG_WARNING, "Spool '%s': topic '%s' not served by producer, message dropped\n", spool->path, topic_name);
+		} else {
+			headers = kafka_spool_headers_read(data + record->topic_size + record->key_size, record->headers_size);
+
+			/* Payload copied because spool space reused once replayed */
+			/* Caller's partition not spooled, replayed by the topic partitioner */
+			response = producev_message(topic, topic->partition, record->key_size ? key : NULL, record->key_size,
+							(void *)(data + record->topic_size + record->key_size + record->headers_size), record->payload_size,
+							RD_KAFKA_MSG_F_COPY, NULL, headers);
+
+			if(headers) {
+				rd_kafka_headers_destroy(headers);
+			}
+
+			if(RD_KAFKA_RESP_ERR__QUEUE_FULL == response) {
+				/* Retry on next poll */
+				break;
+			}
+
+			if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
+				ast_log(LOG_WARNING, "Spool '%s': replay to topic '%s' failed: %s, message dropped\n",
+					spool->path, topic_name, rd_kafka_err2str(response));
+			} else {
+				replayed++;
+			}
+		}
+
+		header->head += record->size;
+		spool->dirty = 1;
+		consumed++;
+
+		if(header->wrap && (header->head == header->wrap)) {
+			/* Records before the file end replayed, follow the tail */
+			header->head = KAFKA_SPOOL_DATA_OFFSET;
+			header->wrap = 0;
+		}
+	}
+
+	if(header->head == header->tail) {
+		/* Drained, reuse spool space */
+		kafka_spool_reset(spool);
+	} else if(consumed) {
+		ast_atomic_fetchadd_int(&spool->pending, -consumed);
+	}
+
+	ast_mutex_unlock(&spool->lock);
+
+	ast_atomic_fetchadd_int(&spool->replayed_count, replayed);
+
+	return replayed;
+}
+
+/*! Flush spool changes to the disk according sync policy */
+static void kafka_spool_sync(struct kafka_spool *spool, int force) {
+	struct timeval now = ast_tvnow();
+	int dirty;
+
+	if(!force && ((KAFKA_SPOOL_SYNC_PERIODIC != spool->sync) || (ast_tvdiff_ms(now, spool->synced) < KAFKA_SPOOL_SYNC_INTERVAL_MS))) {
+		return;
+	}
+
+	ast_mutex_lock(&spool->lock);
+	dirty = spool->dirty;
+	spool->dirty = 0;
+	spool->synced = now;
+	ast_mutex_unlock(&spool->lock);
+
+	if(dirty) {
+		/* Mapping never changed while spool open, sync without lock */
+		msync(spool->map, spool->size, MS_SYNC);
+	}
+}
+
+/*! Size of the serialized headers: for each header 16-bit name size, 32-bit value size, name and value */
+static size_t kafka_spool_headers_size(const rd_kafka_headers_t *headers) {
+	const char *name;
+	const void *value;
+	size_t value_size;
+	size_t size = 0;
+	size_t i;
+
+	for(i = 0;headers && (RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_header_get_all(headers, i, &name, &value, &value_size));i++) {
+		size += sizeof(uint16_t) + sizeof(uint32_t) + strlen(name) + value_size;
+	}
+
+	return size;
+}
+
+/*! Serialize headers to the buffer of kafka_spool_headers_size() bytes */
+static void kafka_spool_headers_write(const rd_kafka_headers_t *headers, unsigned char *buffer) {
+	const char *name;
+	const void *value;
+	size_t value_size;
+	size_t i;
+
+	for(i = 0;RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_header_get_all(headers, i, &name, &value, &value_size);i++) {
+		uint16_t name_size = strlen(name);
+		uint32_t size = value_size;
+
+		memcpy(buffer, &name_size, sizeof(name_size));
+		buffer += sizeof(name_size);
+		memcpy(buffer, &size, sizeof(size));
+		buffer += sizeof(size);
+		memcpy(buffer, name, name_size);
+		buffer += name_size;
+
+		if(value_size) {
+			memcpy(buffer, value, value_size);
+			buffer += value_size;
+		}
+	}
+}
+
+/*! Build headers from the serialized buffer, NULL if no headers */
+static rd_kafka_headers_t *kafka_spool_headers_read(const unsigned char *buffer, size_t size) {
+	rd_kafka_headers_t *headers;
+	const unsigned char *end = buffer + size;
+
+	if((0 == size) || (NULL == (headers = rd_kafka_headers_new(2)))) {
+		return NULL;
+	}
+
+	while(end - buffer >= (ssize_t)(sizeof(uint16_t) + sizeof(uint32_t))) {
+		uint16_t name_size;
+		uint32_t value_size;
+
+		memcpy(&name_size, buffer, sizeof(name_size));
+		buffer += sizeof(name_size);
+		memcpy(&value_size, buffer, sizeof(value_size));
+		buffer += sizeof(value_size);
+
+		if(end - buffer < (ssize_t)name_size + value_size) {
+			/* Damaged headers */
+			break;
+		}
+
+		rd_kafka_header_add(headers, (const char *)buffer, name_size, value_size ? buffer + name_size : NULL, value_size);
+		buffer += name_size + value_size;
+	}
+
+	return headers;
+}
+
+/*! Delivery error can be resolved by later replay */
+static int kafka_spool_retriable(rd_kafka_resp_err_t err) {
+	switch(err) {
+	case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+	case RD_KAFKA_RESP_ERR__TIMED_OUT:
+	case RD_KAFKA_RESP_ERR__TRANSPORT:
+	case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+	case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+	/* Purged after flush timeout */
+	case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+	case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*! Module API: Get existing pipe or create new if not present */
+struct ast_kafka_pipe *ast_kafka_get_pipe(const char *pipe_id, int force) {
+	struct ast_kafka_pipe *pipe;
+
+	/* Pipes never removed while module loaded, lookup under container read lock */
+	if((NULL != (pipe = ao2_find(pipes, pipe_id, OBJ_SEARCH_KEY))) || !force) {
+		return pipe;
+	}
+
+	ao2_lock(pipes);
+
+	/* Pipe may be created by other thread */
+	if(NULL == (pipe = ao2_find(pipes, pipe_id, OBJ_SEARCH_KEY|OBJ_NOLOCK))) {
+		/* Pipe with requested id not found */
+		if(NULL != (pipe = kafka_pipe_alloc(pipe_id))) {
+			/* Add new pipe to the container */
+			ao2_link_flags(pipes, pipe, OBJ_NOLOCK);
+
+			ast_debug(3, "New Kafka pipe %s (%p) added to the container\n", pipe->id, pipe);
+		}
+	}
+
+	ao2_unlock(pipes);
+
+	return pipe;
+}
+
+struct stasis_topic *ast_kafka_get_stasis_topic(struct ast_kafka_pipe *pipe) {
+	return pipe->stasis_topic;
+}
+
+unsigned int ast_kafka_get_stasis_lane_count(struct ast_kafka_pipe *pipe) {
+	return pipe->lanes ? pipe->lanes->count : 0;
+}
+
+struct stasis_topic *ast_kafka_get_stasis_lane_topic(struct ast_kafka_pipe *pipe, unsigned int lane) {
+	if((NULL == pipe->lanes) || (lane >= pipe->lanes->count)) {
+		return NULL;
+	}
+
+	return pipe->lanes->topics[lane];
+}
+
+/*! Consumer seek request */
+struct kafka_seek_options {
+	/*! Kafka topic name or NULL for all topics */
+	const char *topic;
+	/*! Partition or RD_KAFKA_PARTITION_UA for all consumed partitions */
+	int32_t partition;
+	/*! Offset of the next message to consume */
+	int64_t offset;
+};
+
+/*! Module API: Seek pipe's consumer topic partition */
+int ast_kafka_pipe_seek(struct ast_kafka_pipe *pipe, const char *topic, int32_t partition, int64_t offset) {
+	int seeked = 0;
+	struct kafka_seek_options options = {
+		.topic = topic,
+		.partition = partition,
+		.offset = offset,
+	};
+
+	on_all_consumer_topics(pipe, kafka_consumer_topic_seek_cb, &seeked, NULL, &options);
+
+	return seeked ? 0 : -1;
+}
+
+int ast_kafka_pipe_rewind(struct ast_kafka_pipe *pipe) {
+	int seeked = 0;
+	struct kafka_seek_options options = {
+		.topic = NULL,
+		.partition = RD_KAFKA_PARTITION_UA,
+		.offset = RD_KAFKA_OFFSET_BEGINNING,
+	};
+
+	on_all_consumer_topics(pipe, kafka_consumer_topic_seek_cb, &seeked, NULL, &options);
+
+	return seeked ? 0 : -1;
+}
+
+/*! Seek low-level consumer topic if it consume requested partition */
+static int kafka_consumer_topic_seek_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	const struct kafka_seek_options *seek = options;
+	int *seeked = opaque_1;
+	rd_kafka_resp_err_t response;
+	size_t i;
+
+	if((NULL == topic->rd_kafka_topic) || (NULL == topic->service) || (seek->topic && strcmp(topic->id, seek->topic))) {
+		/* High-level consumer partitions are assigned by the group */
+		return 0;
+	}
+
+	for(i = 0;i < topic->partition_count;i++) {
+		int32_t partition = topic->partitions[i].partition;
+
+		if((RD_KAFKA_PARTITION_UA != seek->partition) && (partition != seek->partition)) {
+			/* Partition not requested */
+			continue;
+		}
+
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != (response = rd_kafka_seek(topic->rd_kafka_topic, partition, seek->offset, topic->service->timeout_ms))) {
+			ast_log(LOG_WARNING, "Pipe '%s': unable to seek topic '%s' partition %d to offset %ld: %s\n",
+					pipe->id, topic->id, (int)partition, (long)seek->offset, rd_kafka_err2str(response));
+			continue;
+		}
+
+		ast_debug(1, "Pipe '%s': topic '%s' partition %d seeked to offset %ld\n", pipe->id, topic->id, (int)partition, (long)seek->offset);
+
+		(*seeked)++;
+	}
+
+	return 0;
+}
+
+const void *ast_kafka_consumer_message_payload(const struct ast_kafka_consumer_message *message, size_t *size) {
+	if(size) {
+		*size = message->rkm->len;
+	}
+
+	return message->rkm->payload;
+}
+
+const void *ast_kafka_consumer_message_key(const struct ast_kafka_consumer_message *message, size_t *size) {
+	if(size) {
+		*size = message->rkm->key_len;
+	}
+
+	return message->rkm->key;
+}
+
+int ast_kafka_consumer_message_header(const struct ast_kafka_consumer_message *message, const char *name, const void **value, size_t *size) {
+	rd_kafka_headers_t *headers;
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != rd_kafka_message_headers(message->rkm, &headers)) {
+		return -1;
+	}
+
+	return (RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_header_get_last(headers, name, value, size)) ? 0 : -1;
+}
+
+struct ast_json *ast_kafka_consumer_message_json(const struct ast_kafka_consumer_message *message) {
+	/* Decoded payload cached on first access, message is shared by subscribers */
+	struct ast_json **cached = &((struct ast_kafka_consumer_message *)message)->json;
+	struct ast_json *json = __atomic_load_n(cached, __ATOMIC_ACQUIRE);
+	struct ast_json *expected = NULL;
+
+	if(json) {
+		return ast_json_ref(json);
+	}
+
+	if(NULL == (json = kafka_decode_message(message->rkm))) {
+		return NULL;
+	}
+
+	if(!__atomic_compare_exchange_n(cached, &expected, json, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Decoded by other subscriber */
+		ast_json_unref(json);
+		json = expected;
+	}
+
+	return ast_json_ref(json);
+}
+
+const char *ast_kafka_consumer_message_topic(const struct ast_kafka_consumer_message *message) {
+	return rd_kafka_topic_name(message->rkm->rkt);
+}
+
+int32_t ast_kafka_consumer_message_partition(const struct ast_kafka_consumer_message *message) {
+	return message->rkm->partition;
+}
+
+int64_t ast_kafka_consumer_message_offset(const struct ast_kafka_consumer_message *message) {
+	return message->rkm->offset;
+}
+
+size_t ast_kafka_consumer_batch_count(const struct ast_kafka_consumer_batch *batch) {
+	return batch->count;
+}
+
+const struct ast_kafka_consumer_message *ast_kafka_consumer_batch_message(const struct ast_kafka_consumer_batch *batch, size_t index) {
+	return (index < batch->count) ? &batch->buffer->messages[index] : NULL;
+}
+
+/*! Cli loppback command */
+static char *handle_kafka_loopback(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+	static const char *option[] = {
+		"pipe",
+		NULL,
+	};
+	static const char *pipe_option[] = {
+		"start",
+		"stop",
+		NULL,
+	};
+	RAII_VAR(struct ast_kafka_pipe *, pipe, NULL, ao2_cleanup);
+	RAII_VAR(struct kafka_probe *, probe, NULL, ao2_cleanup);
+	unsigned int interval_ms = KAFKA_PROBE_INTERVAL_MS;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "kafka loopback";
+		e->usage =
+			"Usage: kafka loopback pipe <pipe_id> start [interval <ms>]|stop\n"
+			"       Start or stop continuous loopback probe on the pipe with producer\n"
+			"       and consumer topics. Probe message sent each <ms> (default 1000).\n"
+			"       Round trip latency, loss and reordering shown by\n"
+			"       \"kafka show pipe <pipe_id> latency\"\n";
+		return NULL;
+	case CLI_GENERATE:
+		switch(a->pos) {
+		case 2:
+			/* "kafka loopback" */
+			return ast_cli_complete(a->word, option, a->n);
+		case 3:
+			/* "kafka loopback some"*/
+			if(0 == strcasecmp(a->argv[2], option[0])) {
+				/* "kafka loopback pipe"*/
+				return complete_pipe_choice(a->word);
+			}
+			return NULL;
+		case 4:
+			if(0 == strcasecmp(a->argv[2], option[0])) {
+				/* "kafka loopback pipe <pipe_id>"*/
+				return ast_cli_complete(a->word, pipe_option, a->n);
+			}
+			return NULL;
+		default:
+			/* No completion choices */
+			return NULL;
+		}
+	default:
+		break;
+	}
+
+	if(((5 != a->argc) && (7 != a->argc)) || strcasecmp(a->argv[2], option[0])) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if(7 == a->argc) {
+		if(strcasecmp(a->argv[4], pipe_option[0]) || strcasecmp(a->argv[5], "interval")
+			|| (1 != sscanf(a->argv[6], "%30u", &interval_ms)) || (0 == interval_ms)) {
+			return CLI_SHOWUSAGE;
+		}
+	}
+
+	if(NULL == (pipe = ast_kafka_get_pipe(a->argv[3], 0))) {
+		ast_cli(a->fd, "Pipe '%s' not found\n", a->argv[3]);
+		return CLI_SUCCESS;
+	}
+
+	if(0 == strcasecmp(a->argv[4], pipe_option[1])) {
+		/* "kafka loopback pipe <pipe_id> stop", results kept until next start */
+		if(NULL == (probe = ao2_find(probes, pipe->id, OBJ_SEARCH_KEY))) {
+			ast_cli(a->fd, "Probe on pipe '%s' not started\n", pipe->id);
+		} else {
+			kafka_probe_stop(probe);
+			ast_cli(a->fd, "Probe on pipe '%s' stopped\n", pipe->id);
+		}
+
+		return CLI_SUCCESS;
+	}
+
+	if(strcasecmp(a->argv[4], pipe_option[0])) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if(AST_LIST_EMPTY(&pipe->producer_topics) || AST_LIST_EMPTY(&pipe->consumer_topics)) {
+		ast_cli(a->fd, "Pipe '%s' must have producer and consumer topics\n", pipe->id);
+		return CLI_SUCCESS;
+	}
+
+	/* Restart replace previous probe and results */
+	ao2_callback(probes, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA, kafka_probe_stop_cb, (void *)pipe->id);
+
+	if(NULL == (probe = kafka_probe_alloc(pipe, interval_ms))) {
+		ast_cli(a->fd, "Unable to create probe on pipe '%s'\n", pipe->id);
+		return CLI_SUCCESS;
+	}
+
+	ao2_link(probes, probe);
+	ast_atomic_fetchadd_int(&probes_running, +1);
+
+	/* Sender thread reference the probe */
+	ao2_ref(probe, +1);
+
+	if(ast_pthread_create_background(&probe->thread, NULL, kafka_probe_sender_job, probe)) {
+		probe->thread = AST_PTHREADT_NULL;
+		ao2_ref(probe, -1);
+		ao2_unlink(probes, probe);
+		ast_atomic_fetchadd_int(&probes_running, -1);
+		ast_cli(a->fd, "Unable to start probe on pipe '%s'\n", pipe->id);
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, "Probe on pipe '%s' started, interval %u ms\n", pipe->id, interval_ms);
+
+	return CLI_SUCCESS;
+}
+
+/*! Create stopped loopback probe */
+static struct kafka_probe *kafka_probe_alloc(struct ast_kafka_pipe *pipe, unsigned int interval_ms) {
+	struct kafka_probe *probe = ao2_alloc_options(sizeof(*probe) + strlen(pipe->id) + 1, kafka_probe_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if(NULL == probe) {
+		return NULL;
+	}
+
+	strcpy(probe->pipe_id, pipe->id);
+	ast_mutex_init(&probe->lock);
+	ast_cond_init(&probe->cond, NULL);
+	probe->thread = AST_PTHREADT_NULL;
+	probe->stop = 0;
+	probe->id = ast_random();
+	probe->interval_ms = interval_ms;
+	probe->pipe = ao2_bump(pipe);
+	probe->started = ast_tvnow();
+	probe->window_started_us = kafka_bench_now_us();
+	probe->window = 0;
+
+	return probe;
+}
+
+/*! Release stopped probe */
+static void kafka_probe_destructor(void *obj) {
+	struct kafka_probe *probe = obj;
+
+	ao2_cleanup(probe->pipe);
+	ast_cond_destroy(&probe->cond);
+	ast_mutex_destroy(&probe->lock);
+}
+
+/*! Stop probe sender thread, received messages still counted until probe unlinked */
+static void kafka_probe_stop(struct kafka_probe *probe) {
+	pthread_t thread;
+
+	ast_mutex_lock(&probe->lock);
+	thread = probe->thread;
+	probe->thread = AST_PTHREADT_NULL;
+	probe->stop = 1;
+	ast_cond_signal(&probe->cond);
+	ast_mutex_unlock(&probe->lock);
+
+	if(AST_PTHREADT_NULL != thread) {
+		pthread_join(thread, NULL);
+		ast_atomic_fetchadd_int(&probes_running, -1);
+	}
+}
+
+/*! Stop probe, used on unlink */
+static int kafka_probe_stop_cb(void *obj, void *arg, int flags) {
+	struct kafka_probe *probe = obj;
+
+	if(arg && (flags & OBJ_SEARCH_KEY) && strcmp(probe->pipe_id, arg)) {
+		return 0;
+	}
+
+	kafka_probe_stop(probe);
+
+	return CMP_MATCH;
+}
+
+/*! Find probe by id */
+static int kafka_probe_match_id_cb(void *obj, void *arg, int flags) {
+	const struct kafka_probe *probe = obj;
+
+	return (probe->id == *(const uint32_t *)arg) ? (CMP_MATCH | CMP_STOP) : 0;
+}
+
+/*! Probe sender thread */
+static void *kafka_probe_sender_job(void *opaque) {
+	struct kafka_probe *probe = opaque;
+	struct kafka_probe_payload payload;
+
+	memset(&payload, 0, sizeof(payload));
+	memcpy(payload.magic, KAFKA_PROBE_MAGIC, sizeof(payload.magic));
+	payload.id = probe->id;
+
+	ast_mutex_lock(&probe->lock);
+
+	while(!probe->stop) {
+		struct timeval tv = ast_tvadd(ast_tvnow(), ast_samp2tv(probe->interval_ms, 1000));
+		struct timespec ts = {
+			.tv_sec = tv.tv_sec,
+			.tv_nsec = tv.tv_usec * 1000,
+		};
+
+		payload.seq = probe->sent++;
+
+		/* Release lock while sending, received message may be processed immediately */
+		ast_mutex_unlock(&probe->lock);
+
+		payload.sent_us = kafka_bench_now_us();
+
+		if(ast_kafka_send_raw_message(probe->pipe, NULL, &payload, sizeof(payload), "LOOPBACK")) {
+			ast_debug(3, "Probe message %lu not sent on pipe '%s'\n", (unsigned long)payload.seq, probe->pipe_id);
+		}
+
+		ast_mutex_lock(&probe->lock);
+
+		while(!probe->stop && (ast_cond_timedwait(&probe->cond, &probe->lock, &ts) != ETIMEDOUT)) {
+			/* Spurious wakeup */
+		}
+	}
+
+	ast_mutex_unlock(&probe->lock);
+
+	ao2_ref(probe, -1);
+
+	return NULL;
+}
+
+/*! Account received probe message, called by consumer path in poller thread */
+static void kafka_probe_received(const rd_kafka_message_t *rkm) {
+	RAII_VAR(struct kafka_probe *, probe, NULL, ao2_cleanup);
+	struct kafka_probe_payload probe_payload;
+	const struct kafka_probe_payload *payload = &probe_payload;
+	int64_t now;
+
+	if((rkm->len != sizeof(probe_payload)) || memcmp(rkm->payload, KAFKA_PROBE_MAGIC, sizeof(probe_payload.magic))) {
+		/* Not a probe message */
+		return;
+	}
+
+	/* Payload may be unaligned */
+	memcpy(&probe_payload, rkm->payload, sizeof(probe_payload));
+
+	if(NULL == (probe = ao2_callback(probes, 0, kafka_probe_match_id_cb, &probe_payload.id))) {
+		/* Message from other node or restarted probe */
+		return;
+	}
+
+	now = kafka_bench_now_us();
+
+	ast_mutex_lock(&probe->lock);
+
+	kafka_probe_rotate(probe, now);
+
+	probe->received++;
+
+	if(payload->seq >= probe->highest) {
+		/* Messages between previous and this one not received yet */
+		probe->lost += payload->seq - probe->highest;
+		probe->highest = payload->seq + 1;
+	} else {
+		/* Late message, was counted as lost */
+		probe->reordered++;
+
+		if(probe->lost) {
+			probe->lost--;
+		}
+	}
+
+	if(now >= payload->sent_us) {
+		kafka_histogram_add(&probe->windows[probe->window], now - payload->sent_us);
+		kafka_histogram_add(&probe->total, now - payload->sent_us);
+	}
+
+	ast_mutex_unlock(&probe->lock);
+}
+
+/*! Start new rolling window if current expired, probe must be locked */
+static void kafka_probe_rotate(struct kafka_probe *probe, int64_t now) {
+	if(now - probe->window_started_us < KAFKA_PROBE_WINDOW_MS * 1000) {
+		return;
+	}
+
+	/* Previous window dropped if no messages for two windows */
+	probe->window ^= 1;
+
+	if(now - probe->window_started_us >= KAFKA_PROBE_WINDOW_MS * 2000) {
+		memset(&probe->windows[probe->window ^ 1], 0, sizeof(probe->windows[0]));
+	}
+
+	memset(&probe->windows[probe->window], 0, sizeof(probe->windows[0]));
+	probe->window_started_us = now;
+}
+
+/*! Print probe results */
+static void kafka_probe_show(int fd, struct kafka_probe *probe) {
+	struct kafka_histogram *rolling = ast_calloc(1, sizeof(*rolling));
+	struct kafka_histogram *total = ast_malloc(sizeof(*total));
+	uint64_t sent, received, lost, reordered;
+	int running;
+
+	if((NULL == rolling) || (NULL == total)) {
+		ast_free(rolling);
+		ast_free(total);
+		return;
+	}
+
+	ast_mutex_lock(&probe->lock);
+	kafka_probe_rotate(probe, kafka_bench_now_us());
+	kafka_histogram_merge(rolling, &probe->windows[0]);
+	kafka_histogram_merge(rolling, &probe->windows[1]);
+	memcpy(total, &probe->total, sizeof(*total));
+	sent = probe->sent;
+	received = probe->received;
+	lost = probe->lost;
+	reordered = probe->reordered;
+	running = (AST_PTHREADT_NULL != probe->thread);
+	ast_mutex_unlock(&probe->lock);
+
+	ast_cli(fd, "Probe on pipe '%s' %s, started %ld s ago, interval %u ms\n",
+		probe->pipe_id, running ? "running" : "stopped",
+		(long)ast_tvdiff_sec(ast_tvnow(), probe->started), probe->interval_ms);
+	ast_cli(fd, "Sent %lu, received %lu, lost %lu, reordered %lu, in flight %lu\n",
+		(unsigned long)sent, (unsigned long)received, (unsigned long)lost, (unsigned long)reordered,
+		(unsigned long)((sent > received + lost) ? sent - received - lost : 0));
+
+	kafka_histogram_show(fd, "last window", rolling);
+	kafka_histogram_show(fd, "total", total);
+
+	ast_free(rolling);
+	ast_free(total);
+}
+
+/*! Print histogram percentiles and non-empty buckets */
+static void kafka_histogram_show(int fd, const char *title, const struct kafka_histogram *histogram) {
+	int count = kafka_histogram_count(histogram);
+	unsigned int i;
+
+	ast_cli(fd, "Round trip us (%s): count %d, p50 %lu, p90 %lu, p99 %lu, p999 %lu, max %lu\n",
+		title, count,
+		(unsigned long)kafka_histogram_percentile(histogram, 0.5),
+		(unsigned long)kafka_histogram_percentile(histogram, 0.9),
+		(unsigned long)kafka_histogram_percentile(histogram, 0.99),
+		(unsigned long)kafka_histogram_percentile(histogram, 0.999),
+		(unsigned long)kafka_histogram_percentile(histogram, 1.0));
+
+	for(i = 0;i < KAFKA_HISTOGRAM_BUCKETS;i++) {
+		if(histogram->counts[i]) {
+			ast_cli(fd, "  <= %10lu us: %d\n", (unsigned long)kafka_histogram_bucket_value(i), histogram->counts[i]);
+		}
+	}
+}
+
+/*! Cli benchmark command */
+static char *handle_kafka_bench(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+	static const char *option[] = {
+		"pipe",
+		NULL,
+	};
+	static const char *pipe_option[] = {
+		"messages",
+		"size",
+		"rate",
+		"threads",
+		"json",
+		NULL,
+	};
+	RAII_VAR(struct ast_kafka_pipe *, pipe, NULL, ao2_cleanup);
+	struct ast_kafka_bench_options options = { .threads = 1 };
+	struct ast_kafka_bench_report report;
+	unsigned int i;
+	int arg;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "kafka bench";
+		e->usage =
+			"Usage: kafka bench pipe <pipe_id> messages <n> size <bytes> rate <msg/s> [threads <t>] [json <0|1>]\n"
+			"       Send <n> messages of <bytes> size to the pipe by <t> threads (default 1)\n"
+			"       with total rate <msg/s> (0 for unlimited) and report throughput,\n"
+			"       enqueue to delivery report latency and average time of the publish stages.\n"
+			"       With json 1 messages are packed and published by ast_kafka_publish()\n";
+		return NULL;
+	case CLI_GENERATE:
+		switch(a->pos) {
+		case 2:
+			/* "kafka bench" */
+			return ast_cli_complete(a->word, option, a->n);
+		case 3:
+			/* "kafka bench pipe"*/
+			if(0 == strcasecmp(a->argv[2], option[0])) {
+				return complete_pipe_choice(a->word);
+			}
+			return NULL;
+		default:
+			/* "kafka bench pipe <pipe_id> option value ..." */
+			if((a->pos > 3) && (0 == (a->pos % 2))) {
+				return ast_cli_complete(a->word, pipe_option, a->n);
+			}
+			return NULL;
+		}
+	default:
+		break;
+	}
+
+	if((a->argc < 10) || (a->argc % 2) || strcasecmp(a->argv[2], option[0])) {
+		return CLI_SHOWUSAGE;
+	}
+
+	for(arg = 4;arg < a->argc;arg += 2) {
+		unsigned int value;
+
+		if(1 != sscanf(a->argv[arg + 1], "%30u", &value)) {
+			return CLI_SHOWUSAGE;
+		}
+
+		if(0 == strcasecmp(a->argv[arg], pipe_option[0])) {
+			options.messages = value;
+		} else if(0 == strcasecmp(a->argv[arg], pipe_option[1])) {
+			options.size = value;
+		} else if(0 == strcasecmp(a->argv[arg], pipe_option[2])) {
+			options.rate = value;
+		} else if(0 == strcasecmp(a->argv[arg], pipe_option[3])) {
+			options.threads = value;
+		} else if(0 == strcasecmp(a->argv[arg], pipe_option[4])) {
+			options.json = value ? 1 : 0;
+		} else {
+			return CLI_SHOWUSAGE;
+		}
+	}
+
+	if((0 == options.messages) || (options.messages > INT_MAX) || (0 == options.threads) || (options.threads > KAFKA_BENCH_MAX_THREADS)) {
+		ast_cli(a->fd, "Messages must be positive, threads from 1 to %d\n", KAFKA_BENCH_MAX_THREADS);
+		return CLI_SUCCESS;
+	}
+
+	if(options.size < sizeof(struct kafka_bench_payload)) {
+		/* Benchmark prefix must fit */
+		options.size = sizeof(struct kafka_bench_payload);
+	}
+
+	if(NULL == (pipe = ast_kafka_get_pipe(a->argv[3], 0))) {
+		ast_cli(a->fd, "Pipe '%s' not found\n", a->argv[3]);
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, "Benchmark pipe '%s': %u %s messages of %u bytes, rate %u msg/s, %u threads\n",
+		pipe->id, options.messages, options.json ? "JSON" : "raw", options.size, options.rate, options.threads);
+
+	if(ast_kafka_bench(pipe, &options, &report)) {
+		ast_cli(a->fd, "Benchmark of pipe '%s' failed, pipe have no producers or other benchmark running\n", pipe->id);
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, "Sent %d messages (%d failed) to %d topics in %.3f s: %.0f msg/s, %.2f MB/s\n",
+		report.sent, report.failed, report.topics, report.send_us / 1000000.0,
+		(report.send_us > 0) ? report.sent * 1000000.0 / report.send_us : 0.0,
+		(report.send_us > 0) ? (double)report.sent * options.size / report.send_us : 0.0);
+	ast_cli(a->fd, "Delivered %d of %d messages (%d errors) in %.3f s: %.0f msg/s, %.2f MB/s\n",
+		report.delivered, report.expected, report.delivery_errors, report.total_us / 1000000.0,
+		(report.total_us > 0) ? report.delivered * 1000000.0 / report.total_us : 0.0,
+		(report.total_us > 0) ? (double)report.delivered * options.size / report.total_us : 0.0);
+	ast_cli(a->fd, "Latency enqueue to delivery report, us: p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+		(unsigned long)report.latency_p50_us, (unsigned long)report.latency_p99_us,
+		(unsigned long)report.latency_p999_us, (unsigned long)report.latency_max_us);
+	ast_cli(a->fd, "Queue full %d times, retried %d, dropped %d messages\n",
+		report.queue_full, report.retried, report.dropped);
+
+	for(i = 0;i < AST_KAFKA_STAGE_COUNT;i++) {
+		if(report.stages[i].count) {
+			ast_cli(a->fd, "Stage %-17s %10lu calls, avg %lu ns\n", kafka_stage_names[i],
+				(unsigned long)report.stages[i].count, (unsigned long)report.stages[i].avg_ns);
+		}
+	}
+
+	return CLI_SUCCESS;
+}
+
+/*! Run producer benchmark on the pipe */
+int ast_kafka_bench(struct ast_kafka_pipe *pipe, const struct ast_kafka_bench_options *options, struct ast_kafka_bench_report *report) {
+	RAII_VAR(struct kafka_bench *, bench, NULL, ao2_cleanup);
+	struct kafka_bench_sender *senders;
+	unsigned int size = options->size;
+	int queue_full_before[3] = { 0, 0, 0 };
+	int queue_full_after[3] = { 0, 0, 0 };
+	int64_t started, sent, finished;
+	int expected, topics;
+	unsigned int i;
+
+	if((0 == options->messages) || (options->messages > INT_MAX) || (0 == options->threads) || (options->threads > KAFKA_BENCH_MAX_THREADS)) {
+		ast_log(LOG_WARNING, "Benchmark messages must be positive, threads from 1 to %d\n", KAFKA_BENCH_MAX_THREADS);
+		return -1;
+	}
+
+	if(size < sizeof(struct kafka_bench_payload)) {
+		/* Benchmark prefix must fit */
+		size = sizeof(struct kafka_bench_payload);
+	}
+
+	{
+		RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+
+		if((NULL == snapshot) || (0 == (topics = snapshot->count))) {
+			ast_log(LOG_WARNING, "Benchmark pipe '%s' have no producers\n", pipe->id);
+			return -1;
+		}
+	}
+
+	if(NULL == (bench = ao2_alloc_options(sizeof(*bench), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		return -1;
+	}
+
+	bench->id = ast_random();
+	bench->json = options->json ? 1 : 0;
+	snprintf(bench->marker, sizeof(bench->marker), "%s:%08x", KAFKA_BENCH_MAGIC, bench->id);
+
+	if(NULL == (senders = ast_calloc(options->threads, sizeof(*senders)))) {
+		return -1;
+	}
+
+	/* Only one benchmark at time */
+	if(ast_atomic_fetchadd_int(&bench_running, +1)) {
+		ast_atomic_fetchadd_int(&bench_running, -1);
+		ast_free(senders);
+		ast_log(LOG_WARNING, "Benchmark pipe '%s': other benchmark running\n", pipe->id);
+		return -1;
+	}
+
+	ao2_global_obj_replace_unref(current_bench, bench);
+
+	/* Stages timed only while bench_running set */
+	memset(stage_timings, 0, sizeof(stage_timings));
+
+	on_all_producer_topics(pipe, kafka_bench_queue_full_cb, queue_full_before, NULL, NULL);
+
+	started = kafka_bench_now_us();
+
+	for(i = 0;i < options->threads;i++) {
+		senders[i].bench = bench;
+		senders[i].pipe = pipe;
+		senders[i].messages = options->messages / options->threads + ((i < options->messages % options->threads) ? 1 : 0);
+		senders[i].interval_us = options->rate ? (int64_t)options->threads * 1000000 / options->rate : 0;
+		senders[i].size = size;
+		senders[i].thread = AST_PTHREADT_NULL;
+
+		if(ast_pthread_create(&senders[i].thread, NULL, kafka_bench_sender_job, &senders[i])) {
+			ast_log(LOG_WARNING, "Benchmark pipe '%s': unable to start sender thread %u\n", pipe->id, i);
+			senders[i].thread = AST_PTHREADT_NULL;
+		}
+	}
+
+	for(i = 0;i < options->threads;i++) {
+		if(AST_PTHREADT_NULL != senders[i].thread) {
+			pthread_join(senders[i].thread, NULL);
+		}
+	}
+
+	ast_free(senders);
+
+	sent = kafka_bench_now_us();
+
+	/* Each sent message produced to the every pipe's topic */
+	expected = (bench->sent - bench->failed) * topics;
+
+	while(((bench->delivered + bench->delivery_errors) < expected) && ((kafka_bench_now_us() - sent) < KAFKA_BENCH_DRAIN_TIMEOUT_MS * 1000)) {
+		usleep(10000);
+	}
+
+	finished = kafka_bench_now_us();
+
+	ao2_global_obj_release(current_bench);
+	ast_atomic_fetchadd_int(&bench_running, -1);
+
+	on_all_producer_topics(pipe, kafka_bench_queue_full_cb, queue_full_after, NULL, NULL);
+
+	memset(report, 0, sizeof(*report));
+
+	report->topics = topics;
+	report->sent = bench->sent;
+	report->failed = bench->failed;
+	report->expected = expected;
+	report->delivered = bench->delivered;
+	report->delivery_errors = bench->delivery_errors;
+	report->send_us = sent - started;
+	report->total_us = finished - started;
+	report->latency_p50_us = kafka_histogram_percentile(&bench->latency, 0.5);
+	report->latency_p99_us = kafka_histogram_percentile(&bench->latency, 0.99);
+	report->latency_p999_us = kafka_histogram_percentile(&bench->latency, 0.999);
+	report->latency_max_us = kafka_histogram_percentile(&bench->latency, 1.0);
+	report->queue_full = queue_full_after[0] - queue_full_before[0];
+	report->retried = queue_full_after[1] - queue_full_before[1];
+	report->dropped = queue_full_after[2] - queue_full_before[2];
+
+	for(i = 0;i < AST_KAFKA_STAGE_COUNT;i++) {
+		uint64_t count = __atomic_load_n(&stage_timings[i].count, __ATOMIC_RELAXED);
+		uint64_t total = __atomic_load_n(&stage_timings[i].total_ns, __ATOMIC_RELAXED);
+
+		report->stages[i].count = count;
+		report->stages[i].avg_ns = count ? total / count : 0;
+
+		if(count) {
+			ast_test_suite_event_notify("KAFKA_BENCH_STAGE", "Pipe: %s\r\nStage: %s\r\nCalls: %lu\r\nAverageNs: %lu",
+				pipe->id, kafka_stage_names[i], (unsigned long)count, (unsigned long)report->stages[i].avg_ns);
+		}
+	}
+
+	ast_test_suite_event_notify("KAFKA_BENCH", "Pipe: %s\r\nSent: %d\r\nFailed: %d\r\nExpected: %d\r\nDelivered: %d\r\nErrors: %d\r\nLatencyP99Us: %lu",
+		pipe->id, report->sent, report->failed, report->expected, report->delivered, report->delivery_errors,
+		(unsigned long)report->latency_p99_us);
+
+	return 0;
+}
+
+/*! Get name of the publish pipeline stage */
+const char *ast_kafka_stage_name(enum ast_kafka_stage stage) {
+	return (stage < AST_KAFKA_STAGE_COUNT) ? kafka_stage_names[stage] : "unknown";
+}
+
+/*! Create pipe produced to the librdkafka mock cluster */
+struct ast_kafka_pipe *ast_kafka_mock_pipe_create(const char *pipe_id, unsigned int brokers) {
+	RAII_VAR(struct sorcery_kafka_cluster *, sorcery_cluster, NULL, ao2_cleanup);
+	RAII_VAR(struct sorcery_kafka_producer *, sorcery_producer, NULL, ao2_cleanup);
+	RAII_VAR(struct sorcery_kafka_topic *, sorcery_topic, NULL, ao2_cleanup);
+	struct ast_kafka_pipe *pipe;
+	struct kafka_service *producer;
+	char *value = ast_alloca(TMP_BUF_SIZE);
+	char *id;
+
+	if(ast_strlen_zero(pipe_id) || (0 == brokers)) {
+		return NULL;
+	}
+
+	if(NULL != (pipe = ast_kafka_get_pipe(pipe_id, 0))) {
+		RAII_VAR(struct kafka_topics_snapshot *, snapshot, ao2_global_obj_ref(pipe->producer_snapshot), ao2_cleanup);
+
+		ao2_ref(pipe, -1);
+
+		if(snapshot && snapshot->count) {
+			ast_log(LOG_WARNING, "Kafka mock pipe '%s': pipe already produced\n", pipe_id);
+			return NULL;
+		}
+	}
+
+	id = ast_alloca(strlen(KAFKA_MOCK_PREFIX) + strlen(pipe_id) + 1);
+	sprintf(id, KAFKA_MOCK_PREFIX "%s", pipe_id);
+	snprintf(value, TMP_BUF_SIZE, "%u", brokers);
+
+	{
+		/* librdkafka start in-process cluster instead of connect to the bootstrap brokers */
+		const char *cluster_fields[] = { KAFKA_RDKAFKA_PREFIX "test.mock.num.brokers", value, NULL };
+		const char *producer_fields[] = { "cluster", id, NULL };
+		const char *topic_fields[] = { "pipe", pipe_id, "topic", pipe_id, "producer", id, NULL };
+
+		if((NULL == (sorcery_cluster = kafka_mock_object_alloc(KAFKA_CLUSTER, id, cluster_fields)))
+			|| (NULL == (sorcery_producer = kafka_mock_object_alloc(KAFKA_PRODUCER, id, producer_fields)))
+			|| (NULL == (sorcery_topic = kafka_mock_object_alloc(KAFKA_TOPIC, id, topic_fields)))) {
+			return NULL;
+		}
+	}
+
+	if(NULL == (producer = new_kafka_producer(sorcery_cluster, sorcery_producer))) {
+		return NULL;
+	}
+
+	if(process_producer_topic(producer, sorcery_topic)) {
+		/* This producer has no topics */
+		ao2_ref(producer, -1);
+		return NULL;
+	}
+
+	producer->topic_count++;
+
+	AST_RWDLLIST_WRLOCK(&producers);
+
+	/* Keep object reference count because list reference to it */
+	AST_RWDLLIST_INSERT_TAIL(&producers, producer, link);
+
+	AST_RWDLLIST_UNLOCK(&producers);
+
+	/* Assert monitor thread is running */
+	if(start_monitor_thread(producer->monitor)) {
+		ast_log(LOG_WARNING, "Unable to start monitoring thread.\n");
+	}
+
+	ast_debug(1, "Kafka mock pipe '%s' created with %u brokers\n", pipe_id, brokers);
+
+	return ast_kafka_get_pipe(pipe_id, 0);
+}
+
+/*! Stop mock pipe's producer and release the pipe */
+void ast_kafka_mock_pipe_destroy(struct ast_kafka_pipe *pipe) {
+	RAII_VAR(struct ao2_container *, running, ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL), ao2_cleanup);
+	struct ao2_iterator i;
+	struct kafka_service *service;
+	char *id;
+
+	if(NULL == pipe) {
+		return;
+	}
+
+	id = ast_alloca(strlen(KAFKA_MOCK_PREFIX) + strlen(pipe->id) + 1);
+	sprintf(id, KAFKA_MOCK_PREFIX "%s", pipe->id);
+
+	if(running) {
+		/* Services list is changed by the topics destructors */
+		on_all_producers(reconcile_collect_cb, running, 1, 0);
+
+		i = ao2_iterator_init(running, 0);
+
+		while(NULL != (service = ao2_iterator_next(&i))) {
+			if(!strcmp(ast_sorcery_object_get_id(service->sorcery_service), id)) {
+				retire_service(service, KAFKA_PRODUCER);
+			}
+
+			ao2_ref(service, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+	}
+
+	ast_debug(1, "Kafka mock pipe '%s' destroyed\n", pipe->id);
+
+	ao2_ref(pipe, -1);
+}
+
+/*! Allocate mock pipe's sorcery object with defaults, fields are name and value pairs */
+static void *kafka_mock_object_alloc(const char *type, const char *id, const char *const *fields) {
+	RAII_VAR(struct ast_variable *, objectset, NULL, ast_variables_destroy);
+	void *object;
+
+	for(;*fields;fields += 2) {
+		struct ast_variable *field = ast_variable_new(fields[0], fields[1], "");
+
+		if(NULL == field) {
+			return NULL;
+		}
+
+		ast_variable_list_append(&objectset, field);
+	}
+
+	if(NULL == (object = ast_sorcery_alloc(kafka_sorcery, type, id))) {
+		return NULL;
+	}
+
+	if(ast_sorcery_objectset_apply(kafka_sorcery, object, objectset)) {
+		ast_log(LOG_ERROR, "Kafka mock %s '%s': unable to apply options\n", type, id);
+		ao2_ref(object, -1);
+		return NULL;
+	}
+
+	return object;
+}
+
+/*! Benchmark sender thread */
+static void *kafka_bench_sender_job(void *opaque) {
+	struct kafka_bench_sender *sender = opaque;
+	struct kafka_bench_payload *prefix;
+	char *payload;
+	int64_t next;
+	unsigned int i;
+
+	if(NULL == (payload = ast_malloc(sender->size + 1))) {
+		return NULL;
+	}
+
+	memset(payload, 'x', sender->size);
+	payload[sender->size] = '\0';
+
+	prefix = (struct kafka_bench_payload *)payload;
+	memcpy(prefix->magic, KAFKA_BENCH_MAGIC, sizeof(prefix->magic));
+	prefix->id = sender->bench->id;
+
+	next = kafka_bench_now_us();
+
+	for(i = 0;i < sender->messages;i++) {
+		if(sender->interval_us) {
+			int64_t now = kafka_bench_now_us();
+
+			if(next > now) {
+				usleep(next - now);
+			}
+
+			next += sender->interval_us;
+		}
+
+		if(sender->bench->json) {
+			/* Marker instead of the binary prefix, filler is NUL terminated */
+			int64_t stage = kafka_stage_start(AST_KAFKA_STAGE_PACK);
+			struct ast_json *json = ast_json_pack("{s: s, s: s}", "bench", sender->bench->marker, "data", payload + sizeof(*prefix));
+
+			kafka_stage_stop(AST_KAFKA_STAGE_PACK, stage);
+
+			if((NULL == json) || ast_kafka_publish(sender->pipe, NULL, "BENCH", json)) {
+				ast_atomic_fetchadd_int(&sender->bench->failed, +1);
+			}
+
+			ast_json_unref(json);
+		} else if(ast_kafka_send_raw_message(sender->pipe, NULL, payload, sender->size, "BENCH")) {
+			ast_atomic_fetchadd_int(&sender->bench->failed, +1);
+		}
+
+		ast_atomic_fetchadd_int(&sender->bench->sent, +1);
+	}
+
+	ast_free(payload);
+
+	return NULL;
+}
+
+/*! Account benchmark message delivery report */
+static void kafka_bench_delivered(const rd_kafka_message_t *message) {
+	const struct kafka_bench_payload *prefix = message->payload;
+	RAII_VAR(struct kafka_bench *, bench, NULL, ao2_cleanup);
+	int raw = (message->len >= sizeof(*prefix)) && (0 == memcmp(prefix->magic, KAFKA_BENCH_MAGIC, sizeof(prefix->magic)));
+	int64_t latency;
+
+	if(!raw && (NULL == memmem(message->payload, message->len, KAFKA_BENCH_MAGIC, sizeof(prefix->magic)))) {
+		/* Not a benchmark message */
+		return;
+	}
+
+	if(NULL == (bench = ao2_global_obj_ref(current_bench))) {
+		/* Late delivery report of the previous benchmark */
+		return;
+	}
+
+	if(raw ? (prefix->id != bench->id) : (NULL == memmem(message->payload, message->len, bench->marker, strlen(bench->marker)))) {
+		/* Message of the previous benchmark */
+		return;
+	}
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != message->err) {
+		ast_atomic_fetchadd_int(&bench->delivery_errors, +1);
+	} else {
+		ast_atomic_fetchadd_int(&bench->delivered, +1);
+	}
+
+	if((latency = rd_kafka_message_latency(message)) >= 0) {
+		KAFKA_TRACE(bench__delivered, latency);
+		kafka_histogram_add(&bench->latency, latency);
+	}
+}
+
+/*! Count value in the histogram */
+static void kafka_histogram_add(struct kafka_histogram *histogram, uint64_t value) {
+	ast_atomic_fetchadd_int(&histogram->counts[kafka_histogram_bucket(value)], +1);
+}
+
+/*! Add other histogram counts to the histogram */
+static void kafka_histogram_merge(struct kafka_histogram *histogram, const struct kafka_histogram *other) {
+	unsigned int i;
+
+	for(i = 0;i < KAFKA_HISTOGRAM_BUCKETS;i++) {
+		histogram->counts[i] += other->counts[i];
+	}
+}
+
+/*! Number of counted values */
+static int kafka_histogram_count(const struct kafka_histogram *histogram) {
+	unsigned int i;
+	int count = 0;
+
+	for(i = 0;i < KAFKA_HISTOGRAM_BUCKETS;i++) {
+		count += histogram->counts[i];
+	}
+
+	return count;
+}
+
+/*! Get value percentile from histogram, 0 if histogram empty */
+static uint64_t kafka_histogram_percentile(const struct kafka_histogram *histogram, double percentile) {
+	int64_t threshold = (int64_t)(kafka_histogram_count(histogram) * percentile + 0.5);
+	int64_t counted = 0;
+	unsigned int i;
+	uint64_t value = 0;
+
+	for(i = 0;i < KAFKA_HISTOGRAM_BUCKETS;i++) {
+		if(histogram->counts[i]) {
+			counted += histogram->counts[i];
+			value = kafka_histogram_bucket_value(i);
+
+			if(counted >= threshold) {
+				break;
+			}
+		}
+	}
+
+	return value;
+}
+
+/*! Histogram bucket: linear below KAFKA_HISTOGRAM_SUB_BUCKETS, then KAFKA_HISTOGRAM_SUB_BUCKETS per power of two */
+static unsigned int kafka_histogram_bucket(uint64_t value) {
+	unsigned int exponent;
+	unsigned int bucket;
+
+	if(value < KAFKA_HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+
+	exponent = 63 - __builtin_clzll(value);
+	bucket = (exponent - 3) * KAFKA_HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - 4)) & (KAFKA_HISTOGRAM_SUB_BUCKETS - 1));
+
+	return (bucket < KAFKA_HISTOGRAM_BUCKETS) ? bucket : KAFKA_HISTOGRAM_BUCKETS - 1;
+}
+
+/*! Highest value counted by histogram bucket */
+static uint64_t kafka_histogram_bucket_value(unsigned int bucket) {
+	unsigned int exponent;
+
+	if(bucket < KAFKA_HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	exponent = bucket / KAFKA_HISTOGRAM_SUB_BUCKETS + 3;
+
+	return ((uint64_t)(KAFKA_HISTOGRAM_SUB_BUCKETS + bucket % KAFKA_HISTOGRAM_SUB_BUCKETS + 1) << (exponent - 4)) - 1;
+}
+
+/*! Monotonic time, us */
+static int64_t kafka_bench_now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*! Monotonic time, ns */
+static int64_t kafka_bench_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*! Enter publish pipeline stage, start time or zero if benchmark not running */
+static int64_t kafka_stage_start(enum ast_kafka_stage stage) {
+	KAFKA_TRACE(stage__start, stage);
+
+	return bench_running ? kafka_bench_now_ns() : 0;
+}
+
+/*! Leave publish pipeline stage, account time if started by benchmark */
+static void kafka_stage_stop(enum ast_kafka_stage stage, int64_t started) {
+	KAFKA_TRACE(stage__stop, stage);
+
+	if(started) {
+		__atomic_fetch_add(&stage_timings[stage].count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stage_timings[stage].total_ns, kafka_bench_now_ns() - started, __ATOMIC_RELAXED);
+	}
+}
+
+/*! Collect producer's queue full counters */
+static int kafka_bench_queue_full_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	int *counters = opaque_1;
+
+	counters[0] += topic->service->specific.producer.queue_full_count;
+	counters[1] += topic->service->specific.producer.retried_count;
+	counters[2] += topic->service->specific.producer.dropped_count;
+
+	return 0;
+}
+
+/*! Cli show command */
+static char *handle_kafka_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+	static const char *option[] = {
+		"version",
+		"pipes",
+		"pipe",
+		"stats",
+		NULL,
+	};
+	static const char *pipe_option[] = {
+		"services",
+		"producers",
+		"consumers",
+		"latency",
+		"stats",
+		NULL,
+	};
+	struct kafka_stats_writer writer = {
+		.begin = cli_stats_begin,
+		.value = cli_stats_value,
+		.end = NULL,
+		.fd = a->fd,
+		.count = 0,
+	};
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "kafka show";
+		e->usage =
+			"Usage: kafka show version|pipes|stats|pipe <pipe_id> services|producers|consumers|latency|stats\n"
+			"       Show the version of librdkafka that res_kafka is running against,\n"
+			"       pipes, performance counters or pipe's topics\n";
+		return NULL;
+	case CLI_GENERATE:
+		switch(a->pos) {
+		case 2:
+			/* "kafka show" */
+			return ast_cli_complete(a->word, option, a->n);
+		case 3:
+			/* "kafka show some"*/
+			if(0 == strcasecmp(a->argv[2], option[2])) {
+				/* "kafka show pipe"*/
+				return complete_pipe_choice(a->word);
+			}
+			return NULL;
+		case 4:
+			if(0 == strcasecmp(a->argv[2], option[2])) {
+				/* "kafka show pipe <pipe_id>"*/
+				return ast_cli_complete(a->word, pipe_option, a->n);
+			}
+			return NULL;
+		default:
+			/* No completion choices */
+			return NULL;
+		}
+	default:
+		break;
+	}
+
+	if(3 == a->argc) {
+		if(0 == strcasecmp(a->argv[2], option[0])) {
+			/* "kafka show version" */
+			ast_cli(a->fd, "librdkafka version currently running against: %s\n", rd_kafka_version_str());
+			return CLI_SUCCESS;
+		}
+
+		if(0 == strcasecmp(a->argv[2], option[1])) {
+			/* "kafka show pipes" */
+			ao2_callback(pipes, OBJ_NODATA, show_pipes_cb, a);
+			return CLI_SUCCESS;
+		}
+
+		if(0 == strcasecmp(a->argv[2], option[3])) {
+			/* "kafka show stats" */
+			kafka_stats_report_pipes(&writer, NULL);
+			return CLI_SUCCESS;
+		}
+		return CLI_SHOWUSAGE;
+	}
+
+	if(5 == a->argc) {
+		if(0 == strcasecmp(a->argv[2], option[2])) {
+			/* "kafka show pipe <pipe_id> services|consumers|producers" */
+			RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(a->argv[3],0), ao2_cleanup);
+
+			if(NULL == pipe) {
+				ast_cli(a->fd, "Pipe '%s' not found\n", a->argv[3]);
+			} else {
+				if((0 == strcasecmp(a->argv[4], pipe_option[0])) || (0 == strcasecmp(a->argv[4], pipe_option[1]))) {
+					/* Show services or producers */
+					on_all_producer_topics(pipe, cli_show_topic_cb, a, (char*)pipe_option[1], NULL);
+				}
+
+				if((0 == strcasecmp(a->argv[4], pipe_option[0])) || (0 == strcasecmp(a->argv[4], pipe_option[2]))) {
+					/* Show services or consumers */
+					on_all_consumer_topics(pipe, cli_show_topic_cb, a, (char*)pipe_option[2], NULL);
+				}
+
+				if(0 == strcasecmp(a->argv[4], pipe_option[3])) {
+					/* Show loopback probe results */
+					RAII_VAR(struct kafka_probe *, probe, ao2_find(probes, pipe->id, OBJ_SEARCH_KEY), ao2_cleanup);
+
+					if(NULL == probe) {
+						ast_cli(a->fd, "Probe on pipe '%s' not started, use \"kafka loopback pipe %s start\"\n", pipe->id, pipe->id);
+					} else {
+						kafka_probe_show(a->fd, probe);
+					}
+				}
+
+				if(0 == strcasecmp(a->argv[4], pipe_option[4])) {
+					/* Show pipe performance counters */
+					kafka_stats_report_pipes(&writer, pipe);
+				}
+			}
+
+			return CLI_SUCCESS;
+		}
+	}
+
+	return CLI_SHOWUSAGE;
+}
+
+
+/*! Allocate zeroed performance counters */
+static struct kafka_stats *kafka_stats_alloc(void) {
+	struct kafka_stats *stats = ao2_alloc_options(sizeof(*stats), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if(stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->consumer_lag = -1;
+	}
+
+	return stats;
+}
+
+/*! Counters stripe of the current CPU */
+static unsigned int kafka_stats_stripe(void) {
+#ifdef CPU_SET
+	int cpu = sched_getcpu();
+
+	if(cpu >= 0) {
+		return cpu & (KAFKA_STATS_STRIPES - 1);
+	}
+#endif
+
+	/* CPU unknown, spread threads */
+	return ast_get_tid() & (KAFKA_STATS_STRIPES - 1);
+}
+
+/*! Increment counter w/o lock */
+static void kafka_stats_add(struct kafka_stats *stats, enum kafka_counter counter, uint64_t value) {
+	if(stats) {
+		__atomic_fetch_add(&stats->stripes[kafka_stats_stripe()].counters[counter], value, __ATOMIC_RELAXED);
+	}
+}
+
+/*! Increment topic, pipe and service counter */
+static void kafka_stats_topic_add(struct kafka_topic *topic, enum kafka_counter counter, uint64_t value) {
+	unsigned int stripe = kafka_stats_stripe();
+
+	__atomic_fetch_add(&topic->stats->stripes[stripe].counters[counter], value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&topic->service->stats->stripes[stripe].counters[counter], value, __ATOMIC_RELAXED);
+
+	if(topic->pipe_stats) {
+		__atomic_fetch_add(&topic->pipe_stats->stripes[stripe].counters[counter], value, __ATOMIC_RELAXED);
+	}
+}
+
+/*! Summarize counters of all stripes */
+static void kafka_stats_sum(const struct kafka_stats *stats, uint64_t *counters) {
+	unsigned int i;
+	unsigned int j;
+
+	memset(counters, 0, sizeof(*counters) * KAFKA_COUNTER_MAX);
+
+	for(i = 0;i < KAFKA_STATS_STRIPES;i++) {
+		for(j = 0;j < KAFKA_COUNTER_MAX;j++) {
+			counters[j] += __atomic_load_n(&stats->stripes[i].counters[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*! Account producer's delivery report */
+static void kafka_stats_delivered(struct kafka_topic *topic, const rd_kafka_message_t *message) {
+	enum kafka_counter counter = (RD_KAFKA_RESP_ERR_NO_ERROR == message->err) ? KAFKA_COUNTER_DELIVERED : KAFKA_COUNTER_DELIVERY_FAILED;
+	int64_t latency = rd_kafka_message_latency(message);
+
+	if(NULL == topic) {
+		/* Message produced w/o topic */
+		return;
+	}
+
+	kafka_stats_topic_add(topic, counter, 1);
+
+	if(latency >= 0) {
+		kafka_histogram_add(&topic->stats->delivery_latency, latency);
+		kafka_histogram_add(&topic->service->stats->delivery_latency, latency);
+
+		if(topic->pipe_stats) {
+			kafka_histogram_add(&topic->pipe_stats->delivery_latency, latency);
+		}
+	}
+}
+
+/*! Called by librdkafka each statistics.interval.ms from the service poll */
+static int on_service_statistics(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque) {
+	struct kafka_service *service = opaque;
+	RAII_VAR(struct ast_json *, root, ast_json_load_buf(json, json_len, NULL), ast_json_unref);
+	RAII_VAR(struct kafka_rdkafka_stats *, stats, NULL, ao2_cleanup);
+	struct ast_json *brokers;
+	struct ast_json *topics;
+	struct ast_json_iter *iter;
+	size_t broker_count;
+	size_t partition_count = 0;
+	int64_t lag = -1;
+	size_t i;
+
+	if(NULL == root) {
+		ast_debug(3, "Unable to parse statistics of '%s'\n", rd_kafka_name(rd_kafka));
+		return 0;
+	}
+
+	brokers = ast_json_object_get(root, "brokers");
+	topics = ast_json_object_get(root, "topics");
+	broker_count = brokers ? ast_json_object_size(brokers) : 0;
+
+	for(iter = topics ? ast_json_object_iter(topics) : NULL;iter;iter = ast_json_object_iter_next(topics, iter)) {
+		struct ast_json *partitions = ast_json_object_get(ast_json_object_iter_value(iter), "partitions");
+
+		partition_count += partitions ? ast_json_object_size(partitions) : 0;
+	}
+
+	if(NULL == (stats = ao2_alloc_options(sizeof(*stats) + broker_count * sizeof(*stats->brokers) + partition_count * sizeof(*stats->partitions), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		return 0;
+	}
+
+	stats->msg_cnt = kafka_stats_json_integer(root, "msg_cnt", 0);
+	stats->replyq = kafka_stats_json_integer(root, "replyq", 0);
+	stats->broker_count = 0;
+	stats->brokers = (struct kafka_broker_stats *)(stats + 1);
+	stats->partition_count = 0;
+	stats->partitions = (struct kafka_partition_stats *)(stats->brokers + broker_count);
+
+	for(iter = brokers ? ast_json_object_iter(brokers) : NULL;iter && (stats->broker_count < broker_count);iter = ast_json_object_iter_next(brokers, iter)) {
+		struct ast_json *broker = ast_json_object_iter_value(iter);
+		struct kafka_broker_stats *entry = stats->brokers + stats->broker_count;
+		struct ast_json *state = ast_json_object_get(broker, "state");
+
+		if(kafka_stats_json_integer(broker, "nodeid", -1) < 0) {
+			/* Internal or bootstrap broker */
+			continue;
+		}
+
+		ast_copy_string(entry->name, ast_json_object_iter_key(iter), sizeof(entry->name));
+		entry->up = state && (AST_JSON_STRING == ast_json_typeof(state)) && (0 == strcmp(ast_json_string_get(state), "UP"));
+		entry->rtt_avg_us = kafka_stats_json_integer(ast_json_object_get(broker, "rtt"), "avg", 0);
+		entry->rtt_p99_us = kafka_stats_json_integer(ast_json_object_get(broker, "rtt"), "p99", 0);
+		entry->int_latency_avg_us = kafka_stats_json_integer(ast_json_object_get(broker, "int_latency"), "avg", 0);
+		entry->outbuf_cnt = kafka_stats_json_integer(broker, "outbuf_cnt", 0);
+		entry->waitresp_cnt = kafka_stats_json_integer(broker, "waitresp_cnt", 0);
+		entry->tx = kafka_stats_json_integer(broker, "tx", 0);
+		entry->rx = kafka_stats_json_integer(broker, "rx", 0);
+
+		stats->broker_count++;
+	}
+
+	for(iter = topics ? ast_json_object_iter(topics) : NULL;iter;iter = ast_json_object_iter_next(topics, iter)) {
+		struct ast_json *partitions = ast_json_object_get(ast_json_object_iter_value(iter), "partitions");
+		struct ast_json_iter *partition_iter;
+
+		for(partition_iter = partitions ? ast_json_object_iter(partitions) : NULL;partition_iter && (stats->partition_count < partition_count);partition_iter = ast_json_object_iter_next(partitions, partition_iter)) {
+			struct ast_json *partition = ast_json_object_iter_value(partition_iter);
+			struct kafka_partition_stats *entry = stats->partitions + stats->partition_count;
+
+			if((entry->partition = kafka_stats_json_integer(partition, "partition", RD_KAFKA_PARTITION_UA)) < 0) {
+				/* Unassigned messages queue */
+				continue;
+			}
+
+			ast_copy_string(entry->topic, ast_json_object_iter_key(iter), sizeof(entry->topic));
+			entry->msgq_cnt = kafka_stats_json_integer(partition, "msgq_cnt", 0);
+			entry->txmsgs = kafka_stats_json_integer(partition, "txmsgs", 0);
+			entry->rxmsgs = kafka_stats_json_integer(partition, "rxmsgs", 0);
+			entry->consumer_lag = kafka_stats_json_integer(partition, "consumer_lag", -1);
+
+			stats->partition_count++;
+		}
+	}
+
+	ao2_global_obj_replace_unref(service->rdkafka_stats, stats);
+
+	/* Consumer lag of topics and service */
+	ao2_callback(service->topics, OBJ_NODATA, kafka_stats_consumer_lag_cb, stats);
+
+	for(i = 0;i < stats->partition_count;i++) {
+		if(stats->partitions[i].consumer_lag >= 0) {
+			lag = ((lag < 0) ? 0 : lag) + stats->partitions[i].consumer_lag;
+		}
+	}
+
+	service->stats->consumer_lag = lag;
+
+	/* librdkafka release json buffer */
+	return 0;
+}
+
+/*! Called by librdkafka each statistics.interval.ms on the shared handle, stored by each producer */
+static int on_connection_statistics(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque) {
+	struct kafka_connection *connection = opaque;
+	struct kafka_service *producer;
+
+	ao2_lock(connection);
+
+	AST_LIST_TRAVERSE(&connection->services, producer, specific.producer.connection_link) {
+		on_service_statistics(rd_kafka, json, json_len, producer);
+	}
+
+	ao2_unlock(connection);
+
+	/* librdkafka release json buffer */
+	return 0;
+}
+
+/*! Get integer member of the JSON object */
+static int64_t kafka_stats_json_integer(struct ast_json *object, const char *key, int64_t missing) {
+	struct ast_json *value = object ? ast_json_object_get(object, key) : NULL;
+
+	if(value && (AST_JSON_INTEGER == ast_json_typeof(value))) {
+		return ast_json_integer_get(value);
+	}
+
+	return missing;
+}
+
+/*! Update topic consumer lag by parsed librdkafka statistics */
+static int kafka_stats_consumer_lag_cb(void *obj, void *arg, int flags) {
+	struct kafka_topic *topic = obj;
+	const struct kafka_rdkafka_stats *stats = arg;
+	int64_t lag = -1;
+	size_t i;
+
+	for(i = 0;i < stats->partition_count;i++) {
+		if((stats->partitions[i].consumer_lag >= 0) && (0 == strcmp(stats->partitions[i].topic, topic->id))) {
+			lag = ((lag < 0) ? 0 : lag) + stats->partitions[i].consumer_lag;
+		}
+	}
+
+	topic->stats->consumer_lag = lag;
+
+	return 0;
+}
+
+/*! Report counters record */
+static void kafka_stats_report(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, const struct kafka_stats *stats) {
+	uint64_t counters[KAFKA_COUNTER_MAX];
+	unsigned int i;
+
+	kafka_stats_sum(stats, counters);
+
+	writer->begin(writer, scope, pipe_id, id, -1);
+
+	for(i = 0;i < KAFKA_COUNTER_MAX;i++) {
+		writer->value(writer, kafka_counter_names[i], counters[i]);
+	}
+
+	if(kafka_histogram_count(&stats->delivery_latency)) {
+		writer->value(writer, "delivery_latency_p50_us", kafka_histogram_percentile(&stats->delivery_latency, 0.5));
+		writer->value(writer, "delivery_latency_p99_us", kafka_histogram_percentile(&stats->delivery_latency, 0.99));
+		writer->value(writer, "delivery_latency_p999_us", kafka_histogram_percentile(&stats->delivery_latency, 0.999));
+		writer->value(writer, "delivery_latency_max_us", kafka_histogram_percentile(&stats->delivery_latency, 1.0));
+	}
+
+	if(stats->consumer_lag >= 0) {
+		writer->value(writer, "consumer_lag", stats->consumer_lag);
+	}
+
+	if(writer->end) {
+		writer->end(writer);
+	}
+}
+
+/*! Report topic, it's service, brokers and partitions records */
+static int kafka_stats_report_topic_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	struct kafka_stats_writer *writer = opaque_1;
+	const char *service_type = opaque_2;
+	RAII_VAR(struct kafka_rdkafka_stats *, stats, NULL, ao2_cleanup);
+	size_t i;
+
+	kafka_stats_report(writer, "topic", pipe->id, topic->id, topic->stats);
+
+	if(!kafka_stats_first_report(writer, topic->service)) {
+		/* Service of the other topic or pipe */
+		return 0;
+	}
+
+	kafka_stats_report(writer, service_type, pipe->id, topic->service->sorcery_service ? ast_sorcery_object_get_id(topic->service->sorcery_service) : rd_kafka_name(topic->service->rd_kafka), topic->service->stats);
+
+	if(!kafka_stats_first_report(writer, topic->service->rd_kafka)) {
+		/* Brokers and partitions of the shared handle already reported */
+		return 0;
+	}
+
+	if(NULL == (stats = ao2_global_obj_ref(topic->service->rdkafka_stats))) {
+		/* librdkafka statistics disabled or not received yet */
+		return 0;
+	}
+
+	for(i = 0;i < stats->broker_count;i++) {
+		const struct kafka_broker_stats *broker = stats->brokers + i;
+
+		writer->begin(writer, "broker", pipe->id, broker->name, -1);
+		writer->value(writer, "up", broker->up);
+		writer->value(writer, "rtt_avg_us", broker->rtt_avg_us);
+		writer->value(writer, "rtt_p99_us", broker->rtt_p99_us);
+		writer->value(writer, "int_latency_avg_us", broker->int_latency_avg_us);
+		writer->value(writer, "outbuf_cnt", broker->outbuf_cnt);
+		writer->value(writer, "waitresp_cnt", broker->waitresp_cnt);
+		writer->value(writer, "tx", broker->tx);
+		writer->value(writer, "rx", broker->rx);
+
+		if(writer->end) {
+			writer->end(writer);
+		}
+	}
+
+	/* All topics of the handle, each partition reported once */
+	for(i = 0;i < stats->partition_count;i++) {
+		const struct kafka_partition_stats *partition = stats->partitions + i;
+
+		writer->begin(writer, "partition", pipe->id, partition->topic, partition->partition);
+		writer->value(writer, "msgq_cnt", partition->msgq_cnt);
+		writer->value(writer, "txmsgs", partition->txmsgs);
+		writer->value(writer, "rxmsgs", partition->rxmsgs);
+
+		if(partition->consumer_lag >= 0) {
+			writer->value(writer, "consumer_lag", partition->consumer_lag);
+		}
+
+		if(writer->end) {
+			writer->end(writer);
+		}
+	}
+
+	return 0;
+}
+
+/*! Report pipe and all it's topics records */
+static int kafka_stats_report_pipe_cb(void *obj, void *arg, int flags) {
+	struct ast_kafka_pipe *pipe = obj;
+	struct kafka_stats_writer *writer = arg;
+
+	kafka_stats_report(writer, "pipe", pipe->id, pipe->id, pipe->stats);
+
+	on_all_producer_topics(pipe, kafka_stats_report_topic_cb, writer, "producer", NULL);
+	on_all_consumer_topics(pipe, kafka_stats_report_topic_cb, writer, "consumer", NULL);
+
+	return 0;
+}
+
+/*! Report the pipe or all pipes if NULL, return 0 on success */
+static int kafka_stats_report_pipes(struct kafka_stats_writer *writer, struct ast_kafka_pipe *pipe) {
+	if(AST_VECTOR_INIT(&writer->reported, 16)) {
+		return -1;
+	}
+
+	if(pipe) {
+		kafka_stats_report_pipe_cb(pipe, writer, 0);
+	} else {
+		ao2_callback(pipes, OBJ_NODATA, kafka_stats_report_pipe_cb, writer);
+	}
+
+	AST_VECTOR_FREE(&writer->reported);
+
+	return 0;
+}
+
+/*! Object not reported yet by the writer, remember it */
+static int kafka_stats_first_report(struct kafka_stats_writer *writer, const void *object) {
+	size_t i;
+
+	for(i = 0;i < AST_VECTOR_SIZE(&writer->reported);i++) {
+		if(AST_VECTOR_GET(&writer->reported, i) == object) {
+			return 0;
+		}
+	}
+
+	/* Not remembered object is reported again, not lost */
+	AST_VECTOR_APPEND(&writer->reported, object);
+
+	return 1;
+}
+
+/*! CLI statistics record header */
+static void cli_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition) {
+	if(partition < 0) {
+		ast_cli(writer->fd, "%s '%s':\n", scope, id);
+	} else {
+		ast_cli(writer->fd, "%s '%s' [%d]:\n", scope, id, partition);
+	}
+
+	writer->count++;
+}
+
+/*! CLI statistics value */
+static void cli_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value) {
+	ast_cli(writer->fd, "  %-28s %ld\n", name, (long)value);
+}
+
+/*! AMI statistics event header */
+static void ami_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition) {
+	astman_append(writer->session, "Event: KafkaStats\r\n");
+
+	if(!ast_strlen_zero(writer->action_id)) {
+		astman_append(writer->session, "ActionID: %s\r\n", writer->action_id);
+	}
+
+	astman_append(writer->session, "Scope: %s\r\nPipe: %s\r\nId: %s\r\n", scope, pipe_id, id);
+
+	if(partition >= 0) {
+		astman_append(writer->session, "Partition: %d\r\n", partition);
+	}
+
+	writer->count++;
+}
+
+/*! AMI statistics value, header name in camel case */
+static void ami_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value) {
+	char *header = ast_alloca(strlen(name) + 1);
+	char *dst = header;
+	int upper = 1;
+
+	for(;*name;name++) {
+		if('_' == *name) {
+			upper = 1;
+		} else {
+			*dst++ = upper ? toupper(*name) : *name;
+			upper = 0;
+		}
+	}
+
+	*dst = '\0';
+
+	astman_append(writer->session, "%s: %ld\r\n", header, (long)value);
+}
+
+/*! AMI statistics event end */
+static void ami_stats_end(struct kafka_stats_writer *writer) {
+	astman_append(writer->session, "\r\n");
+}
+
+/*! Metrics endpoint record labels */
+static void metrics_stats_begin(struct kafka_stats_writer *writer, const char *scope, const char *pipe_id, const char *id, int32_t partition) {
+	writer->scope = scope;
+	writer->pipe_id = pipe_id;
+	writer->id = id;
+	writer->partition = partition;
+	writer->count++;
+}
+
+/*! Metrics endpoint value in Prometheus text format, grouped by family */
+static void metrics_stats_value(struct kafka_stats_writer *writer, const char *name, int64_t value) {
+	struct kafka_metrics_family *family = NULL;
+	size_t size = sizeof("kafka__") + strlen(writer->scope) + strlen(name);
+	char *family_name = ast_alloca(size);
+	size_t i;
+
+	snprintf(family_name, size, "kafka_%s_%s", writer->scope, name);
+
+	for(i = 0;i < AST_VECTOR_SIZE(&writer->families);i++) {
+		if(!strcmp(AST_VECTOR_GET(&writer->families, i)->name, family_name)) {
+			family = AST_VECTOR_GET(&writer->families, i);
+			break;
+		}
+	}
+
+	if(NULL == family) {
+		if(NULL == (family = ast_calloc(1, sizeof(*family) + size))) {
+			return;
+		}
+
+		family->type = metrics_stats_type(name);
+		strcpy(family->name, family_name);
+
+		if((NULL == (family->samples = ast_str_create(256))) || AST_VECTOR_APPEND(&writer->families, family)) {
+			ast_free(family->samples);
+			ast_free(family);
+			return;
+		}
+	}
+
+	ast_str_append(&family->samples, 0, "%s{", family->name);
+	metrics_append_label(&family->samples, "pipe", writer->pipe_id);
+	ast_str_append(&family->samples, 0, ",");
+	metrics_append_label(&family->samples, "id", writer->id);
+
+	if(writer->partition >= 0) {
+		ast_str_append(&family->samples, 0, ",partition=\"%d\"", writer->partition);
+	}
+
+	ast_str_append(&family->samples, 0, "} %ld\n", (long)value);
+}
+
+/*! Prometheus type of the value */
+static const char *metrics_stats_type(const char *name) {
+	static const char *totals[] = { "tx", "rx", "txmsgs", "rxmsgs" };
+	unsigned int i;
+
+	for(i = 0;i < KAFKA_COUNTER_MAX;i++) {
+		if(!strcmp(kafka_counter_names[i], name)) {
+			return "counter";
+		}
+	}
+
+	for(i = 0;i < ARRAY_LEN(totals);i++) {
+		if(!strcmp(totals[i], name)) {
+			return "counter";
+		}
+	}
+
+	return "gauge";
+}
+
+/*! Append label with escaped backslash, double-quote and line feed */
+static void metrics_append_label(struct ast_str **out, const char *name, const char *value) {
+	ast_str_append(out, 0, "%s=\"", name);
+
+	for(;*value;value++) {
+		switch(*value) {
+		case '\\':
+			ast_str_append(out, 0, "\\\\");
+			break;
+		case '"':
+			ast_str_append(out, 0, "\\\"");
+			break;
+		case '\n':
+			ast_str_append(out, 0, "\\n");
+			break;
+		default:
+			ast_str_append(out, 0, "%c", *value);
+			break;
+		}
+	}
+
+	ast_str_append(out, 0, "\"");
+}
+
+/*! Output families with TYPE lines and release them */
+static void metrics_stats_flush(struct kafka_stats_writer *writer) {
+	size_t i;
+
+	for(i = 0;i < AST_VECTOR_SIZE(&writer->families);i++) {
+		struct kafka_metrics_family *family = AST_VECTOR_GET(&writer->families, i);
+
+		ast_str_append(&writer->out, 0, "# TYPE %s %s\n%s", family->name, family->type, ast_str_buffer(family->samples));
+
+		ast_free(family->samples);
+		ast_free(family);
+	}
+
+	AST_VECTOR_FREE(&writer->families);
+}
+
+/*! AMI KafkaStats action */
+static int manager_kafka_stats(struct mansession *s, const struct message *m) {
+	const char *pipe_id = astman_get_header(m, "Pipe");
+	RAII_VAR(struct ast_kafka_pipe *, pipe, NULL, ao2_cleanup);
+	struct kafka_stats_writer writer = {
+		.begin = ami_stats_begin,
+		.value = ami_stats_value,
+		.end = ami_stats_end,
+		.session = s,
+		.action_id = astman_get_header(m, "ActionID"),
+		.count = 0,
+	};
+
+	if(!ast_strlen_zero(pipe_id) && (NULL == (pipe = ast_kafka_get_pipe(pipe_id, 0)))) {
+		astman_send_error(s, m, "Pipe not found");
+		return 0;
+	}
+
+	astman_send_listack(s, m, "Kafka statistics will follow", "start");
+
+	kafka_stats_report_pipes(&writer, pipe);
+
+	astman_send_list_complete_start(s, m, "KafkaStatsComplete", writer.count);
+	astman_send_list_complete_end(s);
+
+	return 0;
+}
+
+/*! HTTP kafka/metrics handler */
+static int http_kafka_metrics(struct ast_tcptls_session_instance *ser, const struct ast_http_uri *urih, const char *uri, enum ast_http_method method, struct ast_variable *get_params, struct ast_variable *headers) {
+	struct ast_str *http_header;
+	struct kafka_stats_writer writer = {
+		.begin = metrics_stats_begin,
+		.value = metrics_stats_value,
+		.end = NULL,
+		.count = 0,
+	};
+
+	if((AST_HTTP_GET != method) && (AST_HTTP_HEAD != method)) {
+		ast_http_error(ser, 501, "Not Implemented", "Attempt to use unimplemented / unsupported method");
+		return 0;
+	}
+
+	if(NULL == (http_header = ast_str_create(80))) {
+		ast_http_error(ser, 500, "Server Error", "Out of memory");
+		return 0;
+	}
+
+	if(NULL == (writer.out = ast_str_create(4096))) {
+		ast_free(http_header);
+		ast_http_error(ser, 500, "Server Error", "Out of memory");
+		return 0;
+	}
+
+	if(AST_VECTOR_INIT(&writer.families, 64) || kafka_stats_report_pipes(&writer, NULL)) {
+		AST_VECTOR_FREE(&writer.families);
+		ast_free(writer.out);
+		ast_free(http_header);
+		ast_http_error(ser, 500, "Server Error", "Out of memory");
+		return 0;
+	}
+
+	metrics_stats_flush(&writer);
+
+	ast_str_set(&http_header, 0, "Content-Type: text/plain; version=0.0.4\r\n");
+
+	/* Header and content released by ast_http_send */
+	ast_http_send(ser, method, 200, NULL, http_header, writer.out, 0, 0);
+
+	return 0;
+}
+
+/*! Complete pipe names for cli */
+static char *complete_pipe_choice(const char *word) {
+	int wordlen = strlen(word);
+	struct ao2_iterator i;
+	void *obj;
+
+	i = ao2_iterator_init(pipes, 0);
+	while(NULL != (obj = ao2_iterator_next(&i))) {
+		struct ast_kafka_pipe *pipe = obj;
+
+		if(0 == strncasecmp(word, pipe->id, wordlen)) {
+			ast_cli_completion_add(ast_strdup(pipe->id));
+		}
+
+		ao2_ref(obj, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return NULL;
+}
+
+/*! Show registered pipes */
+static int show_pipes_cb(void *obj, void *arg, int flags) {
+	struct ast_kafka_pipe *pipe = obj;
+	struct ast_cli_args *a = arg;
+
+	ast_cli(a->fd, "%s\n", pipe->id);
+
+	return 0;
+}
+
+static int cli_show_topic_cb(struct kafka_topic *topic, void *opaque_1, void *opaque_2, const void *options, struct ast_kafka_pipe *pipe) {
+	struct ast_cli_args *a = opaque_1;
+	const char *service_type = opaque_2;
+	RAII_VAR(struct kafka_service *, service, ao2_bump(topic->service), ao2_cleanup);
+	const struct rd_kafka_metadata *metadata;
+	rd_kafka_resp_err_t response;
+
+	ast_debug(3, "Kafka request %s (%p) for topic (%p)\n", service_type, service->rd_kafka, topic->rd_kafka_topic);
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR == (response = rd_kafka_metadata(service->rd_kafka, 1, topic->rd_kafka_topic, &metadata, service->timeout_ms))) {
+		int i;
+//		ast_cli(a->fd, "broker id=%d '%s', total brokers %d, total topics %d\n", metadata->orig_broker_id, metadata->orig_broker_name, metadata->broker_cnt, metadata->topic_cnt);
+
+		for(i = 0;i < metadata->topic_cnt;i++) {
+			const rd_kafka_metadata_topic_t *topic_metadata = metadata->topics + i;
+
+			ast_cli(a->fd, "On %s topic '%s' handled by broker %d '%s', total partitions %d, total brokers %d, status %s (%d)\n", 
+				service_type, topic_metadata->topic, metadata->orig_broker_id, metadata->orig_broker_name,
+				topic_metadata->partition_cnt,
+				metadata->broker_cnt, rd_kafka_err2str(topic_metadata->err), topic_metadata->err);
+		}
+
+		rd_kafka_metadata_destroy(metadata);
+	} else {
+		ast_log(LOG_ERROR, "Kafka get metadata got error: %s\n", rd_kafka_err2str(response));
+	}
+
+	if(0 == strcmp(service_type, "producers")) {
+		/* Union holds producer specific counters */
+		ast_cli(a->fd, "On %s topic '%s' queue full %d times, retried %d, dropped %d messages\n",
+			service_type, topic->id,
+			topic->service->specific.producer.queue_full_count,
+			topic->service->specific.producer.retried_count,
+			topic->service->specific.producer.dropped_count);
+
+		if(topic->service->specific.producer.spool) {
+			struct kafka_spool *spool = topic->service->specific.producer.spool;
+			const struct kafka_spool_header *header = (const struct kafka_spool_header *)spool->map;
+			uint64_t used;
+
+			ast_mutex_lock(&spool->lock);
+			used = header->tail - header->head;
+			ast_mutex_unlock(&spool->lock);
+
+			ast_cli(a->fd, "On %s topic '%s' spool '%s' used %lu of %zu bytes, spooled %d, replayed %d, overflow %d messages\n",
+				service_type, topic->id, spool->path, (unsigned long)used, spool->size,
+				spool->spooled_count, spool->replayed_count, spool->overflow_count);
+		}
+	}
+
+	return 0;
+}
+
+
+
+static void on_producer_created(const void *obj) {
+	const struct sorcery_kafka_producer *producer = obj;
+
+	ast_debug(3, "on_producer_created %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
+}
+
+static void on_producer_updated(const void *obj) {
+	const struct sorcery_kafka_producer *producer = obj;
+
+	ast_debug(3, "on_producer_updated %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
+}
+
+static void on_producer_deleted(const void *obj) {
+	const struct sorcery_kafka_producer *producer = obj;
+
+	ast_debug(3, "on_producer_deleted %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
+}
+
+static void on_producer_loaded(const char *type) {
+	ast_debug(3, "on_producer_loaded %s\n", type);
+}
+
+
+
+
+
+/*! Process all defined in configuration file clusters */
+static void process_all_clusters(void) {
+	RAII_VAR(struct ao2_container *, clusters, 
+		ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_CLUSTER, AST_RETRIEVE_FLAG_MULTIPLE | AST_RETRIEVE_FLAG_ALL, NULL), ao2_cleanup);
+
+	if(clusters) {
+		struct ao2_iterator i = ao2_iterator_init(clusters, 0);
+		struct sorcery_kafka_cluster *cluster;
+
+		while(NULL != (cluster = ao2_iterator_next(&i))) {
+			process_cluster(cluster);
+
+			ao2_ref(cluster, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+	}
+}
+
+/*! Process Kafka cluster */
+static void process_cluster(const struct sorcery_kafka_cluster *cluster) {
+	RAII_VAR(struct ast_variable *, filter, ast_variable_new("cluster", ast_sorcery_object_get_id(cluster), ""), ast_variables_destroy);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+
+	ast_debug(3, "Kafka cluster at %s (%p)\n", ast_sorcery_object_get_id(cluster), cluster);
+
+	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_PRODUCER, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
+		ast_log(LOG_WARNING, "Unable to retrieve producers from cluster %s\n", ast_sorcery_object_get_id(cluster));
+	} else {
+		struct ao2_iterator i = ao2_iterator_init(found, 0);
+		struct sorcery_kafka_producer *producer;
 
 		while(NULL != (producer = ao2_iterator_next(&i))) {
 			process_producer(cluster, producer);
 
-			ao2_ref(producer, -1);
+			ao2_ref(producer, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+
+		/* Producers processing complete */
+		ao2_cleanup(found);
+		found = NULL;
+	}
+
+	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_CONSUMER, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
+		ast_log(LOG_WARNING, "Unable to retrieve consumers from cluster %s\n", ast_sorcery_object_get_id(cluster));
+	} else {
+		struct ao2_iterator i = ao2_iterator_init(found, 0);
+		struct sorcery_kafka_consumer *consumer;
+
+		while(NULL != (consumer = ao2_iterator_next(&i))) {
+			process_consumer(cluster, consumer);
+
+			ao2_ref(consumer, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+	}
+}
+
+/*! Process Kafka producer at the cluster */
+static int process_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer) {
+	RAII_VAR(struct ast_variable *, filter, ast_variable_new("producer", ast_sorcery_object_get_id(sorcery_producer), ""), ast_variables_destroy);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+
+	ast_debug(3, "Process Kafka producer %s on cluster %s\n", ast_sorcery_object_get_id(sorcery_producer), ast_sorcery_object_get_id(sorcery_cluster));
+
+	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
+		ast_log(LOG_WARNING, "Unable to retrieve topics from producer %s at cluster %s\n", ast_sorcery_object_get_id(sorcery_producer), ast_sorcery_object_get_id(sorcery_cluster));
+	} else {
+		if(ao2_container_count(found)) {
+			/* Producers present */
+			struct kafka_service *producer = new_kafka_producer(sorcery_cluster, sorcery_producer);
+
+			if(NULL == producer) {
+				return -1;
+			} else {
+				struct ao2_iterator i = ao2_iterator_init(found, 0);
+				struct sorcery_kafka_topic *sorcery_topic;
+
+				while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
+					if(0 == process_producer_topic(producer, sorcery_topic)) {
+						producer->topic_count++;
+					}
+
+					ao2_ref(sorcery_topic, -1);
+				}
+
+				ao2_iterator_destroy(&i);
+
+				if(producer->topic_count) {
+					AST_RWDLLIST_WRLOCK(&producers);
+
+					/* Keep object reference count because list reference to it */
+					AST_RWDLLIST_INSERT_TAIL(&producers, producer, link);
+
+					AST_RWDLLIST_UNLOCK(&producers);
+
+					/* Assert monitor thread is running */
+					if(start_monitor_thread(producer->monitor)) {
+						ast_log(LOG_WARNING, "Unable to start monitoring thread.\n");
+					}
+				} else {
+					/* This producer has no topics */
+					ao2_ref(producer, -1);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*! Process Kafka consumer at the cluster */
+static int process_consumer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_consumer *sorcery_consumer) {
+	RAII_VAR(struct ast_variable *, filter, ast_variable_new("consumer", ast_sorcery_object_get_id(sorcery_consumer), ""), ast_variables_destroy);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+
+	ast_debug(3, "Process Kafka consumer %s on cluster %s\n", ast_sorcery_object_get_id(sorcery_consumer), ast_sorcery_object_get_id(sorcery_cluster));
+
+	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
+		ast_log(LOG_WARNING, "Unable to retrieve topics from consumer %s at cluster %s\n", ast_sorcery_object_get_id(sorcery_consumer), ast_sorcery_object_get_id(sorcery_cluster));
+	} else {
+		if(ao2_container_count(found)) {
+			/* Consumers present */
+			struct kafka_service *consumer = new_kafka_consumer(sorcery_cluster, sorcery_consumer);
+
+			if(NULL == consumer) {
+				return -1;
+			} else {
+				struct ao2_iterator i = ao2_iterator_init(found, 0);
+				struct sorcery_kafka_topic *sorcery_topic;
+
+				while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
+					if(0 == process_consumer_topic(consumer, sorcery_topic)) {
+						consumer->topic_count++;
+					}
+
+					ao2_ref(sorcery_topic, -1);
+				}
+
+				ao2_iterator_destroy(&i);
+
+				if(consumer->topic_count) {
+					if(consumer->specific.consumer.topic_partition_list) {
+						/* High-level consumer, initiate subscription */
+						rd_kafka_resp_err_t response = rd_kafka_subscribe(consumer->rd_kafka, consumer->specific.consumer.topic_partition_list);
+						
+						if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
+							ast_debug(3, "Subscribed to %d topic(s), waiting for rebalance and messages...\n", consumer->specific.consumer.topic_partition_list->cnt);
+						} else {
+							ast_log(LOG_ERROR, "Consumer '%s': unable to subscribe topics because %s\n", ast_sorcery_object_get_id(sorcery_consumer), rd_kafka_err2str(response));
+							
+							/* Consumer not usable */
+							ao2_ref(consumer, -1);
+							
+							return -1;
+						}
+
+						/* At this point we safe to free topic-partition list */
+						rd_kafka_topic_partition_list_destroy(consumer->specific.consumer.topic_partition_list);
+						consumer->specific.consumer.topic_partition_list = NULL;
+						
+						/* Redirect all messages from per-partition queues to
+						 * the main queue so that messages can be consumed with one
+						 * call from all assigned partitions.
+						 *
+						 * The alternative is to poll the main queue (for events)
+						 * and each partition queue separately, which requires setting
+						 * up a rebalance callback and keeping track of the assignment:
+						 * but that is more complex and typically not recommended. */
+						rd_kafka_poll_set_consumer(consumer->rd_kafka);
+
+						/* Private queue not used by high-level consumer, watch the consumer queue instead */
+						rd_kafka_queue_destroy(consumer->specific.consumer.queue);
+						consumer->specific.consumer.queue = rd_kafka_queue_get_consumer(consumer->rd_kafka);
+
+						if(service_watch_queue(consumer, consumer->specific.consumer.queue)) {
+							ast_log(LOG_ERROR, "Consumer '%s': unable to watch consumer queue events\n", ast_sorcery_object_get_id(sorcery_consumer));
+
+							/* Consumer not usable */
+							ao2_ref(consumer, -1);
+
+							return -1;
+						}
+					}
+					
+					AST_RWDLLIST_WRLOCK(&consumers);
+
+					/* Keep object reference count because list reference to it */
+					AST_RWDLLIST_INSERT_TAIL(&consumers, consumer, link);
+
+					AST_RWDLLIST_UNLOCK(&consumers);
+
+					/* Assert monitor thread is running */
+					if(start_monitor_thread(consumer->monitor)) {
+						ast_log(LOG_WARNING, "Unable to start monitoring thread.\n");
+					}
+				} else {
+					/* This consumer has no topics */
+					ao2_ref(consumer, -1);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*! Apply reloaded configuration, keep unchanged services and topics */
+static void reconcile_all_services(void) {
+	struct timeval start = ast_tvnow();
+
+	reconcile_services(KAFKA_PRODUCER);
+	reconcile_services(KAFKA_CONSUMER);
+
+	ast_debug(1, "Kafka services reconciled in %ld ms\n", (long)ast_tvdiff_ms(ast_tvnow(), start));
+}
+
+/*! Reconcile running services of the type (KAFKA_PRODUCER or KAFKA_CONSUMER), create new ones */
+static void reconcile_services(const char *type) {
+	int producer = !strcmp(type, KAFKA_PRODUCER);
+	RAII_VAR(struct ao2_container *, running, ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL), ao2_cleanup);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+	struct ao2_iterator i;
+	struct kafka_service *service;
+	void *sorcery_service;
+
+	if(NULL == running) {
+		return;
+	}
+
+	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, type, AST_RETRIEVE_FLAG_MULTIPLE | AST_RETRIEVE_FLAG_ALL, NULL))) {
+		ast_log(LOG_WARNING, "Unable to retrieve %ss, running services are kept\n", type);
+		return;
+	}
+
+	/* Services list is changed by the topics destructors */
+	if(producer) {
+		on_all_producers(reconcile_collect_cb, running, 1, 0);
+	} else {
+		on_all_consumers(reconcile_collect_cb, running, 1, 0);
+	}
+
+	i = ao2_iterator_init(running, 0);
+
+	while(NULL != (service = ao2_iterator_next(&i))) {
+		reconcile_service(service, type);
+		ao2_ref(service, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	/* Services not running with the new configuration */
+	i = ao2_iterator_init(found, 0);
+
+	while(NULL != (sorcery_service = ao2_iterator_next(&i))) {
+		const char *service_id = ast_sorcery_object_get_id(sorcery_service);
+		struct ao2_iterator j = ao2_iterator_init(running, 0);
+		int kept = 0;
+
+		while(!kept && (NULL != (service = ao2_iterator_next(&j)))) {
+			kept = !service->retired && !strcmp(ast_sorcery_object_get_id(service->sorcery_service), service_id);
+			ao2_ref(service, -1);
+		}
+
+		ao2_iterator_destroy(&j);
+
+		if(!kept) {
+			const char *cluster_id = producer ? ((struct sorcery_kafka_producer *)sorcery_service)->cluster_id : ((struct sorcery_kafka_consumer *)sorcery_service)->cluster_id;
+			RAII_VAR(struct sorcery_kafka_cluster *, sorcery_cluster, ast_sorcery_retrieve_by_id(kafka_sorcery, KAFKA_CLUSTER, cluster_id), ao2_cleanup);
+
+			if(NULL == sorcery_cluster) {
+				ast_log(LOG_WARNING, "Kafka %s '%s': cluster '%s' not found\n", type, service_id, cluster_id);
+			} else if(producer) {
+				process_producer(sorcery_cluster, sorcery_service);
+			} else {
+				process_consumer(sorcery_cluster, sorcery_service);
+			}
+		}
+
+		ao2_ref(sorcery_service, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+}
+
+/*! Collect running services */
+static int reconcile_collect_cb(struct kafka_service *service, void *opaque) {
+	if(!service->retired && service->sorcery_service) {
+		ao2_link(opaque, service);
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Reconcile running service with the reloaded configuration.
+ *
+ * Service options are fixed on librdkafka handle creation, so changed service or cluster
+ * retire the service. Otherwise only removed or changed topics are retired and new topics
+ * added. Retired topic release the service on the last one, the service flush queued messages.
+ *
+ * \return 0 if service kept, -1 if retired
+ */
+static int reconcile_service(struct kafka_service *service, const char *type) {
+	int producer = !strcmp(type, KAFKA_PRODUCER);
+	const char *service_id = ast_sorcery_object_get_id(service->sorcery_service);
+	RAII_VAR(void *, sorcery_service, ast_sorcery_retrieve_by_id(kafka_sorcery, type, service_id), ao2_cleanup);
+	RAII_VAR(struct sorcery_kafka_cluster *, sorcery_cluster, NULL, ao2_cleanup);
+	RAII_VAR(struct ast_variable *, filter, ast_variable_new(producer ? "producer" : "consumer", service_id, ""), ast_variables_destroy);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+	RAII_VAR(struct ao2_container *, retired, ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL), ao2_cleanup);
+	RAII_VAR(struct ao2_container *, added, ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL), ao2_cleanup);
+	int rebuild = (NULL == sorcery_service) || (NULL == filter) || (NULL == retired) || (NULL == added);
+	struct ao2_iterator i;
+	struct kafka_topic *topic;
+	struct sorcery_kafka_topic *sorcery_topic;
+
+	if(!rebuild) {
+		const char *cluster_id = producer ? ((struct sorcery_kafka_producer *)sorcery_service)->cluster_id : ((struct sorcery_kafka_consumer *)sorcery_service)->cluster_id;
+
+		sorcery_cluster = ast_sorcery_retrieve_by_id(kafka_sorcery, KAFKA_CLUSTER, cluster_id);
+		found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter);
+
+		rebuild = (NULL == sorcery_cluster) || (NULL == found)
+			|| sorcery_object_changed(service->sorcery_service, sorcery_service)
+			|| sorcery_object_changed(service->sorcery_cluster, sorcery_cluster);
+	}
+
+	if(!rebuild) {
+		/* Running topics removed from the service or changed */
+		i = ao2_iterator_init(service->topics, 0);
+
+		while(NULL != (topic = ao2_iterator_next(&i))) {
+			RAII_VAR(struct sorcery_kafka_topic *, current, ast_sorcery_retrieve_by_id(kafka_sorcery, KAFKA_TOPIC, ast_sorcery_object_get_id(topic->sorcery_topic)), ao2_cleanup);
+
+			if((NULL == current) || strcmp(producer ? current->producer_id : current->consumer_id, service_id)
+					|| sorcery_object_changed(topic->sorcery_topic, current)) {
+				ao2_link(retired, topic);
+			}
+
+			ao2_ref(topic, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+
+		/* New topics of the service */
+		i = ao2_iterator_init(found, 0);
+
+		while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
+			if(NULL == (topic = service_topic_by_sorcery_id(service, ast_sorcery_object_get_id(sorcery_topic)))) {
+				ao2_link(added, sorcery_topic);
+			} else if(sorcery_object_changed(topic->sorcery_topic, sorcery_topic)) {
+				/* Changed topic, running one is retired */
+				ao2_link(added, sorcery_topic);
+			}
+
+			ao2_cleanup(topic);
+			ao2_ref(sorcery_topic, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+
+		if(ao2_container_count(added) && !producer && !ast_strlen_zero(((struct sorcery_kafka_consumer *)sorcery_service)->group_id)) {
+			/* High-level consumer subscription is built once */
+			rebuild = 1;
+		}
+	}
+
+	if(!rebuild) {
+		/* librdkafka reuse existing topic handle and ignore the new topic options */
+		i = ao2_iterator_init(added, 0);
+
+		while(!rebuild && (NULL != (sorcery_topic = ao2_iterator_next(&i)))) {
+			RAII_VAR(struct kafka_topic *, same, ao2_find(service->topics, sorcery_topic->topic, OBJ_SEARCH_KEY), ao2_cleanup);
+
+			rebuild = (NULL != same);
+			ao2_ref(sorcery_topic, -1);
+		}
+
+		ao2_iterator_destroy(&i);
+	}
+
+	if(rebuild) {
+		ast_debug(1, "Kafka %s '%s' retired by reload\n", type, service_id);
+
+		retire_service(service, type);
+
+		return -1;
+	}
+
+	/* Added before retired, so the service is not released on the last retired topic */
+	i = ao2_iterator_init(added, 0);
+
+	while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
+		if(0 == (producer ? process_producer_topic(service, sorcery_topic) : process_consumer_topic(service, sorcery_topic))) {
+			if(producer) {
+				AST_RWDLLIST_WRLOCK(&producers);
+				service->topic_count++;
+				AST_RWDLLIST_UNLOCK(&producers);
+			} else {
+				AST_RWDLLIST_WRLOCK(&consumers);
+				service->topic_count++;
+				AST_RWDLLIST_UNLOCK(&consumers);
+			}
+
+			ast_debug(1, "Kafka %s '%s': topic '%s' added by reload\n", type, service_id, ast_sorcery_object_get_id(sorcery_topic));
+		}
+
+		ao2_ref(sorcery_topic, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	i = ao2_iterator_init(retired, 0);
+
+	while(NULL != (topic = ao2_iterator_next(&i))) {
+		ast_debug(1, "Kafka %s '%s': topic '%s' retired by reload\n", type, service_id, ast_sorcery_object_get_id(topic->sorcery_topic));
+		retire_service_topic(service, topic, type);
+		ao2_ref(topic, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	return 0;
+}
+
+/*! Compare sorcery objects, changed if differ or can't be compared */
+static int sorcery_object_changed(const void *original, const void *modified) {
+	struct ast_variable *changes = NULL;
+	int changed;
+
+	if(original == modified) {
+		return 0;
+	}
+
+	if(ast_sorcery_diff(kafka_sorcery, original, modified, &changes)) {
+		return 1;
+	}
+
+	changed = (NULL != changes);
+
+	ast_variables_destroy(changes);
+
+	return changed;
+}
+
+/*! Find referenced service topic by sorcery topic id */
+static struct kafka_topic *service_topic_by_sorcery_id(struct kafka_service *service, const char *sorcery_id) {
+	struct ao2_iterator i = ao2_iterator_init(service->topics, 0);
+	struct kafka_topic *topic;
+
+	while(NULL != (topic = ao2_iterator_next(&i))) {
+		if(topic->sorcery_topic && !strcmp(ast_sorcery_object_get_id(topic->sorcery_topic), sorcery_id)) {
+			break;
+		}
+
+		ao2_ref(topic, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	return topic;
+}
+
+/*! Retire service with all its topics, released with the last topic */
+static void retire_service(struct kafka_service *service, const char *type) {
+	struct ao2_iterator i;
+	struct kafka_topic *topic;
+
+	if(!strcmp(type, KAFKA_PRODUCER)) {
+		AST_RWDLLIST_WRLOCK(&producers);
+		service->retired = 1;
+		AST_RWDLLIST_UNLOCK(&producers);
+	} else {
+		AST_RWDLLIST_WRLOCK(&consumers);
+		service->retired = 1;
+		AST_RWDLLIST_UNLOCK(&consumers);
+	}
+
+	i = ao2_iterator_init(service->topics, 0);
+
+	while(NULL != (topic = ao2_iterator_next(&i))) {
+		retire_service_topic(service, topic, type);
+		ao2_ref(topic, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+}
+
+/*! Remove topic from its pipe and service, released by the last user */
+static void retire_service_topic(struct kafka_service *service, struct kafka_topic *topic, const char *type) {
+	RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(topic->sorcery_topic->pipe_id, 0), ao2_cleanup);
+
+	ao2_unlink(service->topics, topic);
+
+	if(NULL == pipe) {
+		return;
+	}
+
+	if(!strcmp(type, KAFKA_PRODUCER)) {
+		AST_LIST_LOCK(&pipe->producer_topics);
+
+		if(AST_LIST_REMOVE(&pipe->producer_topics, topic, link)) {
+			/* Publishers stop to use the topic on the next send */
+			pipe_update_producer_snapshot(pipe);
+
+			/* Object removed from the list */
+			ao2_ref(topic, -1);
+		}
+
+		AST_LIST_UNLOCK(&pipe->producer_topics);
+	} else {
+		AST_LIST_LOCK(&pipe->consumer_topics);
+
+		if(AST_LIST_REMOVE(&pipe->consumer_topics, topic, link)) {
+			/* Object removed from the list */
+			ao2_ref(topic, -1);
+		}
+
+		AST_LIST_UNLOCK(&pipe->consumer_topics);
+	}
+}
+
+/*! Create new producer service object */
+static struct kafka_service *new_kafka_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer) {
+	rd_kafka_conf_t *config = build_rdkafka_cluster_config(sorcery_cluster);
+	struct kafka_service *producer;
+
+	if(NULL == config) {
+		return NULL;
+	} else {
+		/* Set producer-specific configuration options */
+		static const char *service_type = "producer";
+		const char *service_id = ast_sorcery_object_get_id(sorcery_producer);
+		const char *cluster_id = ast_sorcery_object_get_id(sorcery_cluster);
+		
+		if(service_add_property_uint(config, "retry.backoff.ms", sorcery_producer->retry_backoff_ms, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+
+		if(service_add_property_int(config, "request.required.acks", sorcery_producer->request_required_acks, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+		
+		if(service_add_property_uint(config, "message.send.max.retries", sorcery_producer->message_send_max_retries, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+
+		if(service_add_property_uint(config, "max.in.flight.requests.per.connection", sorcery_producer->max_in_flight_requests_per_connection, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+
+		if(service_add_property_string(config, "enable.idempotence", sorcery_producer->enable_idempotence ? "true" : "false", service_type, service_id, cluster_id)) {
+			/* On current version librdkafka idempotence producers not supported yet */
+			ast_log(LOG_WARNING, "Current version librdkafka (%s) not support dempotence producers.\n", rd_kafka_version_str());
+		}
+		
+		if(service_add_property_string(config, "transactional.id", sorcery_producer->transactional_id, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+
+		if(service_add_property_string(config, "client.id", ast_sorcery_object_get_id(sorcery_producer), service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+		
+		if(service_add_property_string(config, "debug", sorcery_producer->debug, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+
+		if(sorcery_producer->statistics_interval_ms) {
+			if(service_add_property_uint(config, "statistics.interval.ms", sorcery_producer->statistics_interval_ms, service_type, service_id, cluster_id)) {
+				rd_kafka_conf_destroy(config);
+				return NULL;
+			}
+
+			/* Statistics served by producer poll */
+			rd_kafka_conf_set_stats_cb(config, on_connection_statistics);
+		}
+
+		if(service_add_property_string(config, "compression.type", sorcery_producer->compression_type, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		} else {
+			/* Latency vs. throughput tuning, negative keep librdkafka default */
+			const struct {
+				const char *property;
+				int value;
+			} tuning[] = {
+				{ "linger.ms", sorcery_producer->linger_ms },
+				{ "batch.num.messages", sorcery_producer->batch_num_messages },
+				{ "batch.size", sorcery_producer->batch_size },
+				{ "queue.buffering.max.messages", sorcery_producer->queue_buffering_max_messages },
+				{ "queue.buffering.max.kbytes", sorcery_producer->queue_buffering_max_kbytes },
+			};
+			unsigned int i;
+
+			for(i = 0;i < ARRAY_LEN(tuning);i++) {
+				if((tuning[i].value >= 0) && service_add_property_int(config, tuning[i].property, tuning[i].value, service_type, service_id, cluster_id)) {
+					rd_kafka_conf_destroy(config);
+					return NULL;
+				}
+			}
+		}
+
+		/* Passthrough properties override typed options */
+		if(service_add_properties(config, sorcery_producer->rdkafka_properties, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+	}
+
+	if(NULL == (producer = new_kafka_service(kafka_producer_destructor))) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': Unable to create producer '%s' because Out of memory\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_producer));
+	} else {
+		/* Compared with the reloaded configuration */
+		producer->sorcery_service = ao2_bump((struct sorcery_kafka_producer *)sorcery_producer);
+		producer->sorcery_cluster = ao2_bump((struct sorcery_kafka_cluster *)sorcery_cluster);
+
+		if(sorcery_producer->spool) {
+			enum kafka_spool_sync sync = KAFKA_SPOOL_SYNC_PERIODIC;
+			const char *path = sorcery_producer->spool_file;
+
+			if(0 == strcasecmp(sorcery_producer->spool_sync, "none")) {
+				sync = KAFKA_SPOOL_SYNC_NONE;
+			} else if(0 == strcasecmp(sorcery_producer->spool_sync, "always")) {
+				sync = KAFKA_SPOOL_SYNC_ALWAYS;
+			} else if(strcasecmp(sorcery_producer->spool_sync, "periodic")) {
+				ast_log(LOG_WARNING,
+					"Unknown spool_sync value '%s'. Valid values are 'none', 'periodic', 'always'.\n",
+					sorcery_producer->spool_sync);
+			}
+
+			if(ast_strlen_zero(path)) {
+				char *default_path = ast_alloca(strlen(ast_config_AST_SPOOL_DIR) + strlen(ast_sorcery_object_get_id(sorcery_producer)) + sizeof("/kafka/.spool"));
+
+				sprintf(default_path, "%s/kafka/%s.spool", ast_config_AST_SPOOL_DIR, ast_sorcery_object_get_id(sorcery_producer));
+				path = default_path;
+			}
+
+			if(NULL == (producer->specific.producer.spool = kafka_spool_open(path, (size_t)sorcery_producer->spool_size * 1024 * 1024, sync))) {
+				ast_log(LOG_WARNING, "Producer '%s' work without spool\n", ast_sorcery_object_get_id(sorcery_producer));
+			}
+		}
+
+		if(0 == strcasecmp(sorcery_producer->on_queue_full, "block")) {
+			producer->specific.producer.queue_full_policy = KAFKA_QUEUE_FULL_BLOCK;
+		} else if(0 == strcasecmp(sorcery_producer->on_queue_full, "spill")) {
+			if(NULL == producer->specific.producer.spool) {
+				ast_log(LOG_WARNING, "Producer '%s': on_queue_full=spill require spool, messages will be dropped\n", ast_sorcery_object_get_id(sorcery_producer));
+			}
+
+			producer->specific.producer.queue_full_policy = KAFKA_QUEUE_FULL_SPILL;
+		} else {
+			if(strcasecmp(sorcery_producer->on_queue_full, "drop")) {
+				ast_log(LOG_WARNING,
+					"Unknown on_queue_full value '%s'. Valid values are 'drop', 'block', 'spill'.\n",
+					sorcery_producer->on_queue_full);
+			}
+
+			producer->specific.producer.queue_full_policy = KAFKA_QUEUE_FULL_DROP;
+		}
+
+		if(sorcery_producer->queue_full_timeout_ms > KAFKA_QUEUE_FULL_MAX_TIMEOUT_MS) {
+			ast_log(LOG_WARNING, "Producer '%s': queue_full_timeout %u too large, limited to %u ms.\n",
+				ast_sorcery_object_get_id(sorcery_producer), sorcery_producer->queue_full_timeout_ms, KAFKA_QUEUE_FULL_MAX_TIMEOUT_MS);
+
+			producer->specific.producer.queue_full_timeout_ms = KAFKA_QUEUE_FULL_MAX_TIMEOUT_MS;
+		} else {
+			producer->specific.producer.queue_full_timeout_ms = sorcery_producer->queue_full_timeout_ms;
+		}
+
+		producer->timeout_ms = sorcery_producer->timeout_ms;
+		/* Key policy and partition are resolved by the producer's topics */
+		producer->partition = RD_KAFKA_PARTITION_UA;
+		producer->topic_count = 0;
+		producer->monitor = select_service_monitor(ast_sorcery_object_get_id(sorcery_producer), sorcery_producer->poller);
+		producer->poll = producer_poll;
+
+		/* Handle reused by producers of the cluster with the same configuration, configuration released */
+		if(NULL == (producer->specific.producer.connection = kafka_connection_attach(producer, sorcery_cluster, config))) {
+			ao2_ref(producer, -1);
+			return NULL;
+		}
+
+		producer->rd_kafka = producer->specific.producer.connection->rd_kafka;
+
+		ast_debug(3, "Producer service '%s' (%p) for cluster '%s' have handle %p\n",
+				ast_sorcery_object_get_id(sorcery_producer), producer,
+				ast_sorcery_object_get_id(sorcery_cluster), producer->rd_kafka);
+
+		return producer;
+	}
+
+	rd_kafka_conf_destroy(config);
+
+	ao2_cleanup(producer);
+
+	return NULL;
+}
+
+static void kafka_producer_destructor(void *obj) {
+	struct kafka_service *producer = obj;
+
+	if(producer->specific.producer.connection) {
+		/* Main queue watched by other producer, handle destroyed by the last one */
+		kafka_connection_detach(producer->specific.producer.connection, producer);
+	}
+
+	ast_alertpipe_close(producer->alert_pipe);
+
+	/* Messages left in the spool replayed after restart */
+	kafka_spool_close(producer->specific.producer.spool);
+	
+	ao2_cleanup(producer->topics);
+	ao2_cleanup(producer->sorcery_service);
+	ao2_cleanup(producer->sorcery_cluster);
+
+	ao2_cleanup(producer->stats);
+	ao2_global_obj_release(producer->rdkafka_stats);
+	ast_rwlock_destroy(&producer->rdkafka_stats.lock);
+}
+
+/*!
+ * \brief Get referenced librdkafka handle for the producer.
+ *
+ * Producers of the same cluster with the same effective configuration (producer's
+ * own client.id excepted) share one handle, so broker connections and librdkafka threads
+ * are not multiplied by the number of producers. librdkafka keep one topic handle per name,
+ * so producers with the same topic names get own handle. Configuration is always released.
+ */
+static struct kafka_connection *kafka_connection_attach(struct kafka_service *producer, const struct sorcery_kafka_cluster *sorcery_cluster, rd_kafka_conf_t *config) {
+	const char *cluster_id = ast_sorcery_object_get_id(sorcery_cluster);
+	const char *producer_id = ast_sorcery_object_get_id(producer->sorcery_service);
+	struct ast_str *key = kafka_connection_key(cluster_id, producer_id, config);
+	struct kafka_connection *connection;
+	int link = 1;
+
+	if((NULL == key) || (NULL == connections)) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create producer '%s' because Out of memory\n", cluster_id, producer_id);
+		ast_free(key);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	ao2_lock(connections);
+
+	if((NULL != (connection = ao2_find(connections, ast_str_buffer(key), OBJ_SEARCH_KEY | OBJ_NOLOCK)))
+		&& kafka_connection_overlap(connection, producer->sorcery_service)) {
+		/* Topic options and callbacks can't be shared, private handle of this producer */
+		ast_debug(3, "Kafka cluster '%s': producer '%s' topics already produced by handle %p\n", cluster_id, producer_id, connection->rd_kafka);
+
+		ao2_ref(connection, -1);
+		ast_str_append(&key, 0, "\nproducer=%s", producer_id);
+
+		if((NULL != (connection = ao2_find(connections, ast_str_buffer(key), OBJ_SEARCH_KEY | OBJ_NOLOCK)))
+			&& kafka_connection_overlap(connection, producer->sorcery_service)) {
+			/* Private handle of the replaced producer instance still alive, don't link the new one */
+			ao2_ref(connection, -1);
+			connection = NULL;
+			link = 0;
+		}
+	}
+
+	if(NULL != connection) {
+		/* Same cluster and configuration, handle reused */
+		ast_debug(3, "Kafka cluster '%s': producer '%s' share handle %p\n", cluster_id, producer_id, connection->rd_kafka);
+
+		rd_kafka_conf_destroy(config);
+	} else if((NULL != (connection = new_kafka_connection(ast_str_buffer(key), config, cluster_id, producer_id))) && link) {
+		ao2_link_flags(connections, connection, OBJ_NOLOCK);
+	}
+
+	if(connection) {
+		ao2_lock(connection);
+
+		AST_LIST_INSERT_TAIL(&connection->services, producer, specific.producer.connection_link);
+
+		if(AST_LIST_FIRST(&connection->services) == producer) {
+			/* Delivery reports signalled to the first producer */
+			service_watch_queue(producer, connection->main_queue);
+		}
+
+		ao2_unlock(connection);
+	}
+
+	ao2_unlock(connections);
+
+	ast_free(key);
+
+	return connection;
+}
+
+/*! Release producer's reference to the shared handle */
+static void kafka_connection_detach(struct kafka_connection *connection, struct kafka_service *producer) {
+	if(connections) {
+		/* Not reused while detached */
+		ao2_lock(connections);
+	}
+
+	ao2_lock(connection);
+
+	if(AST_LIST_FIRST(&connection->services) == producer) {
+		AST_LIST_REMOVE_HEAD(&connection->services, specific.producer.connection_link);
+
+		if(AST_LIST_EMPTY(&connection->services)) {
+			/* Producer alert pipe will be closed */
+			rd_kafka_queue_io_event_enable(connection->main_queue, -1, NULL, 0);
+		} else {
+			/* Delivery reports signalled to the next producer */
+			service_watch_queue(AST_LIST_FIRST(&connection->services), connection->main_queue);
+		}
+	} else {
+		AST_LIST_REMOVE(&connection->services, producer, specific.producer.connection_link);
+	}
+
+	if(connections && AST_LIST_EMPTY(&connection->services)) {
+		/* Handle destroyed with the last reference */
+		ao2_unlink_flags(connections, connection, OBJ_NOLOCK);
+	}
+
+	ao2_unlock(connection);
+
+	if(connections) {
+		ao2_unlock(connections);
+	}
+
+	ao2_ref(connection, -1);
+}
+
+/*! Create shared librdkafka producer handle, configuration owned by the handle or released */
+static struct kafka_connection *new_kafka_connection(const char *key, rd_kafka_conf_t *config, const char *cluster_id, const char *producer_id) {
+	struct kafka_connection *connection = ao2_alloc(sizeof(*connection) + strlen(key) + 1, kafka_connection_destructor);
+	char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+
+	if(NULL == connection) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create producer '%s' because Out of memory\n", cluster_id, producer_id);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	strcpy(connection->key, key);
+	connection->rd_kafka = NULL;
+	connection->main_queue = NULL;
+	AST_LIST_HEAD_INIT_NOLOCK(&connection->services);
+
+	/* Passed to on_connection_statistics as opaque value, delivery reports use the topic opaque */
+	rd_kafka_conf_set_opaque(config, connection);
+
+	/* Processed message callback */
+	rd_kafka_conf_set_dr_msg_cb(config, on_producer_message_processed);
+
+	/* Attempt to creare librdkafka producer */
+	if(NULL == (connection->rd_kafka = rd_kafka_new(RD_KAFKA_PRODUCER, config, errstr, KAFKA_ERRSTR_MAX_SIZE))) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create producer '%s' because %s\n", cluster_id, producer_id, errstr);
+		rd_kafka_conf_destroy(config);
+		ao2_ref(connection, -1);
+		return NULL;
+	}
+
+	/* Delivery reports arrive to the main queue */
+	if(NULL == (connection->main_queue = rd_kafka_queue_get_main(connection->rd_kafka))) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': unable to watch producer '%s' events\n", cluster_id, producer_id);
+		ao2_ref(connection, -1);
+		return NULL;
+	}
+
+	return connection;
+}
+
+static void kafka_connection_destructor(void *obj) {
+	struct kafka_connection *connection = obj;
+
+	if(connection->main_queue) {
+		service_unwatch_queue(connection->main_queue);
+	}
+
+	if(connection->rd_kafka) {
+		ast_debug(3, "Destroy shared rd_kafka_t object %p\n", connection->rd_kafka);
+		rd_kafka_destroy(connection->rd_kafka);
+	}
+}
+
+/*! Build shared handle key from the cluster id and configuration properties, NULL on Out of memory */
+static struct ast_str *kafka_connection_key(const char *cluster_id, const char *producer_id, rd_kafka_conf_t *config) {
+	struct ast_str *key = ast_str_create(1024);
+	const char **properties;
+	size_t count;
+	size_t i;
+
+	if(NULL == key) {
+		return NULL;
+	}
+
+	ast_str_set(&key, 0, "%s", cluster_id);
+
+	properties = rd_kafka_conf_dump(config, &count);
+
+	for(i = 0;i + 1 < count;i += 2) {
+		if((0 == strcmp(properties[i], "client.id")) && (0 == strcmp(properties[i + 1], producer_id))) {
+			/* Default client.id is the producer id, the first producer's one is used */
+			continue;
+		}
+
+		ast_str_append(&key, 0, "\n%s=%s", properties[i], properties[i + 1]);
+	}
+
+	rd_kafka_conf_dump_free(properties, count);
+
+	return key;
+}
+
+/*! Find referenced producer's topic on the shared handle by Kafka topic name, NULL if not found */
+static struct kafka_topic *kafka_connection_topic(struct kafka_connection *connection, const char *topic_name) {
+	struct kafka_topic *topic = NULL;
+	struct kafka_service *producer;
+
+	ao2_lock(connection);
+
+	AST_LIST_TRAVERSE(&connection->services, producer, specific.producer.connection_link) {
+		if(NULL != (topic = ao2_find(producer->topics, topic_name, OBJ_SEARCH_KEY))) {
+			break;
+		}
+	}
+
+	ao2_unlock(connection);
+
+	return topic;
+}
+
+/*! Replay spools of all producers using the handle, return the largest number of replayed records */
+static int kafka_connection_replay(struct kafka_connection *connection, int budget) {
+	struct kafka_service *producer;
+	int replayed = 0;
+
+	/* Producers not referenced, lock keep them while replayed */
+	ao2_lock(connection);
+
+	AST_LIST_TRAVERSE(&connection->services, producer, specific.producer.connection_link) {
+		struct kafka_spool *spool = producer->specific.producer.spool;
+		int count;
+
+		if((NULL == spool) || (ao2_ref(producer, 0) <= 0)) {
+			/* No spool or producer is being destroyed */
+			continue;
+		}
+
+		if(!kafka_spool_empty(spool) && ((count = kafka_spool_replay(producer, budget)) > replayed)) {
+			replayed = count;
+		}
+
+		kafka_spool_sync(spool, 0);
+	}
+
+	ao2_unlock(connection);
+
+	return replayed;
+}
+
+/*! Check if any topic of the producer is already produced by other producer on the handle */
+static int kafka_connection_overlap(struct kafka_connection *connection, const struct sorcery_kafka_producer *sorcery_producer) {
+	RAII_VAR(struct ast_variable *, filter, ast_variable_new("producer", ast_sorcery_object_get_id(sorcery_producer), ""), ast_variables_destroy);
+	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+	struct ao2_iterator i;
+	struct sorcery_kafka_topic *sorcery_topic;
+	int overlap = 0;
+
+	if((NULL == filter) || (NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter)))) {
+		/* Unknown topics, don't share */
+		return 1;
+	}
+
+	i = ao2_iterator_init(found, 0);
+
+	while(!overlap && (NULL != (sorcery_topic = ao2_iterator_next(&i)))) {
+		struct kafka_topic *topic = kafka_connection_topic(connection, sorcery_topic->topic);
+
+		if(topic) {
+			overlap = 1;
+			ao2_ref(topic, -1);
+		}
+
+		ao2_ref(sorcery_topic, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	return overlap;
+}
+
+/*! Calculate shared handle hash */
+AO2_STRING_FIELD_HASH_FN(kafka_connection, key)
+/*! Compare shared handles */
+AO2_STRING_FIELD_CMP_FN(kafka_connection, key)
+
+/*! Create new consumer service object */
+static struct kafka_service *new_kafka_consumer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_consumer *sorcery_consumer) {
+	rd_kafka_conf_t *config = build_rdkafka_cluster_config(sorcery_cluster);
+	struct kafka_service *consumer;
+
+	if(NULL == config) {
+		return NULL;
+	} else {
+		/* Set consumer-specific configuration options */
+		static const char *service_type = "consumer";
+		const char *service_id = ast_sorcery_object_get_id(sorcery_consumer);
+		const char *cluster_id = ast_sorcery_object_get_id(sorcery_cluster);
+
+		if(ast_strlen_zero(sorcery_consumer->group_id)) {
+			ast_debug(3, "Consumer '%s' without 'group_id' is low-level consumer\n", service_id);
+		} else {		
+			if(service_add_property_string(config, "group.id", sorcery_consumer->group_id, service_type, service_id, cluster_id)) {
+				rd_kafka_conf_destroy(config);
+				return NULL;
+			}	
+		}
+
+		if(!strcasecmp(sorcery_consumer->commit_mode, "processed") && !ast_strlen_zero(sorcery_consumer->group_id)) {
+			/* Offsets stored and committed when processed */
+			if(service_add_property_string(config, "enable.auto.commit", "false", service_type, service_id, cluster_id)
+				|| service_add_property_string(config, "enable.auto.offset.store", "false", service_type, service_id, cluster_id)) {
+				rd_kafka_conf_destroy(config);
+				return NULL;
+			}
+
+			/* Asynchronous commit results served by consumer poll */
+			rd_kafka_conf_set_offset_commit_cb(config, on_consumer_offsets_committed);
+
+			/* Processed offsets committed and revoked partitions forgotten before unassign */
+			rd_kafka_conf_set_rebalance_cb(config, on_consumer_rebalance);
+		} else if(service_add_property_string(config, "enable.auto.commit", sorcery_consumer->enable_auto_commit ? "true" : "false", service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+
+		if(service_add_property_uint(config, "auto.commit.interval.ms", sorcery_consumer->auto_commit_interval_ms, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+
+		/* Emit RD_KAFKA_RESP_ERR__PARTITION_EOF event whenever the consumer reaches the end of a partition. */
+		if(service_add_property_string(config, "enable.partition.eof", "true", service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+		
+		if(service_add_property_string(config, "client.id", ast_sorcery_object_get_id(sorcery_consumer), service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+		
+		if(service_add_property_string(config, "debug", sorcery_consumer->debug, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}		
+
+		if(sorcery_consumer->statistics_interval_ms) {
+			if(service_add_property_uint(config, "statistics.interval.ms", sorcery_consumer->statistics_interval_ms, service_type, service_id, cluster_id)) {
+				rd_kafka_conf_destroy(config);
+				return NULL;
+			}
+
+			/* Statistics served by consumer poll */
+			rd_kafka_conf_set_stats_cb(config, on_service_statistics);
+		}
+
+		/* Passthrough properties override typed options */
+		if(service_add_properties(config, sorcery_consumer->rdkafka_properties, service_type, service_id, cluster_id)) {
+			rd_kafka_conf_destroy(config);
+			return NULL;
+		}
+	}
+
+	if(NULL == (consumer = new_kafka_service(kafka_consumer_destructor))) {
+		ast_log(LOG_ERROR, "Kafka cluster '%s': Unable to create consumer '%s' because Out of memory\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer));
+	} else {
+		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+
+		/* Compared with the reloaded configuration */
+		consumer->sorcery_service = ao2_bump((struct sorcery_kafka_consumer *)sorcery_consumer);
+		consumer->sorcery_cluster = ao2_bump((struct sorcery_kafka_cluster *)sorcery_cluster);
+
+		consumer->rd_kafka = NULL;
+		consumer->specific.consumer.queue = NULL;
+		consumer->specific.consumer.batch = NULL;
+		consumer->specific.consumer.batch_size = 0;
+		consumer->specific.consumer.batch_pool = NULL;
+		consumer->specific.consumer.batch_count = 0;
+		consumer->specific.consumer.batch_timeout_ms = 0;
+		consumer->specific.consumer.tracker = NULL;
+
+		if(!strcasecmp(sorcery_consumer->commit_mode, "processed")) {
+			if(ast_strlen_zero(sorcery_consumer->group_id)) {
+				ast_log(LOG_WARNING, "Consumer '%s': commit_mode=processed require 'group_id', offsets are not tracked\n", ast_sorcery_object_get_id(sorcery_consumer));
+			} else if(NULL == (consumer->specific.consumer.tracker = new_kafka_commit_tracker(sorcery_consumer))) {
+				rd_kafka_conf_destroy(config);
+				ao2_cleanup(consumer);
+				return NULL;
+			}
+		} else if(strcasecmp(sorcery_consumer->commit_mode, "auto")) {
+			ast_log(LOG_WARNING, "Consumer '%s': unknown commit_mode '%s', auto used\n", ast_sorcery_object_get_id(sorcery_consumer), sorcery_consumer->commit_mode);
+		}
+
+		if(ast_strlen_zero(sorcery_consumer->group_id)) {
+			/* Low-level consumer */
+			consumer->specific.consumer.topic_partition_list = NULL;
+
+			if(consumer_partitions_parse(consumer, sorcery_consumer)) {
+				rd_kafka_conf_destroy(config);
+				ao2_cleanup(consumer);
+				return NULL;
+			}
+		} else {
+			if(!ast_strlen_zero(sorcery_consumer->partitions)) {
+				ast_log(LOG_WARNING, "Consumer '%s': partitions are assigned by the group, 'partitions' ignored\n", ast_sorcery_object_get_id(sorcery_consumer));
+			}
+
+			/* High-level consumer, default for 1 topic (can be extended when need) */
+			if(NULL == (consumer->specific.consumer.topic_partition_list = rd_kafka_topic_partition_list_new(1))) {
+				rd_kafka_conf_destroy(config);
+				ao2_cleanup(consumer);
+				return NULL;
+			}
+		}
+		
+		consumer->timeout_ms = sorcery_consumer->timeout_ms;
+		consumer->partition = (sorcery_consumer->partition < 0) ? RD_KAFKA_PARTITION_UA : sorcery_consumer->partition;
+
+		if(sorcery_consumer->batch_size > 1) {
+			/* Forward received messages by batches */
+			if((NULL == (consumer->specific.consumer.batch = ast_calloc(sorcery_consumer->batch_size, sizeof(rd_kafka_message_t *))))
+					|| (NULL == (consumer->specific.consumer.batch_pool = new_kafka_batch_pool()))) {
+				rd_kafka_conf_destroy(config);
+				ao2_cleanup(consumer);
+				return NULL;
+			}
+
+			consumer->specific.consumer.batch_size = sorcery_consumer->batch_size;
+			consumer->specific.consumer.batch_timeout_ms = sorcery_consumer->batch_timeout_ms;
+		}
+		consumer->topic_count = 0;
+		consumer->monitor = select_service_monitor(ast_sorcery_object_get_id(sorcery_consumer), sorcery_consumer->poller);
+
+		/* Passed to on_consumer_message_processed as opaque value */
+		rd_kafka_conf_set_opaque(config, consumer);
+
+		/* Processed message callback */
+		rd_kafka_conf_set_dr_msg_cb(config, on_consumer_message_processed);
+
+		/* Attempt to creare librdkafka consumer */
+		if(NULL == (consumer->rd_kafka = rd_kafka_new(RD_KAFKA_CONSUMER, config, errstr, KAFKA_ERRSTR_MAX_SIZE))) {
+			ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create consumer '%s' because %s\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer), errstr);
+		} else {
+			if(consumer->specific.consumer.tracker) {
+				/* Handle used for commits until consumer closed */
+				consumer->specific.consumer.tracker->rd_kafka = consumer->rd_kafka;
+			}
+
+			if(NULL == (consumer->specific.consumer.queue = rd_kafka_queue_new(consumer->rd_kafka))) {
+				ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create consumer '%s' queue because %s\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer), errstr);
+			} else if(consumer->specific.consumer.topic_partition_list) {
+				/* High-level consumer, queue events watched after subscription */
+				consumer->poll = high_level_consumer_poll;
+
+				ast_debug(3, "Consumer service '%s' (%p) for cluster '%s' have handle %p\n",
+						ast_sorcery_object_get_id(sorcery_consumer), consumer,
+						ast_sorcery_object_get_id(sorcery_cluster), consumer->rd_kafka);
+
+				return consumer;
+			} else {
+				/* Low-level consumer, events on the main queue and messages on the consumer queue */
+				consumer->main_queue = rd_kafka_queue_get_main(consumer->rd_kafka);
+				consumer->poll = low_level_consumer_poll;
+
+				if(service_watch_queue(consumer, consumer->main_queue) || service_watch_queue(consumer, consumer->specific.consumer.queue)) {
+					ast_log(LOG_ERROR, "Kafka cluster '%s': unable to watch consumer '%s' events\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer));
+
+					/* Handle released by the destructor */
+					ao2_ref(consumer, -1);
+					return NULL;
+				}
+
+				ast_debug(3, "Consumer service '%s' (%p) for cluster '%s' have handle %p\n",
+						ast_sorcery_object_get_id(sorcery_consumer), consumer,
+						ast_sorcery_object_get_id(sorcery_cluster), consumer->rd_kafka);
+
+				return consumer;
+			}
+
+			rd_kafka_destroy(consumer->rd_kafka);
+			consumer->rd_kafka = NULL;
+
+			ao2_cleanup(consumer);
+
+			return NULL;
+		}
+	}
+
+	rd_kafka_conf_destroy(config);
+
+	ao2_cleanup(consumer);
+
+	return NULL;
+}
+
+static void kafka_consumer_destructor(void *obj) {
+	struct kafka_service *consumer = obj;
+
+	if(consumer->specific.consumer.topic_partition_list) {
+		/* Subscription list still exist */
+		rd_kafka_topic_partition_list_destroy(consumer->specific.consumer.topic_partition_list);
+	}
+
+	while(consumer->specific.consumer.batch_count) {
+		/* Not forwarded messages redelivered from committed offsets */
+		rd_kafka_message_destroy(consumer->specific.consumer.batch[--consumer->specific.consumer.batch_count]);
+	}
+
+	ast_free(consumer->specific.consumer.batch);
+	ao2_cleanup(consumer->specific.consumer.batch_pool);
+	ast_free(consumer->specific.consumer.partitions);
+
+	if(consumer->specific.consumer.tracker) {
+		/* Messages still referenced by subscribers are not committed */
+		kafka_commit_detach(consumer->specific.consumer.tracker);
+		ao2_ref(consumer->specific.consumer.tracker, -1);
+	}
+	
+	if(consumer->specific.consumer.queue) {
+		service_unwatch_queue(consumer->specific.consumer.queue);
+	}
+
+	if(consumer->main_queue) {
+		service_unwatch_queue(consumer->main_queue);
+	}
+
+	if(consumer->rd_kafka) {
+		ast_debug(3, "Destroy rd_kafka_t object %p on consumer %p\n", consumer->rd_kafka, consumer);
+		rd_kafka_destroy(consumer->rd_kafka);
+	}
+
+	ast_alertpipe_close(consumer->alert_pipe);
+
+	ao2_cleanup(consumer->topics);
+	ao2_cleanup(consumer->sorcery_service);
+	ao2_cleanup(consumer->sorcery_cluster);
+
+	ao2_cleanup(consumer->stats);
+	ao2_global_obj_release(consumer->rdkafka_stats);
+	ast_rwlock_destroy(&consumer->rdkafka_stats.lock);
+}
+
+/*! Calculate hash */
+AO2_STRING_FIELD_HASH_FN(kafka_topic, id)
+/*! Compare pipes */
+AO2_STRING_FIELD_CMP_FN(kafka_topic, id)
+
+/*! Common service allocator */
+static struct kafka_service *new_kafka_service(void (*service_destructor)(void *obj)) {
+	struct kafka_service *service = ao2_alloc(sizeof(*service), service_destructor);
+	
+	if(service) {
+		/* Initialize service-specific area */
+		memset(&service->specific, 0, sizeof(service->specific));
+
+		service->rd_kafka = NULL;
+		service->main_queue = NULL;
+		service->poll = NULL;
+		service->topics = NULL;
+		service->sorcery_service = NULL;
+		service->sorcery_cluster = NULL;
+		service->retired = 0;
+
+		ast_rwlock_init(&service->rdkafka_stats.lock);
+		service->rdkafka_stats.obj = NULL;
+
+		if(NULL == (service->stats = kafka_stats_alloc())) {
+			/* Service not usable */
+			ast_alertpipe_clear(service->alert_pipe);
+			ao2_ref(service, -1);
+			return NULL;
+		}
+
+		/* Build service events notification pipe */
+		if(ast_alertpipe_init(service->alert_pipe)) {
+			ast_log(LOG_ERROR, "Unable to create service alert pipe: %s\n", strerror(errno));
+
+			/* Service not usable */
+			ast_alertpipe_clear(service->alert_pipe);
+			ao2_ref(service, -1);
+			return NULL;
+		}
+		
+		/* Build topic storage */
+		if(NULL == (service->topics = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, KAFKA_TOPIC_BUCKETS, kafka_topic_hash_fn, NULL, kafka_topic_cmp_fn))) {
+			/* Service not usable */
+			ao2_ref(service, -1);
+			return NULL;
+		}
+	}
+	
+	return service;
+}
+
+
+
+/*! Build common rdkafka cluster configuration */
+static rd_kafka_conf_t *build_rdkafka_cluster_config(const struct sorcery_kafka_cluster *cluster) {
+	rd_kafka_conf_t *config = rd_kafka_conf_new();
+	char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+
+	if(NULL == config) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to create configuration object\n", ast_sorcery_object_get_id(cluster));
+		return NULL;
+	}
+
+	/* Set our logger */
+	rd_kafka_conf_set_log_cb(config, rdkafka_logger);
+	
+	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "metadata.broker.list", cluster->brokers, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set bootstrap brokers because %s\n", ast_sorcery_object_get_id(cluster), errstr);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "security.protocol", cluster->security_protocol, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set security protocol because %s\n", ast_sorcery_object_get_id(cluster), errstr);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.mechanism", cluster->sasl_mechanism, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL mechanism because %s\n", ast_sorcery_object_get_id(cluster), errstr);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.username", cluster->sasl_username, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL username because %s\n", ast_sorcery_object_get_id(cluster), errstr);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.password", cluster->sasl_password, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL password because %s\n", ast_sorcery_object_get_id(cluster), errstr);
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	if(service_add_properties(config, cluster->rdkafka_properties, "cluster", ast_sorcery_object_get_id(cluster), ast_sorcery_object_get_id(cluster))) {
+		rd_kafka_conf_destroy(config);
+		return NULL;
+	}
+
+	return config;
+}
+
+/*! Add signed integer property value to the Kafka configuration */
+static int service_add_property_int(rd_kafka_conf_t *config, 
+					const char *property, int value, 
+					const char *service_type,
+					const char *service_id,
+					const char *cluster_id) {
+	char *tmp = ast_alloca(TMP_BUF_SIZE);
+	
+	snprintf(tmp, TMP_BUF_SIZE, "%d", value);
+
+	return service_add_property_string(config, property, tmp, service_type, service_id, cluster_id);
+}
+
+/*! Add unsigned integer property value to the Kafka configuration */
+static int service_add_property_uint(rd_kafka_conf_t *config, 
+					const char *property, unsigned value, 
+					const char *service_type,
+					const char *service_id,
+					const char *cluster_id) {
+	char *tmp = ast_alloca(TMP_BUF_SIZE);
+	
+	snprintf(tmp, TMP_BUF_SIZE, "%u", value);
+
+	return service_add_property_string(config, property, tmp, service_type, service_id, cluster_id);
+}
+
+/*! Add string property value to the Kafka configuration */
+static int service_add_property_string(rd_kafka_conf_t *config, 
+					const char *property, const char *value,
+					const char *service_type,
+					const char *service_id,
+					const char *cluster_id) {
+	if(value && strlen(value)) {
+		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+
+		if(RD_KAFKA_CONF_OK == rd_kafka_conf_set(config, property, value, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+			return 0;
+		}
+
+		ast_log(LOG_ERROR, "Kafka %s '%s' on cluster '%s': unable to set '%s' property because %s\n", 
+			service_type, service_id, cluster_id, property, errstr);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! Add rdkafka.<name> passthrough properties to the Kafka configuration */
+static int service_add_properties(rd_kafka_conf_t *config, 
+					const struct ast_variable *properties,
+					const char *service_type,
+					const char *service_id,
+					const char *cluster_id) {
+	const struct ast_variable *property;
+
+	for(property = properties;property;property = property->next) {
+		if(service_add_property_string(config, property->name + strlen(KAFKA_RDKAFKA_PREFIX), property->value, service_type, service_id, cluster_id)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*! Process Kafka producer related topic at the cluster */
+static int process_producer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic) {
+#if 1
+	RAII_VAR(struct kafka_topic *, topic, new_kafka_producer_topic(producer, sorcery_topic), ao2_cleanup);
+	RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(sorcery_topic->pipe_id, 1), ao2_cleanup);
+
+	if(pipe && topic) {
+		/* Topic counters summarized by the pipe */
+		topic->pipe_stats = ao2_bump(pipe->stats);
+
+		/* Compared with the reloaded configuration */
+		topic->sorcery_topic = ao2_bump((struct sorcery_kafka_topic *)sorcery_topic);
+
+		/* Add topic to the service storage */
+		ao2_link(producer->topics, topic);
+
+		AST_LIST_LOCK(&pipe->producer_topics);
+
+		/* Add new topic to the specified pipe */
+		AST_LIST_INSERT_TAIL(&pipe->producer_topics, topic, link);
+
+		/* Publishers see new topic on the next send */
+		pipe_update_producer_snapshot(pipe);
+
+		/* Object in the list */
+		ao2_ref(topic, +1);
+
+		AST_LIST_UNLOCK(&pipe->producer_topics);
+		
+		return 0;
+	} else {
+		ast_log(LOG_ERROR, "Unable to add producer topic '%s' to pipe '%s' - Out of memory\n", 
+			ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->pipe_id);
+
+		return -1;
+	}
+
+#else
+	struct kafka_topic *topic;
+	rd_kafka_resp_err_t response;
+
+	struct ast_kafka_pipe *pipe = ast_kafka_get_pipe(sorcery_topic->pipe_id, 1);
+	ao2_cleanup(pipe);
+
+	ast_debug(3, "Process Kafka topic %s for producer %p\n", ast_sorcery_object_get_id(sorcery_topic), producer);
+
+	topic = new_kafka_producer_topic(producer, sorcery_topic);
+
+	if(rd_kafka_produce(topic->rd_kafka_topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY, "test", 4, NULL, 0, NULL)) {
+		ast_log(LOG_ERROR, "Unable to produce message producer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
+	}
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR == (response = rd_kafka_flush(producer->rd_kafka, 10000))) {
+		ast_log(LOG_ERROR, "Kafka producer topic %s got error: %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(response));
+	}
+
+	ao2_cleanup(topic);
+#endif
+}
+
+/*! Process Kafka consumer related topic at the cluster */
+static int process_consumer_topic(struct kafka_service *consumer, const struct sorcery_kafka_topic *sorcery_topic) {
+	RAII_VAR(struct kafka_topic *, topic, new_kafka_consumer_topic(consumer, sorcery_topic), ao2_cleanup);
+	RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(sorcery_topic->pipe_id, 1), ao2_cleanup);
+
+	if(pipe && topic) {
+		/* Received messages forwarded to the pipe's stasis topic */
+		topic->stasis_topic = ao2_bump(pipe->stasis_topic);
+		topic->lanes = ao2_bump(pipe->lanes);
+
+		/* Topic counters summarized by the pipe */
+		topic->pipe_stats = ao2_bump(pipe->stats);
+
+		/* Compared with the reloaded configuration */
+		topic->sorcery_topic = ao2_bump((struct sorcery_kafka_topic *)sorcery_topic);
+
+		/* Add topic to the service storage */
+		ao2_link(consumer->topics, topic);
+		
+		AST_LIST_LOCK(&pipe->consumer_topics);
+
+		/* Add new topic to the specified pipe */
+		AST_LIST_INSERT_TAIL(&pipe->consumer_topics, topic, link);
+
+		/* Object in the list */
+		ao2_ref(topic, +1);
+
+		AST_LIST_UNLOCK(&pipe->consumer_topics);
+
+		return 0;
+	} else {
+		ast_log(LOG_ERROR, "Unable to add consumer topic '%s' to pipe '%s' - Out of memory\n", 
+			ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->pipe_id);
+
+		return -1;
+	}
+}
+
+
+
+
+static struct kafka_topic *new_kafka_producer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic) {
+	struct kafka_topic *topic = ao2_alloc(sizeof(*topic), kafka_producer_topic_destructor);
+
+	if(NULL == topic) {
+		ast_log(LOG_ERROR, "Out of memory while create producer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
+	} else {
+		const struct sorcery_kafka_producer *sorcery_producer = producer->sorcery_service;
+		rd_kafka_topic_conf_t *config;
+		int force_null_key = 0;
+		int valid_format;
+		
+		topic->service = NULL;
+		topic->forced_key = NULL;
+		topic->filter = NULL;
+		topic->rd_kafka_topic = NULL;
+		topic->stasis_topic = NULL;
+		topic->sorcery_topic = NULL;
+		topic->headers = 0;
+		topic->format = KAFKA_FORMAT_JSON;
+		topic->pipe_stats = NULL;
+
+		if((NULL == (topic->stats = kafka_stats_alloc())) || ast_string_field_init(topic, 64)) {
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		ast_string_field_set(topic, id, sorcery_topic->topic);
+
+		topic->headers = sorcery_topic->headers;
+		topic->format = kafka_format_parse(sorcery_topic->format, &valid_format);
+
+		if(!valid_format) {
+			ast_log(LOG_WARNING, "Topic '%s': unknown format '%s', 'json' will be used\n", ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->format);
+		}
+
+		/* Resolve key policy, partition and headers mode once, per message only one producev call left */
+		if(0 == strcasecmp(sorcery_producer->key_overwrite, "uuid")) {
+			char pbx_uuid[AST_UUID_STR_LEN];
+
+			ast_pbx_uuid_get(pbx_uuid, sizeof(pbx_uuid));
+
+			topic->forced_key = ast_strdup(pbx_uuid);
+		} else if(0 == strcasecmp(sorcery_producer->key_overwrite, "value")) {
+			topic->forced_key = ast_strdup(sorcery_producer->key_value);
+		} else if(0 == strcasecmp(sorcery_producer->key_overwrite, "null")) {
+			/* Force null key*/
+			force_null_key = 1;
+		} else if(strcasecmp(sorcery_producer->key_overwrite, "no")) {
+			ast_log(LOG_WARNING, 
+				"Unknown key_overwrite value '%s'. Valid values are 'no', 'uuid', 'value', 'null'.\n", 
+				sorcery_producer->key_overwrite);
+		}
+
+		topic->forced_key_size = topic->forced_key ? strlen(topic->forced_key) : 0;
+		topic->force_null_key = force_null_key || (topic->forced_key && (0 == topic->forced_key_size));
+		topic->partition = (sorcery_producer->partition < 0) ? RD_KAFKA_PARTITION_UA : sorcery_producer->partition;
+		topic->partitioner = NULL;
+		topic->partitioner_key_hash = 0;
+		topic->sticky_linger_ms = 0;
+		topic->sticky_partition = RD_KAFKA_PARTITION_UA;
+		topic->sticky_until_us = 0;
+		topic->partitioner_count = 0;
+
+		if(!ast_strlen_zero(sorcery_producer->partitioner)) {
+			unsigned int i;
+
+			for(i = 0;i < ARRAY_LEN(kafka_partitioners);i++) {
+				if(0 == strcasecmp(sorcery_producer->partitioner, kafka_partitioners[i].name)) {
+					topic->partitioner = kafka_partitioners[i].partitioner;
+					topic->partitioner_key_hash = kafka_partitioners[i].key_hash;
+					topic->sticky_linger_ms = kafka_partitioners[i].random ? sorcery_producer->sticky_linger_ms : 0;
+					break;
+				}
+			}
+
+			if(NULL == topic->partitioner) {
+				ast_log(LOG_WARNING, "Producer '%s': unknown partitioner '%s', librdkafka partitioner will be used\n",
+					ast_sorcery_object_get_id(sorcery_producer), sorcery_producer->partitioner);
+			}
+		}
+		topic->producev_unkeyed = topic->headers ? producev_headers : producev_plain;
+		topic->producev_keyed = topic->force_null_key ? topic->producev_unkeyed : (topic->headers ? producev_key_headers : producev_key);
+
+		if(NULL == (config = rd_kafka_topic_conf_new())) {
+			ast_log(LOG_ERROR, "Unable to create config for producer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		/* With topic's callbacks we want see the kafka_producer_topic structure reference */
+		rd_kafka_topic_conf_set_opaque(config, topic);
+
+		topic_add_property_string(config, 
+						"offset.store.method", "broker",
+						ast_sorcery_object_get_id(sorcery_topic));
+		
+		
+		if(topic_add_property_uint(config, 
+						"message.timeout.ms", sorcery_topic->message_timeout_ms,
+						ast_sorcery_object_get_id(sorcery_topic))) {
+			rd_kafka_topic_conf_destroy(config);
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		if(topic_add_properties(config, sorcery_topic->rdkafka_properties, ast_sorcery_object_get_id(sorcery_topic))) {
+			rd_kafka_topic_conf_destroy(config);
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		if(topic->partitioner) {
+			/* Learn partitions count for key hash sends, override rdkafka.partitioner */
+			rd_kafka_topic_conf_set_partitioner_cb(config, kafka_topic_partitioner);
+		}
+		
+		if(NULL == (topic->rd_kafka_topic = rd_kafka_topic_new(producer->rd_kafka, sorcery_topic->topic, config))) {
+			ast_log(LOG_ERROR, "Unable to create producer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
+			rd_kafka_topic_conf_destroy(config);
+
+			/* This object not usable */
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		if(rd_kafka_topic_opaque(topic->rd_kafka_topic) != topic) {
+			/* librdkafka reused the handle of other topic object, its callbacks would see that object */
+			ast_log(LOG_ERROR, "Unable to create producer topic '%s' because topic '%s' already produced by the same librdkafka handle\n",
+				ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->topic);
+
+			/* Handle reference released by destructor, conf released by librdkafka */
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		/* Topic handle created, link this object to the service */
+		topic->service = producer;
+		ao2_ref(producer, +1);
+	}
+
+	return topic;
+}
+
+static void kafka_producer_topic_destructor(void *obj) {
+	struct kafka_topic *topic = obj;
+	RAII_VAR(struct kafka_service *, producer, topic->service, ao2_cleanup);
+
+	if(producer) {
+		int last_topic;
+
+		AST_RWDLLIST_WRLOCK(&producers);
+
+		if(! --producer->topic_count) {
+			last_topic = 1;
+
+			/* Remove service from producers list */
+			AST_DLLIST_REMOVE(&producers, producer, link);
+		} else {
+			last_topic = 0;
+		}
+
+		AST_RWDLLIST_UNLOCK(&producers);
+
+		if(last_topic) {
+			/* Monitor must release this service */
+			notify_monitor_thread(producer->monitor);
+
+			/* Outstanding messages reference their topics, so nothing left to flush */
+			ao2_ref(producer, -1);
+		}
+	}
+
+	if(topic->rd_kafka_topic) {
+		ast_debug(3, "Destroy rd_kafka_topic_t object %p on producer's topic %p\n", topic->rd_kafka_topic, topic);
+		rd_kafka_topic_destroy(topic->rd_kafka_topic);
+	}
+
+	ast_free(topic->forced_key);
+
+	ao2_cleanup(topic->stats);
+	ao2_cleanup(topic->pipe_stats);
+	ao2_cleanup(topic->sorcery_topic);
+
+	ast_string_field_free_memory(topic);
+}
+
+
+static struct kafka_topic *new_kafka_consumer_topic(struct kafka_service *consumer, const struct sorcery_kafka_topic *sorcery_topic) {
+	struct kafka_topic *topic = ao2_alloc(sizeof(*topic), kafka_consumer_topic_destructor);
+
+	if(NULL == topic) {
+		ast_log(LOG_ERROR, "Out of memory while create consumer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
+	} else {
+		topic->service = NULL;
+		topic->rd_kafka_topic = NULL;
+		topic->stasis_topic = NULL;
+		topic->sorcery_topic = NULL;
+		topic->headers = 0;
+		topic->format = KAFKA_FORMAT_JSON;
+		topic->pipe_stats = NULL;
+		topic->lanes = NULL;
+		topic->filter = NULL;
+		topic->partitions = NULL;
+		topic->partition_count = 0;
+
+		if((NULL == (topic->stats = kafka_stats_alloc())) || ast_string_field_init(topic, 64)) {
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+
+		ast_string_field_set(topic, id, sorcery_topic->topic);
+
+		if((sorcery_topic->drop_own_eid || !ast_strlen_zero(sorcery_topic->reason_in) || !ast_strlen_zero(sorcery_topic->key_prefix))
+			&& (NULL == (topic->filter = new_kafka_topic_filter(sorcery_topic)))) {
+			ast_log(LOG_ERROR, "Out of memory while create consumer topic '%s' filter\n", ast_sorcery_object_get_id(sorcery_topic));
+			ao2_ref(topic, -1);
+			return NULL;
+		}
+		
+		if(consumer->specific.consumer.topic_partition_list) {
+			/* High-level consumer */
+			if(NULL == rd_kafka_topic_partition_list_add(consumer->specific.consumer.topic_partition_list,
+									sorcery_topic->topic,
+									/* the partition is ignored
+									* by subscribe() */
+									RD_KAFKA_PARTITION_UA)) {
+				ast_log(LOG_ERROR, "Pipe '%s': Unable to add consumer topic '%s' to the subscription list.\n", sorcery_topic->pipe_id, sorcery_topic->topic);
+				ao2_ref(topic, -1);
+				return NULL;
+			}
+		} else {
+			/* Low-level consumer */
+			rd_kafka_topic_conf_t *config = rd_kafka_topic_conf_new();
+
+			if(NULL == config) {
+				ast_log(LOG_ERROR, "Unable to create config for consumer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
+				ao2_ref(topic, -1);
+				return NULL;
+			}
+
+			/* With topic's callbacks we want see the kafka_producer_topic structure reference */
+			rd_kafka_topic_conf_set_opaque(config, topic);
+
+			if(topic_add_properties(config, sorcery_topic->rdkafka_properties, ast_sorcery_object_get_id(sorcery_topic))) {
+				rd_kafka_topic_conf_destroy(config);
+				ao2_ref(topic, -1);
+				return NULL;
+			}
+
+			if(NULL == (topic->rd_kafka_topic = rd_kafka_topic_new(consumer->rd_kafka, sorcery_topic->topic, config))) {
+				ast_log(LOG_ERROR, "Unable to create consumer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
+				rd_kafka_topic_conf_destroy(config);
+
+				/* This object not usable */
+				ao2_ref(topic, -1);
+				return NULL;
+			}
+
+			/* Start consuming each partition from the configured offset */
+			if(consumer_topic_start(consumer, topic, sorcery_topic)) {
+				/* Destroy librdkafka topic object */
+				rd_kafka_topic_destroy(topic->rd_kafka_topic);
+				topic->rd_kafka_topic = NULL;
+
+				/* This object not usable */
+				ao2_ref(topic, -1);
+				return NULL;
+			}
+		}
+		
+		/* Topic handle created, link this object to the service */
+		topic->service = consumer;
+		ao2_ref(consumer, +1);
+	}
+
+	return topic;
+}
+
+static void kafka_consumer_topic_destructor(void *obj) {
+	struct kafka_topic *topic = obj;
+	RAII_VAR(struct kafka_service *, consumer, topic->service, ao2_cleanup);
+
+	if(consumer) {
+		int last_topic;
+
+		if(topic->rd_kafka_topic) {
+			/* Stop consuming on this topic */
+			consumer_topic_stop(topic);
+		}
+
+		AST_RWDLLIST_WRLOCK(&consumers);
+
+		if(! --consumer->topic_count) {
+			last_topic = 1;
+
+			/* Remove service from consumers list */
+			AST_DLLIST_REMOVE(&consumers, consumer, link);
+		} else {
+			last_topic = 0;
+		}
+
+		AST_RWDLLIST_UNLOCK(&consumers);
+
+		if(last_topic) {
+			/* Monitor must release this service */
+			notify_monitor_thread(consumer->monitor);
+
+			if(NULL == topic->rd_kafka_topic) {
+				if(consumer->specific.consumer.tracker) {
+					/* Commit processed offsets while group membership still active */
+					kafka_commit_detach(consumer->specific.consumer.tracker);
+				}
+
+				/* High-level consumer */
+				rd_kafka_consumer_close(consumer->rd_kafka);
+			}
+			
+			/* Wait for messages to be delivered */
+			kafka_service_flush(consumer, "Consumer", 0);
+
+			/* No reference to this service */
+			ao2_ref(consumer, -1);
+		}
+	}
+
+	if(topic->rd_kafka_topic) {
+		ast_debug(3, "Destroy rd_kafka_topic_t object %p on consumer's topic %p\n", topic->rd_kafka_topic, topic);
+		rd_kafka_topic_destroy(topic->rd_kafka_topic);
+	}
+
+	ao2_cleanup(topic->stasis_topic);
+	ao2_cleanup(topic->lanes);
+
+	kafka_topic_filter_destroy(topic->filter);
+	ast_free(topic->partitions);
+
+	ao2_cleanup(topic->stats);
+	ao2_cleanup(topic->pipe_stats);
+	ao2_cleanup(topic->sorcery_topic);
+	
+	ast_string_field_free_memory(topic);
+}
+
+/*!
+ * \brief Start consuming low-level consumer topic partitions.
+ *
+ * Each partition is started with its own queue, forwarded to the consumer queue,
+ * so the consumer poll serve all partitions. Started partitions are stopped on failure.
+ *
+ * \return 0 on success, -1 on failure
+ */
+static int consumer_topic_start(struct kafka_service *consumer, struct kafka_topic *topic, const struct sorcery_kafka_topic *sorcery_topic) {
+	const int32_t *partitions = consumer->specific.consumer.partitions;
+	size_t count = consumer->specific.consumer.partition_count;
+	rd_kafka_topic_partition_list_t *times = NULL;
+	int32_t *all = NULL;
+	int status = 0;
+	size_t i;
+
+	if(consumer->specific.consumer.all_partitions) {
+		const struct rd_kafka_metadata *metadata;
+		rd_kafka_resp_err_t response;
+		int partition;
+
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != (response = rd_kafka_metadata(consumer->rd_kafka, 0, topic->rd_kafka_topic, &metadata, consumer->timeout_ms))) {
+			ast_log(LOG_ERROR, "Unable to get partitions of consumer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(response));
+			return -1;
+		}
+
+		if((1 != metadata->topic_cnt) || (RD_KAFKA_RESP_ERR_NO_ERROR != metadata->topics[0].err) || (metadata->topics[0].partition_cnt <= 0)) {
+			ast_log(LOG_ERROR, "Consumer topic '%s': topic '%s' has no partitions\n", ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->topic);
+			rd_kafka_metadata_destroy(metadata);
+			return -1;
+		}
+
+		if(NULL == (all = ast_calloc(metadata->topics[0].partition_cnt, sizeof(*all)))) {
+			rd_kafka_metadata_destroy(metadata);
+			return -1;
+		}
+
+		for(partition = 0;partition < metadata->topics[0].partition_cnt;partition++) {
+			all[partition] = metadata->topics[0].partitions[partition].id;
+		}
+
+		/* Positive, checked above */
+		count = (size_t)metadata->topics[0].partition_cnt;
+
+		rd_kafka_metadata_destroy(metadata);
+
+		partitions = all;
+	} else if(NULL == partitions) {
+		/* Single partition option */
+		partitions = &consumer->partition;
+		count = 1;
+	}
+
+	if(NULL == (topic->partitions = ast_calloc(count, sizeof(*topic->partitions)))) {
+		ast_free(all);
+		return -1;
+	}
+
+	if(consumer->specific.consumer.start_by_time) {
+		int64_t timestamp = (consumer->specific.consumer.start_time > 0) ? (int64_t)consumer->specific.consumer.start_time * 1000
+			: ast_tvdiff_ms(ast_tvnow(), ast_tv(0, 0)) + (int64_t)consumer->specific.consumer.start_time * 1000;
+		rd_kafka_resp_err_t response;
+
+		if(NULL == (times = rd_kafka_topic_partition_list_new(count))) {
+			ast_free(all);
+			return -1;
+		}
+
+		for(i = 0;i < count;i++) {
+			rd_kafka_topic_partition_list_add(times, topic->id, partitions[i])->offset = timestamp;
+		}
+
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != (response = rd_kafka_offsets_for_times(consumer->rd_kafka, times, consumer->timeout_ms))) {
+			ast_log(LOG_WARNING, "Consumer topic '%s': unable to get offsets by time because %s, consumed from the end\n",
+				ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(response));
+
+			rd_kafka_topic_partition_list_destroy(times);
+			times = NULL;
+		}
+	}
+
+	for(i = 0;i < count;i++) {
+		struct kafka_topic_partition *entry = topic->partitions + i;
+		int64_t offset = consumer->specific.consumer.start_offset;
+
+		if(consumer->specific.consumer.start_by_time) {
+			/* Partition without messages since the time consumed from the end */
+			offset = (times && (RD_KAFKA_RESP_ERR_NO_ERROR == times->elems[i].err) && (times->elems[i].offset >= 0)) ? times->elems[i].offset : RD_KAFKA_OFFSET_END;
+		}
+
+		entry->partition = partitions[i];
+
+		if(NULL == (entry->queue = rd_kafka_queue_new(consumer->rd_kafka))) {
+			ast_log(LOG_ERROR, "Unable to create queue of consumer topic '%s' partition %d\n", ast_sorcery_object_get_id(sorcery_topic), (int)entry->partition);
+			status = -1;
+			break;
+		}
+
+		/* Partition messages served by the consumer queue */
+		rd_kafka_queue_forward(entry->queue, consumer->specific.consumer.queue);
+
+		if(rd_kafka_consume_start_queue(topic->rd_kafka_topic, entry->partition, offset, entry->queue) < 0) {
+			ast_log(LOG_ERROR, "Unable to start consuming topic '%s' partition %d because %s\n",
+				ast_sorcery_object_get_id(sorcery_topic), (int)entry->partition, rd_kafka_err2str(rd_kafka_last_error()));
+
+			rd_kafka_queue_destroy(entry->queue);
+			entry->queue = NULL;
+			status = -1;
+			break;
+		}
+
+		topic->partition_count++;
+
+		ast_debug(3, "Consumer topic '%s' partition %d started from offset %ld\n", ast_sorcery_object_get_id(sorcery_topic), (int)entry->partition, (long)offset);
+	}
+
+	if(times) {
+		rd_kafka_topic_partition_list_destroy(times);
+	}
+
+	ast_free(all);
+
+	if(status) {
+		consumer_topic_stop(topic);
+	}
+
+	return status;
+}
+
+/*! Stop consuming low-level consumer topic partitions */
+static void consumer_topic_stop(struct kafka_topic *topic) {
+	size_t i;
+
+	for(i = 0;i < topic->partition_count;i++) {
+		rd_kafka_consume_stop(topic->rd_kafka_topic, topic->partitions[i].partition);
+		rd_kafka_queue_destroy(topic->partitions[i].queue);
+	}
+
+	topic->partition_count = 0;
+}
+
+/*! Resolve low-level consumer partitions and start offset options */
+static int consumer_partitions_parse(struct kafka_service *consumer, const struct sorcery_kafka_consumer *sorcery_consumer) {
+	const char *service_id = ast_sorcery_object_get_id(sorcery_consumer);
+
+	consumer->specific.consumer.start_offset = RD_KAFKA_OFFSET_BEGINNING;
+	consumer->specific.consumer.start_by_time = 0;
+	consumer->specific.consumer.start_time = sorcery_consumer->start_time;
+
+	if(0 == strcasecmp(sorcery_consumer->start_offset, "end")) {
+		consumer->specific.consumer.start_offset = RD_KAFKA_OFFSET_END;
+	} else if(0 == strcasecmp(sorcery_consumer->start_offset, "stored")) {
+		consumer->specific.consumer.start_offset = RD_KAFKA_OFFSET_STORED;
+	} else if(0 == strcasecmp(sorcery_consumer->start_offset, "timestamp")) {
+		consumer->specific.consumer.start_by_time = 1;
+	} else if(strcasecmp(sorcery_consumer->start_offset, "beginning")) {
+		ast_log(LOG_WARNING,
+			"Unknown start_offset value '%s'. Valid values are 'beginning', 'end', 'stored', 'timestamp'.\n",
+			sorcery_consumer->start_offset);
+	}
+
+	if(0 == strcasecmp(sorcery_consumer->partitions, "all")) {
+		consumer->specific.consumer.all_partitions = 1;
+	} else if(!ast_strlen_zero(sorcery_consumer->partitions)) {
+		char *list = ast_strdupa(sorcery_consumer->partitions);
+		size_t count = 1;
+		char *item;
+		const char *c;
+
+		for(c = list;*c;c++) {
+			count += (',' == *c);
+		}
+
+		if(NULL == (consumer->specific.consumer.partitions = ast_calloc(count, sizeof(int32_t)))) {
+			return -1;
 		}
 
-		ao2_iterator_destroy(&i);
+		while(NULL != (item = strsep(&list, ","))) {
+			int partition;
 
-		/* Producers processing complete */
-		ao2_cleanup(found);
-		found = NULL;
+			if((1 != sscanf(item, "%d", &partition)) || (partition < 0)) {
+				ast_log(LOG_WARNING, "Consumer '%s': invalid partition '%s' ignored\n", service_id, item);
+				continue;
+			}
+
+			consumer->specific.consumer.partitions[consumer->specific.consumer.partition_count++] = partition;
+		}
+
+		if(0 == consumer->specific.consumer.partition_count) {
+			ast_log(LOG_ERROR, "Consumer '%s': no valid partitions in '%s'\n", service_id, sorcery_consumer->partitions);
+			return -1;
+		}
 	}
 
-	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_CONSUMER, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
-		ast_log(LOG_WARNING, "Unable to retrieve consumers from cluster %s\n", ast_sorcery_object_get_id(cluster));
-	} else {
-		struct ao2_iterator i = ao2_iterator_init(found, 0);
-		struct sorcery_kafka_consumer *consumer;
+	return 0;
+}
 
-		while(NULL != (consumer = ao2_iterator_next(&i))) {
-			process_consumer(cluster, consumer);
+/*! Add signed integer property value to the Kafka configuration */
+static int topic_add_property_int(rd_kafka_topic_conf_t *config, 
+					const char *property, int value, 
+					const char *topic_id) {
+	char *tmp = ast_alloca(TMP_BUF_SIZE);
+	
+	snprintf(tmp, TMP_BUF_SIZE, "%d", value);
 
-			ao2_ref(consumer, -1);
+	return topic_add_property_string(config, property, tmp, topic_id);
+}
+
+/*! Add unsigned integer property value to the Kafka configuration */
+static int topic_add_property_uint(rd_kafka_topic_conf_t *config, 
+					const char *property, unsigned value, 
+					const char *topic_id) {
+	char *tmp = ast_alloca(TMP_BUF_SIZE);
+	
+	snprintf(tmp, TMP_BUF_SIZE, "%u", value);
+
+	return topic_add_property_string(config, property, tmp, topic_id);
+}
+
+/*! Add string property value to the Kafka configuration */
+static int topic_add_property_string(rd_kafka_topic_conf_t  *config, 
+					const char *property, const char *value,
+					const char *topic_id) {
+	if(value && strlen(value)) {
+		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+
+		if(RD_KAFKA_CONF_OK == rd_kafka_topic_conf_set(config, property, value, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
+			return 0;
 		}
 
-		ao2_iterator_destroy(&i);
+		ast_log(LOG_ERROR, "Kafka topic '%s': unable to set '%s' property because %s\n", 
+			topic_id, property, errstr);
+
+		return -1;
 	}
+
+	return 0;
 }
 
-/*! Process Kafka producer at the cluster */
-static int process_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer) {
-	RAII_VAR(struct ast_variable *, filter, ast_variable_new("producer", ast_sorcery_object_get_id(sorcery_producer), ""), ast_variables_destroy);
-	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+/*! Add rdkafka.<name> passthrough properties to the Kafka topic configuration */
+static int topic_add_properties(rd_kafka_topic_conf_t *config, 
+					const struct ast_variable *properties,
+					const char *topic_id) {
+	const struct ast_variable *property;
 
-	ast_debug(3, "Process Kafka producer %s on cluster %s\n", ast_sorcery_object_get_id(sorcery_producer), ast_sorcery_object_get_id(sorcery_cluster));
+	for(property = properties;property;property = property->next) {
+		if(topic_add_property_string(config, property->name + strlen(KAFKA_RDKAFKA_PREFIX), property->value, topic_id)) {
+			return -1;
+		}
+	}
 
-	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
-		ast_log(LOG_WARNING, "Unable to retrieve topics from producer %s at cluster %s\n", ast_sorcery_object_get_id(sorcery_producer), ast_sorcery_object_get_id(sorcery_cluster));
-	} else {
-		if(ao2_container_count(found)) {
-			/* Producers present */
-			struct kafka_service *producer = new_kafka_producer(sorcery_cluster, sorcery_producer);
+	return 0;
+}
 
-			if(NULL == producer) {
-				return -1;
-			} else {
-				struct ao2_iterator i = ao2_iterator_init(found, 0);
-				struct sorcery_kafka_topic *sorcery_topic;
+/*! Keep rdkafka.<name> option of the sorcery object */
+static int kafka_properties_append(struct ast_variable **properties, const struct ast_variable *var) {
+	struct ast_variable *property = ast_variable_new(var->name, var->value, "");
 
-				while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
-					if(0 == process_producer_topic(producer, sorcery_topic)) {
-						producer->topic_count++;
-					}
+	if(NULL == property) {
+		return -1;
+	}
 
-					ao2_ref(sorcery_topic, -1);
-				}
+	ast_variable_list_append(properties, property);
 
-				ao2_iterator_destroy(&i);
+	return 0;
+}
 
-				if(producer->topic_count) {
-					AST_RWDLLIST_WRLOCK(&producers);
+/*! Copy rdkafka.<name> options of the sorcery object to the object set */
+static int kafka_properties_to_fields(const struct ast_variable *properties, struct ast_variable **fields) {
+	const struct ast_variable *property;
+	struct ast_variable *head = NULL;
+	struct ast_variable *field;
 
-					/* Keep object reference count because list reference to it */
-					AST_RWDLLIST_INSERT_TAIL(&producers, producer, link);
+	for(property = properties;property;property = property->next) {
+		if(NULL == (field = ast_variable_new(property->name, property->value, ""))) {
+			ast_variables_destroy(head);
+			return -1;
+		}
 
-					AST_RWDLLIST_UNLOCK(&producers);
+		ast_variable_list_append(&head, field);
+	}
 
-					/* Assert monitor thread is running */
-					if(start_monitor_thread()) {
-						ast_log(LOG_WARNING, "Unable to start monitoring thread.\n");
-					}
-				} else {
-					/* This producer has no topics */
-					ao2_ref(producer, -1);
-				}
+	*fields = head;
+
+	return 0;
+}
+
+/*! Define sorcery handlers of the rdkafka.<name> options for the object type */
+#define KAFKA_PROPERTIES_HANDLERS(type) \
+static int type##_rdkafka_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) { \
+	return kafka_properties_append(&((struct type *)obj)->rdkafka_properties, var); \
+} \
+static int type##_rdkafka_to_fields(const void *obj, struct ast_variable **fields) { \
+	return kafka_properties_to_fields(((const struct type *)obj)->rdkafka_properties, fields); \
+}
+
+KAFKA_PROPERTIES_HANDLERS(sorcery_kafka_cluster)
+KAFKA_PROPERTIES_HANDLERS(sorcery_kafka_producer)
+KAFKA_PROPERTIES_HANDLERS(sorcery_kafka_consumer)
+KAFKA_PROPERTIES_HANDLERS(sorcery_kafka_topic)
+
+
+
+
+
+/*! Allocate monitor threads descriptors as configured in the general section */
+static int init_monitors(void) {
+	RAII_VAR(struct sorcery_kafka_general *, general, sorcery_kafka_general_get(), ao2_cleanup);
+	unsigned int count = general ? general->poller_threads : 1;
+	char *cpus = (general && !ast_strlen_zero(general->poller_cpus)) ? ast_strdupa(general->poller_cpus) : NULL;
+	unsigned int i;
+
+	if(0 == count) {
+		count = 1;
+	} else if(count > KAFKA_MONITOR_MAX_THREADS) {
+		ast_log(LOG_WARNING, "Too many poller threads %u, limited to %d\n", count, KAFKA_MONITOR_MAX_THREADS);
+		count = KAFKA_MONITOR_MAX_THREADS;
+	}
+
+	if(NULL == (monitors = ast_calloc(count, sizeof(*monitors)))) {
+		return -1;
+	}
+
+	monitor_count = count;
+
+	for(i = 0;i < count;i++) {
+		monitors[i].thread = AST_PTHREADT_NULL;
+		monitors[i].index = i;
+		monitors[i].cpu = -1;
+		ast_alertpipe_clear(monitors[i].alert_pipe);
+	}
+
+	if(cpus) {
+		/* Pin poller threads round-robin on the listed CPUs */
+		int pinned[KAFKA_MONITOR_MAX_THREADS];
+		unsigned int pinned_count = 0;
+		char *cpu;
+
+		while((pinned_count < ARRAY_LEN(pinned)) && (NULL != (cpu = strsep(&cpus, ",")))) {
+			if((1 == sscanf(cpu, "%d", &pinned[pinned_count])) && (pinned[pinned_count] >= 0)) {
+				pinned_count++;
+			} else {
+				ast_log(LOG_WARNING, "Invalid poller CPU '%s' ignored\n", cpu);
 			}
 		}
+
+		for(i = 0;pinned_count && (i < count);i++) {
+			monitors[i].cpu = pinned[i % pinned_count];
+		}
 	}
 
+	ast_debug(3, "Kafka services served by %u poller thread(s)\n", count);
+
 	return 0;
 }
 
-/*! Process Kafka consumer at the cluster */
-static int process_consumer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_consumer *sorcery_consumer) {
-	RAII_VAR(struct ast_variable *, filter, ast_variable_new("consumer", ast_sorcery_object_get_id(sorcery_consumer), ""), ast_variables_destroy);
-	RAII_VAR(struct ao2_container *, found, NULL, ao2_cleanup);
+/*! Stop all monitor threads and release descriptors */
+static void destroy_monitors(void) {
+	unsigned int i;
 
-	ast_debug(3, "Process Kafka consumer %s on cluster %s\n", ast_sorcery_object_get_id(sorcery_consumer), ast_sorcery_object_get_id(sorcery_cluster));
+	for(i = 0;i < monitor_count;i++) {
+		struct kafka_monitor *monitor = &monitors[i];
+		pthread_t active_monitor;
 
-	if(NULL == (found = ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_TOPIC, AST_RETRIEVE_FLAG_MULTIPLE, filter))) {
-		ast_log(LOG_WARNING, "Unable to retrieve topics from consumer %s at cluster %s\n", ast_sorcery_object_get_id(sorcery_consumer), ast_sorcery_object_get_id(sorcery_cluster));
-	} else {
-		if(ao2_container_count(found)) {
-			/* Consumers present */
-			struct kafka_service *consumer = new_kafka_consumer(sorcery_cluster, sorcery_consumer);
+		ast_mutex_lock(&monitor_lock);
 
-			if(NULL == consumer) {
-				return -1;
-			} else {
-				struct ao2_iterator i = ao2_iterator_init(found, 0);
-				struct sorcery_kafka_topic *sorcery_topic;
+		active_monitor = monitor->thread;
 
-				while(NULL != (sorcery_topic = ao2_iterator_next(&i))) {
-					if(0 == process_consumer_topic(consumer, sorcery_topic)) {
-						consumer->topic_count++;
-					}
+		/* Prevent monitor activation */
+		monitor->thread = AST_PTHREADT_STOP;
 
-					ao2_ref(sorcery_topic, -1);
-				}
+		if((AST_PTHREADT_NULL != active_monitor) && (AST_PTHREADT_STOP != active_monitor)) {
+			/* Wakeup monitor thread, it will see stop request */
+			ast_alertpipe_write(monitor->alert_pipe);
+		}
 
-				ao2_iterator_destroy(&i);
+		ast_mutex_unlock(&monitor_lock);
 
-				if(consumer->topic_count) {
-					if(consumer->specific.consumer.topic_partition_list) {
-						/* High-level consumer, initiate subscription */
-						rd_kafka_resp_err_t response = rd_kafka_subscribe(consumer->rd_kafka, consumer->specific.consumer.topic_partition_list);
-						
-						if(RD_KAFKA_RESP_ERR_NO_ERROR == response) {
-							ast_debug(3, "Subscribed to %d topic(s), waiting for rebalance and messages...\n", consumer->specific.consumer.topic_partition_list->cnt);
-						} else {
-							ast_log(LOG_ERROR, "Consumer '%s': unable to subscribe topics because %s\n", ast_sorcery_object_get_id(sorcery_consumer), rd_kafka_err2str(response));
-							
-							/* Consumer not usable */
-							ao2_ref(consumer, -1);
-							
-							return -1;
-						}
+		if((AST_PTHREADT_NULL != active_monitor) && (AST_PTHREADT_STOP != active_monitor)) {
+			/* Need to stop monitor thread */
+			pthread_join(active_monitor, NULL);
 
-						/* At this point we safe to free topic-partition list */
-						rd_kafka_topic_partition_list_destroy(consumer->specific.consumer.topic_partition_list);
-						consumer->specific.consumer.topic_partition_list = NULL;
-						
-						/* Redirect all messages from per-partition queues to
-						 * the main queue so that messages can be consumed with one
-						 * call from all assigned partitions.
-						 *
-						 * The alternative is to poll the main queue (for events)
-						 * and each partition queue separately, which requires setting
-						 * up a rebalance callback and keeping track of the assignment:
-						 * but that is more complex and typically not recommended. */
-						rd_kafka_poll_set_consumer(consumer->rd_kafka);
-					}
-					
-					AST_RWDLLIST_WRLOCK(&consumers);
+			ast_alertpipe_close(monitor->alert_pipe);
+		}
+	}
 
-					/* Keep object reference count because list reference to it */
-					AST_RWDLLIST_INSERT_TAIL(&consumers, consumer, link);
+	ast_free(monitors);
+	monitors = NULL;
+	monitor_count = 0;
+}
 
-					AST_RWDLLIST_UNLOCK(&consumers);
+/*! Start asynchronous publish lanes as configured in the general section */
+static int init_publish_lanes(void) {
+	RAII_VAR(struct sorcery_kafka_general *, general, sorcery_kafka_general_get(), ao2_cleanup);
+	unsigned int count = general ? general->publish_threads : 0;
+	unsigned int high_water = general ? general->publish_high_water : 0;
+	char name[AST_TASKPROCESSOR_MAX_NAME + 1];
+	unsigned int i;
 
-					/* Assert monitor thread is running */
-					if(start_monitor_thread()) {
-						ast_log(LOG_WARNING, "Unable to start monitoring thread.\n");
-					}
-				} else {
-					/* This consumer has no topics */
-					ao2_ref(consumer, -1);
-				}
+	if(0 == count) {
+		/* Messages produced on the caller's thread */
+		return 0;
+	} else if(count > KAFKA_MONITOR_MAX_THREADS) {
+		ast_log(LOG_WARNING, "Too many publish threads %u, limited to %d\n", count, KAFKA_MONITOR_MAX_THREADS);
+		count = KAFKA_MONITOR_MAX_THREADS;
+	}
+
+	if(NULL == (publish_lanes = ast_calloc(count, sizeof(*publish_lanes)))) {
+		return -1;
+	}
+
+	for(i = 0;i < count;i++) {
+		struct kafka_publish_lane *lane = &publish_lanes[i];
+
+		ast_mutex_init(&lane->lock);
+		AST_LIST_HEAD_INIT_NOLOCK(&lane->items);
+
+		snprintf(name, sizeof(name), "%s-%u", KAFKA_TASKPROCESSOR_PUBLISH_ID, i);
+
+		if(NULL == (lane->tps = ast_taskprocessor_get(name, TPS_REF_DEFAULT))) {
+			ast_log(LOG_ERROR, "Failed to create Kafka publish taskprocessor '%s'\n", name);
+			ast_mutex_destroy(&lane->lock);
+
+			while(i--) {
+				ast_taskprocessor_unreference(publish_lanes[i].tps);
+				ast_mutex_destroy(&publish_lanes[i].lock);
 			}
+
+			ast_free(publish_lanes);
+			publish_lanes = NULL;
+			return -1;
+		}
+
+		if(high_water && ast_taskprocessor_alert_set_levels(lane->tps, high_water * 9 / 10, high_water)) {
+			ast_log(LOG_WARNING, "Invalid Kafka publish high water level %u\n", high_water);
 		}
 	}
 
+	publish_queue_max = general->publish_queue_max ? general->publish_queue_max : UINT_MAX;
+
+	/* Enable asynchronous publish */
+	publish_lane_count = count;
+
+	ast_debug(3, "Kafka messages published by %u thread(s)\n", count);
+
 	return 0;
 }
 
-/*! Create new producer service object */
-static struct kafka_service *new_kafka_producer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_producer *sorcery_producer) {
-	rd_kafka_conf_t *config = build_rdkafka_cluster_config(sorcery_cluster);
-	struct kafka_service *producer;
+/*! Stop publish lanes, messages left in queues produced on the current thread */
+static void destroy_publish_lanes(void) {
+	unsigned int count = publish_lane_count;
+	unsigned int i;
 
-	if(NULL == config) {
-		return NULL;
-	} else {
-		/* Set producer-specific configuration options */
-		static const char *service_type = "producer";
-		const char *service_id = ast_sorcery_object_get_id(sorcery_producer);
-		const char *cluster_id = ast_sorcery_object_get_id(sorcery_cluster);
-		
-		if(service_add_property_uint(config, "retry.backoff.ms", sorcery_producer->retry_backoff_ms, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
+	/* New messages produced on the caller's thread */
+	publish_lane_count = 0;
+
+	for(i = 0;i < count;i++) {
+		struct kafka_publish_lane *lane = &publish_lanes[i];
+
+		/* Wait for the taskprocessor thread */
+		ast_taskprocessor_unreference(lane->tps);
+		lane->tps = NULL;
+
+		while(!AST_LIST_EMPTY(&lane->items)) {
+			kafka_publish_drain(lane);
+		}
+
+		ast_mutex_destroy(&lane->lock);
+	}
+
+	ast_free(publish_lanes);
+	publish_lanes = NULL;
+}
+
+/*! Wait for outstanding messages until flush timeout or common unload deadline, producer's leftovers may be spooled */
+static void kafka_service_flush(struct kafka_service *service, const char *service_type, int producer) {
+	struct timeval deadline = ast_tvzero(flush_deadline) ? ast_tvadd(ast_tvnow(), ast_samp2tv(flush_timeout_ms, 1000)) : flush_deadline;
+	int64_t remaining;
+	int outstanding;
+
+	while(((outstanding = rd_kafka_outq_len(service->rd_kafka)) > 0) && ((remaining = ast_tvdiff_ms(deadline, ast_tvnow())) > 0)) {
+		ast_debug(3, "%s %p have %d outstanding message(s), wait %ldms\n", service_type, service, outstanding, (long)remaining);
+
+		rd_kafka_poll(service->rd_kafka, (service->timeout_ms && (service->timeout_ms < remaining)) ? service->timeout_ms : remaining);
+	}
+
+	if(outstanding > 0) {
+		ast_log(LOG_WARNING, "%s '%s': %d outstanding message(s) not delivered in %ums\n", service_type, rd_kafka_name(service->rd_kafka), outstanding, flush_timeout_ms);
+
+		if(flush_spool && producer) {
+			kafka_service_purge(service);
+		}
+	}
+}
+
+/*! Purge outstanding producer's messages, delivery reports append them to the spool. Return number of not served messages */
+static int kafka_service_purge(struct kafka_service *producer) {
+	struct timeval deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(KAFKA_FLUSH_PURGE_TIMEOUT_MS, 1000));
+	rd_kafka_resp_err_t response;
+	int outstanding;
+
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != (response = rd_kafka_purge(producer->rd_kafka, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT))) {
+		ast_log(LOG_WARNING, "Producer '%s': unable to purge outstanding messages: %s\n", rd_kafka_name(producer->rd_kafka), rd_kafka_err2str(response));
+		return rd_kafka_outq_len(producer->rd_kafka);
+	}
+
+	/* Purged messages failed by delivery reports */
+	while(((outstanding = rd_kafka_outq_len(producer->rd_kafka)) > 0) && (ast_tvdiff_ms(deadline, ast_tvnow()) > 0)) {
+		rd_kafka_poll(producer->rd_kafka, KAFKA_QUEUE_FULL_POLL_MS);
+	}
+
+	return outstanding;
+}
+
+/*! Flush all producers concurrently with one deadline, called on module unload */
+static void kafka_flush_producers(void) {
+	struct timeval started = ast_tvnow();
+	struct kafka_flush_job *jobs;
+	struct kafka_service *service;
+	size_t count = 0;
+	size_t i;
+	int outstanding = 0;
+	int purged = 0;
+
+	/* Topic destructors wait only up to this deadline */
+	flush_deadline = ast_tvadd(started, ast_samp2tv(flush_timeout_ms, 1000));
+
+	AST_RWDLLIST_RDLOCK(&producers);
+
+	AST_DLLIST_TRAVERSE(&producers, service, link) {
+		count++;
+	}
+
+	if((0 == count) || (NULL == (jobs = ast_calloc(count, sizeof(*jobs))))) {
+		AST_RWDLLIST_UNLOCK(&producers);
+		return;
+	}
+
+	count = 0;
+
+	AST_DLLIST_TRAVERSE(&producers, service, link) {
+		for(i = 0;i < count;i++) {
+			if(jobs[i].producer->rd_kafka == service->rd_kafka) {
+				/* Shared handle flushed once */
+				break;
+			}
 		}
 
-		if(service_add_property_int(config, "request.required.acks", sorcery_producer->request_required_acks, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
+		if(i == count) {
+			jobs[count].thread = AST_PTHREADT_NULL;
+			jobs[count].producer = ao2_bump(service);
+			jobs[count].result = RD_KAFKA_RESP_ERR_NO_ERROR;
+			count++;
 		}
-		
-		if(service_add_property_uint(config, "message.send.max.retries", sorcery_producer->message_send_max_retries, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
+	}
+
+	AST_RWDLLIST_UNLOCK(&producers);
+
+	for(i = 0;i < count;i++) {
+		if(0 == rd_kafka_outq_len(jobs[i].producer->rd_kafka)) {
+			/* Nothing to flush */
+			continue;
 		}
 
-		if(service_add_property_uint(config, "max.in.flight.requests.per.connection", sorcery_producer->max_in_flight_requests_per_connection, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
+		if(ast_pthread_create(&jobs[i].thread, NULL, kafka_flush_job_run, &jobs[i])) {
+			/* Flushed by this thread, still up to the same deadline */
+			jobs[i].thread = AST_PTHREADT_NULL;
+			kafka_flush_job_run(&jobs[i]);
 		}
+	}
 
-		if(service_add_property_string(config, "enable.idempotence", sorcery_producer->enable_idempotence ? "true" : "false", service_type, service_id, cluster_id)) {
-			/* On current version librdkafka idempotence producers not supported yet */
-			ast_log(LOG_WARNING, "Current version librdkafka (%s) not support dempotence producers.\n", rd_kafka_version_str());
+	for(i = 0;i < count;i++) {
+		int pending;
+
+		if(AST_PTHREADT_NULL != jobs[i].thread) {
+			pthread_join(jobs[i].thread, NULL);
 		}
-		
-		if(service_add_property_string(config, "transactional.id", sorcery_producer->transactional_id, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
+
+		if((pending = rd_kafka_outq_len(jobs[i].producer->rd_kafka)) > 0) {
+			ast_log(LOG_WARNING, "Producer '%s': %d outstanding message(s) not delivered in %ums: %s\n",
+				rd_kafka_name(jobs[i].producer->rd_kafka), pending, flush_timeout_ms, rd_kafka_err2str(jobs[i].result));
+
+			outstanding += pending;
+
+			if(flush_spool) {
+				/* Delivery reports of purged messages append them to the producer's spool */
+				purged += pending - kafka_service_purge(jobs[i].producer);
+			}
 		}
 
-		if(service_add_property_string(config, "client.id", ast_sorcery_object_get_id(sorcery_producer), service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
-		
-		if(service_add_property_string(config, "debug", sorcery_producer->debug, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
+		ao2_ref(jobs[i].producer, -1);
 	}
 
-	if(NULL == (producer = new_kafka_service(kafka_producer_destructor))) {
-		ast_log(LOG_ERROR, "Kafka cluster '%s': Unable to create producer '%s' because Out of memory\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_producer));
+	ast_free(jobs);
+
+	if(outstanding) {
+		ast_log(LOG_NOTICE, "Kafka flushed %zu producer handle(s) in %ldms, %d message(s) outstanding, %d purged%s\n",
+			count, (long)ast_tvdiff_ms(ast_tvnow(), started), outstanding, purged, flush_spool ? " to the spool" : "");
 	} else {
-		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+		ast_debug(3, "Kafka flushed %zu producer handle(s) in %ldms\n", count, (long)ast_tvdiff_ms(ast_tvnow(), started));
+	}
+}
 
-		if(0 == strcasecmp(sorcery_producer->key_overwrite, "uuid")) {
-			char pbx_uuid[AST_UUID_STR_LEN];
+/*! Flush one producer's handle up to the common deadline */
+static void *kafka_flush_job_run(void *opaque) {
+	struct kafka_flush_job *job = opaque;
+	int64_t remaining = ast_tvdiff_ms(flush_deadline, ast_tvnow());
 
-			ast_pbx_uuid_get(pbx_uuid, sizeof(pbx_uuid));
+	job->result = rd_kafka_flush(job->producer->rd_kafka, (remaining > 0) ? (int)remaining : 0);
 
-			producer->specific.producer.forced_key = ast_strdup(pbx_uuid);
-			producer->specific.producer.force_null_key = 0;
-		} else if(0 == strcasecmp(sorcery_producer->key_overwrite, "value")) {
-			producer->specific.producer.forced_key = ast_strdup(sorcery_producer->key_value);
-			producer->specific.producer.force_null_key = 0;
-		} else if(0 == strcasecmp(sorcery_producer->key_overwrite, "null")) {
-			/* Force null key*/
-			producer->specific.producer.forced_key = NULL;
-			producer->specific.producer.force_null_key = 1;
-		} else if(0 == strcasecmp(sorcery_producer->key_overwrite, "no")) {
-			/* Use originator's key */
-			producer->specific.producer.forced_key = NULL;
-			producer->specific.producer.force_null_key = 0;
-		} else {
-			ast_log(LOG_WARNING, 
-				"Unknown key_overwrite value '%s'. Valid values are 'no', 'uuid', 'value', 'null'.\n", 
-				sorcery_producer->key_overwrite);
-			
-			/* Use originator's key */
-			producer->specific.producer.forced_key = NULL;
-			producer->specific.producer.force_null_key = 0;
-		}
-		
-		producer->timeout_ms = sorcery_producer->timeout_ms;
-		producer->partition = (sorcery_producer->partition < 0) ? RD_KAFKA_PARTITION_UA : sorcery_producer->partition;
-		producer->topic_count = 0;
+	return NULL;
+}
 
-		/* Passed to on_producer_message_processed as opaque value */
-		rd_kafka_conf_set_opaque(config, producer);
+/*! Set number of dispatch lanes of the pipes created after */
+static void init_dispatch_lanes(void) {
+	RAII_VAR(struct sorcery_kafka_general *, general, sorcery_kafka_general_get(), ao2_cleanup);
+	unsigned int count = general ? general->dispatch_lanes : 0;
 
-		/* Processed message callback */
-		rd_kafka_conf_set_dr_msg_cb(config, on_producer_message_processed);
+	if(count > KAFKA_MONITOR_MAX_THREADS) {
+		ast_log(LOG_WARNING, "Too many dispatch lanes %u, limited to %d\n", count, KAFKA_MONITOR_MAX_THREADS);
+		count = KAFKA_MONITOR_MAX_THREADS;
+	}
 
-		/* Attempt to creare librdkafka producer */
-		if(NULL == (producer->rd_kafka = rd_kafka_new(RD_KAFKA_PRODUCER, config, errstr, KAFKA_ERRSTR_MAX_SIZE))) {
-			ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create producer '%s' because %s\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_producer), errstr);
-		} else {
-			ast_debug(3, "Producer service '%s' (%p) for cluster '%s' have handle %p\n",
-					ast_sorcery_object_get_id(sorcery_producer), producer,
-					ast_sorcery_object_get_id(sorcery_cluster), producer->rd_kafka);
+	dispatch_lane_count = count;
+
+	if(count) {
+		ast_debug(3, "Kafka consumed messages dispatched by %u lane(s)\n", count);
+	}
+}
 
-			return producer;
+/*! Select monitor thread for the service by explicit index or by service id hash */
+static struct kafka_monitor *select_service_monitor(const char *service_id, int poller) {
+	if(poller >= 0) {
+		if((unsigned int)poller >= monitor_count) {
+			ast_log(LOG_WARNING, "Service '%s': poller %d not exist, use poller %u\n", service_id, poller, poller % monitor_count);
 		}
+
+		return &monitors[poller % monitor_count];
 	}
 
-	rd_kafka_conf_destroy(config);
+	return &monitors[ast_str_hash(service_id) % monitor_count];
+}
 
-	ao2_cleanup(producer);
+/*! Start monitor thread if possible */
+static int start_monitor_thread(struct kafka_monitor *monitor) {
+	int res = 0;
 
-	return NULL;
+	ast_mutex_lock(&monitor_lock);
+
+	if(AST_PTHREADT_NULL == monitor->thread) {
+		if(ast_alertpipe_init(monitor->alert_pipe)) {
+			ast_log(LOG_ERROR, "Unable to create monitor alert pipe: %s\n", strerror(errno));
+			res = -1;
+		} else if((res = ast_pthread_create_background(&monitor->thread, NULL, monitor_thread_job, monitor))) {
+			ast_alertpipe_close(monitor->alert_pipe);
+			monitor->thread = AST_PTHREADT_NULL;
+		}
+	} else if(AST_PTHREADT_STOP != monitor->thread) {
+		/* Monitor already running, services list changed */
+		ast_alertpipe_write(monitor->alert_pipe);
+	}
+
+	ast_mutex_unlock(&monitor_lock);
+
+	return res;
 }
 
-static void kafka_producer_destructor(void *obj) {
-	struct kafka_service *producer = obj;
+/*! Inform monitor thread about services list changes */
+static void notify_monitor_thread(struct kafka_monitor *monitor) {
+	ast_mutex_lock(&monitor_lock);
 
-	if(producer->rd_kafka) {
-		ast_debug(3, "Destroy rd_kafka_t object %p on producer %p\n", producer->rd_kafka, producer);
-		rd_kafka_destroy(producer->rd_kafka);
+	if((AST_PTHREADT_NULL != monitor->thread) && (AST_PTHREADT_STOP != monitor->thread)) {
+		ast_alertpipe_write(monitor->alert_pipe);
 	}
-	
-	ast_free(producer->specific.producer.forced_key);
-	
-	ao2_cleanup(producer->topics);
+
+	ast_mutex_unlock(&monitor_lock);
 }
 
-/*! Create new consumer service object */
-static struct kafka_service *new_kafka_consumer(const struct sorcery_kafka_cluster *sorcery_cluster, const struct sorcery_kafka_consumer *sorcery_consumer) {
-	rd_kafka_conf_t *config = build_rdkafka_cluster_config(sorcery_cluster);
-	struct kafka_service *consumer;
+/*! Monitoring thread job
+ *
+ * Thread sleep in poll() until librdkafka signal any service queue
+ * become non-empty or services list changed.
+ */
+static void *monitor_thread_job(void *opaque) {
+	struct kafka_monitor *monitor = opaque;
+	struct kafka_service **services = NULL;
+	struct pollfd *fds = NULL;
+	size_t allocated = 0;
+	size_t count = 0;
+	size_t i;
+	int rebuild = 1;
+	int timeout;
+
+	ast_debug(3, "Monitor thread %u started.\n", monitor->index);
+
+#ifdef CPU_SET
+	if(monitor->cpu >= 0) {
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(monitor->cpu, &cpuset);
+
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+			ast_log(LOG_WARNING, "Unable to pin poller thread %u to CPU %d\n", monitor->index, monitor->cpu);
+		}
+	}
+#endif
 
-	if(NULL == config) {
-		return NULL;
-	} else {
-		/* Set consumer-specific configuration options */
-		static const char *service_type = "consumer";
-		const char *service_id = ast_sorcery_object_get_id(sorcery_consumer);
-		const char *cluster_id = ast_sorcery_object_get_id(sorcery_cluster);
+	for(;;) {
+		int ready;
 
-		if(ast_strlen_zero(sorcery_consumer->group_id)) {
-			ast_log(LOG_WARNING, 
-				"Kafka low-level consumers not supported yet. Please specify 'group_id' option for consumer '%s'\n", 
-				service_id);
-		} else {		
-			if(service_add_property_string(config, "group.id", sorcery_consumer->group_id, service_type, service_id, cluster_id)) {
-				rd_kafka_conf_destroy(config);
-				return NULL;
-			}	
+		if(rebuild) {
+			if(monitor_services_snapshot(monitor, &services, &allocated, &count, &fds)) {
+				/* Previous services still served, retry on the next wakeup */
+				ast_log(LOG_ERROR, "Monitor thread %u: Out of memory, services list not updated\n", monitor->index);
+
+				if((NULL == fds) && monitor_stop_requested(monitor)) {
+					/* Alert pipe not watched yet */
+					break;
+				}
+			} else {
+				rebuild = 0;
+			}
 		}
 
-		if(service_add_property_string(config, "enable.auto.commit", sorcery_consumer->enable_auto_commit ? "true" : "false", service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
+		timeout = KAFKA_MONITOR_IDLE_TIMEOUT_MS;
 
-		if(service_add_property_uint(config, "auto.commit.interval.ms", sorcery_consumer->auto_commit_interval_ms, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
+		for(i = 0;i < count;i++) {
+			if(!ast_tvzero(services[i]->wakeup)) {
+				/* Service requested poll before idle timeout */
+				int64_t remaining = ast_tvdiff_ms(services[i]->wakeup, ast_tvnow());
 
-		/* Emit RD_KAFKA_RESP_ERR__PARTITION_EOF event whenever the consumer reaches the end of a partition. */
-		if(service_add_property_string(config, "enable.partition.eof", "true", service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
-		
-		if(service_add_property_string(config, "client.id", ast_sorcery_object_get_id(sorcery_consumer), service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
-		
-		if(service_add_property_string(config, "debug", sorcery_consumer->debug, service_type, service_id, cluster_id)) {
-			rd_kafka_conf_destroy(config);
-			return NULL;
-		}		
-	}
+				if(remaining < timeout) {
+					timeout = (remaining > 0) ? remaining : 0;
+				}
+			}
+		}
 
-	if(NULL == (consumer = new_kafka_service(kafka_consumer_destructor))) {
-		ast_log(LOG_ERROR, "Kafka cluster '%s': Unable to create consumer '%s' because Out of memory\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer));
-	} else {
-		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+		/* Without descriptors only sleep until the snapshot retry */
+		if((ready = ast_poll(fds, fds ? count + 1 : 0, timeout)) < 0) {
+			if(EINTR != errno) {
+				ast_log(LOG_ERROR, "Monitor thread %u poll failed: %s\n", monitor->index, strerror(errno));
 
-		consumer->rd_kafka = NULL;
-		consumer->specific.consumer.queue = NULL;
+				if(monitor_stop_requested(monitor)) {
+					break;
+				}
 
-		if(ast_strlen_zero(sorcery_consumer->group_id)) {
-			/* Low-level consumer */
-			consumer->specific.consumer.topic_partition_list = NULL;
-		} else {
-			/* High-level consumer, default for 1 topic (can be extended when need) */
-			if(NULL == (consumer->specific.consumer.topic_partition_list = rd_kafka_topic_partition_list_new(1))) {
-				rd_kafka_conf_destroy(config);
-				ao2_cleanup(consumer);
-				return NULL;
+				/* Descriptors are built again, services still served after pause */
+				usleep(KAFKA_MONITOR_ERROR_PAUSE_US);
+				rebuild = 1;
 			}
+
+			continue;
 		}
-		
-		consumer->timeout_ms = sorcery_consumer->timeout_ms;
-		consumer->partition = (sorcery_consumer->partition < 0) ? RD_KAFKA_PARTITION_UA : sorcery_consumer->partition;
-		consumer->topic_count = 0;
 
-		/* Passed to on_consumer_message_processed as opaque value */
-		rd_kafka_conf_set_opaque(config, consumer);
+		for(i = 0;i < count;i++) {
+			struct kafka_service *service = services[i];
+			int served;
 
-		/* Processed message callback */
-		rd_kafka_conf_set_dr_msg_cb(config, on_consumer_message_processed);
+			if(ready && !(fds[i + 1].revents & POLLIN) && (ast_tvzero(service->wakeup) || (ast_tvcmp(ast_tvnow(), service->wakeup) < 0))) {
+				/* No events signalled on this service */
+				continue;
+			}
 
-		/* Attempt to creare librdkafka consumer */
-		if(NULL == (consumer->rd_kafka = rd_kafka_new(RD_KAFKA_CONSUMER, config, errstr, KAFKA_ERRSTR_MAX_SIZE))) {
-			ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create consumer '%s' because %s\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer), errstr);
-		} else {
-			if(NULL == (consumer->specific.consumer.queue = rd_kafka_queue_new(consumer->rd_kafka))) {
-				ast_log(LOG_ERROR, "Kafka cluster '%s': unable to create consumer '%s' queue because %s\n", ast_sorcery_object_get_id(sorcery_cluster), ast_sorcery_object_get_id(sorcery_consumer), errstr);
-			} else {
-				ast_debug(3, "Consumer service '%s' (%p) for cluster '%s' have handle %p\n",
-						ast_sorcery_object_get_id(sorcery_consumer), consumer,
-						ast_sorcery_object_get_id(sorcery_cluster), consumer->rd_kafka);
+			/* Queue event signalled only when queue become non-empty, so reset alert before draining */
+			ast_alertpipe_flush(service->alert_pipe);
 
-				return consumer;
+			served = service->poll(service, KAFKA_MONITOR_POLL_BUDGET);
+
+			kafka_stats_add(service->stats, KAFKA_COUNTER_POLL_ITERATIONS, 1);
+			kafka_stats_add(service->stats, served ? KAFKA_COUNTER_POLL_EVENTS : KAFKA_COUNTER_POLL_IDLE, served ? served : 1);
+
+			if(served >= KAFKA_MONITOR_POLL_BUDGET) {
+				/* Budget exhausted, continue on next iteration */
+				ast_alertpipe_write(service->alert_pipe);
 			}
+		}
 
-			rd_kafka_destroy(consumer->rd_kafka);
-			consumer->rd_kafka = NULL;
+		if(fds && (fds[0].revents & POLLIN)) {
+			ast_alertpipe_flush(monitor->alert_pipe);
 
-			ao2_cleanup(consumer);
+			if(monitor_stop_requested(monitor)) {
+				break;
+			}
 
-			return NULL;
+			/* Services list changed */
+			rebuild = 1;
 		}
 	}
 
-	rd_kafka_conf_destroy(config);
+	for(i = 0;i < count;i++) {
+		ao2_ref(services[i], -1);
+	}
 
-	ao2_cleanup(consumer);
+	ast_free(services);
+	ast_free(fds);
+
+	ast_debug(3, "Monitor thread %u finished.\n", monitor->index);
 
 	return NULL;
 }
 
-static void kafka_consumer_destructor(void *obj) {
-	struct kafka_service *consumer = obj;
+/*! Build referenced array of active services served by the monitor and poll descriptors,
+ * previous snapshot kept on allocation failure, return 0 on success */
+static int monitor_services_snapshot(struct kafka_monitor *monitor, struct kafka_service ***services, size_t *allocated, size_t *count, struct pollfd **fds) {
+	size_t found = 0;
+	size_t i;
+	struct pollfd *new_fds;
+	struct kafka_service *service;
 
-	if(consumer->specific.consumer.topic_partition_list) {
-		/* Subscription list still exist */
-		rd_kafka_topic_partition_list_destroy(consumer->specific.consumer.topic_partition_list);
+	AST_RWDLLIST_RDLOCK(&producers);
+	AST_RWDLLIST_RDLOCK(&consumers);
+
+	AST_DLLIST_TRAVERSE(&producers, service, link) {
+		found += (service->monitor == monitor);
 	}
-	
-	if(consumer->specific.consumer.queue) {
-		rd_kafka_queue_destroy(consumer->specific.consumer.queue);
+
+	AST_DLLIST_TRAVERSE(&consumers, service, link) {
+		found += (service->monitor == monitor);
 	}
 
-	if(consumer->rd_kafka) {
-		ast_debug(3, "Destroy rd_kafka_t object %p on consumer %p\n", consumer->rd_kafka, consumer);
-		rd_kafka_destroy(consumer->rd_kafka);
+	/* New snapshot placed after the previous one until it's released */
+	if(*count + found > *allocated) {
+		struct kafka_service **tmp = ast_realloc(*services, (*count + found) * sizeof(*tmp));
+
+		if(NULL == tmp) {
+			AST_RWDLLIST_UNLOCK(&consumers);
+			AST_RWDLLIST_UNLOCK(&producers);
+			return -1;
+		}
+
+		*services = tmp;
+		*allocated = *count + found;
 	}
 
-	ao2_cleanup(consumer->topics);
-}
+	if(NULL == (new_fds = ast_calloc(found + 1, sizeof(*new_fds)))) {
+		AST_RWDLLIST_UNLOCK(&consumers);
+		AST_RWDLLIST_UNLOCK(&producers);
+		return -1;
+	}
 
-/*! Calculate hash */
-AO2_STRING_FIELD_HASH_FN(kafka_topic, id)
-/*! Compare pipes */
-AO2_STRING_FIELD_CMP_FN(kafka_topic, id)
+	found = 0;
 
-/*! Common service allocator */
-static struct kafka_service *new_kafka_service(void (*service_destructor)(void *obj)) {
-	struct kafka_service *service = ao2_alloc(sizeof(*service), service_destructor);
-	
-	if(service) {
-		/* Initialize service-specific area */
-		memset(&service->specific, 0, sizeof(service->specific));
-		
-		/* Build topic storage */
-		if(NULL == (service->topics = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, KAFKA_TOPIC_BUCKETS, kafka_topic_hash_fn, NULL, kafka_topic_cmp_fn))) {
-			/* Service not usable */
-			ao2_ref(service, -1);
-			return NULL;
+	AST_DLLIST_TRAVERSE(&producers, service, link) {
+		if(service->monitor == monitor) {
+			ao2_ref(service, +1);
+			(*services)[*count + found++] = service;
+		}
+	}
+
+	AST_DLLIST_TRAVERSE(&consumers, service, link) {
+		if(service->monitor == monitor) {
+			ao2_ref(service, +1);
+			(*services)[*count + found++] = service;
 		}
 	}
-	
-	return service;
+
+	AST_RWDLLIST_UNLOCK(&consumers);
+	AST_RWDLLIST_UNLOCK(&producers);
+
+	/* Release previous snapshot */
+	for(i = 0;i < *count;i++) {
+		ao2_ref((*services)[i], -1);
+	}
+
+	memmove(*services, *services + *count, found * sizeof(**services));
+	*count = found;
+
+	new_fds[0].fd = ast_alertpipe_readfd(monitor->alert_pipe);
+	new_fds[0].events = POLLIN;
+
+	for(i = 0;i < found;i++) {
+		new_fds[i + 1].fd = ast_alertpipe_readfd((*services)[i]->alert_pipe);
+		new_fds[i + 1].events = POLLIN;
+	}
+
+	ast_free(*fds);
+	*fds = new_fds;
+
+	return 0;
+}
+
+/*! Monitor thread requested to stop */
+static int monitor_stop_requested(const struct kafka_monitor *monitor) {
+	int stop;
+
+	ast_mutex_lock(&monitor_lock);
+	stop = (AST_PTHREADT_STOP == monitor->thread);
+	ast_mutex_unlock(&monitor_lock);
+
+	return stop;
+}
+
+/*! Forward librdkafka queue events to the service alert pipe */
+static int service_watch_queue(struct kafka_service *service, rd_kafka_queue_t *queue) {
+	/* Same payload valid for eventfd and for pipe based alert pipe */
+	static const uint64_t payload = 1;
+
+	if(NULL == queue) {
+		return -1;
+	}
+
+	rd_kafka_queue_io_event_enable(queue, service->alert_pipe[1], &payload, sizeof(payload));
+
+	/* Queue may be already non-empty, force first poll */
+	ast_alertpipe_write(service->alert_pipe);
+
+	return 0;
 }
 
+/*! Stop forward librdkafka queue events and release queue */
+static void service_unwatch_queue(rd_kafka_queue_t *queue) {
+	rd_kafka_queue_io_event_enable(queue, -1, NULL, 0);
+	rd_kafka_queue_destroy(queue);
+}
 
+/*! Serve service's main queue events (delivery reports, errors, statistics) */
+static int service_main_queue_poll(struct kafka_service *service, int budget) {
+	int processed = 0;
+	int served;
 
-/*! Build common rdkafka cluster configuration */
-static rd_kafka_conf_t *build_rdkafka_cluster_config(const struct sorcery_kafka_cluster *cluster) {
-	rd_kafka_conf_t *config = rd_kafka_conf_new();
-	char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+	while((processed < budget) && ((served = rd_kafka_poll(service->rd_kafka, 0)) > 0)) {
+		processed += served;
+	}
 
-	if(NULL == config) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to create configuration object\n", ast_sorcery_object_get_id(cluster));
-		return NULL;
+	return processed;
+}
+
+/*! Serve producer's main queue events and replay spools of the producer's handle */
+static int producer_poll(struct kafka_service *producer, int budget) {
+	int processed = service_main_queue_poll(producer, budget);
+
+	/* Replay also on idle poll, when no delivery reports expected. Only one producer of the shared handle is signalled */
+	if(kafka_connection_replay(producer->specific.producer.connection, KAFKA_SPOOL_REPLAY_BUDGET) >= KAFKA_SPOOL_REPLAY_BUDGET) {
+		/* More records pending */
+		processed = budget;
 	}
 
-	/* Set our logger */
-	rd_kafka_conf_set_log_cb(config, rdkafka_logger);
-	
-	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "metadata.broker.list", cluster->brokers, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set bootstrap brokers because %s\n", ast_sorcery_object_get_id(cluster), errstr);
-		rd_kafka_conf_destroy(config);
-		return NULL;
+	return processed;
+}
+
+/*! Serve high-level consumer's queue, main queue forwarded to it */
+static int high_level_consumer_poll(struct kafka_service *consumer, int budget) {
+	int processed = 0;
+	rd_kafka_message_t *rkm;
+
+	if(consumer->specific.consumer.tracker) {
+		/* Commit by interval, also on idle poll */
+		kafka_commit_flush(consumer->specific.consumer.tracker, 0);
 	}
 
-	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "security.protocol", cluster->security_protocol, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set security protocol because %s\n", ast_sorcery_object_get_id(cluster), errstr);
-		rd_kafka_conf_destroy(config);
-		return NULL;
+	if(consumer->specific.consumer.batch) {
+		return consumer_batch_poll(consumer, budget);
 	}
 
-	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.mechanism", cluster->sasl_mechanism, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL mechanism because %s\n", ast_sorcery_object_get_id(cluster), errstr);
-		rd_kafka_conf_destroy(config);
-		return NULL;
+	while((processed < budget) && (NULL != (rkm = rd_kafka_consumer_poll(consumer->rd_kafka, 0)))) {
+		processed++;
+
+		consumer_message_process(consumer, rkm);
 	}
 
-	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.username", cluster->sasl_username, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL username because %s\n", ast_sorcery_object_get_id(cluster), errstr);
-		rd_kafka_conf_destroy(config);
-		return NULL;
+	return processed;
+}
+
+/*! Serve low-level consumer's main and messages queues */
+static int low_level_consumer_poll(struct kafka_service *consumer, int budget) {
+	int processed = service_main_queue_poll(consumer, budget);
+	rd_kafka_message_t *rkm;
+
+	if(consumer->specific.consumer.batch) {
+		return processed + consumer_batch_poll(consumer, budget - processed);
 	}
 
-	if(RD_KAFKA_CONF_OK != rd_kafka_conf_set(config, "sasl.password", cluster->sasl_password, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-		ast_log(LOG_ERROR, "Kafka cluster %s: unable to set SASL password because %s\n", ast_sorcery_object_get_id(cluster), errstr);
-		rd_kafka_conf_destroy(config);
-		return NULL;
+	while((processed < budget) && (NULL != (rkm = rd_kafka_consume_queue(consumer->specific.consumer.queue, 0)))) {
+		processed++;
+
+		consumer_message_process(consumer, rkm);
 	}
 
-	return config;
+	return processed;
 }
 
-/*! Add signed integer property value to the Kafka configuration */
-static int service_add_property_int(rd_kafka_conf_t *config, 
-					const char *property, int value, 
-					const char *service_type,
-					const char *service_id,
-					const char *cluster_id) {
-	char *tmp = ast_alloca(TMP_BUF_SIZE);
-	
-	snprintf(tmp, TMP_BUF_SIZE, "%d", value);
+/*! Serve consumer's messages queue by batches */
+static int consumer_batch_poll(struct kafka_service *consumer, int budget) {
+	rd_kafka_message_t **batch = consumer->specific.consumer.batch;
+	size_t batch_size = consumer->specific.consumer.batch_size;
+	int processed = 0;
+	ssize_t count;
 
-	return service_add_property_string(config, property, tmp, service_type, service_id, cluster_id);
-}
+	/* Never block the poller, batch filled across wakeups until batch_timeout */
+	while(processed < budget) {
+		size_t collected = consumer->specific.consumer.batch_count;
 
-/*! Add unsigned integer property value to the Kafka configuration */
-static int service_add_property_uint(rd_kafka_conf_t *config, 
-					const char *property, unsigned value, 
-					const char *service_type,
-					const char *service_id,
-					const char *cluster_id) {
-	char *tmp = ast_alloca(TMP_BUF_SIZE);
-	
-	snprintf(tmp, TMP_BUF_SIZE, "%u", value);
+		if((count = rd_kafka_consume_batch_queue(consumer->specific.consumer.queue, 0, batch + collected, batch_size - collected)) > 0) {
+			if(0 == collected) {
+				/* The first message set the batch deadline */
+				consumer->wakeup = ast_tvadd(ast_tvnow(), ast_samp2tv(consumer->specific.consumer.batch_timeout_ms, 1000));
+			}
 
-	return service_add_property_string(config, property, tmp, service_type, service_id, cluster_id);
-}
+			collected += count;
+			consumer->specific.consumer.batch_count = collected;
+		}
 
-/*! Add string property value to the Kafka configuration */
-static int service_add_property_string(rd_kafka_conf_t *config, 
-					const char *property, const char *value,
-					const char *service_type,
-					const char *service_id,
-					const char *cluster_id) {
-	if(value && strlen(value)) {
-		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+		if((count > 0) && (collected < batch_size)) {
+			/* Queue may have more messages */
+			continue;
+		}
 
-		if(RD_KAFKA_CONF_OK == rd_kafka_conf_set(config, property, value, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-			return 0;
+		if(0 == collected) {
+			/* Nothing received */
+			break;
 		}
 
-		ast_log(LOG_ERROR, "Kafka %s '%s' on cluster '%s': unable to set '%s' property because %s\n", 
-			service_type, service_id, cluster_id, property, errstr);
+		if((collected < batch_size) && (ast_tvcmp(ast_tvnow(), consumer->wakeup) < 0)) {
+			/* Queue drained, wait for more messages up to the deadline */
+			break;
+		}
 
-		return -1;
+		consumer->specific.consumer.batch_count = 0;
+		consumer->wakeup = ast_tv(0, 0);
+
+		processed += collected;
+
+		consumer_batch_process(consumer, batch, collected);
 	}
 
-	return 0;
+	return processed;
 }
 
-/*! Process Kafka producer related topic at the cluster */
-static int process_producer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic) {
-#if 1
-	RAII_VAR(struct kafka_topic *, topic, new_kafka_producer_topic(producer, sorcery_topic), ao2_cleanup);
-	RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(sorcery_topic->pipe_id, 1), ao2_cleanup);
-
-	if(pipe && topic) {
-		/* Add topic to the service storage */
-		ao2_link(producer->topics, topic);
+/*! Process message or error, received by consumer */
+static void consumer_message_process(struct kafka_service *consumer, rd_kafka_message_t *rkm) {
+	if(RD_KAFKA_RESP_ERR_NO_ERROR == rkm->err) {
+		RAII_VAR(struct kafka_topic *, topic, NULL, ao2_cleanup);
+		size_t count = 1;
 
-		AST_LIST_LOCK(&pipe->producer_topics);
+		if(probes_running) {
+			kafka_probe_received(rkm);
+		}
 
-		/* Add new topic to the specified pipe */
-		AST_LIST_INSERT_TAIL(&pipe->producer_topics, topic, link);
+		topic = consumer_message_topic(consumer, &rkm, &count);
 
-		/* Object in the list */
-		ao2_ref(topic, +1);
+		if(0 == count) {
+			/* Filtered and released */
+			return;
+		}
 
-		AST_LIST_UNLOCK(&pipe->producer_topics);
-		
-		return 0;
+		if(topic && topic->stasis_topic) {
+			/* Message ownership moved to the stasis message */
+			stasis_publish_kafka_consumer_message(kafka_dispatch_topic(topic, rkm), consumer->specific.consumer.tracker, rkm);
+			return;
+		}
+	} else if(RD_KAFKA_RESP_ERR__PARTITION_EOF == rkm->err) {
+		ast_debug(3, "Consumer reached end of topic '%s' partition %d at offset %ld\n",
+				rkm->rkt ? rd_kafka_topic_name(rkm->rkt) : "", rkm->partition, (long)rkm->offset);
 	} else {
-		ast_log(LOG_ERROR, "Unable to add producer topic '%s' to pipe '%s' - Out of memory\n", 
-			ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->pipe_id);
-
-		return -1;
+		ast_log(LOG_WARNING, "Got consumer error %d: %s\n", rkm->err, rd_kafka_message_errstr(rkm));
 	}
 
-#else
-	struct kafka_topic *topic;
-	rd_kafka_resp_err_t response;
+	rd_kafka_message_destroy(rkm);
+}
 
-	struct ast_kafka_pipe *pipe = ast_kafka_get_pipe(sorcery_topic->pipe_id, 1);
-	ao2_cleanup(pipe);
+/*! Process batch of messages or errors, received by consumer */
+static void consumer_batch_process(struct kafka_service *consumer, rd_kafka_message_t **rkms, size_t count) {
+	size_t i = 0;
 
-	ast_debug(3, "Process Kafka topic %s for producer %p\n", ast_sorcery_object_get_id(sorcery_topic), producer);
+	while(i < count) {
+		RAII_VAR(struct kafka_topic *, topic, NULL, ao2_cleanup);
+		size_t received;
+		size_t run = 1;
 
-	topic = new_kafka_producer_topic(producer, sorcery_topic);
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != rkms[i]->err) {
+			consumer_message_process(consumer, rkms[i++]);
+			continue;
+		}
 
-	if(rd_kafka_produce(topic->rd_kafka_topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY, "test", 4, NULL, 0, NULL)) {
-		ast_log(LOG_ERROR, "Unable to produce message producer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
-	}
+		/* Messages from the same topic published by one stasis message */
+		while((i + run < count) && (RD_KAFKA_RESP_ERR_NO_ERROR == rkms[i + run]->err) && (rkms[i + run]->rkt == rkms[i]->rkt)) {
+			run++;
+		}
 
-	if(RD_KAFKA_RESP_ERR_NO_ERROR == (response = rd_kafka_flush(producer->rd_kafka, 10000))) {
-		ast_log(LOG_ERROR, "Kafka producer topic %s got error: %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(response));
-	}
+		if(probes_running) {
+			size_t j;
 
-	ao2_cleanup(topic);
-#endif
+			for(j = 0;j < run;j++) {
+				kafka_probe_received(rkms[i + j]);
+			}
+		}
+
+		received = run;
+
+		if((NULL == (topic = consumer_message_topic(consumer, rkms + i, &run))) || (NULL == topic->stasis_topic)) {
+			size_t j;
+
+			for(j = 0;j < run;j++) {
+				rd_kafka_message_destroy(rkms[i + j]);
+			}
+		} else if(0 == run) {
+			/* All messages filtered and released */
+		} else if(topic->lanes) {
+			/* Messages ownership moved to the lanes stasis messages */
+			consumer_batch_dispatch(topic->lanes, consumer->specific.consumer.tracker, consumer->specific.consumer.batch_pool, rkms + i, run);
+		} else {
+			/* Messages ownership moved to the stasis message */
+			stasis_publish_kafka_consumer_batch(topic->stasis_topic, consumer->specific.consumer.tracker, consumer->specific.consumer.batch_pool, rkms + i, run);
+		}
+
+		i += received;
+	}
 }
 
-/*! Process Kafka consumer related topic at the cluster */
-static int process_consumer_topic(struct kafka_service *consumer, const struct sorcery_kafka_topic *sorcery_topic) {
-	RAII_VAR(struct kafka_topic *, topic, new_kafka_consumer_topic(consumer, sorcery_topic), ao2_cleanup);
-	RAII_VAR(struct ast_kafka_pipe *, pipe, ast_kafka_get_pipe(sorcery_topic->pipe_id, 1), ao2_cleanup);
+/*!
+ * Account messages from the same topic and find referenced consumer topic for them, NULL if topic not handled by consumer.
+ * Messages dropped by topic filter are released, accepted ones moved to the beginning and count updated.
+ */
+static struct kafka_topic *consumer_message_topic(struct kafka_service *consumer, rd_kafka_message_t **rkms, size_t *count) {
+	const char *topic_name = rd_kafka_topic_name(rkms[0]->rkt);
+	struct kafka_topic *topic = ao2_find(consumer->topics, topic_name, OBJ_SEARCH_KEY);
+	size_t bytes = 0;
+	size_t i;
 
-	if(pipe && topic) {
-		/* Add topic to the service storage */
-		ao2_link(consumer->topics, topic);
-		
-		AST_LIST_LOCK(&pipe->consumer_topics);
+	if(NULL == topic) {
+		ast_debug(3, "Consumer %p got message from unknown topic '%s'\n", consumer, topic_name);
+		return NULL;
+	}
 
-		/* Add new topic to the specified pipe */
-		AST_LIST_INSERT_TAIL(&pipe->consumer_topics, topic, link);
+	for(i = 0;i < *count;i++) {
+		bytes += rkms[i]->len;
+	}
 
-		/* Object in the list */
-		ao2_ref(topic, +1);
+	kafka_stats_topic_add(topic, KAFKA_COUNTER_CONSUMED_MESSAGES, *count);
+	kafka_stats_topic_add(topic, KAFKA_COUNTER_CONSUMED_BYTES, bytes);
 
-		AST_LIST_UNLOCK(&pipe->consumer_topics);
+	if(topic->filter) {
+		size_t accepted = 0;
 
-		return 0;
-	} else {
-		ast_log(LOG_ERROR, "Unable to add consumer topic '%s' to pipe '%s' - Out of memory\n", 
-			ast_sorcery_object_get_id(sorcery_topic), sorcery_topic->pipe_id);
+		for(i = 0;i < *count;i++) {
+			if(kafka_topic_filter_accept(topic->filter, rkms[i])) {
+				rkms[accepted++] = rkms[i];
+			} else {
+				/* Never tracked, committed with the next processed message */
+				rd_kafka_message_destroy(rkms[i]);
+			}
+		}
 
-		return -1;
+		if(accepted < *count) {
+			kafka_stats_topic_add(topic, KAFKA_COUNTER_FILTERED, *count - accepted);
+			*count = accepted;
+		}
 	}
-}
 
+	if(consumer->specific.consumer.tracker && topic->stasis_topic) {
+		/* Tracked in the received order, before dispatched to lanes */
+		for(i = 0;i < *count;i++) {
+			kafka_commit_track(consumer->specific.consumer.tracker, rkms[i]);
+		}
+	}
 
+	return topic;
+}
 
+/*! Build consumer topic filter */
+static struct kafka_topic_filter *new_kafka_topic_filter(const struct sorcery_kafka_topic *sorcery_topic) {
+	struct kafka_topic_filter *filter;
+	size_t count = 0;
+	const char *ptr;
+	char *reasons;
+	char *reason;
+
+	/* Upper bound of the reasons number */
+	for(ptr = sorcery_topic->reason_in;*ptr;ptr++) {
+		count += (',' == *ptr);
+	}
 
-static struct kafka_topic *new_kafka_producer_topic(struct kafka_service *producer, const struct sorcery_kafka_topic *sorcery_topic) {
-	struct kafka_topic *topic = ao2_alloc(sizeof(*topic), kafka_producer_topic_destructor);
+	if(NULL == (filter = ast_calloc(1, sizeof(*filter) + (count + 1) * sizeof(filter->reasons[0])))) {
+		return NULL;
+	}
 
-	if(NULL == topic) {
-		ast_log(LOG_ERROR, "Out of memory while create producer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
-	} else {
-		rd_kafka_topic_conf_t *config;
-		
-		topic->service = NULL;
-		topic->rd_kafka_topic = NULL;
+	filter->drop_own_eid = sorcery_topic->drop_own_eid;
 
-		if(ast_string_field_init(topic, 64)) {
-			ao2_ref(topic, -1);
+	if(!ast_strlen_zero(sorcery_topic->key_prefix)) {
+		if(NULL == (filter->key_prefix = ast_strdup(sorcery_topic->key_prefix))) {
+			kafka_topic_filter_destroy(filter);
 			return NULL;
 		}
 
-		ast_string_field_set(topic, id, sorcery_topic->topic);
-		
-		if(NULL == (config = rd_kafka_topic_conf_new())) {
-			ast_log(LOG_ERROR, "Unable to create config for producer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
-			ao2_ref(topic, -1);
+		filter->key_prefix_size = strlen(filter->key_prefix);
+	}
+
+	if(!ast_strlen_zero(sorcery_topic->reason_in)) {
+		if(NULL == (filter->reasons_buf = ast_strdup(sorcery_topic->reason_in))) {
+			kafka_topic_filter_destroy(filter);
 			return NULL;
 		}
 
-		/* With topic's callbacks we want see the kafka_producer_topic structure reference */
-		rd_kafka_topic_conf_set_opaque(config, topic);
+		reasons = filter->reasons_buf;
 
-		topic_add_property_string(config, 
-						"offset.store.method", "broker",
-						ast_sorcery_object_get_id(sorcery_topic));
-		
-		
-		if(topic_add_property_uint(config, 
-						"message.timeout.ms", sorcery_topic->message_timeout_ms,
-						ast_sorcery_object_get_id(sorcery_topic))) {
-			rd_kafka_topic_conf_destroy(config);
-			ao2_ref(topic, -1);
-			return NULL;
-		}
-		
-		if(NULL == (topic->rd_kafka_topic = rd_kafka_topic_new(producer->rd_kafka, sorcery_topic->topic, config))) {
-			ast_log(LOG_ERROR, "Unable to create producer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
-			rd_kafka_topic_conf_destroy(config);
+		while((reason = strsep(&reasons, ","))) {
+			reason = ast_strip(reason);
 
-			/* This object not usable */
-			ao2_ref(topic, -1);
-			return NULL;
+			if(!ast_strlen_zero(reason)) {
+				filter->reasons[filter->reason_count++] = reason;
+			}
 		}
 
-		/* Topic handle created, link this object to the service */
-		topic->service = producer;
-		ao2_ref(producer, +1);
+		if(0 == filter->reason_count) {
+			ast_log(LOG_WARNING, "Topic '%s': empty 'reason_in', any reason accepted\n", ast_sorcery_object_get_id(sorcery_topic));
+		}
 	}
 
-	return topic;
+	return filter;
 }
 
-static void kafka_producer_topic_destructor(void *obj) {
-	struct kafka_topic *topic = obj;
-	RAII_VAR(struct kafka_service *, producer, topic->service, ao2_cleanup);
+/*! Release consumer topic filter */
+static void kafka_topic_filter_destroy(struct kafka_topic_filter *filter) {
+	if(filter) {
+		ast_free(filter->key_prefix);
+		ast_free(filter->reasons_buf);
+		ast_free(filter);
+	}
+}
 
-	if(producer) {
-		int last_topic;
+/*! Check raw message by the topic filter, non-zero if accepted */
+static int kafka_topic_filter_accept(const struct kafka_topic_filter *filter, const rd_kafka_message_t *rkm) {
+	rd_kafka_headers_t *headers = NULL;
+	const void *value;
+	size_t size;
+	size_t i;
+
+	if(filter->key_prefix && ((rkm->key_len < filter->key_prefix_size) || memcmp(rkm->key, filter->key_prefix, filter->key_prefix_size))) {
+		return 0;
+	}
+
+	if((filter->drop_own_eid || filter->reason_count) && (RD_KAFKA_RESP_ERR_NO_ERROR != rd_kafka_message_headers(rkm, &headers))) {
+		/* Message without headers */
+		headers = NULL;
+	}
+
+	if(filter->drop_own_eid && headers && global_producer_eid
+		&& (RD_KAFKA_RESP_ERR_NO_ERROR == rd_kafka_header_get_last(headers, "eid", &value, &size))
+		&& (size == strlen(global_producer_eid)) && (0 == memcmp(value, global_producer_eid, size))) {
+		/* Published by this server */
+		return 0;
+	}
 
-		AST_RWDLLIST_WRLOCK(&producers);
+	if(0 == filter->reason_count) {
+		return 1;
+	}
 
-		if(! --producer->topic_count) {
-			last_topic = 1;
+	if((NULL == headers) || (RD_KAFKA_RESP_ERR_NO_ERROR != rd_kafka_header_get_last(headers, "reason", &value, &size))) {
+		return 0;
+	}
 
-			/* Remove service from producers list */
-			AST_DLLIST_REMOVE(&producers, producer, link);
-		} else {
-			last_topic = 0;
+	for(i = 0;i < filter->reason_count;i++) {
+		if((strlen(filter->reasons[i]) == size) && (0 == memcmp(value, filter->reasons[i], size))) {
+			return 1;
 		}
+	}
 
-		AST_RWDLLIST_UNLOCK(&producers);
+	return 0;
+}
 
-		if(last_topic) {
-			/* Wait for messages to be delivered */
-			while(rd_kafka_outq_len(producer->rd_kafka) > 0) {
-				ast_debug(3, "Producer %p have %u outstanding message(s), wait %ums\n", 
-						producer, rd_kafka_outq_len(producer->rd_kafka), producer->timeout_ms);
+/*! Select dispatch lane by message key hash, messages without key by partition */
+static unsigned int kafka_dispatch_lane(const struct kafka_dispatch_lanes *lanes, const rd_kafka_message_t *rkm) {
+	const unsigned char *key = rkm->key;
+	unsigned int hash = 5381;
+	size_t i;
 
-				rd_kafka_poll(producer->rd_kafka, producer->timeout_ms);
-			}
+	if((NULL == key) || (0 == rkm->key_len)) {
+		return (unsigned int)rkm->partition % lanes->count;
+	}
 
-			/* No reference to this service */
-			ao2_ref(producer, -1);
-		}
+	/* Same as ast_str_hash(), key is not null-terminated */
+	for(i = 0;i < rkm->key_len;i++) {
+		hash = hash * 33 ^ key[i];
 	}
 
-	if(topic->rd_kafka_topic) {
-		ast_debug(3, "Destroy rd_kafka_topic_t object %p on producer's topic %p\n", topic->rd_kafka_topic, topic);
-		rd_kafka_topic_destroy(topic->rd_kafka_topic);
+	return hash % lanes->count;
+}
+
+/*! Stasis topic of the consumed message: lane topic or the pipe's topic */
+static struct stasis_topic *kafka_dispatch_topic(const struct kafka_topic *topic, const rd_kafka_message_t *rkm) {
+	if(topic->lanes) {
+		return topic->lanes->topics[kafka_dispatch_lane(topic->lanes, rkm)];
 	}
 
-	ast_string_field_free_memory(topic);
+	return topic->stasis_topic;
 }
 
+/*! Publish messages from the same topic by lanes, each lane get one batch with its messages in order */
+static void consumer_batch_dispatch(const struct kafka_dispatch_lanes *lanes, struct kafka_commit_tracker *tracker, struct kafka_batch_pool *pool, rd_kafka_message_t **rkms, size_t count) {
+	unsigned int *lane_ids = ast_alloca(count * sizeof(*lane_ids));
+	rd_kafka_message_t **lane_rkms = ast_alloca(count * sizeof(*lane_rkms));
+	size_t i;
+	size_t j;
 
-static struct kafka_topic *new_kafka_consumer_topic(struct kafka_service *consumer, const struct sorcery_kafka_topic *sorcery_topic) {
-	struct kafka_topic *topic = ao2_alloc(sizeof(*topic), kafka_consumer_topic_destructor);
+	for(i = 0;i < count;i++) {
+		lane_ids[i] = kafka_dispatch_lane(lanes, rkms[i]);
+	}
 
-	if(NULL == topic) {
-		ast_log(LOG_ERROR, "Out of memory while create consumer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
-	} else {
-		topic->service = NULL;
-		topic->rd_kafka_topic = NULL;
+	for(i = 0;i < count;i++) {
+		size_t lane_count = 0;
 
-		if(ast_string_field_init(topic, 64)) {
-			ao2_ref(topic, -1);
-			return NULL;
+		if(NULL == rkms[i]) {
+			/* Already published by its lane */
+			continue;
 		}
 
-		ast_string_field_set(topic, id, sorcery_topic->topic);
-		
-		if(consumer->specific.consumer.topic_partition_list) {
-			/* High-level consumer */
-			if(NULL == rd_kafka_topic_partition_list_add(consumer->specific.consumer.topic_partition_list,
-									sorcery_topic->topic,
-									/* the partition is ignored
-									* by subscribe() */
-									RD_KAFKA_PARTITION_UA)) {
-				ast_log(LOG_ERROR, "Pipe '%s': Unable to add consumer topic '%s' to the subscription list.\n", sorcery_topic->pipe_id, sorcery_topic->topic);
-				ao2_ref(topic, -1);
-				return NULL;
+		for(j = i;j < count;j++) {
+			if(rkms[j] && (lane_ids[j] == lane_ids[i])) {
+				lane_rkms[lane_count++] = rkms[j];
+				rkms[j] = NULL;
 			}
-		} else {
-			/* Low-level consumer */
-			rd_kafka_topic_conf_t *config = rd_kafka_topic_conf_new();
+		}
 
-			if(NULL == config) {
-				ast_log(LOG_ERROR, "Unable to create config for consumer topic '%s'\n", ast_sorcery_object_get_id(sorcery_topic));
-				ao2_ref(topic, -1);
-				return NULL;
-			}
+		stasis_publish_kafka_consumer_batch(lanes->topics[lane_ids[i]], tracker, pool, lane_rkms, lane_count);
+	}
+}
 
-			/* With topic's callbacks we want see the kafka_producer_topic structure reference */
-			rd_kafka_topic_conf_set_opaque(config, topic);
+/*! Create processed offsets tracker, handle set when consumer created */
+static struct kafka_commit_tracker *new_kafka_commit_tracker(const struct sorcery_kafka_consumer *sorcery_consumer) {
+	struct kafka_commit_tracker *tracker = ao2_alloc(sizeof(*tracker), kafka_commit_tracker_destructor);
 
-			if(NULL == (topic->rd_kafka_topic = rd_kafka_topic_new(consumer->rd_kafka, sorcery_topic->topic, config))) {
-				ast_log(LOG_ERROR, "Unable to create consumer topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
-				rd_kafka_topic_conf_destroy(config);
+	if(NULL == tracker) {
+		return NULL;
+	}
 
-				/* This object not usable */
-				ao2_ref(topic, -1);
-				return NULL;
-			}
+	tracker->rd_kafka = NULL;
+	tracker->batch = sorcery_consumer->commit_batch ? sorcery_consumer->commit_batch : 1;
+	tracker->interval_ms = sorcery_consumer->commit_interval_ms;
+	tracker->pending = 0;
+	tracker->committed = ast_tvnow();
+	tracker->generation = 0;
+	AST_LIST_HEAD_INIT_NOLOCK(&tracker->partitions);
 
-			/* Start consuming from end of kafka partition queue: next msg */
-	#if 1
-			if(rd_kafka_consume_start_queue(topic->rd_kafka_topic, consumer->partition, RD_KAFKA_OFFSET_BEGINNING, consumer->specific.consumer.queue) < 0) {
-	#else
-			if(rd_kafka_consume_start(topic->rd_kafka_topic, consumer->partition, RD_KAFKA_OFFSET_END) < 0) {
-	#endif
-				ast_log(LOG_ERROR, "Unable to start consuming topic '%s' because %s\n", ast_sorcery_object_get_id(sorcery_topic), rd_kafka_err2str(rd_kafka_last_error()));
+	return tracker;
+}
 
-				/* Destroy librdkafka topic object */
-				rd_kafka_topic_destroy(topic->rd_kafka_topic);
-				topic->rd_kafka_topic = NULL;
+/*! Processed offsets tracker destructor */
+static void kafka_commit_tracker_destructor(void *obj) {
+	struct kafka_commit_tracker *tracker = obj;
+	struct kafka_commit_partition *partition;
 
-				/* This object not usable */
-				ao2_ref(topic, -1);
-				return NULL;
-			}
+	while((partition = AST_LIST_REMOVE_HEAD(&tracker->partitions, link))) {
+		ast_free(partition->offsets);
+		ast_free(partition);
+	}
+}
+
+/*! Find tracked partition of the message, NULL if not found. Tracker must be locked */
+static struct kafka_commit_partition *kafka_commit_partition_find(struct kafka_commit_tracker *tracker, const char *topic_name, int32_t partition_id) {
+	struct kafka_commit_partition *partition;
+
+	AST_LIST_TRAVERSE(&tracker->partitions, partition, link) {
+		if((partition->partition == partition_id) && (0 == strcmp(partition->topic, topic_name))) {
+			return partition;
 		}
-		
-		/* Topic handle created, link this object to the service */
-		topic->service = consumer;
-		ao2_ref(consumer, +1);
 	}
 
-	return topic;
+	return NULL;
 }
 
-static void kafka_consumer_topic_destructor(void *obj) {
-	struct kafka_topic *topic = obj;
-	RAII_VAR(struct kafka_service *, consumer, topic->service, ao2_cleanup);
+/*! Track dispatched message, messages of the partition tracked in ascending offsets order */
+static void kafka_commit_track(struct kafka_commit_tracker *tracker, const rd_kafka_message_t *rkm) {
+	const char *topic_name = rd_kafka_topic_name(rkm->rkt);
+	struct kafka_commit_partition *partition;
 
-	if(consumer) {
-		int last_topic;
+	ao2_lock(tracker);
 
-		if(topic->rd_kafka_topic) {
-			/* Stop consuming on this topic */
-			rd_kafka_consume_stop(topic->rd_kafka_topic, consumer->partition);
+	if(NULL == (partition = kafka_commit_partition_find(tracker, topic_name, rkm->partition))) {
+		if(NULL == (partition = ast_calloc(1, sizeof(*partition) + strlen(topic_name) + 1))) {
+			ao2_unlock(tracker);
+			return;
 		}
 
-		AST_RWDLLIST_WRLOCK(&consumers);
+		strcpy(partition->topic, topic_name);
+		partition->partition = rkm->partition;
+		partition->watermark = RD_KAFKA_OFFSET_INVALID;
+		partition->committed = RD_KAFKA_OFFSET_INVALID;
+		partition->generation = tracker->generation;
 
-		if(! --consumer->topic_count) {
-			last_topic = 1;
+		AST_LIST_INSERT_TAIL(&tracker->partitions, partition, link);
+	}
 
-			/* Remove service from consumers list */
-			AST_DLLIST_REMOVE(&consumers, consumer, link);
-		} else {
-			last_topic = 0;
-		}
+	if(partition->count && (rkm->offset <= partition->offsets[partition->count - 1].offset)) {
+		/* Partition rewound (seek or rebalance), release of previous messages ignored */
+		ast_debug(3, "Commit tracker: topic '%s' partition %d rewound to offset %ld\n", topic_name, rkm->partition, (long)rkm->offset);
 
-		AST_RWDLLIST_UNLOCK(&consumers);
+		partition->head = 0;
+		partition->count = 0;
+		partition->watermark = RD_KAFKA_OFFSET_INVALID;
+		partition->committed = RD_KAFKA_OFFSET_INVALID;
+	}
 
-		if(last_topic) {
-			if(NULL == topic->rd_kafka_topic) {
-				/* High-level consumer */
-				rd_kafka_consumer_close(consumer->rd_kafka);
-			}
-			
-			/* Wait for messages to be delivered */
-			while(rd_kafka_outq_len(consumer->rd_kafka) > 0) {
-				ast_debug(3, "Consumer %p have %u outstanding message(s), wait %ums\n", 
-						consumer, rd_kafka_outq_len(consumer->rd_kafka), consumer->timeout_ms);
+	if(partition->count == partition->allocated) {
+		if(partition->head) {
+			/* Drop processed entries */
+			partition->count -= partition->head;
+			memmove(partition->offsets, partition->offsets + partition->head, partition->count * sizeof(*partition->offsets));
+			partition->head = 0;
+		}
+
+		if(partition->count == partition->allocated) {
+			size_t allocated = partition->allocated ? partition->allocated * 2 : 64;
+			struct kafka_commit_offset *offsets = ast_realloc(partition->offsets, allocated * sizeof(*offsets));
 
-				rd_kafka_poll(consumer->rd_kafka, consumer->timeout_ms);
+			if(NULL == offsets) {
+				/* Untracked message is committed with the next processed message */
+				ao2_unlock(tracker);
+				return;
 			}
 
-			/* No reference to this service */
-			ao2_ref(consumer, -1);
+			partition->offsets = offsets;
+			partition->allocated = allocated;
 		}
 	}
 
-	if(topic->rd_kafka_topic) {
-		ast_debug(3, "Destroy rd_kafka_topic_t object %p on consumer's topic %p\n", topic->rd_kafka_topic, topic);
-		rd_kafka_topic_destroy(topic->rd_kafka_topic);
-	}
-	
-	ast_string_field_free_memory(topic);
-}
-
-/*! Add signed integer property value to the Kafka configuration */
-static int topic_add_property_int(rd_kafka_topic_conf_t *config, 
-					const char *property, int value, 
-					const char *topic_id) {
-	char *tmp = ast_alloca(TMP_BUF_SIZE);
-	
-	snprintf(tmp, TMP_BUF_SIZE, "%d", value);
+	partition->offsets[partition->count].offset = rkm->offset;
+	partition->offsets[partition->count].done = 0;
+	partition->count++;
 
-	return topic_add_property_string(config, property, tmp, topic_id);
+	ao2_unlock(tracker);
 }
 
-/*! Add unsigned integer property value to the Kafka configuration */
-static int topic_add_property_uint(rd_kafka_topic_conf_t *config, 
-					const char *property, unsigned value, 
-					const char *topic_id) {
-	char *tmp = ast_alloca(TMP_BUF_SIZE);
-	
-	snprintf(tmp, TMP_BUF_SIZE, "%u", value);
+/*! Mark message processed, advance partition low-watermark and commit by batch */
+static void kafka_commit_done(struct kafka_commit_tracker *tracker, const rd_kafka_message_t *rkm, unsigned int generation) {
+	struct kafka_commit_partition *partition;
+	size_t low;
+	size_t high;
 
-	return topic_add_property_string(config, property, tmp, topic_id);
-}
+	ao2_lock(tracker);
 
-/*! Add string property value to the Kafka configuration */
-static int topic_add_property_string(rd_kafka_topic_conf_t  *config, 
-					const char *property, const char *value,
-					const char *topic_id) {
-	if(value && strlen(value)) {
-		char *errstr = ast_alloca(KAFKA_ERRSTR_MAX_SIZE);
+	if((NULL == (partition = kafka_commit_partition_find(tracker, rd_kafka_topic_name(rkm->rkt), rkm->partition)))
+		|| (generation < partition->generation)) {
+		/* Partition revoked after the message dispatched, owned by other consumer or assigned again */
+		ao2_unlock(tracker);
+		return;
+	}
 
-		if(RD_KAFKA_CONF_OK == rd_kafka_topic_conf_set(config, property, value, errstr, KAFKA_ERRSTR_MAX_SIZE)) {
-			return 0;
-		}
+	/* Binary search of not processed entry */
+	low = partition->head;
+	high = partition->count;
 
-		ast_log(LOG_ERROR, "Kafka topic '%s': unable to set '%s' property because %s\n", 
-			topic_id, property, errstr);
+	while(low < high) {
+		size_t middle = low + (high - low) / 2;
 
-		return -1;
+		if(partition->offsets[middle].offset < rkm->offset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
 	}
 
-	return 0;
-}
-
-
+	if((low < partition->count) && (partition->offsets[low].offset == rkm->offset)) {
+		partition->offsets[low].done = 1;
 
+		while((partition->head < partition->count) && partition->offsets[partition->head].done) {
+			/* Commit offset is the next message to consume */
+			partition->watermark = partition->offsets[partition->head].offset + 1;
+			partition->head++;
+			tracker->pending++;
+		}
+	}
 
+	if(tracker->pending >= tracker->batch) {
+		kafka_commit_offsets(tracker, 1);
+	}
 
-/*! Start monitor thread if possible */
-static int start_monitor_thread(void) {
-	int res = 0;
+	ao2_unlock(tracker);
+}
 
-	ast_mutex_lock(&monitor_lock);
+/*! Commit processed offsets by interval or forced */
+static void kafka_commit_flush(struct kafka_commit_tracker *tracker, int force) {
+	ao2_lock(tracker);
 
-	if(AST_PTHREADT_NULL == monitor) {
-		res = ast_pthread_create_detached_background(&monitor, NULL, monitor_thread_job, NULL);
+	if(tracker->pending && (force || (ast_tvdiff_ms(ast_tvnow(), tracker->committed) >= (int64_t)tracker->interval_ms))) {
+		kafka_commit_offsets(tracker, !force);
 	}
 
-	ast_mutex_unlock(&monitor_lock);
-
-	return res;
+	ao2_unlock(tracker);
 }
 
-/*! Monitoring thread job */
-static void *monitor_thread_job(void *opaque) {
-	int active;
-
-	ast_debug(3, "Monitor thread started.\n");
+/*! Current tracker generation, stored by dispatched messages */
+static unsigned int kafka_commit_generation(struct kafka_commit_tracker *tracker) {
+	unsigned int generation;
 
-	do {
-		int processed = 0;
-		struct kafka_service *service;
+	ao2_lock(tracker);
+	generation = tracker->generation;
+	ao2_unlock(tracker);
 
-		active = 0;
-
-		/* Process producer services*/
-		AST_RWDLLIST_RDLOCK(&producers);
-		AST_DLLIST_TRAVERSE(&producers, service, link) {
-			active++;
+	return generation;
+}
 
-			/* Process producer events */
-			processed += rd_kafka_poll(service->rd_kafka, 0);
-		}
-		AST_RWDLLIST_UNLOCK(&producers);
+/*! Synchronously commit processed offsets and forget revoked partitions */
+static void kafka_commit_revoke(struct kafka_commit_tracker *tracker, const rd_kafka_topic_partition_list_t *partitions) {
+	int i;
 
-		AST_RWDLLIST_RDLOCK(&consumers);
-		AST_DLLIST_TRAVERSE(&consumers, service, link) {
-			rd_kafka_message_t *rkm;
-			
-			active++;
-			
-			if(NULL != (rkm = rd_kafka_consumer_poll(service->rd_kafka, 0))) {
-				processed++;
-				
-				if(RD_KAFKA_RESP_ERR_NO_ERROR == rkm->err) {
-					const char *topic_name = rd_kafka_topic_name(rkm->rkt);
-					RAII_VAR(struct kafka_topic *, topic, ao2_find(service->topics, topic_name, OBJ_SEARCH_KEY), ao2_cleanup);
-
-					ast_debug(3, "Got consumer MESSAGE from topic '%s' at offset %lu, topic pvt=%p\n", topic_name, rkm->offset, topic);	
-				} else {
-					ast_debug(3, "Got consumer error %d: %s\n", rkm->err, rd_kafka_err2str(rkm->err));
-				}
-				
-				rd_kafka_message_destroy(rkm);
-			}
-#if 0			
-#if 0
-			rd_kafka_message_t* msg = rd_kafka_consumer_poll(service->rd_kafka, 0);
+	ao2_lock(tracker);
 
-			ast_debug(3, "Got consumer msg=%p\n", msg);
+	/* Last chance to commit, the partition may be consumed by other group member then */
+	kafka_commit_offsets(tracker, 0);
 
-			if(RD_KAFKA_RESP_ERR_NO_ERROR == msg->err) {
-				/* We got a message */
-				ast_debug(3, "Got message!!!\n");
+	for(i = 0;partitions && (i < partitions->cnt);i++) {
+		struct kafka_commit_partition *partition = kafka_commit_partition_find(tracker, partitions->elems[i].topic, partitions->elems[i].partition);
 
-				rd_kafka_message_destroy(msg);
-			} else {
-				/* We got a status */
-				ast_debug(3, "Got consumer status %d: %s\n", msg->err, rd_kafka_err2str(msg->err));
+		if(partition) {
+			AST_LIST_REMOVE(&tracker->partitions, partition, link);
+			ast_free(partition->offsets);
+			ast_free(partition);
+		}
+	}
 
-				rd_kafka_message_destroy(msg);
-			}
+	/* In-flight messages of revoked partitions must not commit stale offsets */
+	tracker->generation++;
 
-			active++;
-#else
-#if 1
-			rd_kafka_message_t *msg = rd_kafka_consume_queue(service->specific.consumer.queue, 0);
+	ao2_unlock(tracker);
+}
 
-			if(NULL != msg) {
-				if(RD_KAFKA_RESP_ERR_NO_ERROR == msg->err) {
-					rd_kafka_resp_err_t response;
+/*! Synchronously commit processed offsets and stop commits, consumer is going to be closed */
+static void kafka_commit_detach(struct kafka_commit_tracker *tracker) {
+	kafka_commit_flush(tracker, 1);
 
-					ast_debug(3, "Got consumer message %d: %s\n", msg->err, rd_kafka_err2str(msg->err));
+	ao2_lock(tracker);
+	tracker->rd_kafka = NULL;
+	ao2_unlock(tracker);
+}
 
-//					if(RD_KAFKA_RESP_ERR_NO_ERROR == (response = rd_kafka_commit_message(service->rd_kafka, msg, 0))) {
-//					} else {
-//						ast_debug(3, "Consumer message commit failed %d: %s\n", response, rd_kafka_err2str(response));
-//					}
-				} else {
-					ast_debug(3, "Got consumer status %d: %s\n", msg->err, rd_kafka_err2str(msg->err));
-				}
+/*! Commit low-watermarks of partitions changed since last commit. Tracker must be locked */
+static int kafka_commit_offsets(struct kafka_commit_tracker *tracker, int async) {
+	rd_kafka_topic_partition_list_t *offsets;
+	struct kafka_commit_partition *partition;
+	rd_kafka_resp_err_t response;
 
-				processed++;
-				rd_kafka_message_destroy(msg);
-			}
-#endif
+	tracker->pending = 0;
+	tracker->committed = ast_tvnow();
 
-			active++;
+	if(NULL == tracker->rd_kafka) {
+		return 0;
+	}
 
-			/* Process consumer events */
-			processed += rd_kafka_poll(service->rd_kafka, 0);
-#endif
-#endif
-		}
-		AST_RWDLLIST_UNLOCK(&consumers);
+	if(NULL == (offsets = rd_kafka_topic_partition_list_new(1))) {
+		return -1;
+	}
 
-		if(active && !processed) {
-			/* Some services exist, but no pending events yet */
-			usleep(KAFKA_MONITOR_NO_EVENTS_SLEEP_US);
+	AST_LIST_TRAVERSE(&tracker->partitions, partition, link) {
+		if(partition->watermark != partition->committed) {
+			rd_kafka_topic_partition_list_add(offsets, partition->topic, partition->partition)->offset = partition->watermark;
+			partition->committed = partition->watermark;
 		}
-	} while(active);
+	}
 
-	ast_mutex_lock(&monitor_lock);
+	if(0 == offsets->cnt) {
+		rd_kafka_topic_partition_list_destroy(offsets);
+		return 0;
+	}
 
-	if((AST_PTHREADT_NULL != monitor) && (AST_PTHREADT_STOP != monitor)) {
-		/* Normal thread shudtown */
-		monitor = AST_PTHREADT_NULL;
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != (response = rd_kafka_commit(tracker->rd_kafka, offsets, async))) {
+		ast_log(LOG_WARNING, "Consumer '%s': unable to commit %d partition(s) offsets: %s\n", rd_kafka_name(tracker->rd_kafka), offsets->cnt, rd_kafka_err2str(response));
 	}
 
-	ast_mutex_unlock(&monitor_lock);
+	rd_kafka_topic_partition_list_destroy(offsets);
 
-	ast_debug(3, "Monitor thread finished.\n");
+	return (RD_KAFKA_RESP_ERR_NO_ERROR == response) ? 0 : -1;
+}
 
-	return NULL;
+/*! Release consumed librdkafka message, tracked message is processed */
+static void kafka_consumer_message_release(struct kafka_commit_tracker *tracker, rd_kafka_message_t *rkm, unsigned int generation) {
+	if(tracker) {
+		kafka_commit_done(tracker, rkm, generation);
+	}
+
+	rd_kafka_message_destroy(rkm);
 }
 
 /*! Called by librdkafka when producer message processing complete */
 static void on_producer_message_processed(rd_kafka_t *rd_kafka, const rd_kafka_message_t *message, void *opaque) {
-	const struct kafka_service *producer = opaque;
-	
+	struct kafka_shared_payload *shared = message->_private;
+	/* Handle may be shared, topic is unique on the handle and referenced by the message */
+	RAII_VAR(struct kafka_topic *, topic, rd_kafka_topic_opaque(message->rkt), ao2_cleanup);
+	const struct kafka_service *producer = topic ? topic->service : NULL;
+	int64_t stage = kafka_stage_start(AST_KAFKA_STAGE_DELIVERY);
+
+	if(bench_running) {
+		kafka_bench_delivered(message);
+	}
+
+	kafka_stats_delivered(topic, message);
+
 	if(RD_KAFKA_RESP_ERR_NO_ERROR == message->err) {
 		/* Message successfully sent to the broker */
 		const char *topic_name = rd_kafka_topic_name(message->rkt);
 		
 		ast_debug(3, "Message sent to the topic '%s'\n", topic_name);
+	} else if(producer && producer->specific.producer.spool && kafka_spool_retriable(message->err)) {
+		/* Broker unavailable, keep message for replay */
+		struct kafka_spool *spool = producer->specific.producer.spool;
+		rd_kafka_headers_t *headers = NULL;
+
+		rd_kafka_message_headers(message, &headers);
+
+		if(kafka_spool_append(spool, rd_kafka_topic_name(message->rkt), message->key, message->key_len, headers, message->payload, message->len)) {
+			ast_log(LOG_ERROR, "Unable to sent message to the topic '%s' by '%s'. Reason: %s\n",
+				rd_kafka_topic_name(message->rkt), rd_kafka_name(rd_kafka),
+				rd_kafka_err2str(message->err));
+		}
+
+		/* Delay replay, messages enqueued before will failed too */
+		ast_mutex_lock(&spool->lock);
+		spool->hold = ast_tvadd(ast_tvnow(), ast_samp2tv(KAFKA_SPOOL_RETRY_MS, 1000));
+		ast_mutex_unlock(&spool->lock);
 	} else {
 		/* Producer's message sending fatal error occured*/
 		ast_log(LOG_ERROR, "Unable to sent message to the topic '%s' by '%s'. Reason: %s\n", 
 			rd_kafka_topic_name(message->rkt), rd_kafka_name(rd_kafka), 
 			rd_kafka_err2str(message->err));
 	}
+
+	if(shared) {
+		/* Message referenced shared payload, released after spooled */
+		ao2_ref(shared, -1);
+	}
+
+	kafka_stage_stop(AST_KAFKA_STAGE_DELIVERY, stage);
+}
+
+/*! Called by librdkafka when consumer message processing complete */
+static void on_consumer_message_processed(rd_kafka_t *rd_kafka, const rd_kafka_message_t *message, void *opaque) {
+	const struct kafka_topic *topic = opaque;
+
+//	ast_debug(3,"on_consumer_message_processed(%p, %p, %p)\n", rd_kafka, message, opaque);
+	if(RD_KAFKA_RESP_ERR_NO_ERROR == message->err) {
+		/* Message successfully received from the broker */
+		const char *topic_name = rd_kafka_topic_name(message->rkt);
+
+		ast_debug(3, "Message received from the topic '%s'\n", topic_name);
+	} else {
+		/* Producer's message sending fatal error occured*/
+		ast_log(LOG_ERROR, "Unable to receive message from the topic '%s' by '%s'. Reason: %s\n", 
+			rd_kafka_topic_name(message->rkt), rd_kafka_name(rd_kafka), 
+			rd_kafka_err2str(message->err));
+	}
+}
+
+/*! Asynchronous offsets commit result, served by consumer poll */
+static void on_consumer_offsets_committed(rd_kafka_t *rd_kafka, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *offsets, void *opaque) {
+	if((RD_KAFKA_RESP_ERR_NO_ERROR == err) || (RD_KAFKA_RESP_ERR__NO_OFFSET == err)) {
+		ast_debug(3, "Consumer '%s' committed %d partition(s) offsets\n", rd_kafka_name(rd_kafka), offsets ? offsets->cnt : 0);
+	} else {
+		/* Offsets committed again by next processed messages, otherwise messages redelivered */
+		ast_log(LOG_WARNING, "Consumer '%s' offsets commit failed: %s\n", rd_kafka_name(rd_kafka), rd_kafka_err2str(err));
+	}
 }
 
-/*! Called by librdkafka when consumer message processing complete */
-static void on_consumer_message_processed(rd_kafka_t *rd_kafka, const rd_kafka_message_t *message, void *opaque) {
-	const struct kafka_topic *topic = opaque;
+/*! Called by librdkafka on group rebalance of the consumer with processed offsets commit */
+static void on_consumer_rebalance(rd_kafka_t *rd_kafka, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque) {
+	struct kafka_service *consumer = opaque;
+	int cooperative = (0 == strcmp(rd_kafka_rebalance_protocol(rd_kafka), "COOPERATIVE"));
+	rd_kafka_error_t *error = NULL;
+	rd_kafka_resp_err_t response = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+	switch(err) {
+	case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
+		ast_debug(3, "Consumer '%s': %d partition(s) assigned\n", rd_kafka_name(rd_kafka), partitions->cnt);
+
+		if(cooperative) {
+			error = rd_kafka_incremental_assign(rd_kafka, partitions);
+		} else {
+			response = rd_kafka_assign(rd_kafka, partitions);
+		}
+		break;
+	case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
+		ast_debug(3, "Consumer '%s': %d partition(s) revoked\n", rd_kafka_name(rd_kafka), partitions->cnt);
+
+		if(consumer->specific.consumer.tracker) {
+			kafka_commit_revoke(consumer->specific.consumer.tracker, partitions);
+		}
+
+		if(cooperative) {
+			error = rd_kafka_incremental_unassign(rd_kafka, partitions);
+		} else {
+			response = rd_kafka_assign(rd_kafka, NULL);
+		}
+		break;
+	default:
+		ast_log(LOG_WARNING, "Consumer '%s' rebalance failed: %s\n", rd_kafka_name(rd_kafka), rd_kafka_err2str(err));
 
-//	ast_debug(3,"on_consumer_message_processed(%p, %p, %p)\n", rd_kafka, message, opaque);
-	if(RD_KAFKA_RESP_ERR_NO_ERROR == message->err) {
-		/* Message successfully received from the broker */
-		const char *topic_name = rd_kafka_topic_name(message->rkt);
+		if(consumer->specific.consumer.tracker) {
+			/* Assignment lost, nothing owned anymore */
+			kafka_commit_revoke(consumer->specific.consumer.tracker, partitions);
+		}
 
-		ast_debug(3, "Message received from the topic '%s'\n", topic_name);
-	} else {
-		/* Producer's message sending fatal error occured*/
-		ast_log(LOG_ERROR, "Unable to receive message from the topic '%s' by '%s'. Reason: %s\n", 
-			rd_kafka_topic_name(message->rkt), rd_kafka_name(rd_kafka), 
-			rd_kafka_err2str(message->err));
+		response = rd_kafka_assign(rd_kafka, NULL);
+		break;
+	}
+
+	if(error) {
+		ast_log(LOG_WARNING, "Consumer '%s': unable to apply rebalance: %s\n", rd_kafka_name(rd_kafka), rd_kafka_error_string(error));
+		rd_kafka_error_destroy(error);
+	} else if(RD_KAFKA_RESP_ERR_NO_ERROR != response) {
+		ast_log(LOG_WARNING, "Consumer '%s': unable to apply rebalance: %s\n", rd_kafka_name(rd_kafka), rd_kafka_err2str(response));
 	}
 }
 
@@ -2275,29 +10153,6 @@ static int on_all_consumer_topics(struct ast_kafka_pipe *pipe, int (*callback)(s
 	return status;
 }
 
-/*! Fetch kafka_service object by rdkafka topic's handle */
-static struct kafka_service *rdkafka_topic_to_service(const rd_kafka_topic_t *rd_kafka_topic) {
-	RAII_VAR(struct kafka_topic *, topic, rdkafka_topic_to_topic(rd_kafka_topic), ao2_cleanup);
-	struct kafka_service *service = topic->service;
-
-	ast_assert(service != topic);
-
-	ao2_ref(service, +1);
-
-	return service;
-}
-
-/*! Fetch kafka_topic object by rdkafka topic's handle */
-static struct kafka_topic *rdkafka_topic_to_topic(const rd_kafka_topic_t *rd_kafka_topic) {
-	struct kafka_topic *topic = rd_kafka_topic_opaque(rd_kafka_topic);
-
-	ast_assert(NULL != topic);
-
-	ao2_ref(topic, +1);
-
-	return topic;
-}
-
 
 /*! Common register sorcery object actions */
 static int sorcery_object_register(const char *type, void *(*alloc)(const char *name),int (*apply)(const struct ast_sorcery *sorcery, void *obj)) {
@@ -2350,6 +10205,8 @@ static void sorcery_kafka_topic_destructor(void *obj) {
 
 	ast_debug(3, "Destroyed Kafka topic %s (%p)\n", ast_sorcery_object_get_id(topic), topic);
 
+	ast_variables_destroy(topic->rdkafka_properties);
+
 	ast_string_field_free_memory(topic);
 }
 
@@ -2383,6 +10240,8 @@ static void sorcery_kafka_producer_destructor(void *obj) {
 
 //	ast_debug(3, "Destroyed Kafka producer %s (%p)\n", ast_sorcery_object_get_id(producer), producer);
 
+	ast_variables_destroy(producer->rdkafka_properties);
+
 	ast_string_field_free_memory(producer);
 }
 
@@ -2416,9 +10275,74 @@ static void sorcery_kafka_consumer_destructor(void *obj) {
 
 //	ast_debug(3, "Destroyed Kafka consumer %s (%p)\n", ast_sorcery_object_get_id(consumer), consumer);
 
+	ast_variables_destroy(consumer->rdkafka_properties);
+
 	ast_string_field_free_memory(consumer);
 }
 
+/*! Get module-wide parameters, NULL if general section not defined */
+static struct sorcery_kafka_general *sorcery_kafka_general_get(void) {
+	RAII_VAR(struct ao2_container *, found, ast_sorcery_retrieve_by_fields(kafka_sorcery, KAFKA_GENERAL, AST_RETRIEVE_FLAG_MULTIPLE | AST_RETRIEVE_FLAG_ALL, NULL), ao2_cleanup);
+
+	if((NULL == found) || (0 == ao2_container_count(found))) {
+		return NULL;
+	}
+
+	if(ao2_container_count(found) > 1) {
+		ast_log(LOG_WARNING, "Multiple Kafka '%s' sections defined, only one will be used\n", KAFKA_GENERAL);
+	}
+
+	return ao2_callback(found, 0, NULL, NULL);
+}
+
+static int sorcery_kafka_general_apply_handler(const struct ast_sorcery *sorcery, void *obj) {
+	struct sorcery_kafka_general *general = obj;
+
+	if(general->poller_threads > KAFKA_MONITOR_MAX_THREADS) {
+		ast_log(LOG_ERROR, "Kafka %s: poller_threads %u exceed limit %d\n", ast_sorcery_object_get_id(general), general->poller_threads, KAFKA_MONITOR_MAX_THREADS);
+		return -1;
+	}
+
+	if(monitor_count && general->poller_threads && (general->poller_threads != monitor_count)) {
+		ast_log(LOG_NOTICE, "Kafka %s: poller_threads change take effect on module load\n", ast_sorcery_object_get_id(general));
+	}
+
+	if(monitor_count && (general->publish_threads != publish_lane_count)) {
+		ast_log(LOG_NOTICE, "Kafka %s: publish_threads change take effect on module load\n", ast_sorcery_object_get_id(general));
+	}
+
+	if(monitor_count && (general->dispatch_lanes != dispatch_lane_count)) {
+		ast_log(LOG_NOTICE, "Kafka %s: dispatch_lanes change take effect on module load\n", ast_sorcery_object_get_id(general));
+	}
+
+	/* Used by the next topic removal or unload */
+	flush_timeout_ms = general->flush_timeout_ms;
+	flush_spool = general->flush_spool;
+
+	return 0;
+}
+
+static void *sorcery_kafka_general_alloc(const char *name) {
+	struct sorcery_kafka_general *general = ast_sorcery_generic_alloc(sizeof(*general), sorcery_kafka_general_destructor);
+
+	if(NULL == general) {
+		return NULL;
+	}
+
+	if(ast_string_field_init(general, 64)) {
+		ao2_cleanup(general);
+		return NULL;
+	}
+
+	return general;
+}
+
+static void sorcery_kafka_general_destructor(void *obj) {
+	struct sorcery_kafka_general *general = obj;
+
+	ast_string_field_free_memory(general);
+}
+
 static int sorcery_kafka_cluster_apply_handler(const struct ast_sorcery *sorcery, void *obj) {
 	struct sorcery_kafka_cluster *cluster = obj;
 
@@ -2467,6 +10391,8 @@ static void sorcery_kafka_cluster_destructor(void *obj) {
 
 //	ast_debug(3, "Destroyed Kafka cluster %s (%p)\n", ast_sorcery_object_get_id(cluster), cluster);
 
+	ast_variables_destroy(cluster->rdkafka_properties);
+
 	ast_string_field_free_memory(cluster);
 }
 
@@ -2481,9 +10407,18 @@ static void *kafka_pipe_alloc(const char *pipe_id) {
 	}
 
 	pipe->stasis_topic = NULL;
+	pipe->lanes = NULL;
+
+	if(NULL == (pipe->stats = kafka_stats_alloc())) {
+		ao2_cleanup(pipe);
+		return NULL;
+	}
 	
 	AST_LIST_HEAD_INIT(&pipe->producer_topics);
 
+	ast_rwlock_init(&pipe->producer_snapshot.lock);
+	pipe->producer_snapshot.obj = NULL;
+
 	AST_LIST_HEAD_INIT(&pipe->consumer_topics);
 
 	if(ast_string_field_init(pipe, 64)) {
@@ -2502,10 +10437,67 @@ static void *kafka_pipe_alloc(const char *pipe_id) {
 		ao2_cleanup(pipe);
 		return NULL;		
 	}
+
+	if(dispatch_lane_count && (NULL == (pipe->lanes = new_kafka_dispatch_lanes(buf, pipe->stasis_topic, dispatch_lane_count)))) {
+		ast_log(LOG_WARNING, "Pipe '%s': unable to create dispatch lanes, messages forwarded to the pipe's topic only\n", pipe_id);
+	}
 	
 	return pipe;
 }
 
+/*! Create pipe's dispatch lanes, each lane forwarded to the pipe's stasis topic */
+static struct kafka_dispatch_lanes *new_kafka_dispatch_lanes(const char *name, struct stasis_topic *stasis_topic, unsigned int count) {
+	struct kafka_dispatch_lanes *lanes = ao2_alloc_options(sizeof(*lanes) + count * sizeof(lanes->topics[0]), kafka_dispatch_lanes_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	size_t bufsize = strlen(name) + sizeof("/4294967295");
+	char *buf = ast_alloca(bufsize);
+	unsigned int i;
+
+	if(NULL == lanes) {
+		return NULL;
+	}
+
+	lanes->count = 0;
+
+	if(NULL == (lanes->forwards = ast_calloc(count, sizeof(*lanes->forwards)))) {
+		ao2_ref(lanes, -1);
+		return NULL;
+	}
+
+	for(i = 0;i < count;i++) {
+		snprintf(buf, bufsize, "%s/%u", name, i);
+
+		if(NULL == (lanes->topics[i] = stasis_topic_create(buf))) {
+			ao2_ref(lanes, -1);
+			return NULL;
+		}
+
+		lanes->count++;
+
+		if(NULL == (lanes->forwards[i] = stasis_forward_all(lanes->topics[i], stasis_topic))) {
+			ao2_ref(lanes, -1);
+			return NULL;
+		}
+	}
+
+	return lanes;
+}
+
+/*! Dispatch lanes destructor */
+static void kafka_dispatch_lanes_destructor(void *obj) {
+	struct kafka_dispatch_lanes *lanes = obj;
+	unsigned int i;
+
+	for(i = 0;i < lanes->count;i++) {
+		if(lanes->forwards) {
+			stasis_forward_cancel(lanes->forwards[i]);
+		}
+
+		ao2_cleanup(lanes->topics[i]);
+	}
+
+	ast_free(lanes->forwards);
+}
+
 /*! Pipe object destructor */
 static void kafka_pipe_destructor(void *obj) {
 	struct ast_kafka_pipe *pipe = obj;
@@ -2522,6 +10514,9 @@ static void kafka_pipe_destructor(void *obj) {
 
 	AST_LIST_HEAD_DESTROY(&pipe->consumer_topics);
 
+	ao2_global_obj_release(pipe->producer_snapshot);
+	ast_rwlock_destroy(&pipe->producer_snapshot.lock);
+
 	AST_LIST_LOCK(&pipe->producer_topics);
 
 	while(NULL != (topic = AST_LIST_REMOVE_HEAD(&pipe->producer_topics, link))) {
@@ -2537,33 +10532,42 @@ static void kafka_pipe_destructor(void *obj) {
 
 	ast_string_field_free_memory(pipe);
 
+	ao2_cleanup(pipe->lanes);
 	ao2_cleanup(pipe->stasis_topic);
+
+	ao2_cleanup(pipe->stats);
 }
 
-/*! Publish ast_kafka_consumer_message stasis message */
-static int stasis_publish_kafka_consumer_message(struct stasis_topic *topic, rd_kafka_message_t *rkm) {
+/*! Publish ast_kafka_consumer_message stasis message, message ownership moved to this function */
+static int stasis_publish_kafka_consumer_message(struct stasis_topic *topic, struct kafka_commit_tracker *tracker, rd_kafka_message_t *rkm) {
 	RAII_VAR(struct ast_kafka_consumer_message *, payload, NULL, ao2_cleanup);
 	RAII_VAR(struct stasis_message *, message, NULL, ao2_cleanup);
-	
-	if(NULL == topic) {
-		return -1;
-	}
-	
-	if(NULL == ast_kafka_consumer_message_type()) {
+
+	unsigned int generation = tracker ? kafka_commit_generation(tracker) : 0;
+
+	if((NULL == topic) || (NULL == ast_kafka_consumer_message_type())) {
+		kafka_consumer_message_release(tracker, rkm, generation);
 		return -1;
 	}
-	
-	if(NULL == (payload = ao2_alloc(sizeof(*payload), kafka_consumer_message_destructor))) {
+
+	if(NULL == (payload = ao2_alloc_options(sizeof(*payload), kafka_consumer_message_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		kafka_consumer_message_release(tracker, rkm, generation);
 		return -1;
 	}
-	
+
+	/* Released with payload */
 	payload->rkm = rkm;
-	
+	payload->tracker = ao2_bump(tracker);
+	payload->generation = generation;
+	payload->json = NULL;
+
 	if(NULL == (message = stasis_message_create(ast_kafka_consumer_message_type(), payload))) {
 		return -1;
 	}
-	
+
 	stasis_publish(topic, message);
+
+	return 0;
 }
 
 /*! ast_kafka_consumer_message destructor */
@@ -2572,8 +10576,150 @@ static void kafka_consumer_message_destructor(void *obj) {
 	
 	if(message->rkm) {
 		/* Need to release librdkafka object */
-		rd_kafka_message_destroy(message->rkm);
+		kafka_consumer_message_release(message->tracker, message->rkm, message->generation);
+	}
+
+	ao2_cleanup(message->tracker);
+	ast_json_unref(message->json);
+}
+
+/*! Publish ast_kafka_consumer_batch stasis message, messages ownership moved to this function */
+static int stasis_publish_kafka_consumer_batch(struct stasis_topic *topic, struct kafka_commit_tracker *tracker, struct kafka_batch_pool *pool, rd_kafka_message_t **rkms, size_t count) {
+	RAII_VAR(struct ast_kafka_consumer_batch *, payload, NULL, ao2_cleanup);
+	RAII_VAR(struct stasis_message *, message, NULL, ao2_cleanup);
+	unsigned int generation = tracker ? kafka_commit_generation(tracker) : 0;
+	struct kafka_batch_buffer *buffer = NULL;
+	size_t i;
+
+	if((NULL == topic) || (NULL == ast_kafka_consumer_batch_type()) ||
+		(NULL == (buffer = kafka_batch_buffer_get(pool, count))) ||
+		(NULL == (payload = ao2_alloc_options(sizeof(*payload), kafka_consumer_batch_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK)))) {
+		for(i = 0;i < count;i++) {
+			kafka_consumer_message_release(tracker, rkms[i], generation);
+		}
+
+		if(buffer) {
+			kafka_batch_buffer_put(pool, buffer);
+		}
+
+		return -1;
+	}
+
+	/* Released with payload */
+	for(i = 0;i < count;i++) {
+		buffer->messages[i].rkm = rkms[i];
+		buffer->messages[i].tracker = NULL;
+		buffer->messages[i].generation = generation;
+		buffer->messages[i].json = NULL;
+	}
+
+	payload->buffer = buffer;
+	payload->pool = ao2_bump(pool);
+
+	payload->tracker = ao2_bump(tracker);
+	payload->generation = generation;
+	payload->count = count;
+
+	if(NULL == (message = stasis_message_create(ast_kafka_consumer_batch_type(), payload))) {
+		return -1;
+	}
+
+	stasis_publish(topic, message);
+
+	return 0;
+}
+
+/*! ast_kafka_consumer_batch destructor */
+static void kafka_consumer_batch_destructor(void *obj) {
+	struct ast_kafka_consumer_batch *batch = obj;
+	size_t i;
+
+	for(i = 0;i < batch->count;i++) {
+		kafka_consumer_message_release(batch->tracker, batch->buffer->messages[i].rkm, batch->generation);
+		ast_json_unref(batch->buffer->messages[i].json);
+	}
+
+	kafka_batch_buffer_put(batch->pool, batch->buffer);
+
+	ao2_cleanup(batch->pool);
+	ao2_cleanup(batch->tracker);
+}
+
+/*! Create consumer's batch buffers pool */
+static struct kafka_batch_pool *new_kafka_batch_pool(void) {
+	struct kafka_batch_pool *pool = ao2_alloc(sizeof(*pool), kafka_batch_pool_destructor);
+
+	if(pool) {
+		AST_LIST_HEAD_INIT_NOLOCK(&pool->buffers);
+		pool->count = 0;
+	}
+
+	return pool;
+}
+
+/*! Batch buffers pool destructor, called when the consumer and all its batches released */
+static void kafka_batch_pool_destructor(void *obj) {
+	struct kafka_batch_pool *pool = obj;
+	struct kafka_batch_buffer *buffer;
+
+	while(NULL != (buffer = AST_LIST_REMOVE_HEAD(&pool->buffers, link))) {
+		ast_free(buffer);
+	}
+}
+
+/*! Get messages buffer for the batch of count messages, recycled one from the pool if available */
+static struct kafka_batch_buffer *kafka_batch_buffer_get(struct kafka_batch_pool *pool, size_t count) {
+	struct kafka_batch_buffer *buffer = NULL;
+	size_t capacity = KAFKA_BATCH_BUFFER_MIN;
+
+	if(pool) {
+		ao2_lock(pool);
+
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&pool->buffers, buffer, link) {
+			if(buffer->capacity >= count) {
+				AST_LIST_REMOVE_CURRENT(link);
+				pool->count--;
+				break;
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+
+		ao2_unlock(pool);
+	}
+
+	if(buffer) {
+		return buffer;
+	}
+
+	/* Power of two capacity, so buffers of the lanes batches fit each other */
+	while(capacity < count) {
+		capacity <<= 1;
+	}
+
+	if(NULL == (buffer = ast_malloc(sizeof(*buffer) + capacity * sizeof(buffer->messages[0])))) {
+		return NULL;
 	}
+
+	buffer->capacity = capacity;
+
+	return buffer;
+}
+
+/*! Return batch messages buffer to the pool, released if the pool is full or not exist */
+static void kafka_batch_buffer_put(struct kafka_batch_pool *pool, struct kafka_batch_buffer *buffer) {
+	if(pool) {
+		ao2_lock(pool);
+
+		if(pool->count < KAFKA_BATCH_BUFFERS_MAX) {
+			AST_LIST_INSERT_HEAD(&pool->buffers, buffer, link);
+			pool->count++;
+			buffer = NULL;
+		}
+
+		ao2_unlock(pool);
+	}
+
+	ast_free(buffer);
 }
 
 /*! librdkafka logger callback */
@@ -2594,6 +10740,9 @@ static void update_global_producer_eid(void) {
         ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
 	
 	global_producer_eid = ast_strdup(eid_str);
+
+	/* Prebuilt headers contain previous EID */
+	flush_message_headers();
 }
 
 /*! Clear global producer's EID */
@@ -2602,29 +10751,85 @@ static void clear_global_producer_eid(void) {
 	global_producer_eid = NULL;
 }
 
+/*! Calculate loopback probe hash */
+AO2_STRING_FIELD_HASH_FN(kafka_probe, pipe_id)
+/*! Compare loopback probes */
+AO2_STRING_FIELD_CMP_FN(kafka_probe, pipe_id)
+
+/*! Calculate headers template hash */
+AO2_STRING_FIELD_HASH_FN(kafka_headers_template, reason)
+/*! Compare headers templates */
+AO2_STRING_FIELD_CMP_FN(kafka_headers_template, reason)
+
 /*! Calculate hash */
 AO2_STRING_FIELD_HASH_FN(ast_kafka_pipe, id)
 /*! Compare pipes */
 AO2_STRING_FIELD_CMP_FN(ast_kafka_pipe, id)
 
 static int load_module(void) {
-	/* Monitor thread not started yet */
-	monitor = AST_PTHREADT_NULL;
+	/* Monitor threads not allocated yet */
+	monitors = NULL;
+	monitor_count = 0;
+
+	/* Not unloading */
+	flush_deadline = ast_tv(0, 0);
 
 	AST_RWDLLIST_HEAD_INIT(&producers);
 	AST_RWDLLIST_HEAD_INIT(&consumers);
 
 	update_global_producer_eid();
 	
-	if(STASIS_MESSAGE_TYPE_INIT(ast_kafka_consumer_message_type)) {
+	if(STASIS_MESSAGE_TYPE_INIT(ast_kafka_consumer_message_type) || STASIS_MESSAGE_TYPE_INIT(ast_kafka_consumer_batch_type)) {
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
 		return AST_MODULE_LOAD_DECLINE;
 	}
 	
-	if(NULL == (pipes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, KAFKA_PIPE_BUCKETS, ast_kafka_pipe_hash_fn, NULL, ast_kafka_pipe_cmp_fn))) {
+	if(NULL == (pipes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, KAFKA_PIPE_BUCKETS, ast_kafka_pipe_hash_fn, NULL, ast_kafka_pipe_cmp_fn))) {
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
+		clear_global_producer_eid();
+		AST_RWDLLIST_HEAD_DESTROY(&producers);
+		AST_RWDLLIST_HEAD_DESTROY(&consumers);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (headers_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, KAFKA_HEADERS_BUCKETS, kafka_headers_template_hash_fn, NULL, kafka_headers_template_cmp_fn))) {
+		ao2_cleanup(pipes);
+		pipes = NULL;
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
+		clear_global_producer_eid();
+		AST_RWDLLIST_HEAD_DESTROY(&producers);
+		AST_RWDLLIST_HEAD_DESTROY(&consumers);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (connections = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, KAFKA_CONNECTION_BUCKETS, kafka_connection_hash_fn, NULL, kafka_connection_cmp_fn))) {
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(pipes);
+		pipes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
+		clear_global_producer_eid();
+		AST_RWDLLIST_HEAD_DESTROY(&producers);
+		AST_RWDLLIST_HEAD_DESTROY(&consumers);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (probes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, KAFKA_PROBE_BUCKETS, kafka_probe_hash_fn, NULL, kafka_probe_cmp_fn))) {
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(pipes);
+		pipes = NULL;
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2649,13 +10854,50 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
+		clear_global_producer_eid();
+		AST_RWDLLIST_HEAD_DESTROY(&producers);
+		AST_RWDLLIST_HEAD_DESTROY(&consumers);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(sorcery_object_register(KAFKA_GENERAL, sorcery_kafka_general_alloc, sorcery_kafka_general_apply_handler)) {
+		ast_sorcery_unref(kafka_sorcery);
+		kafka_sorcery = NULL;
+//		ast_taskprocessor_unreference(kafka_tps);
+//		kafka_tps = NULL;
+		ao2_cleanup(pipes);
+		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "poller_threads", "1", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, poller_threads));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "poller_cpus", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_general, poller_cpus));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "publish_threads", "0", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, publish_threads));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "publish_queue_max", "10000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, publish_queue_max));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "publish_high_water", "500", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, publish_high_water));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "dispatch_lanes", "0", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, dispatch_lanes));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "flush_timeout", "10000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_general, flush_timeout_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_GENERAL, "flush_spool", "yes", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_general, flush_spool));
+
 	if(sorcery_object_register(KAFKA_CLUSTER, sorcery_kafka_cluster_alloc, sorcery_kafka_cluster_apply_handler)) {
 		ast_sorcery_unref(kafka_sorcery);
 		kafka_sorcery = NULL;
@@ -2663,7 +10905,14 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2675,6 +10924,7 @@ static int load_module(void) {
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CLUSTER, "sasl_mechanism", "PLAIN", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_cluster, sasl_mechanism));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CLUSTER, "sasl_username", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_cluster, sasl_username));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CLUSTER, "sasl_password", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_cluster, sasl_password));
+	ast_sorcery_object_fields_register(kafka_sorcery, KAFKA_CLUSTER, "^rdkafka\\..+$", sorcery_kafka_cluster_rdkafka_handler, sorcery_kafka_cluster_rdkafka_to_fields);
 
 	if(sorcery_object_register(KAFKA_TOPIC, sorcery_kafka_topic_alloc, sorcery_kafka_topic_apply_handler)) {
 		ast_sorcery_unref(kafka_sorcery);
@@ -2683,7 +10933,14 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2695,6 +10952,12 @@ static int load_module(void) {
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "producer", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_topic, producer_id));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "consumer", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_topic, consumer_id));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "message_timeout_ms", "300000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_topic, message_timeout_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "headers", "yes", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_topic, headers));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "format", "json", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_topic, format));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "drop_own_eid", "no", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_topic, drop_own_eid));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "reason_in", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_topic, reason_in));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_TOPIC, "key_prefix", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_topic, key_prefix));
+	ast_sorcery_object_fields_register(kafka_sorcery, KAFKA_TOPIC, "^rdkafka\\..+$", sorcery_kafka_topic_rdkafka_handler, sorcery_kafka_topic_rdkafka_to_fields);
 
 	if(sorcery_object_register(KAFKA_PRODUCER, sorcery_kafka_producer_alloc, sorcery_kafka_producer_apply_handler)) {
 		ast_sorcery_unref(kafka_sorcery);
@@ -2703,7 +10966,14 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2713,6 +10983,7 @@ static int load_module(void) {
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "cluster", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, cluster_id));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "timeout", "10000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_producer, timeout_ms));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "partition", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, partition));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "poller", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, poller));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "key_overwrite", "no", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, key_overwrite));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "key_value", "no", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, key_value));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "request_required_acks", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, request_required_acks));
@@ -2722,6 +10993,22 @@ static int load_module(void) {
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "enable_idempotence", "no", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_producer, enable_idempotence));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "transactional_id", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, transactional_id));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "debug", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, debug));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "on_queue_full", "drop", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, on_queue_full));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "queue_full_timeout", "100", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_producer, queue_full_timeout_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "spool", "no", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_producer, spool));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "spool_file", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, spool_file));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "spool_size", "64", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_producer, spool_size));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "spool_sync", "periodic", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, spool_sync));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "statistics_interval", "0", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_producer, statistics_interval_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "compression_type", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, compression_type));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "linger_ms", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, linger_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "batch_num_messages", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, batch_num_messages));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "batch_size", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, batch_size));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "queue_buffering_max_messages", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, queue_buffering_max_messages));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "queue_buffering_max_kbytes", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_producer, queue_buffering_max_kbytes));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "partitioner", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_producer, partitioner));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_PRODUCER, "sticky_linger_ms", "10", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_producer, sticky_linger_ms));
+	ast_sorcery_object_fields_register(kafka_sorcery, KAFKA_PRODUCER, "^rdkafka\\..+$", sorcery_kafka_producer_rdkafka_handler, sorcery_kafka_producer_rdkafka_to_fields);
 
 
 
@@ -2733,7 +11020,14 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2749,7 +11043,14 @@ static int load_module(void) {
 //		kafka_tps = NULL;
 		ao2_cleanup(pipes);
 		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
 		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 		clear_global_producer_eid();
 		AST_RWDLLIST_HEAD_DESTROY(&producers);
 		AST_RWDLLIST_HEAD_DESTROY(&consumers);
@@ -2761,46 +11062,92 @@ static int load_module(void) {
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "isolation_level", "read_committed", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_consumer, isolation_level));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "timeout", "10000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, timeout_ms));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "partition", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_consumer, partition));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "partitions", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_consumer, partitions));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "start_offset", "beginning", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_consumer, start_offset));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "start_time", "0", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_consumer, start_time));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "poller", "-1", OPT_INT_T, 0, FLDSET(struct sorcery_kafka_consumer, poller));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "batch_size", "1", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, batch_size));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "batch_timeout", "0", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, batch_timeout_ms));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "enable_auto_commit", "yes", OPT_BOOL_T, 1, FLDSET(struct sorcery_kafka_consumer, enable_auto_commit));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "auto_commit_interval", "5000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, auto_commit_interval_ms));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "commit_mode", "auto", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_consumer, commit_mode));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "commit_batch", "1000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, commit_batch));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "commit_interval", "1000", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, commit_interval_ms));
 	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "debug", "", OPT_STRINGFIELD_T, 0, STRFLDSET(struct sorcery_kafka_consumer, debug));
+	ast_sorcery_object_field_register(kafka_sorcery, KAFKA_CONSUMER, "statistics_interval", "0", OPT_UINT_T, 0, FLDSET(struct sorcery_kafka_consumer, statistics_interval_ms));
+	ast_sorcery_object_fields_register(kafka_sorcery, KAFKA_CONSUMER, "^rdkafka\\..+$", sorcery_kafka_consumer_rdkafka_handler, sorcery_kafka_consumer_rdkafka_to_fields);
 
 
 	/* Load all registered objects */
 	ast_sorcery_load(kafka_sorcery);
 
+	/* Poller threads pool sized by the general section */
+	if(init_monitors()) {
+		ast_log(LOG_ERROR, "Failed to allocate Kafka poller threads.\n");
+		ast_sorcery_observer_remove(kafka_sorcery, KAFKA_PRODUCER, &producer_observers);
+		ast_sorcery_unref(kafka_sorcery);
+		kafka_sorcery = NULL;
+		ao2_cleanup(pipes);
+		pipes = NULL;
+		ao2_cleanup(headers_cache);
+		headers_cache = NULL;
+		ao2_cleanup(connections);
+		connections = NULL;
+		ao2_cleanup(probes);
+		probes = NULL;
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+		STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
+		clear_global_producer_eid();
+		AST_RWDLLIST_HEAD_DESTROY(&producers);
+		AST_RWDLLIST_HEAD_DESTROY(&consumers);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Pipes created with dispatch lanes, optional */
+	init_dispatch_lanes();
+
 	/* Process all defined clusters */
 	process_all_clusters();
 
+	/* Publish threads, optional */
+	if(init_publish_lanes()) {
+		ast_log(LOG_WARNING, "Failed to start Kafka publish threads, messages produced synchronously.\n");
+	}
+
 	ast_cli_register_multiple(kafka_cli, ARRAY_LEN(kafka_cli));
+	ast_manager_register_xml("KafkaStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_kafka_stats);
+	ast_http_uri_link(&kafka_metrics_uri);
 
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void) {
-	pthread_t active_monitor;
+	/* Statistics handlers walk the pipes */
+	ast_http_uri_unlink(&kafka_metrics_uri);
+	ast_manager_unregister("KafkaStats");
+
+	/* Flush queued messages while pipes are alive */
+	destroy_publish_lanes();
+
+	/* Probes send to the pipes */
+	ao2_callback(probes, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, kafka_probe_stop_cb, NULL);
+	ao2_cleanup(probes);
+	probes = NULL;
+
+	/* Deliver outstanding messages of all producers concurrently, up to one deadline */
+	kafka_flush_producers();
 
 	/* When we remove pipes, it destroy all linked services */
 	ao2_cleanup(pipes);
 	pipes = NULL;
 
-	ast_mutex_lock(&monitor_lock);
-
-	active_monitor = monitor;
+	destroy_monitors();
 
-	/* Prevent monitor activation */
-	monitor = AST_PTHREADT_STOP;
-
-	ast_mutex_unlock(&monitor_lock);
+	ao2_cleanup(headers_cache);
+	headers_cache = NULL;
 
-	if((AST_PTHREADT_NULL != active_monitor) && (AST_PTHREADT_STOP != active_monitor)) {
-		/* Need to stop monitor thread */
-#if 0
-		pthread_cancel(active_monitor);
-		pthread_kill(active_monitor, SIGURG);
-#endif
-		pthread_join(active_monitor, NULL);
-	}
+	ao2_cleanup(connections);
+	connections = NULL;
 
 	ast_sorcery_observer_remove(kafka_sorcery, KAFKA_PRODUCER, &producer_observers);
 
@@ -2816,6 +11163,7 @@ static int unload_module(void) {
 	AST_RWDLLIST_HEAD_DESTROY(&consumers);
 
 	STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_message_type);
+	STASIS_MESSAGE_TYPE_CLEANUP(ast_kafka_consumer_batch_type);
 	
 	clear_global_producer_eid();
 	
@@ -2827,6 +11175,9 @@ static int reload_module(void) {
 	
 	ast_sorcery_reload(kafka_sorcery);
 
+	/* Only changed services and topics are rebuilt */
+	reconcile_all_services();
+
 	return 0;
 }
 
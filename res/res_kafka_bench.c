@@ -0,0 +1,170 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2020, Vedga
+ *
+ * Igor Nikolaev <support@vedga.com>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \brief Kafka producer benchmark tests
+ *
+ * This module run the res_kafka producer benchmark against the
+ * librdkafka mock cluster, no Kafka brokers needed. Run it by
+ * "test execute category /res/kafka/".
+ *
+ * \author Igor Nikolaev <igorn@ozon.ru>
+ * \since 13.7.0
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<depend type="module">res_kafka</depend>
+	<defaultenabled>no</defaultenabled>
+	<support_level>extended</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/res_kafka.h"
+
+#include "asterisk/module.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/test.h"
+#include "asterisk/utils.h"
+
+/*! Tests category */
+#define KAFKA_BENCH_CATEGORY "/res/kafka/"
+
+/*! Mock cluster pipe, also the Kafka topic name */
+#define KAFKA_BENCH_PIPE "kafka_bench_mock"
+
+/*! Number of the mock cluster brokers */
+#define KAFKA_BENCH_MOCK_BROKERS 3
+
+/*! Messages sent by each test */
+#define KAFKA_BENCH_MESSAGES 10000
+
+/*! Payload size of each test message */
+#define KAFKA_BENCH_SIZE 256
+
+/*! Run benchmark on the mock pipe and report results */
+static enum ast_test_result_state kafka_bench_run(struct ast_test *test, const struct ast_kafka_bench_options *options) {
+	struct ast_kafka_pipe *pipe;
+	struct ast_kafka_bench_report report;
+	unsigned int i;
+	int res;
+
+	if(NULL == (pipe = ast_kafka_mock_pipe_create(KAFKA_BENCH_PIPE, KAFKA_BENCH_MOCK_BROKERS))) {
+		ast_test_status_update(test, "Unable to create mock pipe '%s'\n", KAFKA_BENCH_PIPE);
+		return AST_TEST_FAIL;
+	}
+
+	res = ast_kafka_bench(pipe, options, &report);
+
+	ast_kafka_mock_pipe_destroy(pipe);
+
+	if(res) {
+		ast_test_status_update(test, "Benchmark of mock pipe '%s' failed\n", KAFKA_BENCH_PIPE);
+		return AST_TEST_FAIL;
+	}
+
+	ast_test_status_update(test, "Sent %d messages (%d failed) in %.3f s, delivered %d of %d (%d errors) in %.3f s\n",
+		report.sent, report.failed, report.send_us / 1000000.0,
+		report.delivered, report.expected, report.delivery_errors, report.total_us / 1000000.0);
+	ast_test_status_update(test, "Latency enqueue to delivery report, us: p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+		(unsigned long)report.latency_p50_us, (unsigned long)report.latency_p99_us,
+		(unsigned long)report.latency_p999_us, (unsigned long)report.latency_max_us);
+
+	for(i = 0;i < AST_KAFKA_STAGE_COUNT;i++) {
+		if(report.stages[i].count) {
+			ast_test_status_update(test, "Stage %-17s %10lu calls, avg %lu ns\n", ast_kafka_stage_name(i),
+				(unsigned long)report.stages[i].count, (unsigned long)report.stages[i].avg_ns);
+		}
+	}
+
+	if(report.failed || report.delivery_errors || (report.delivered != report.expected)) {
+		ast_test_status_update(test, "Not all messages delivered\n");
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+AST_TEST_DEFINE(kafka_bench_raw) {
+	struct ast_kafka_bench_options options = {
+		.messages = KAFKA_BENCH_MESSAGES,
+		.size = KAFKA_BENCH_SIZE,
+		.rate = 0,
+		.threads = 1,
+		.json = 0,
+	};
+
+	switch(cmd) {
+	case TEST_INIT:
+		info->name = "bench_raw";
+		info->category = KAFKA_BENCH_CATEGORY;
+		info->summary = "Raw messages producer benchmark";
+		info->description = "Send raw messages by one thread to the mock cluster and wait all delivery reports.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	return kafka_bench_run(test, &options);
+}
+
+AST_TEST_DEFINE(kafka_bench_json) {
+	struct ast_kafka_bench_options options = {
+		.messages = KAFKA_BENCH_MESSAGES,
+		.size = KAFKA_BENCH_SIZE,
+		.rate = 0,
+		.threads = 4,
+		.json = 1,
+	};
+
+	switch(cmd) {
+	case TEST_INIT:
+		info->name = "bench_json";
+		info->category = KAFKA_BENCH_CATEGORY;
+		info->summary = "JSON events producer benchmark";
+		info->description = "Publish JSON events by four threads to the mock cluster and wait all delivery reports.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	return kafka_bench_run(test, &options);
+}
+
+static int load_module(void) {
+	AST_TEST_REGISTER(kafka_bench_raw);
+	AST_TEST_REGISTER(kafka_bench_json);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int unload_module(void) {
+	AST_TEST_UNREGISTER(kafka_bench_raw);
+	AST_TEST_UNREGISTER(kafka_bench_json);
+
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Kafka producer benchmark tests",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	);
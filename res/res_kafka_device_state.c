@@ -0,0 +1,936 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2020, Vedga
+ *
+ * Igor Nikolaev <support@vedga.com>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \brief Cluster-wide device states via Kafka
+ *
+ * This module consume the "device_state" pipe and keep
+ * the last state of each device published by any server.
+ *
+ * \author Igor Nikolaev <igorn@ozon.ru>
+ * \since 13.7.0
+ */
+
+/*** MODULEINFO
+	<depend type="module">res_kafka</depend>
+	<defaultenabled>no</defaultenabled>
+	<support_level>extended</support_level>
+ ***/
+
+/*** DOCUMENTATION
+	<configInfo name="res_kafka_device_state" language="en_US">
+		<synopsis>Kafka cluster-wide device states</synopsis>
+		<configFile name="kafka_device_state.conf">
+			<configObject name="general">
+				<synopsis>Device states table options</synopsis>
+				<configOption name="snapshot_interval" default="60">
+					<synopsis>Table snapshot interval, seconds, 0 to disable</synopsis>
+					<description><para>
+						The table is saved with the consumed partitions offsets. On load
+						the snapshot is restored and consumers seeked to the saved offsets,
+						so the topic is not replayed from the beginning.
+						</para>
+					</description>
+				</configOption>
+				<configOption name="snapshot_file">
+					<synopsis>Snapshot file, default astspooldir/kafka/device_state.snapshot</synopsis>
+				</configOption>
+			</configObject>
+		</configFile>
+	</configInfo>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/res_kafka.h"
+#include "asterisk/res_kafka_device_state.h"
+
+#include "asterisk/module.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/config.h"
+#include "asterisk/paths.h"
+#include "asterisk/sched.h"
+#include "asterisk/stasis.h"
+#include "asterisk/devicestate.h"
+#include "asterisk/utils.h"
+#include "asterisk/vector.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KAFKA_PIPE_DEVICE_STATE "device_state"
+
+/*! Buckets for device states hash. Keep it prime! */
+#define DEVICE_STATE_BUCKETS 1021
+
+/*! Maximum device key length */
+#define DEVICE_STATE_KEY_MAX 256
+
+/*! Maximum Kafka topic name length */
+#define DEVICE_STATE_TOPIC_MAX 256
+
+/*! Module configuration file */
+#define DEVICE_STATE_CONFIG "kafka_device_state.conf"
+
+/*! Default snapshot interval, s */
+#define DEVICE_STATE_SNAPSHOT_INTERVAL 60
+
+/*! Snapshot file signature 'KDSS' */
+#define DEVICE_STATE_SNAPSHOT_MAGIC 0x4b445353
+
+/*! Snapshot file format version */
+#define DEVICE_STATE_SNAPSHOT_VERSION 1
+
+/*! Snapshot records alignment */
+#define DEVICE_STATE_SNAPSHOT_ALIGN 8
+
+/*! Cluster-wide device state, never modified after link */
+struct kafka_device_state {
+	/*! EID of the server published the state */
+	struct ast_eid eid;
+	/*! Device state */
+	enum ast_device_state state;
+	/*! Device key (device name without technology) */
+	char key[0];
+};
+
+/*! Consumed partition position, offset of the next message to apply */
+struct device_state_position {
+	/*! Partition */
+	int32_t partition;
+	/*! Consumer seeked to the offset */
+	int seeked;
+	/*! Next offset */
+	int64_t offset;
+	/*! Kafka topic name */
+	char topic[DEVICE_STATE_TOPIC_MAX];
+};
+
+/*! Snapshot file header, followed by positions and device records */
+struct device_state_snapshot_header {
+	/*! DEVICE_STATE_SNAPSHOT_MAGIC */
+	uint32_t magic;
+	/*! DEVICE_STATE_SNAPSHOT_VERSION */
+	uint32_t version;
+	/*! Snapshot file size */
+	uint64_t size;
+	/*! Number of positions records */
+	uint32_t position_count;
+	/*! Number of device records */
+	uint32_t device_count;
+};
+
+/*! Snapshot position record */
+struct device_state_snapshot_position {
+	/*! Next offset */
+	int64_t offset;
+	/*! Partition */
+	int32_t partition;
+	/*! Topic name length */
+	uint32_t topic_size;
+	/*! Kafka topic name, not terminated */
+	char topic[DEVICE_STATE_TOPIC_MAX];
+};
+
+/*! Snapshot device record, followed by the key */
+struct device_state_snapshot_device {
+	/*! Whole record size, aligned to DEVICE_STATE_SNAPSHOT_ALIGN */
+	uint32_t size;
+	/*! Device state */
+	uint32_t state;
+	/*! EID of the server published the state */
+	unsigned char eid[sizeof(struct ast_eid)];
+	/*! Key length */
+	uint16_t key_size;
+	/*! Device key, not terminated */
+	char key[0];
+};
+
+/* Fowrdwd local functions declaration */
+static void device_state_cb(void *data, struct stasis_subscription *sub, struct stasis_message *message);
+static void device_state_received(const struct ast_kafka_consumer_message *message);
+static void device_state_update(const char *key, const struct ast_eid *eid, enum ast_device_state state);
+static int device_state_is_offline(enum ast_device_state state);
+static void device_state_announce(void);
+static const char *device_state_key(const char *device);
+static enum ast_device_state device_state_provider_cb(const char *data);
+static int device_state_position_applied(const struct ast_kafka_consumer_message *message);
+static void device_state_position_update(const struct ast_kafka_consumer_message *message);
+static int device_state_snapshot_save(const char *path);
+static int device_state_snapshot_load(const char *path);
+static int device_state_snapshot_cb(const void *data);
+static struct device_state_position *device_state_position_find(const char *topic, int32_t partition);
+static void device_state_schedule_snapshot(void);
+static int load_config(int reload);
+static int load_module(void);
+static int unload_module(void);
+static int reload_module(void);
+
+/* Local variables */
+static struct stasis_subscription *device_state_subscription;
+
+/*! Device state pipe, cached for module lifetime */
+static struct ast_kafka_pipe *device_state_pipe;
+
+/*! Device states by key */
+static struct ao2_container *device_states;
+
+/*! Consumed partitions positions (protected by device_states lock) */
+static AST_VECTOR(, struct device_state_position) device_state_positions;
+
+/*! Snapshot scheduler */
+static struct ast_sched_context *device_state_sched;
+
+/*! Scheduled snapshot id or -1 */
+static int device_state_snapshot_id = -1;
+
+/*! Snapshot file path */
+static char device_state_snapshot_path[PATH_MAX];
+
+/*! Snapshot interval, s, 0 if disabled */
+static unsigned int device_state_snapshot_interval;
+
+/*! Serialize snapshot save and snapshot options change */
+AST_MUTEX_DEFINE_STATIC(device_state_snapshot_lock);
+
+/*! Calculate device state hash */
+AO2_STRING_FIELD_HASH_FN(kafka_device_state, key)
+/*! Compare device states */
+AO2_STRING_FIELD_CMP_FN(kafka_device_state, key)
+
+/*! Module API: Get cluster-wide device state */
+int ast_kafka_device_state_get(const char *device, struct ast_eid *eid, enum ast_device_state *state) {
+	struct kafka_device_state *entry;
+
+	if((NULL == device_states) || ast_strlen_zero(device)) {
+		return -1;
+	}
+
+	if(NULL == (entry = ao2_find(device_states, device_state_key(device), OBJ_SEARCH_KEY))) {
+		return -1;
+	}
+
+	if(eid) {
+		*eid = entry->eid;
+	}
+
+	if(state) {
+		*state = entry->state;
+	}
+
+	ao2_ref(entry, -1);
+
+	return 0;
+}
+
+/*! Pipe's consumer messages */
+static void device_state_cb(void *data, struct stasis_subscription *sub, struct stasis_message *message) {
+	if(stasis_message_type(message) == ast_kafka_consumer_message_type()) {
+		device_state_received(stasis_message_data(message));
+	} else if(stasis_message_type(message) == ast_kafka_consumer_batch_type()) {
+		const struct ast_kafka_consumer_batch *batch = stasis_message_data(message);
+		size_t count = ast_kafka_consumer_batch_count(batch);
+		size_t i;
+
+		/* Batch messages are in the topic order */
+		for(i = 0;i < count;i++) {
+			device_state_received(ast_kafka_consumer_batch_message(batch, i));
+		}
+	}
+}
+
+/*! Process device state event {reason, eid, sysname, payload: {name, state}} */
+static void device_state_received(const struct ast_kafka_consumer_message *message) {
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	struct ast_json *payload;
+	const char *reason, *eid_str, *name, *state_str;
+	const char *raw_key;
+	size_t key_size = 0;
+	char key[DEVICE_STATE_KEY_MAX];
+	struct ast_eid eid;
+
+	if(device_state_position_applied(message)) {
+		/* Restored from snapshot */
+		return;
+	}
+
+	/* Reapply of the last message after snapshot is harmless, result is the same */
+	device_state_position_update(message);
+
+	if(NULL == (json = ast_kafka_consumer_message_json(message))) {
+		ast_debug(3, "Kafka device state: message at %s[%d]@%ld not decoded\n",
+				ast_kafka_consumer_message_topic(message),
+				(int)ast_kafka_consumer_message_partition(message),
+				(long)ast_kafka_consumer_message_offset(message));
+		return;
+	}
+
+	reason = ast_json_string_get(ast_json_object_get(json, "reason"));
+
+	if((NULL == reason) || strcmp(reason, KAFKA_PIPE_DEVICE_STATE)) {
+		/* Not a device state event */
+		return;
+	}
+
+	if((NULL == (payload = ast_json_object_get(json, "payload")))
+			|| (NULL == (state_str = ast_json_string_get(ast_json_object_get(payload, "state"))))) {
+		return;
+	}
+
+	name = ast_json_string_get(ast_json_object_get(payload, "name"));
+
+	if((NULL == (raw_key = ast_kafka_consumer_message_key(message, &key_size))) || (0 == key_size)) {
+		/* Old publisher without message key */
+		if(ast_strlen_zero(name)) {
+			return;
+		}
+
+		ast_copy_string(key, device_state_key(name), sizeof(key));
+	} else if(key_size < sizeof(key)) {
+		memcpy(key, raw_key, key_size);
+		key[key_size] = '\0';
+	} else {
+		ast_log(LOG_WARNING, "Kafka device state: device key too long, message skipped\n");
+		return;
+	}
+
+	eid_str = ast_json_string_get(ast_json_object_get(json, "eid"));
+
+	if(ast_strlen_zero(eid_str) || ast_str_to_eid(&eid, eid_str)) {
+		memset(&eid, 0, sizeof(eid));
+	}
+
+	device_state_update(key, &eid, ast_devstate_val(state_str));
+}
+
+/*! Apply device state received from the server eid */
+static void device_state_update(const char *key, const struct ast_eid *eid, enum ast_device_state state) {
+	size_t key_size = strlen(key) + 1;
+	struct kafka_device_state *current, *entry;
+
+	ao2_wrlock(device_states);
+
+	if(NULL != (current = ao2_find(device_states, key, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		if(device_state_is_offline(state) && ast_eid_cmp(&current->eid, eid)) {
+			/* Device went offline on other server, registered here */
+			ao2_unlock(device_states);
+			ao2_ref(current, -1);
+			return;
+		}
+
+		if((current->state == state) && !ast_eid_cmp(&current->eid, eid)) {
+			/* Nothing changed */
+			ao2_unlock(device_states);
+			ao2_ref(current, -1);
+			return;
+		}
+	}
+
+	if(NULL == (entry = ao2_alloc_options(sizeof(*entry) + key_size, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		ao2_unlock(device_states);
+		ao2_cleanup(current);
+		return;
+	}
+
+	entry->eid = *eid;
+	entry->state = state;
+	memcpy(entry->key, key, key_size);
+
+	/* Readers hold reference to the previous entry */
+	if(current) {
+		ao2_unlink_flags(device_states, current, OBJ_NOLOCK);
+		ao2_ref(current, -1);
+	}
+
+	ao2_link_flags(device_states, entry, OBJ_NOLOCK);
+	ao2_ref(entry, -1);
+
+	ao2_unlock(device_states);
+
+	ast_devstate_changed(state, AST_DEVSTATE_CACHABLE, AST_KAFKA_DEVICE_STATE_TECH "/%s", key);
+
+	ast_debug(3, "Kafka device '%s' change state to %u '%s'.\n", key, state, ast_devstate_str(state));
+}
+
+/*! Announce all table states, e.g. restored from snapshot */
+static void device_state_announce(void) {
+	struct ao2_iterator i = ao2_iterator_init(device_states, 0);
+	struct kafka_device_state *entry;
+
+	while((entry = ao2_iterator_next(&i))) {
+		ast_devstate_changed(entry->state, AST_DEVSTATE_CACHABLE, AST_KAFKA_DEVICE_STATE_TECH "/%s", entry->key);
+		ao2_ref(entry, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+}
+
+/*! Device is physically offline */
+static int device_state_is_offline(enum ast_device_state state) {
+	switch(state) {
+	case AST_DEVICE_UNKNOWN:
+	case AST_DEVICE_INVALID:
+	case AST_DEVICE_UNAVAILABLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*! Device key, device name without technology */
+static const char *device_state_key(const char *device) {
+	const char *skip_tech = strchr(device, '/');
+
+	/* skip_tech point to the '/' after channel tech */
+	return skip_tech ? skip_tech + sizeof(char) : device;
+}
+
+/*! Device state provider for "Kafka/<device key>" */
+static enum ast_device_state device_state_provider_cb(const char *data) {
+	enum ast_device_state state;
+
+	if(ast_kafka_device_state_get(data, NULL, &state)) {
+		return AST_DEVICE_UNKNOWN;
+	}
+
+	return state;
+}
+
+/*! Find partition position, only subscription thread modify positions */
+static struct device_state_position *device_state_position_find(const char *topic, int32_t partition) {
+	size_t i;
+
+	for(i = 0;i < AST_VECTOR_SIZE(&device_state_positions);i++) {
+		struct device_state_position *position = AST_VECTOR_GET_ADDR(&device_state_positions, i);
+
+		if((position->partition == partition) && !strcmp(position->topic, topic)) {
+			return position;
+		}
+	}
+
+	return NULL;
+}
+
+/*! Message already applied to the table restored from snapshot */
+static int device_state_position_applied(const struct ast_kafka_consumer_message *message) {
+	const char *topic = ast_kafka_consumer_message_topic(message);
+	int32_t partition = ast_kafka_consumer_message_partition(message);
+	struct device_state_position *position = device_state_position_find(topic, partition);
+	int64_t next;
+
+	if((NULL == position) || (ast_kafka_consumer_message_offset(message) >= position->offset)) {
+		return 0;
+	}
+
+	if(!position->seeked) {
+		/* Consumer started from the beginning, seek once */
+		ao2_wrlock(device_states);
+		position->seeked = 1;
+		next = position->offset;
+		ao2_unlock(device_states);
+
+		ast_kafka_pipe_seek(device_state_pipe, topic, partition, next);
+	}
+
+	return 1;
+}
+
+/*! Store position after the message */
+static void device_state_position_update(const struct ast_kafka_consumer_message *message) {
+	const char *topic = ast_kafka_consumer_message_topic(message);
+	int32_t partition = ast_kafka_consumer_message_partition(message);
+	int64_t next = ast_kafka_consumer_message_offset(message) + 1;
+	struct device_state_position *position = device_state_position_find(topic, partition);
+
+	if(position) {
+		ao2_wrlock(device_states);
+		position->offset = next;
+		ao2_unlock(device_states);
+	} else if(strlen(topic) < DEVICE_STATE_TOPIC_MAX) {
+		struct device_state_position new_position = {
+			.partition = partition,
+			.seeked = 1,
+			.offset = next,
+		};
+
+		strcpy(new_position.topic, topic);
+
+		ao2_wrlock(device_states);
+
+		if(AST_VECTOR_APPEND(&device_state_positions, new_position)) {
+			ast_log(LOG_WARNING, "Kafka device state: unable to track topic '%s' partition %d position\n", topic, (int)partition);
+		}
+
+		ao2_unlock(device_states);
+	}
+}
+
+/*! Record size of the device key */
+#define DEVICE_STATE_SNAPSHOT_DEVICE_SIZE(key_size) \
+	((sizeof(struct device_state_snapshot_device) + (key_size) + DEVICE_STATE_SNAPSHOT_ALIGN - 1) & ~(DEVICE_STATE_SNAPSHOT_ALIGN - 1))
+
+/*! Save table with positions to the file, return 0 on success */
+static int device_state_snapshot_save(const char *path) {
+	struct device_state_snapshot_header header = {
+		.magic = DEVICE_STATE_SNAPSHOT_MAGIC,
+		.version = DEVICE_STATE_SNAPSHOT_VERSION,
+		.size = sizeof(header),
+		.position_count = 0,
+		.device_count = 0,
+	};
+	struct device_state_position *positions = NULL;
+	struct ao2_iterator *i;
+	struct kafka_device_state *entry;
+	char *tmp_path, *dir, *slash;
+	size_t count, n;
+	FILE *file;
+	int fd, failed = 0;
+
+	/* Entries are immutable, only references are collected under lock */
+	ao2_rdlock(device_states);
+
+	if((count = AST_VECTOR_SIZE(&device_state_positions))) {
+		if(NULL == (positions = ast_malloc(count * sizeof(*positions)))) {
+			ao2_unlock(device_states);
+			return -1;
+		}
+
+		memcpy(positions, AST_VECTOR_GET_ADDR(&device_state_positions, 0), count * sizeof(*positions));
+	}
+
+	i = ao2_callback(device_states, OBJ_MULTIPLE | OBJ_NOLOCK, NULL, NULL);
+
+	ao2_unlock(device_states);
+
+	if(NULL == i) {
+		ast_free(positions);
+		return -1;
+	}
+
+	/* Create snapshot directory if not exist */
+	dir = ast_strdupa(path);
+
+	if(NULL != (slash = strrchr(dir, '/'))) {
+		*slash = '\0';
+
+		if(*dir && ast_mkdir(dir, 0755)) {
+			ast_log(LOG_ERROR, "Snapshot '%s': unable to create directory: %s\n", path, strerror(errno));
+			ao2_iterator_destroy(i);
+			ast_free(positions);
+			return -1;
+		}
+	}
+
+	tmp_path = ast_alloca(strlen(path) + sizeof(".tmp"));
+	sprintf(tmp_path, "%s.tmp", path);
+
+	if(((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) || (NULL == (file = fdopen(fd, "w")))) {
+		ast_log(LOG_ERROR, "Snapshot '%s': unable to open: %s\n", tmp_path, strerror(errno));
+
+		if(fd >= 0) {
+			close(fd);
+		}
+
+		ao2_iterator_destroy(i);
+		ast_free(positions);
+		return -1;
+	}
+
+	/* Header rewritten when sizes are known */
+	failed |= (1 != fwrite(&header, sizeof(header), 1, file));
+
+	for(n = 0;n < count;n++) {
+		struct device_state_snapshot_position record;
+
+		memset(&record, 0, sizeof(record));
+		record.offset = positions[n].offset;
+		record.partition = positions[n].partition;
+		record.topic_size = strlen(positions[n].topic);
+		memcpy(record.topic, positions[n].topic, record.topic_size);
+
+		failed |= (1 != fwrite(&record, sizeof(record), 1, file));
+		header.position_count++;
+		header.size += sizeof(record);
+	}
+
+	while((entry = ao2_iterator_next(i))) {
+		union {
+			struct device_state_snapshot_device device;
+			char buf[DEVICE_STATE_SNAPSHOT_DEVICE_SIZE(DEVICE_STATE_KEY_MAX)];
+		} record;
+		size_t key_size = strlen(entry->key);
+
+		memset(&record, 0, sizeof(record));
+		record.device.size = DEVICE_STATE_SNAPSHOT_DEVICE_SIZE(key_size);
+		record.device.state = entry->state;
+		memcpy(record.device.eid, &entry->eid, sizeof(record.device.eid));
+		record.device.key_size = key_size;
+		memcpy(record.device.key, entry->key, key_size);
+
+		failed |= (1 != fwrite(&record, record.device.size, 1, file));
+		header.device_count++;
+		header.size += record.device.size;
+
+		ao2_ref(entry, -1);
+	}
+
+	ao2_iterator_destroy(i);
+	ast_free(positions);
+
+	failed |= fseek(file, 0, SEEK_SET) || (1 != fwrite(&header, sizeof(header), 1, file));
+	failed |= fflush(file) || fsync(fd);
+	failed |= fclose(file);
+
+	/* Previous snapshot replaced only by complete one */
+	if(failed || rename(tmp_path, path)) {
+		ast_log(LOG_ERROR, "Snapshot '%s': unable to write: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+
+	ast_debug(1, "Snapshot '%s': %u devices, %u partitions saved\n", path, header.device_count, header.position_count);
+
+	return 0;
+}
+
+/*! Restore table with positions from the file, return number of devices or -1 */
+static int device_state_snapshot_load(const char *path) {
+	const struct device_state_snapshot_header *header;
+	const unsigned char *map, *record;
+	struct stat st;
+	uint32_t n;
+	int fd, count = 0;
+
+	if((fd = open(path, O_RDONLY)) < 0) {
+		if(ENOENT != errno) {
+			ast_log(LOG_WARNING, "Snapshot '%s': unable to open: %s\n", path, strerror(errno));
+		}
+
+		return -1;
+	}
+
+	if(fstat(fd, &st) || ((size_t)st.st_size < sizeof(*header))) {
+		ast_log(LOG_WARNING, "Snapshot '%s': invalid file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	if(MAP_FAILED == (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+		ast_log(LOG_WARNING, "Snapshot '%s': unable to map: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	header = (const struct device_state_snapshot_header *)map;
+
+	if((DEVICE_STATE_SNAPSHOT_MAGIC != header->magic) || (DEVICE_STATE_SNAPSHOT_VERSION != header->version)
+			|| (header->size != (uint64_t)st.st_size)
+			|| ((uint64_t)header->position_count * sizeof(struct device_state_snapshot_position) > header->size - sizeof(*header))) {
+		ast_log(LOG_WARNING, "Snapshot '%s': invalid header, snapshot ignored\n", path);
+		munmap((void *)map, st.st_size);
+		return -1;
+	}
+
+	record = map + sizeof(*header);
+
+	ao2_wrlock(device_states);
+
+	for(n = 0;n < header->position_count;n++, record += sizeof(struct device_state_snapshot_position)) {
+		const struct device_state_snapshot_position *position = (const struct device_state_snapshot_position *)record;
+		struct device_state_position new_position = {
+			.partition = position->partition,
+			.seeked = 0,
+			.offset = position->offset,
+		};
+
+		if(position->topic_size >= DEVICE_STATE_TOPIC_MAX) {
+			continue;
+		}
+
+		memcpy(new_position.topic, position->topic, position->topic_size);
+		new_position.topic[position->topic_size] = '\0';
+
+		AST_VECTOR_APPEND(&device_state_positions, new_position);
+	}
+
+	for(n = 0;n < header->device_count;n++) {
+		const struct device_state_snapshot_device *device = (const struct device_state_snapshot_device *)record;
+		size_t left = map + header->size - record;
+		struct kafka_device_state *entry;
+
+		if((left < sizeof(*device)) || (device->size > left) || (device->key_size >= DEVICE_STATE_KEY_MAX)
+				|| (DEVICE_STATE_SNAPSHOT_DEVICE_SIZE(device->key_size) != device->size)) {
+			/* Truncated file, keep devices before */
+			ast_log(LOG_WARNING, "Snapshot '%s': damaged record at %lu, %u devices dropped\n",
+					path, (unsigned long)(record - map), header->device_count - n);
+			break;
+		}
+
+		if(NULL != (entry = ao2_alloc_options(sizeof(*entry) + device->key_size + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+			memcpy(&entry->eid, device->eid, sizeof(entry->eid));
+			entry->state = device->state;
+			memcpy(entry->key, device->key, device->key_size);
+			entry->key[device->key_size] = '\0';
+
+			ao2_link_flags(device_states, entry, OBJ_NOLOCK);
+			ao2_ref(entry, -1);
+			count++;
+		}
+
+		record += device->size;
+	}
+
+	ao2_unlock(device_states);
+
+	munmap((void *)map, st.st_size);
+
+	return count;
+}
+
+/*! Periodic snapshot, return next interval or 0 if disabled */
+static int device_state_snapshot_cb(const void *data) {
+	int interval;
+
+	ast_mutex_lock(&device_state_snapshot_lock);
+
+	if((interval = device_state_snapshot_interval * 1000)) {
+		device_state_snapshot_save(device_state_snapshot_path);
+	}
+
+	ast_mutex_unlock(&device_state_snapshot_lock);
+
+	return interval;
+}
+
+/*! Reschedule periodic snapshot by the current interval */
+static void device_state_schedule_snapshot(void) {
+	AST_SCHED_DEL(device_state_sched, device_state_snapshot_id);
+
+	if(device_state_snapshot_interval
+			&& ((device_state_snapshot_id = ast_sched_add(device_state_sched, device_state_snapshot_interval * 1000, device_state_snapshot_cb, NULL)) < 0)) {
+		ast_log(LOG_WARNING, "Unable to schedule device states snapshot\n");
+	}
+}
+
+/*! Load module configuration, return 0 on success */
+static int load_config(int reload) {
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg = ast_config_load(DEVICE_STATE_CONFIG, config_flags);
+	unsigned int interval = DEVICE_STATE_SNAPSHOT_INTERVAL;
+	const char *value, *path = NULL;
+
+	if(CONFIG_STATUS_FILEUNCHANGED == cfg) {
+		return 0;
+	}
+
+	if(CONFIG_STATUS_FILEINVALID == cfg) {
+		ast_log(LOG_ERROR, "Config file '%s' is invalid\n", DEVICE_STATE_CONFIG);
+		return -1;
+	}
+
+	if(cfg) {
+		if((value = ast_variable_retrieve(cfg, "general", "snapshot_interval"))
+				&& (1 != sscanf(value, "%30u", &interval))) {
+			ast_log(LOG_WARNING, "Invalid snapshot_interval '%s', default %d used\n", value, DEVICE_STATE_SNAPSHOT_INTERVAL);
+			interval = DEVICE_STATE_SNAPSHOT_INTERVAL;
+		}
+
+		path = ast_variable_retrieve(cfg, "general", "snapshot_file");
+	}
+
+	ast_mutex_lock(&device_state_snapshot_lock);
+
+	if(ast_strlen_zero(path)) {
+		snprintf(device_state_snapshot_path, sizeof(device_state_snapshot_path), "%s/kafka/device_state.snapshot", ast_config_AST_SPOOL_DIR);
+	} else {
+		ast_copy_string(device_state_snapshot_path, path, sizeof(device_state_snapshot_path));
+	}
+
+	device_state_snapshot_interval = interval;
+
+	ast_mutex_unlock(&device_state_snapshot_lock);
+
+	if(cfg) {
+		ast_config_destroy(cfg);
+	}
+
+	return 0;
+}
+
+static int load_module(void) {
+	struct device_state_position *positions;
+	size_t i, count;
+	int restored;
+
+	if(load_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (device_states = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, DEVICE_STATE_BUCKETS,
+									kafka_device_state_hash_fn, NULL, kafka_device_state_cmp_fn))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(AST_VECTOR_INIT(&device_state_positions, 8)) {
+		ao2_cleanup(device_states);
+		device_states = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Provider not depend on res_kafka, devices are UNKNOWN until the table is filled */
+	if(ast_devstate_prov_add(AST_KAFKA_DEVICE_STATE_TECH, device_state_provider_cb)) {
+		AST_VECTOR_FREE(&device_state_positions);
+		ao2_cleanup(device_states);
+		device_states = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Pipe created if not configured yet, so topics added on reload are visible */
+	if(NULL == (device_state_pipe = ast_kafka_get_pipe(KAFKA_PIPE_DEVICE_STATE, 1))) {
+		ast_devstate_prov_del(AST_KAFKA_DEVICE_STATE_TECH);
+		AST_VECTOR_FREE(&device_state_positions);
+		ao2_cleanup(device_states);
+		device_states = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if((NULL == (device_state_sched = ast_sched_context_create())) || ast_sched_start_thread(device_state_sched)) {
+		if(device_state_sched) {
+			ast_sched_context_destroy(device_state_sched);
+			device_state_sched = NULL;
+		}
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
+		ast_devstate_prov_del(AST_KAFKA_DEVICE_STATE_TECH);
+		AST_VECTOR_FREE(&device_state_positions);
+		ao2_cleanup(device_states);
+		device_states = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Warm table, consumed messages before saved offsets are skipped */
+	if(device_state_snapshot_interval && ((restored = device_state_snapshot_load(device_state_snapshot_path)) >= 0)) {
+		ast_log(LOG_NOTICE, "Snapshot '%s': %d devices restored\n", device_state_snapshot_path, restored);
+
+		/* Hints created before the provider registration are refreshed */
+		device_state_announce();
+	}
+
+	if(NULL == (device_state_subscription = stasis_subscribe(ast_kafka_get_stasis_topic(device_state_pipe),
+									device_state_cb, NULL))) {
+		ast_sched_context_destroy(device_state_sched);
+		device_state_sched = NULL;
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
+		ast_devstate_prov_del(AST_KAFKA_DEVICE_STATE_TECH);
+		AST_VECTOR_FREE(&device_state_positions);
+		ao2_cleanup(device_states);
+		device_states = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Messages forwarded before subscription are lost, consume the topic again from the beginning */
+	ast_kafka_pipe_rewind(device_state_pipe);
+
+	/* Then skip messages already in the restored table, positions are appended by the subscription */
+	ao2_rdlock(device_states);
+	count = AST_VECTOR_SIZE(&device_state_positions);
+	positions = count ? ast_malloc(count * sizeof(*positions)) : NULL;
+
+	if(positions) {
+		memcpy(positions, AST_VECTOR_GET_ADDR(&device_state_positions, 0), count * sizeof(*positions));
+	}
+
+	ao2_unlock(device_states);
+
+	/* Not seeked here partitions are seeked on the first skipped message */
+	for(i = 0;positions && (i < count);i++) {
+		if(!ast_kafka_pipe_seek(device_state_pipe, positions[i].topic, positions[i].partition, positions[i].offset)) {
+			struct device_state_position *position;
+
+			ao2_wrlock(device_states);
+
+			if(NULL != (position = device_state_position_find(positions[i].topic, positions[i].partition))) {
+				position->seeked = 1;
+			}
+
+			ao2_unlock(device_states);
+		}
+	}
+
+	ast_free(positions);
+
+	device_state_schedule_snapshot();
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int unload_module(void) {
+	device_state_subscription = stasis_unsubscribe_and_join(device_state_subscription);
+
+	/* Scheduled snapshot cancelled with the scheduler thread */
+	ast_sched_context_destroy(device_state_sched);
+	device_state_sched = NULL;
+	device_state_snapshot_id = -1;
+
+	if(device_state_snapshot_interval) {
+		/* Next start from the last consumed offsets */
+		device_state_snapshot_save(device_state_snapshot_path);
+	}
+
+	ast_devstate_prov_del(AST_KAFKA_DEVICE_STATE_TECH);
+
+	ao2_cleanup(device_states);
+	device_states = NULL;
+
+	AST_VECTOR_FREE(&device_state_positions);
+
+	ao2_cleanup(device_state_pipe);
+	device_state_pipe = NULL;
+
+	return 0;
+}
+
+static int reload_module(void) {
+	if(load_config(1)) {
+		return -1;
+	}
+
+	device_state_schedule_snapshot();
+
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_ORDER, "Kafka cluster-wide device states",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+	.load_pri = AST_MODPRI_DEVSTATE_CONSUMER,
+	.nonoptreq = "res_kafka",
+	);
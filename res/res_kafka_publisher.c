@@ -34,6 +34,24 @@
  ***/
 
 /*** DOCUMENTATION
+	<configInfo name="res_kafka_publisher" language="en_US">
+		<synopsis>Kafka events producer</synopsis>
+		<configFile name="kafka_publisher.conf">
+			<configObject name="device_state">
+				<synopsis>Device state events</synopsis>
+				<configOption name="coalesce_ms" default="0">
+					<synopsis>Device state coalescing interval, ms</synopsis>
+					<description><para>
+						When not 0, only the latest state of each device (by message key) is
+						published once per interval. Offline states (UNKNOWN, INVALID and
+						UNAVAILABLE) are published immediately and supersede the pending one.
+						Default 0 publish each state change immediately.
+						</para>
+					</description>
+				</configOption>
+			</configObject>
+		</configFile>
+	</configInfo>
  ***/
 
 #include "asterisk.h"
@@ -41,8 +59,11 @@
 ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 
 #include "asterisk/res_kafka.h"
+#include "asterisk/res_kafka_device_state.h"
 
 #include "asterisk/module.h"
+#include "asterisk/config.h"
+#include "asterisk/sched.h"
 #include "asterisk/stasis.h"
 #include "asterisk/devicestate.h"
 #include "asterisk/stasis_app_device_state.h"
@@ -52,8 +73,29 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 
 #define KAFKA_PIPE_DEVICE_STATE "device_state"
 
+/*! Module configuration file */
+#define KAFKA_PUBLISHER_CONFIG "kafka_publisher.conf"
+
+/*! Buckets for pending device states hash. Keep it prime! */
+#define DEVICE_STATE_PENDING_BUCKETS 257
+
+/*! Latest device state not published yet */
+struct device_state_pending {
+	/*! Device state */
+	enum ast_device_state state;
+	/*! Message key, point into the device name */
+	const char *key;
+	/*! Device name */
+	char device[0];
+};
+
 /* Fowrdwd local functions declaration */
 static void device_state_cb(void *data, struct stasis_subscription *sub, struct stasis_message *message);
+static void device_state_publish(const char *device, const char *key, enum ast_device_state state);
+static int device_state_is_terminal(enum ast_device_state state);
+static void device_state_flush(void);
+static int device_state_flush_cb(const void *data);
+static int load_config(int reload);
 static int load_module(void);
 static int unload_module(void);
 static int reload_module(void);
@@ -61,11 +103,30 @@ static int reload_module(void);
 /* Local variables */
 static struct stasis_subscription *device_state_subscription;
 
+/*! Device state pipe, cached for module lifetime */
+static struct ast_kafka_pipe *device_state_pipe;
+
+/*! Pending device states by message key, container lock serialize publish */
+static struct ao2_container *device_state_pending;
+
+/*! Coalescing flush scheduler */
+static struct ast_sched_context *device_state_sched;
+
+/*! Scheduled flush id or -1 (protected by device_state_pending lock) */
+static int device_state_flush_id = -1;
+
+/*! Coalescing interval, ms, 0 if disabled (protected by device_state_pending lock) */
+static unsigned int device_state_coalesce_ms;
+
+/*! Calculate pending device state hash */
+AO2_STRING_FIELD_HASH_FN(device_state_pending, key)
+/*! Compare pending device states */
+AO2_STRING_FIELD_CMP_FN(device_state_pending, key)
+
 static void device_state_cb(void *data, struct stasis_subscription *sub, struct stasis_message *message) {
         struct ast_device_state_message *payload;
         enum ast_device_state state;
         const char *device, *skip_tech, *key;
-	RAII_VAR(struct ast_kafka_pipe *, pipe, NULL, ao2_cleanup);
 	
         if (stasis_message_type(message) != ast_device_state_message_type()) {
                 return;
@@ -84,6 +145,11 @@ static void device_state_cb(void *data, struct stasis_subscription *sub, struct
                 return;
         }
 
+	/* States received from Kafka must not be published back */
+	if(!strncmp(device, AST_KAFKA_DEVICE_STATE_TECH "/", sizeof(AST_KAFKA_DEVICE_STATE_TECH))) {
+		return;
+	}
+
 	if(NULL == (skip_tech = strchr(device, '/'))) {
 		key = device;
 	} else {
@@ -91,18 +157,190 @@ static void device_state_cb(void *data, struct stasis_subscription *sub, struct
 		key = skip_tech + sizeof(char);
 	}
 	
-	
-	if(NULL != (pipe = ast_kafka_get_pipe(KAFKA_PIPE_DEVICE_STATE,0))) {
+	ao2_lock(device_state_pending);
+
+	if(device_state_coalesce_ms && !device_state_is_terminal(state)) {
+		/* Replace pending state, published by the next flush */
+		size_t device_size = strlen(device) + 1;
+		struct device_state_pending *pending = ao2_alloc_options(sizeof(*pending) + device_size, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+		if(pending) {
+			pending->state = state;
+			memcpy(pending->device, device, device_size);
+			pending->key = pending->device + (key - device);
+
+			ao2_find(device_state_pending, pending->key, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA | OBJ_NOLOCK);
+			ao2_link_flags(device_state_pending, pending, OBJ_NOLOCK);
+			ao2_ref(pending, -1);
+
+			ao2_unlock(device_state_pending);
+
+			ast_debug(3, "Device '%s' change state to %u '%s', pending.\n", device, state, ast_devstate_str(state));
+			return;
+		}
+
+		/* Out of memory, publish immediately */
+	}
+
+	/* Pending state superseded, must not be published after this one */
+	ao2_find(device_state_pending, key, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA | OBJ_NOLOCK);
+
+	device_state_publish(device, key, state);
+
+	ao2_unlock(device_state_pending);
+}
+
+/*! Publish device state to the pipe */
+static void device_state_publish(const char *device, const char *key, enum ast_device_state state) {
+	if(NULL != device_state_pipe) {
 		RAII_VAR(struct ast_json *, json, stasis_app_device_state_to_json(device, state), ast_json_unref);
-		ast_kafka_publish(pipe, key, KAFKA_PIPE_DEVICE_STATE, json);
+		ast_kafka_publish(device_state_pipe, key, KAFKA_PIPE_DEVICE_STATE, json);
 	}
 	
 	ast_debug(3, "Device '%s' change state to %u '%s'.\n", device, state, ast_devstate_str(state));
 }
 
+/*! Device state must be published without coalescing */
+static int device_state_is_terminal(enum ast_device_state state) {
+	switch(state) {
+	case AST_DEVICE_UNKNOWN:
+	case AST_DEVICE_INVALID:
+	case AST_DEVICE_UNAVAILABLE:
+		/* Device offline */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*! Publish all pending device states */
+static void device_state_flush(void) {
+	struct ao2_iterator i;
+	struct device_state_pending *pending;
+
+	ao2_lock(device_state_pending);
+
+	i = ao2_iterator_init(device_state_pending, AO2_ITERATOR_UNLINK | AO2_ITERATOR_DONTLOCK);
+
+	while((pending = ao2_iterator_next(&i))) {
+		device_state_publish(pending->device, pending->key, pending->state);
+		ao2_ref(pending, -1);
+	}
+
+	ao2_iterator_destroy(&i);
+
+	ao2_unlock(device_state_pending);
+}
+
+/*! Scheduled coalescing flush, return next flush interval or 0 if coalescing disabled */
+static int device_state_flush_cb(const void *data) {
+	int interval;
+
+	device_state_flush();
+
+	ao2_lock(device_state_pending);
+
+	if(0 == (interval = device_state_coalesce_ms)) {
+		/* Entry removed by scheduler */
+		device_state_flush_id = -1;
+	}
+
+	ao2_unlock(device_state_pending);
+
+	return interval;
+}
+
+/*! Load module configuration, return 0 on success */
+static int load_config(int reload) {
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg = ast_config_load(KAFKA_PUBLISHER_CONFIG, config_flags);
+	unsigned int coalesce_ms = 0;
+	const char *value;
+
+	if(CONFIG_STATUS_FILEUNCHANGED == cfg) {
+		return 0;
+	}
+
+	if(CONFIG_STATUS_FILEINVALID == cfg) {
+		ast_log(LOG_ERROR, "Config file '%s' is invalid\n", KAFKA_PUBLISHER_CONFIG);
+		return -1;
+	}
+
+	if(cfg) {
+		if((value = ast_variable_retrieve(cfg, "device_state", "coalesce_ms"))
+				&& (1 != sscanf(value, "%30u", &coalesce_ms))) {
+			ast_log(LOG_WARNING, "Invalid device_state coalesce_ms '%s', coalescing disabled\n", value);
+			coalesce_ms = 0;
+		}
+
+		ast_config_destroy(cfg);
+	}
+
+	ao2_lock(device_state_pending);
+
+	if(coalesce_ms != device_state_coalesce_ms) {
+		ast_debug(1, "Device state coalescing interval %u ms\n", coalesce_ms);
+	}
+
+	device_state_coalesce_ms = coalesce_ms;
+
+	/* Interval change applied on the next flush, last one flush pending states and stop */
+	if(coalesce_ms && (device_state_flush_id < 0)) {
+		if((device_state_flush_id = ast_sched_add(device_state_sched, coalesce_ms, device_state_flush_cb, NULL)) < 0) {
+			ast_log(LOG_WARNING, "Unable to schedule device state flush, coalescing disabled\n");
+			device_state_coalesce_ms = 0;
+		}
+	}
+
+	ao2_unlock(device_state_pending);
+
+	return 0;
+}
+
 static int load_module(void) {
-	if(NULL == (device_state_subscription = stasis_subscribe(ast_device_state_topic_all(), 
+	/* Pipe created if not configured yet, so topics added on reload are visible */
+	if(NULL == (device_state_pipe = ast_kafka_get_pipe(KAFKA_PIPE_DEVICE_STATE, 1))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (device_state_pending = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, DEVICE_STATE_PENDING_BUCKETS,
+									device_state_pending_hash_fn, NULL, device_state_pending_cmp_fn))) {
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if((NULL == (device_state_sched = ast_sched_context_create())) || ast_sched_start_thread(device_state_sched)) {
+		if(device_state_sched) {
+			ast_sched_context_destroy(device_state_sched);
+			device_state_sched = NULL;
+		}
+		ao2_cleanup(device_state_pending);
+		device_state_pending = NULL;
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(load_config(0)) {
+		ast_sched_context_destroy(device_state_sched);
+		device_state_sched = NULL;
+		ao2_cleanup(device_state_pending);
+		device_state_pending = NULL;
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if(NULL == (device_state_subscription = stasis_subscribe(ast_device_state_topic_all(),
 									device_state_cb, NULL))) {
+		ast_sched_context_destroy(device_state_sched);
+		device_state_sched = NULL;
+		device_state_flush_id = -1;
+		ao2_cleanup(device_state_pending);
+		device_state_pending = NULL;
+		ao2_cleanup(device_state_pipe);
+		device_state_pipe = NULL;
 		return AST_MODULE_LOAD_DECLINE;
 	}
 	
@@ -111,12 +349,27 @@ static int load_module(void) {
 
 static int unload_module(void) {
 	device_state_subscription = stasis_unsubscribe_and_join(device_state_subscription);
+
+	/* Scheduled flush cancelled with the scheduler thread */
+	ast_sched_context_destroy(device_state_sched);
+	device_state_sched = NULL;
+	device_state_flush_id = -1;
+	device_state_coalesce_ms = 0;
+
+	/* Last states of the coalesced bursts */
+	device_state_flush();
+
+	ao2_cleanup(device_state_pending);
+	device_state_pending = NULL;
+
+	ao2_cleanup(device_state_pipe);
+	device_state_pipe = NULL;
 	
 	return 0;
 }
 
 static int reload_module(void) {
-	return 0;
+	return load_config(1);
 }
 	
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "Kafka events producer",